@@ -9,6 +9,7 @@
 #include <arch/proto.h>
 #include <arch/irqchip.h>
 #include <arch/tsc.h>
+#include <arch/vsyscall.h>
 
 #include <lwk/smp.h>
 #include <lwk/init.h>
@@ -124,6 +125,7 @@ cpu_init(void)
 	//fpu_init();		 /* floating point unit */
 	irqchip_local_init();    /* Interrupt Controller */
 	time_init();		 /* detects CPU frequency, udelay(), etc. */
+	vsyscall_cpu_init();	 /* per-CPU vsyscall page state */
 	barrier();		 /* compiler memory barrier, avoids reordering */
 
 }
@@ -290,6 +292,7 @@ phys_cpu_remove(unsigned int phys_cpu_id,
 		__aspace_update_cpumask(KERNEL_ASPACE_ID, &cpu_present_map);
 
 		kmem_free_pages((void *)cpu_gdt_descr[target_cpu].address, 0);
+		kmem_cpu_drain(target_cpu);
 		free_per_cpu_area(target_cpu);
         }
 #endif
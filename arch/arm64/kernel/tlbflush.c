@@ -1,9 +1,19 @@
 #include <lwk/tlbflush.h>
 #include <lwk/cpuinfo.h>
 #include <lwk/xcall.h>
+#include <lwk/params.h>
 #include <arch/processor.h>
 #include <arch/barrier.h>
 #include <arch/tlbflush.h>
+#include <arch/page.h>
+
+
+/**
+ * Ranges larger than this many pages are flushed by invalidating the
+ * whole TLB rather than by issuing one TLBI per page.
+ */
+static unsigned long tlb_flush_ceiling = 32;
+param(tlb_flush_ceiling, ulong);
 
 
 
@@ -47,6 +57,57 @@ flush_tlb(void)
 }
 
 
+/**
+ * Flush the entries for [start, end) from the calling CPU's TLB.
+ */
+void
+__flush_tlb_range(vaddr_t start, vaddr_t end)
+{
+	vaddr_t addr;
+
+	if (end <= start)
+		return;
+
+	if (((end - start) >> PAGE_SHIFT) > tlb_flush_ceiling) {
+		local_flush_tlb_all();
+		return;
+	}
+
+	dsb(nshst);
+	for (addr = start & PAGE_MASK; addr < end; addr += PAGE_SIZE)
+		__tlbi(vaae1, addr >> 12);
+	dsb(nsh);
+	isb();
+}
+
+
+/**
+ * Flush the entries for [start, end) from the TLBs of the CPUs in
+ * cpu_mask. Inner shareable TLB invalidations are broadcast by the
+ * hardware, so no cross-call is needed and cpu_mask only decides whether
+ * any flush is needed at all.
+ */
+void
+flush_tlb_mask_range(cpumask_t cpu_mask, vaddr_t start, vaddr_t end)
+{
+	vaddr_t addr;
+
+	if ((end <= start) || cpus_empty(cpu_mask))
+		return;
+
+	if (((end - start) >> PAGE_SHIFT) > tlb_flush_ceiling) {
+		flush_tlb_all();
+		return;
+	}
+
+	dsb(ishst);
+	for (addr = start & PAGE_MASK; addr < end; addr += PAGE_SIZE)
+		__tlbi(vaae1is, addr >> 12);
+	dsb(ish);
+	isb();
+}
+
+
 
 
 /**
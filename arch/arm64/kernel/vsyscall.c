@@ -23,52 +23,135 @@
 #include <lwk/init.h>
 #include <lwk/time.h>
 #include <lwk/unistd.h>
+#include <lwk/smp.h>
+#include <lwk/topology.h>
 #include <arch/vsyscall.h>
+#include <arch/msr.h>
+#include <arch/barrier.h>
 #include <arch/pgtable.h>
 #include <arch/fixmap.h>
 
+#define PMUSERENR_CR	(1 << 2)	/* EL0 reads of PMCCNTR_EL0 */
+
 #define __vsyscall(nr) __attribute__ ((unused,__section__(".vsyscall_" #nr)))
-#define __syscall_clobber "r11","cx","memory"
+#define __section_vsyscall_data __attribute__ ((unused,__section__(".vsyscall_data"),aligned(64)))
+
+/* from /usr/include/linux/time.h */
+#define CLOCK_REALTIME                  0
+#define CLOCK_MONOTONIC                 1
+
+/**
+ * Data read by the vsyscall functions, see the x86_64 version.
+ */
+struct vsyscall_data {
+	struct vtime_data	vtime;
+};
+
+struct vsyscall_data __vsyscall_data __section_vsyscall_data;
+
+/**
+ * User space version of get_time(). Everything called from the vsyscall
+ * page must be inlined, kernel text is not accessible from user space.
+ * The cycle counter is readable from EL0, see vsyscall_cpu_init().
+ */
+static __always_inline ktime_t
+vget_time(void)
+{
+	const volatile struct vtime_data *vt = &__vsyscall_data.vtime;
+	uint32_t seq;
+	uint64_t cycles, ns;
+
+	do {
+		seq = vt->seq;
+		smp_rmb();
+		isb();
+		cycles = __mrs(pmccntr_el0);
+		ns = (((unsigned __int128)cycles * vt->mult) >> vt->shift)
+		     + vt->offset;
+		smp_rmb();
+	} while ((seq & 1) || (seq != vt->seq));
+
+	return ns;
+}
 
 int __vsyscall(0)
 vgettimeofday(struct timeval *tv, struct timezone *tz)
 {
-	int ret;
-#if 0
-	asm volatile("syscall"
-		: "=a" (ret)
-		: "0" (__NR_gettimeofday),"D" (tv),"S" (tz)
-		: __syscall_clobber );
-#endif
-	return ret;
+	if (tv) {
+		uint64_t now = vget_time();
+
+		tv->tv_sec  = now / NSEC_PER_SEC;
+		tv->tv_usec = (now % NSEC_PER_SEC) / NSEC_PER_USEC;
+	}
+
+	if (tz) {
+		tz->tz_minuteswest = 0;
+		tz->tz_dsttime     = 0;
+	}
+
+	return 0;
 }
 
 time_t __vsyscall(1)
 vtime(time_t *t)
 {
-	int ret;
-
-#if 0
-	asm volatile("syscall"
-		: "=a" (ret)
-		: "0" (__NR_time),"D" (t)
-		: __syscall_clobber );
-#endif
-	return ret;
+	time_t now_sec = vget_time() / NSEC_PER_SEC;
+
+	if (t)
+		*t = now_sec;
+
+	return now_sec;
 }
 
 long __vsyscall(2)
 vgetcpu(unsigned *cpu, unsigned *node, void *tcache)
 {
-#if 0
-	asm volatile("syscall"
-		:
-		: "a" (__NR_getcpu),"D" (cpu)
-		: __syscall_clobber );
-#endif
+	/* TPIDRRO_EL0 holds (node << 12) | cpu */
+	uint64_t id = __mrs(tpidrro_el0);
+
+	if (cpu)
+		*cpu = id & 0xfff;
+	if (node)
+		*node = id >> 12;
 	return 0;
 }
 
+int __vsyscall(3)
+vclock_gettime(clockid_t which_clock, struct timespec *tp)
+{
+	uint64_t now;
+
+	if ((which_clock != CLOCK_REALTIME) && (which_clock != CLOCK_MONOTONIC)) {
+		register long x0 asm("x0") = which_clock;
+		register long x1 asm("x1") = (long)tp;
+		register long x8 asm("x8") = __NR_clock_gettime;
+
+		asm volatile("svc #0"
+			: "+r" (x0)
+			: "r" (x1), "r" (x8)
+			: "memory");
+		return x0;
+	}
+
+	now = vget_time();
+	tp->tv_sec  = now / NSEC_PER_SEC;
+	tp->tv_nsec = now % NSEC_PER_SEC;
+	return 0;
+}
+
+/**
+ * Records the calling CPU's ID in TPIDRRO_EL0 for vgetcpu(), and lets
+ * EL0 read the cycle counter for vget_time(). EL0 gets no other PMU
+ * access, as writes to PMCR_EL0 could stop or reset the kernel's clock.
+ */
+void
+vsyscall_cpu_init(void)
+{
+	__msr(tpidrro_el0, (u64)((cpu_to_node(this_cpu) << 12) | this_cpu));
+	__msr(pmuserenr_el0, (u64)PMUSERENR_CR);
+	isb();
+}
+
 void __init
 vsyscall_map(void)
 {
@@ -86,5 +169,10 @@ vsyscall_map(void)
 			VSYSCALL_ADDR(__NR_vtime));
 	BUG_ON((unsigned long) &vgetcpu !=
 			VSYSCALL_ADDR(__NR_vgetcpu));
+	BUG_ON((unsigned long) &vclock_gettime !=
+			VSYSCALL_ADDR(__NR_vclock_gettime));
+
+	/* Let user space read the time without entering the kernel */
+	vtime_init(&__vsyscall_data.vtime);
 }
 
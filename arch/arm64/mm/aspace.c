@@ -9,6 +9,14 @@
 #include <arch/page_table.h>
 #include <arch/tlbflush.h>
 #include <lwk/bootmem.h>
+#include <arch/mmu.h>
+
+
+/**
+ * Source of arch_aspace.ctx_id values. Context IDs are never reused, so a
+ * CPU can never mistake a new aspace for an old one that had the same ASID.
+ */
+static atomic64_t next_ctx_id = ATOMIC64_INIT(0);
 
 extern bool bootmem_destoyed;
 
@@ -30,6 +38,7 @@ arch_aspace_create(
 	printk("Kernel page tables do not need to be copied on ARM\n");
 	if ((aspace->arch.pgd = kmem_get_pages(0)) == NULL)
 		return -ENOMEM;
+	aspace->arch.ctx_id = atomic64_inc_return(&next_ctx_id);
 	return 0;
 }
 
@@ -101,7 +110,7 @@ arch_aspace_activate(
 		asm volatile(
 				"dsb #0\n"
 				"msr TTBR0_EL1, %0\n"
-				"isb\n":: "r" (__pa(aspace->arch.pgd)) : "memory");
+				"isb\n":: "r" (__pa(aspace->arch.pgd) | asid_activate(aspace)) : "memory");
 	} else {
 		// Nothing to do for the bootstrap aspace
 	}
@@ -505,6 +514,281 @@ arch_aspace_unmap_page(
 	find_and_delete_pte(aspace, start, pagesz);
 }
 
+
+/**
+ * Returns the first address after addr that is aligned to size, clamped to
+ * end. Used to skip over page table entries that map nothing.
+ */
+static vaddr_t
+next_boundary(
+	vaddr_t		addr,
+	vmpagesize_t	size,
+	vaddr_t		end
+)
+{
+	vaddr_t next = (addr | (size - 1)) + 1;
+
+	return ((next == 0) || (next > end)) ? end : next;
+}
+
+
+/**
+ * Returns true if [start, end) can be mapped starting at start with a
+ * single block/page entry of size pagesz.
+ */
+static bool
+can_map_leaf(
+	vaddr_t		start,
+	paddr_t		paddr,
+	vaddr_t		end,
+	vmpagesize_t	pagesz,
+	vmpagesize_t	pagesz_mask
+)
+{
+	return (pagesz_mask & pagesz) &&
+	       !(start & (pagesz - 1)) &&
+	       !(paddr & (pagesz - 1)) &&
+	       ((end - start) >= pagesz);
+}
+
+
+/**
+ * Replaces a 2 MB or 1 GB block entry with a table that maps the same
+ * physical memory with the same attributes using the next smaller page
+ * size. The architecture requires break-before-make when changing the
+ * size of a mapping, so the block is invalidated and flushed from the TLB
+ * before the fully populated table is linked in.
+ */
+static xpte_t *
+split_large_page(
+	xpte_t *	pte,
+	vmpagesize_t	pagesz
+)
+{
+	const vmpagesize_t child_pagesz = pagesz >> 9;
+	xpte_t block = *pte;
+	xpte_t *table;
+	unsigned int i;
+
+	if ((table = alloc_page_table(NULL)) == NULL)
+		return NULL;
+
+	for (i = 0; i < 512; i++) {
+		table[i] = block;
+		table[i].base_paddr += i * (child_pagesz >> PAGE_SHIFT_4KB);
+		table[i].type = (child_pagesz == VM_PAGE_4KB) ? 1 : 0;
+	}
+
+	memset(pte, 0, sizeof(xpte_t));
+	flush_tlb_all();
+
+	pte->base_paddr = __pa(table) >> PAGE_SHIFT;
+	pte->type       = 1;
+	pte->valid      = 1;
+
+	return table;
+}
+
+
+/**
+ * Maps a physically contiguous range into an address space.
+ *
+ * Unlike arch_aspace_map_page(), the page tables are walked once for the
+ * whole range, consecutive entries within each table are filled in a
+ * single pass, and caches and TLBs are flushed once at the end rather than
+ * once per page. Wherever the virtual and physical addresses are suitably
+ * aligned, and pagesz_mask allows it, 1 GB and 2 MB block entries are used
+ * instead of 4 KB pages. Existing blocks that only partially overlap the
+ * range are split.
+ *
+ * Arguments:
+ *       [IN] aspace:      Address space to map the range into.
+ *       [IN] start:       Address in aspace to map the range to.
+ *       [IN] paddr:       Physical address of the start of the range.
+ *       [IN] extent:      Size of the range, in bytes.
+ *       [IN] flags:       Protection and memory type flags.
+ *       [IN] pagesz_mask: Page sizes that may be used. start, paddr, and
+ *                         extent must be aligned to the smallest of them.
+ *
+ * Returns:
+ *       Success: 0
+ *       Failure: Error Code, the range may be partially mapped.
+ */
+int
+arch_aspace_map_range(
+	struct aspace *	aspace,
+	vaddr_t		start,
+	paddr_t		paddr,
+	size_t		extent,
+	vmflags_t	flags,
+	vmpagesize_t	pagesz_mask
+)
+{
+	const vaddr_t end = start + extent;
+	int status = 0;
+
+	xpte_t *pmd;	/* Page Middle Directory: level 2 */
+	xpte_t *ptd;	/* Page Table Directory:  level 3 */
+
+	xpte_t *pge;	/* Page Global Directory Entry */
+	xpte_t *pme;	/* Page Middle Directory Entry */
+
+	if (aspace->arch.pgd == NULL)
+		panic("Aspace has NULL PGD\n");
+
+	while (start < end) {
+		/* Traverse the Page Global Directory */
+		pge = &aspace->arch.pgd[(start >> 30) & 0x1FF];
+		if ((!pge->valid || !pge->type) &&
+		    can_map_leaf(start, paddr, end, VM_PAGE_1GB, pagesz_mask)) {
+			write_pte((xpte_leaf_t *)pge, paddr, flags, VM_PAGE_1GB);
+			start += VM_PAGE_1GB;
+			paddr += VM_PAGE_1GB;
+			continue;
+		}
+		if (!pge->valid) {
+			if (!alloc_page_table(pge)) {
+				status = -ENOMEM;
+				break;
+			}
+		} else if (!pge->type) {
+			if (!split_large_page(pge, VM_PAGE_1GB)) {
+				status = -ENOMEM;
+				break;
+			}
+		}
+		pmd = __va(xpte_paddr(pge));
+
+		/* Fill Page Middle Directory entries */
+		do {
+			pme = &pmd[(start >> 21) & 0x1FF];
+			if ((!pme->valid || !pme->type) &&
+			    can_map_leaf(start, paddr, end,
+			                 VM_PAGE_2MB, pagesz_mask)) {
+				write_pte((xpte_leaf_t *)pme, paddr, flags,
+				          VM_PAGE_2MB);
+				start += VM_PAGE_2MB;
+				paddr += VM_PAGE_2MB;
+				continue;
+			}
+			if (!pme->valid) {
+				if (!alloc_page_table(pme)) {
+					status = -ENOMEM;
+					goto out;
+				}
+			} else if (!pme->type) {
+				if (!split_large_page(pme, VM_PAGE_2MB)) {
+					status = -ENOMEM;
+					goto out;
+				}
+			}
+			ptd = __va(xpte_paddr(pme));
+
+			/* Fill Page Table Directory entries */
+			do {
+				write_pte((xpte_leaf_t *)&ptd[(start >> 12) & 0x1FF],
+				          paddr, flags, VM_PAGE_4KB);
+				start += VM_PAGE_4KB;
+				paddr += VM_PAGE_4KB;
+			} while ((start < end) && (start & (VM_PAGE_2MB - 1)));
+
+		} while ((start < end) && (start & (VM_PAGE_1GB - 1)));
+	}
+
+out:
+	flush_cache_all();
+	flush_tlb_all();
+	local_flush_tlb_all();
+	return status;
+}
+
+
+/**
+ * Unmaps a range from an address space. Blocks that only partially overlap
+ * the range are split first, and page tables that become empty are freed
+ * (the PGD is never freed).
+ *
+ * Arguments:
+ *       [IN] aspace: Address space to unmap the range from.
+ *       [IN] start:  Address in aspace of the start of the range.
+ *       [IN] extent: Size of the range, in bytes.
+ *
+ * Returns:
+ *       Success: 0
+ *       Failure: Error Code, the range may be partially unmapped.
+ */
+int
+arch_aspace_unmap_range(
+	struct aspace *	aspace,
+	vaddr_t		start,
+	size_t		extent
+)
+{
+	const vaddr_t end = start + extent;
+
+	xpte_t *pmd;	/* Page Middle Directory: level 2 */
+	xpte_t *ptd;	/* Page Table Directory:  level 3 */
+
+	xpte_t *pge;	/* Page Global Directory Entry */
+	xpte_t *pme;	/* Page Middle Directory Entry */
+
+	if (aspace->arch.pgd == NULL)
+		panic("Aspace has NULL PGD\n");
+
+	while (start < end) {
+		/* Traverse the Page Global Directory */
+		pge = &aspace->arch.pgd[(start >> 30) & 0x1FF];
+		if (!pge->valid) {
+			start = next_boundary(start, VM_PAGE_1GB, end);
+			continue;
+		}
+		if (!pge->type) {
+			if (can_map_leaf(start, 0, end,
+			                 VM_PAGE_1GB, VM_PAGE_1GB)) {
+				memset(pge, 0, sizeof(xpte_t));
+				start += VM_PAGE_1GB;
+				continue;
+			}
+			if (!split_large_page(pge, VM_PAGE_1GB))
+				return -ENOMEM;
+		}
+		pmd = __va(xpte_paddr(pge));
+
+		/* Clear Page Middle Directory entries */
+		do {
+			pme = &pmd[(start >> 21) & 0x1FF];
+			if (!pme->valid) {
+				start = next_boundary(start, VM_PAGE_2MB, end);
+				continue;
+			}
+			if (!pme->type) {
+				if (can_map_leaf(start, 0, end,
+				                 VM_PAGE_2MB, VM_PAGE_2MB)) {
+					memset(pme, 0, sizeof(xpte_t));
+					start += VM_PAGE_2MB;
+					continue;
+				}
+				if (!split_large_page(pme, VM_PAGE_2MB))
+					return -ENOMEM;
+			}
+			ptd = __va(xpte_paddr(pme));
+
+			/* Clear Page Table Directory entries */
+			do {
+				memset(&ptd[(start >> 12) & 0x1FF], 0,
+				       sizeof(xpte_t));
+				start += VM_PAGE_4KB;
+			} while ((start < end) && (start & (VM_PAGE_2MB - 1)));
+
+			try_to_free_table(ptd, pme);
+		} while ((start < end) && (start & (VM_PAGE_1GB - 1)));
+
+		try_to_free_table(pmd, pge);
+	}
+
+	return 0;
+}
+
 int
 arch_aspace_smartmap(struct aspace *src, struct aspace *dst,
                      vaddr_t start, size_t extent)
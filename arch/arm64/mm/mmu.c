@@ -25,6 +25,8 @@
 #include <lwk/pfn.h>
 
 #include <lwk/types.h>
+#include <lwk/percpu.h>
+#include <lwk/smp.h>
 
 
 #if 0
@@ -573,6 +575,73 @@ void __init paging_init(void)
 	//cpu_set_reserved_ttbr0();
 	//flush_tlb_all();
 }
+
+
+/**
+ * Number of ASIDs each CPU hands out to address spaces, ASIDs 1 through
+ * NR_ASPACE_ASIDS. ASID 0 is used for everything else.
+ */
+#define NR_ASPACE_ASIDS		16
+
+/**
+ * Per-CPU record of which address spaces own which ASIDs.
+ */
+struct asid_cache {
+	unsigned int	next;		/* Next slot to evict, round robin */
+	struct {
+		uint64_t	ctx_id;	/* Owner's arch.ctx_id, 0 if unused */
+		uint64_t	tlb_gen; /* Owner's tlb_gen when last loaded */
+	} slot[NR_ASPACE_ASIDS];
+};
+static DEFINE_PER_CPU(struct asid_cache, asid_cache);
+
+/**
+ * Picks the ASID the calling CPU tags aspace's TLB entries with, and returns
+ * it positioned for TTBR0_EL1. The CPU's stale entries for that ASID, left
+ * over from a previous owner or from a TLB shootdown this CPU missed while
+ * not running the aspace, are invalidated first.
+ *
+ * Must be called with interrupts disabled, after the CPU has been added to
+ * aspace->tlb_cpus.
+ */
+unsigned long
+asid_activate(struct aspace *aspace)
+{
+	struct asid_cache *cache = &__get_cpu_var(asid_cache);
+	unsigned long asid;
+	uint64_t tlb_gen;
+	unsigned int i;
+
+	if (!aspace->arch.ctx_id)
+		return 0;
+
+	/* Pairs with the smp_mb() in __aspace_take_tlb_batch() */
+	smp_mb();
+	tlb_gen = aspace->tlb_gen;
+
+	for (i = 0; i < NR_ASPACE_ASIDS; i++) {
+		if (cache->slot[i].ctx_id == aspace->arch.ctx_id)
+			break;
+	}
+
+	if (i == NR_ASPACE_ASIDS) {
+		i = cache->next;
+		cache->next = (i + 1) % NR_ASPACE_ASIDS;
+		cache->slot[i].ctx_id = aspace->arch.ctx_id;
+		cache->slot[i].tlb_gen = tlb_gen - 1;	/* force a flush */
+	}
+
+	asid = (unsigned long)(i + 1) << 48;
+
+	if (cache->slot[i].tlb_gen != tlb_gen) {
+		dsb(nshst);
+		__tlbi(aside1, asid);
+		dsb(nsh);
+		cache->slot[i].tlb_gen = tlb_gen;
+	}
+
+	return asid;
+}
 #if 0
 
 struct aspace init_mm;
@@ -26,6 +26,7 @@
 #include <lwk/init.h>
 #include <lwk/acpi.h>
 #include <lwk/bootmem.h>
+#include <lwk/topology.h>
 
 #include <arch/pgtable.h>
 #include <arch/io_apic.h>
@@ -68,6 +69,67 @@ static u64 acpi_lapic_addr __initdata = APIC_DEFAULT_PHYS_BASE;
 #warning ACPI uses CMPXCHG, i486 and later hardware
 #endif
 
+/* --------------------------------------------------------------------------
+                              NUMA Affinity
+   -------------------------------------------------------------------------- */
+
+extern int srat_rev;
+
+/*
+ * NUMA node of each local APIC ID, as reported by the SRAT.
+ * Consulted whenever a CPU's per-CPU area is set up, including hot-add.
+ */
+static s16 apicid_to_node_map[MAX_APICS] = { [0 ... MAX_APICS-1] = -1 };
+
+static void __init
+acpi_numa_set_apicid_node(u32 apic_id, u32 pxm, u32 flags)
+{
+	if (!(flags & ACPI_SRAT_CPU_ENABLED))
+		return;
+
+	if ((apic_id >= MAX_APICS) || (pxm >= MAX_NUMNODES)) {
+		printk(KERN_WARNING PREFIX
+		       "Ignoring SRAT entry for APIC 0x%x in PXM %u\n",
+		       apic_id, pxm);
+		return;
+	}
+
+	apicid_to_node_map[apic_id] = pxm;
+}
+
+void __init
+acpi_numa_processor_affinity_init(struct acpi_srat_cpu_affinity *pa)
+{
+	u32 pxm = pa->proximity_domain_lo;
+
+	if (srat_rev >= 2) {
+		pxm |= pa->proximity_domain_hi[0] << 8;
+		pxm |= pa->proximity_domain_hi[1] << 16;
+		pxm |= pa->proximity_domain_hi[2] << 24;
+	}
+
+	acpi_numa_set_apicid_node(pa->apic_id, pxm, pa->flags);
+}
+
+void __init
+acpi_numa_x2apic_affinity_init(struct acpi_srat_x2apic_cpu_affinity *pa)
+{
+	acpi_numa_set_apicid_node(pa->apic_id, pa->proximity_domain, pa->flags);
+}
+
+/*
+ * Returns the NUMA node of the CPU with the given local APIC ID.
+ * CPUs not described by the SRAT are placed on node 0.
+ */
+int
+apicid_to_node(unsigned int apic_id)
+{
+	if ((apic_id >= MAX_APICS) || (apicid_to_node_map[apic_id] < 0))
+		return 0;
+
+	return apicid_to_node_map[apic_id];
+}
+
 /* --------------------------------------------------------------------------
                               Boot-time Configuration
    -------------------------------------------------------------------------- */
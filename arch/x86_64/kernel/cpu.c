@@ -17,6 +17,8 @@
 #include <arch/i387.h>
 #include <arch/apic.h>
 #include <arch/tsc.h>
+#include <arch/tlbflush.h>
+#include <arch/vsyscall.h>
 
 /**
  * Bitmap of CPUs that have been initialized.
@@ -267,10 +269,12 @@ cpu_init(void)
 	pda_init(cpu, me);	/* per-cpu data area */
 	identify_cpu();		/* determine cpu features via CPUID */
 	cr4_init();		/* control register 4 */
+	pcid_init();		/* process-context identifiers */
 	gdt_init();		/* global descriptor table */
 	idt_init();		/* interrupt descriptor table */
 	tss_init();		/* task state segment */
 	msr_init();		/* misc. model specific registers */
+	vsyscall_cpu_init();	/* per-CPU vsyscall page state */
 	dbg_init();		/* debug registers */
 	fpu_init();		/* floating point unit */
 	lapic_init();		/* local advanced prog. interrupt controller */
@@ -445,6 +449,7 @@ phys_cpu_remove(unsigned int phys_cpu_id,
 		aspace_update_cpumask(KERNEL_ASPACE_ID, &cpu_present_map);
 
 		kmem_free_pages((void *)cpu_gdt_descr[target_cpu].address, 0);
+		kmem_cpu_drain(target_cpu);
 		free_per_cpu_area(target_cpu);
         }
 
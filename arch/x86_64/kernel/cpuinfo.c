@@ -529,6 +529,13 @@ identify_cpu(void)
 		}
 	}
 
+	/* Determine Intel-defined structured extended features: level 7 */
+	if (a->cpuid_level >= 0x00000007) {
+		int eax, ebx, ecx, edx;
+		cpuid_count(0x00000007, 0, &eax, &ebx, &ecx, &edx);
+		a->x86_capability[9] = ebx;
+	}
+
 	/* Determine if we support 1GB pages. Intel and AMD both set bit 26 in
 	 * cpuid(0x80000001):edx, which we've already queried in
 	 * identify_cpu()
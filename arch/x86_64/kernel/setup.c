@@ -5,6 +5,7 @@
 #include <lwk/smp.h>
 #include <lwk/sched.h>
 #include <lwk/acpi.h>
+#include <lwk/topology.h>
 #include <arch/bootsetup.h>
 #include <arch/e820.h>
 #include <arch/page.h>
@@ -163,6 +164,19 @@ reserve_memory(void)
 	}
 }
 
+/**
+ * Records which NUMA node a CPU is on, based on its APIC ID.
+ * Must be called after the CPU's per-CPU area has been set up.
+ */
+static void
+setup_cpu_numa_node(int cpu)
+{
+	int node = apicid_to_node(cpu_info[cpu].arch.apic_id);
+
+	cpu_info[cpu].numa_node_id = node;
+	set_cpu_numa_node(cpu, node);
+}
+
 /**
  * This initializes a per-CPU area for a specific CPU.
  *
@@ -184,7 +198,7 @@ setup_per_cpu_area(int cpu)
  	 */
 	size = ALIGN(__per_cpu_end - __per_cpu_start, SMP_CACHE_BYTES);
 
-        ptr = kmem_alloc(size);
+        ptr = kmem_alloc_node(size, apicid_to_node(cpu_info[cpu].arch.apic_id));
 	if (!ptr)
 		panic("Cannot allocate cpu data for CPU %d\n", cpu);
 
@@ -200,6 +214,8 @@ setup_per_cpu_area(int cpu)
 	cpu_pda(cpu)->data_offset = ptr - __per_cpu_start;
 
 	memcpy(ptr, __per_cpu_start, __per_cpu_end - __per_cpu_start);
+
+	setup_cpu_numa_node(cpu);
 } 
 
 void
@@ -258,6 +274,8 @@ setup_per_cpu_areas(void)
             cpu_pda(i)->data_offset = ptr - __per_cpu_start;
 
             memcpy(ptr, __per_cpu_start, __per_cpu_end - __per_cpu_start);
+
+            setup_cpu_numa_node(i);
         }
 }
 
@@ -203,6 +203,11 @@ arch_set_timer_oneshot(unsigned int nsec){
 	lapic_set_timer_oneshot(nsec);
 }
 
+void
+arch_stop_timer_oneshot(void){
+	lapic_stop_timer();
+}
+
 void
 arch_core_timer_init()
 {
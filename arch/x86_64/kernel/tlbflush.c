@@ -1,7 +1,27 @@
 #include <lwk/tlbflush.h>
 #include <lwk/cpuinfo.h>
 #include <lwk/xcall.h>
+#include <lwk/params.h>
+#include <lwk/smp.h>
 #include <arch/processor.h>
+#include <arch/page.h>
+
+
+/**
+ * Ranges larger than this many pages are flushed by reloading CR3 rather
+ * than by issuing one INVLPG per page.
+ */
+static unsigned long tlb_flush_ceiling = 32;
+param(tlb_flush_ceiling, ulong);
+
+
+/**
+ * Range passed to the flush_tlb_mask_range() cross-call handler.
+ */
+struct tlb_range {
+	vaddr_t	start;
+	vaddr_t	end;
+};
 
 
 /**
@@ -18,6 +38,18 @@ __flush_tlb(void)
 {
 	uint64_t tmpreg;
 
+	/*
+	 * With PCIDs enabled, reloading CR3 only flushes the entries tagged
+	 * with the current PCID. Entries of the other PCIDs must go too.
+	 */
+	if (read_cr4() & X86_CR4_PCIDE) {
+		if (cpu_has(&cpu_info[this_cpu], X86_FEATURE_INVPCID))
+			__invpcid(0, 0, INVPCID_TYPE_ALL_NON_GLOBAL);
+		else
+			__flush_tlb_kernel();
+		return;
+	}
+
 	__asm__ __volatile__(
 		"movq %%cr3, %0;  # flush TLB \n"
 		"movq %0, %%cr3;              \n"
@@ -47,6 +79,55 @@ flush_tlb(void)
 }
 
 
+/**
+ * Flush the non-global entries for [start, end) from the calling CPU's TLB.
+ */
+void
+__flush_tlb_range(vaddr_t start, vaddr_t end)
+{
+	vaddr_t addr;
+
+	if (end <= start)
+		return;
+
+	if (((end - start) >> PAGE_SHIFT) > tlb_flush_ceiling) {
+		__flush_tlb();
+		return;
+	}
+
+	for (addr = start & PAGE_MASK; addr < end; addr += PAGE_SIZE)
+		__flush_tlb_one(addr);
+}
+
+
+/**
+ * flush_tlb_mask_range() cross-call handler.
+ */
+static void
+do_flush_tlb_range_xcall(void *info)
+{
+	struct tlb_range *range = info;
+
+	__flush_tlb_range(range->start, range->end);
+}
+
+
+/**
+ * Flush the non-global entries for [start, end) from the TLBs of the CPUs
+ * in cpu_mask.
+ */
+void
+flush_tlb_mask_range(cpumask_t cpu_mask, vaddr_t start, vaddr_t end)
+{
+	struct tlb_range range = { .start = start, .end = end };
+
+	if ((end <= start) || cpus_empty(cpu_mask))
+		return;
+
+	xcall_function(cpu_mask, do_flush_tlb_range_xcall, &range, 1);
+}
+
+
 /**
  * Flush all entries in the calling CPU's TLB, including global entries.
  *
@@ -23,45 +23,144 @@
 #include <lwk/init.h>
 #include <lwk/time.h>
 #include <lwk/unistd.h>
+#include <lwk/smp.h>
+#include <lwk/cpuinfo.h>
+#include <lwk/topology.h>
 #include <arch/vsyscall.h>
+#include <arch/msr.h>
+#include <arch/system.h>
 #include <arch/pgtable.h>
 #include <arch/fixmap.h>
 
 #define __vsyscall(nr) __attribute__ ((unused,__section__(".vsyscall_" #nr)))
+#define __section_vsyscall_data __attribute__ ((unused,__section__(".vsyscall_data"),aligned(64)))
 #define __syscall_clobber "r11","cx","memory"
 
+/* from /usr/include/linux/time.h */
+#define CLOCK_REALTIME                  0
+#define CLOCK_MONOTONIC                 1
+
+/* How vgetcpu() finds out the current CPU */
+#define VGETCPU_SYSCALL	0
+#define VGETCPU_RDTSCP	1	/* TSC_AUX holds (node << 12) | cpu */
+
+/**
+ * Data read by the vsyscall functions. This is linked into the vsyscall
+ * page, which is read-only to user space. The kernel updates it through
+ * vsyscall_data, its alias in the kernel's mapping of the same memory.
+ */
+struct vsyscall_data {
+	struct vtime_data	vtime;
+	int			getcpu_mode;
+};
+
+struct vsyscall_data __vsyscall_data __section_vsyscall_data;
+extern struct vsyscall_data vsyscall_data;
+
+/**
+ * User space version of get_time(). Everything called from the vsyscall
+ * page must be inlined, kernel text is not accessible from user space.
+ */
+static __always_inline ktime_t
+vget_time(void)
+{
+	const volatile struct vtime_data *vt = &__vsyscall_data.vtime;
+	uint32_t seq;
+	uint64_t cycles, ns;
+
+	do {
+		seq = vt->seq;
+		rmb();
+		rdtscll(cycles);
+		ns = (((unsigned __int128)cycles * vt->mult) >> vt->shift)
+		     + vt->offset;
+		rmb();
+	} while ((seq & 1) || (seq != vt->seq));
+
+	return ns;
+}
+
 int __vsyscall(0)
 vgettimeofday(struct timeval *tv, struct timezone *tz)
 {
-	int ret;
-	asm volatile("syscall"
-		: "=a" (ret)
-		: "0" (__NR_gettimeofday),"D" (tv),"S" (tz)
-		: __syscall_clobber );
-	return ret;
+	if (tv) {
+		uint64_t now = vget_time();
+
+		tv->tv_sec  = now / NSEC_PER_SEC;
+		tv->tv_usec = (now % NSEC_PER_SEC) / NSEC_PER_USEC;
+	}
+
+	if (tz) {
+		tz->tz_minuteswest = 0;
+		tz->tz_dsttime     = 0;
+	}
+
+	return 0;
 }
 
 time_t __vsyscall(1)
 vtime(time_t *t)
 {
-	int ret;
-	asm volatile("syscall"
-		: "=a" (ret)
-		: "0" (__NR_time),"D" (t)
-		: __syscall_clobber );
-	return ret;
+	time_t now_sec = vget_time() / NSEC_PER_SEC;
+
+	if (t)
+		*t = now_sec;
+
+	return now_sec;
 }
 
 long __vsyscall(2)
 vgetcpu(unsigned *cpu, unsigned *node, void *tcache)
 {
-	asm volatile("syscall"
-		:
-		: "a" (__NR_getcpu),"D" (cpu)
-		: __syscall_clobber );
+	unsigned int eax, edx, aux;
+
+	if (__vsyscall_data.getcpu_mode != VGETCPU_RDTSCP) {
+		asm volatile("syscall"
+			:
+			: "a" (__NR_getcpu),"D" (cpu)
+			: __syscall_clobber );
+		return 0;
+	}
+
+	asm volatile("rdtscp" : "=a" (eax), "=d" (edx), "=c" (aux));
+
+	if (cpu)
+		*cpu = aux & 0xfff;
+	if (node)
+		*node = aux >> 12;
 	return 0;
 }
 
+int __vsyscall(3)
+vclock_gettime(clockid_t which_clock, struct timespec *tp)
+{
+	uint64_t now;
+	int ret;
+
+	if ((which_clock != CLOCK_REALTIME) && (which_clock != CLOCK_MONOTONIC)) {
+		asm volatile("syscall"
+			: "=a" (ret)
+			: "0" (__NR_clock_gettime),"D" (which_clock),"S" (tp)
+			: __syscall_clobber );
+		return ret;
+	}
+
+	now = vget_time();
+	tp->tv_sec  = now / NSEC_PER_SEC;
+	tp->tv_nsec = now % NSEC_PER_SEC;
+	return 0;
+}
+
+/**
+ * Records the calling CPU's ID in its TSC_AUX register, for vgetcpu().
+ */
+void
+vsyscall_cpu_init(void)
+{
+	if (cpu_has(&cpu_info[this_cpu], X86_FEATURE_RDTSCP))
+		wrmsrl(MSR_TSC_AUX, (cpu_to_node(this_cpu) << 12) | this_cpu);
+}
+
 void __init
 vsyscall_map(void)
 {
@@ -79,5 +178,12 @@ vsyscall_map(void)
 			VSYSCALL_ADDR(__NR_vtime));
 	BUG_ON((unsigned long) &vgetcpu !=
 			VSYSCALL_ADDR(__NR_vgetcpu));
+	BUG_ON((unsigned long) &vclock_gettime !=
+			VSYSCALL_ADDR(__NR_vclock_gettime));
+
+	/* Let user space read the time without entering the kernel */
+	if (boot_cpu_has(X86_FEATURE_RDTSCP))
+		vsyscall_data.getcpu_mode = VGETCPU_RDTSCP;
+	vtime_init(&vsyscall_data.vtime);
 }
 
@@ -3,31 +3,120 @@
 #include <lwk/xcall.h>
 #include <lwk/task.h>
 #include <lwk/smp.h>
+#include <lwk/percpu.h>
 #include <arch/apic.h>
 #include <arch/idt_vectors.h>
 #include <arch/processor.h>
 
 /**
- * Used to pass data to and synchronize the CPUs targeted by a cross-call.
+ * Number of entries in each CPU's cross-call mailbox.
  */
-struct xcall_data_struct {
+#define XCALL_MAILBOX_SIZE	64
+
+/**
+ * Number of asynchronous (wait=false) cross-calls each CPU may have in
+ * flight at once.
+ */
+#define XCALL_ASYNC_SLOTS	8
+
+/**
+ * Describes one cross-call. It is shared by all of the cross-call's targets
+ * and lives on the initiator's stack (wait=true) or in the initiator's
+ * per-CPU pool of async slots (wait=false).
+ */
+struct xcall {
 	void		(*func)(void *info);
 	void *		info;
-	atomic_t	started;
-	atomic_t	finished;
-	bool		wait;
+	atomic_t	pending;	/* # targets that have not finished */
+};
+
+/**
+ * Per-CPU queue of cross-calls waiting to run on the CPU. Any CPU may add
+ * to a mailbox, only its owner removes from it.
+ *
+ * Each entry's seq tells its state relative to the lap of the ring the
+ * entry's position belongs to: 2*lap means free, 2*lap+1 means it holds a
+ * cross-call. A zeroed mailbox is therefore empty.
+ */
+struct xcall_mailbox {
+	struct {
+		unsigned long	seq;
+		struct xcall *	call;
+	} slot[XCALL_MAILBOX_SIZE];
+	unsigned long		tail;		/* Next position to fill */
+	unsigned long		head;		/* Next position to run */
+	int			ipi_pending;	/* IPI sent, not yet handled */
 };
+static DEFINE_PER_CPU(struct xcall_mailbox, xcall_mailbox);
+
+/**
+ * Pool of cross-call descriptors for this CPU's asynchronous cross-calls.
+ */
+static DEFINE_PER_CPU(struct xcall[XCALL_ASYNC_SLOTS], xcall_async);
+
+#define XCALL_LAP(pos)		(2 * ((pos) / XCALL_MAILBOX_SIZE))
+
+/**
+ * Adds a cross-call to the target CPU's mailbox. Lock-free, spins only if
+ * the mailbox is full.
+ */
+static void
+xcall_post(unsigned int cpu, struct xcall *call)
+{
+	struct xcall_mailbox *mbox = &per_cpu(xcall_mailbox, cpu);
+	unsigned long pos, seq;
+
+	for (;;) {
+		pos = ACCESS_ONCE(mbox->tail);
+		seq = ACCESS_ONCE(mbox->slot[pos % XCALL_MAILBOX_SIZE].seq);
+
+		if (seq == XCALL_LAP(pos)) {
+			/* Entry is free, try to claim it */
+			if (cmpxchg(&mbox->tail, pos, pos + 1) == pos)
+				break;
+		} else if ((long)(seq - XCALL_LAP(pos)) < 0) {
+			/* Mailbox is full, wait for the target to drain it */
+			cpu_relax();
+		}
+	}
+
+	mbox->slot[pos % XCALL_MAILBOX_SIZE].call = call;
+	wmb();
+	mbox->slot[pos % XCALL_MAILBOX_SIZE].seq = XCALL_LAP(pos) + 1;
+}
 
 /**
- * Global cross-call data pointer, protected by xcall_data_lock.
+ * Returns a free async cross-call descriptor of the calling CPU, waiting
+ * for an earlier async cross-call to complete if they are all in use.
  */
-static struct xcall_data_struct *xcall_data;
-static DEFINE_SPINLOCK(xcall_data_lock);
+static struct xcall *
+xcall_get_async(void)
+{
+	struct xcall *pool = __get_cpu_var(xcall_async);
+	unsigned int i;
+
+	for (;;) {
+		for (i = 0; i < XCALL_ASYNC_SLOTS; i++) {
+			if (atomic_read(&pool[i].pending) == 0) {
+				rmb();
+				return &pool[i];
+			}
+		}
+		cpu_relax();
+	}
+}
 
 /**
  * x86_64 specific code for carrying out inter-CPU function calls. 
  * This function should not be called directly. Call xcall_function() instead.
  *
+ * The cross-call is queued in each target CPU's mailbox, so any number of
+ * CPUs may have cross-calls in flight at once. A target is only sent an IPI
+ * if it has no IPI outstanding already, otherwise its pending IPI handler
+ * picks up the new cross-call as well.
+ *
+ * If wait=false, this returns as soon as the cross-call has been queued.
+ *
  * Arguments:
  *       [IN] cpu_mask: The target CPUs of the cross-call.
  *       [IN] func:     The function to execute on each target CPU.
@@ -46,7 +135,8 @@ arch_xcall_function(
 	bool		wait
 )
 {
-	struct xcall_data_struct data;
+	struct xcall sync_call, *call;
+	unsigned long irqstate;
 	unsigned int num_cpus;
 	unsigned int cpu;
 
@@ -55,62 +145,78 @@ arch_xcall_function(
 	if (!num_cpus)
 		return 0;
 
-	/* Fill in the xcall data structure on our stack */
-	data.func = func;
-	data.info = info;
-	atomic_set(&data.started, 0);
-	if (wait)
-		atomic_set(&data.finished, 0);
-	data.wait = wait;
-
-	/* Spin with IRQs enabled */
-	while (!spin_trylock_irq(&xcall_data_lock))
-		;
-	/* IRQs are now disabled */
-
-	/* Set the global xcall data pointer */
-	xcall_data = &data;
+	/* Fill in the xcall descriptor */
+	call = wait ? &sync_call : xcall_get_async();
+	call->func = func;
+	call->info = info;
+	atomic_set(&call->pending, num_cpus);
 	wmb();
 
-	/* Send inter-processor interrupts to the target CPUs */
-	for_each_cpu_mask(cpu, cpu_mask)
-		lapic_send_ipi(cpu, LWK_XCALL_FUNCTION_VECTOR);
-
-	/* Wait for initiation responses */
-	while (atomic_read(&data.started) != num_cpus)
-		cpu_relax();
+	/*
+	 * Queue the cross-call on each target and send it an IPI right away
+	 * if it needs one. Every target we have posted to is then sure to be
+	 * draining its mailbox while we might spin on the next target's full
+	 * mailbox, so two CPUs cross-calling each other can not deadlock.
+	 * Interrupts are disabled around the IPI so that an interrupt handler
+	 * sending an IPI of its own can not interleave with our ICR writes.
+	 */
+	for_each_cpu_mask(cpu, cpu_mask) {
+		xcall_post(cpu, call);
+		if (xchg(&per_cpu(xcall_mailbox, cpu).ipi_pending, 1) == 0) {
+			local_irq_save(irqstate);
+			lapic_send_ipi(cpu, LWK_XCALL_FUNCTION_VECTOR);
+			local_irq_restore(irqstate);
+		}
+	}
 
-	/* If requested, wait for completion responses */
+	/* If requested, wait for completion responses. Spin with IRQs
+	 * enabled so cross-calls targeting us are not held up. */
 	if (wait) {
-		while (atomic_read(&data.finished) != num_cpus)
+		while (atomic_read(&call->pending) != 0)
 			cpu_relax();
 	}
-	spin_unlock_irq(&xcall_data_lock);
 
 	return 0;
 }
 
 /**
- * The interrupt handler for inter-CPU function calls.
+ * The interrupt handler for inter-CPU function calls. Runs every cross-call
+ * in the calling CPU's mailbox.
  */
 void
 arch_xcall_function_interrupt(struct pt_regs *regs, unsigned int vector)
 {
-	void (*func)(void *info) = xcall_data->func;
-	void *info               = xcall_data->info;
-	int wait                 = xcall_data->wait;
-
-	/* Notify initiating CPU that we've started */
-	mb();
-	atomic_inc(&xcall_data->started);
+	struct xcall_mailbox *mbox = &__get_cpu_var(xcall_mailbox);
+	struct xcall *call;
+	unsigned long pos;
+
+	/*
+	 * Clear ipi_pending before looking in the mailbox. A cross-call
+	 * posted after this point either is seen below, or sends a new IPI.
+	 */
+	mbox->ipi_pending = 0;
+	smp_mb();
+
+	for (;;) {
+		pos = mbox->head;
+		if (ACCESS_ONCE(mbox->slot[pos % XCALL_MAILBOX_SIZE].seq)
+		     != XCALL_LAP(pos) + 1)
+			break;
+		rmb();
+		call = mbox->slot[pos % XCALL_MAILBOX_SIZE].call;
+
+		/* Hand the entry back to senders */
+		mb();
+		mbox->slot[pos % XCALL_MAILBOX_SIZE].seq =
+			XCALL_LAP(pos + XCALL_MAILBOX_SIZE);
+		mbox->head = pos + 1;
 
-	/* Execute the cross-call function */
-	(*func)(info);
+		/* Execute the cross-call function */
+		(*call->func)(call->info);
 
-	/* Notify initiating CPU that the cross-call function has completed */
-	if (wait) {
+		/* Notify the initiating CPU that we are done with call */
 		mb();
-		atomic_inc(&xcall_data->finished);
+		atomic_dec(&call->pending);
 	}
 }
 
@@ -7,6 +7,64 @@
 #include <arch/page.h>      /* TODO: remove */
 #include <arch/pgtable.h>   /* TODO: remove */
 #include <arch/page_table.h>
+#include <arch/tlbflush.h>
+#include <lwk/params.h>
+#include <lwk/percpu.h>
+#include <lwk/cpuinfo.h>
+#include <lwk/smp.h>
+
+
+/**
+ * Source of arch_aspace.ctx_id values. Context IDs are never reused, so a
+ * CPU can never mistake a new aspace for an old one that had the same ID.
+ */
+static atomic64_t next_ctx_id = ATOMIC64_INIT(0);
+
+
+/**
+ * Number of PCIDs each CPU hands out to address spaces, PCIDs 1 through
+ * NR_ASPACE_PCIDS. PCID 0 is used for everything else.
+ */
+#define NR_ASPACE_PCIDS		8
+
+/**
+ * CR3 bit that preserves the TLB entries tagged with the PCID being loaded.
+ */
+#define CR3_NOFLUSH		(1UL << 63)
+
+/**
+ * Per-CPU record of which address spaces own which PCIDs.
+ */
+struct pcid_cache {
+	bool		enabled;	/* CR4.PCIDE is set on this CPU */
+	unsigned int	next;		/* Next slot to evict, round robin */
+	struct {
+		uint64_t	ctx_id;	/* Owner's arch.ctx_id, 0 if unused */
+		uint64_t	tlb_gen; /* Owner's tlb_gen when last loaded */
+	} slot[NR_ASPACE_PCIDS];
+};
+static DEFINE_PER_CPU(struct pcid_cache, pcid_cache);
+
+/**
+ * Set to false on the kernel command line to disable use of PCIDs.
+ */
+static bool pcid = true;
+param(pcid, bool);
+
+
+/**
+ * Enables PCIDs on the calling CPU, if it supports them. Must be called
+ * while CR3 holds PCID 0, i.e., before any aspace has been activated.
+ */
+void __init
+pcid_init(void)
+{
+	if (!pcid || !cpu_has(&cpu_info[this_cpu], X86_FEATURE_PCID))
+		return;
+
+	set_in_cr4(X86_CR4_PCIDE);
+	__get_cpu_var(pcid_cache).enabled = true;
+}
 
 
 /**
@@ -28,6 +86,8 @@ arch_aspace_create(
 	for (i = pgd_index(PAGE_OFFSET); i < PTRS_PER_PGD; i++)
 		aspace->arch.pgd[i] = bootstrap_task.aspace->arch.pgd[i];
 
+	aspace->arch.ctx_id = atomic64_inc_return(&next_ctx_id);
+
 	return 0;
 }
 
@@ -81,15 +141,51 @@ arch_aspace_destroy(
 /**
  * Loads the address space object's root page table pointer into the calling
  * CPU's CR3 register, causing the aspace to become active.
+ *
+ * If PCIDs are enabled, each CPU tags the TLB entries of its most recently
+ * used aspaces with a PCID of their own, so switching back to one of them
+ * finds its TLB entries still warm. The entries are only kept if no TLB
+ * shootdown was issued for the aspace since this CPU last loaded it, as
+ * shootdowns only reach CPUs the aspace is currently active on.
  */
 void
 arch_aspace_activate(
 	struct aspace *	aspace
 )
 {
-	asm volatile(
-		"movq %0,%%cr3" :: "r" (__pa(aspace->arch.pgd)) : "memory"
-	);
+	struct pcid_cache *cache = &__get_cpu_var(pcid_cache);
+	unsigned long cr3 = __pa(aspace->arch.pgd);
+	uint64_t tlb_gen;
+	unsigned int i;
+
+	if (!cache->enabled || !aspace->arch.ctx_id)
+		goto load;
+
+	/*
+	 * context_switch() has already added this CPU to aspace->tlb_cpus,
+	 * see __aspace_take_tlb_batch() for why tlb_gen is read after that.
+	 */
+	tlb_gen = aspace->tlb_gen;
+
+	for (i = 0; i < NR_ASPACE_PCIDS; i++) {
+		if (cache->slot[i].ctx_id == aspace->arch.ctx_id) {
+			if (cache->slot[i].tlb_gen == tlb_gen)
+				cr3 |= CR3_NOFLUSH;
+			goto found;
+		}
+	}
+
+	/* Take over the next slot, loading without NOFLUSH clears its PCID */
+	i = cache->next;
+	cache->next = (i + 1) % NR_ASPACE_PCIDS;
+	cache->slot[i].ctx_id = aspace->arch.ctx_id;
+
+found:
+	cache->slot[i].tlb_gen = tlb_gen;
+	cr3 |= i + 1;
+
+load:
+	asm volatile("movq %0,%%cr3" :: "r" (cr3) : "memory");
 }
 
 
@@ -419,6 +515,290 @@ arch_aspace_unmap_page(
 	find_and_delete_pte(aspace, start, pagesz);
 }
 
+
+/**
+ * Returns the first address after addr that is aligned to size, clamped to
+ * end. Used to skip over page table entries that map nothing.
+ */
+static vaddr_t
+next_boundary(
+	vaddr_t		addr,
+	vmpagesize_t	size,
+	vaddr_t		end
+)
+{
+	vaddr_t next = (addr | (size - 1)) + 1;
+
+	return ((next == 0) || (next > end)) ? end : next;
+}
+
+
+/**
+ * Returns true if [start, end) can be mapped starting at start with a
+ * single leaf entry of size pagesz.
+ */
+static bool
+can_map_leaf(
+	vaddr_t		start,
+	paddr_t		paddr,
+	vaddr_t		end,
+	vmpagesize_t	pagesz,
+	vmpagesize_t	pagesz_mask
+)
+{
+	return (pagesz_mask & pagesz) &&
+	       !(start & (pagesz - 1)) &&
+	       !(paddr & (pagesz - 1)) &&
+	       ((end - start) >= pagesz);
+}
+
+
+/**
+ * Replaces a 2 MB or 1 GB leaf entry with a page table that maps the same
+ * physical memory with the same attributes using the next smaller page
+ * size. The new table is fully populated before it is linked in, so the
+ * mapping stays valid throughout.
+ */
+static xpte_t *
+split_large_page(
+	xpte_t *	pte,
+	vmpagesize_t	pagesz
+)
+{
+	const vmpagesize_t child_pagesz = pagesz >> 9;
+	xpte_t leaf = *pte;
+	xpte_t *table;
+	xpte_t _pte;
+	unsigned int i;
+
+	if ((table = alloc_page_table(NULL)) == NULL)
+		return NULL;
+
+	for (i = 0; i < 512; i++) {
+		table[i] = leaf;
+		table[i].base_paddr += i * (child_pagesz >> PAGE_SHIFT);
+		if (child_pagesz == VM_PAGE_4KB)
+			table[i].pagesize = 0;
+	}
+
+	memset(&_pte, 0, sizeof(_pte));
+	_pte.present     = 1;
+	_pte.write       = 1;
+	_pte.user        = 1;
+	_pte.base_paddr  = __pa(table) >> PAGE_SHIFT;
+	*pte = _pte;
+
+	return table;
+}
+
+
+/**
+ * Maps a physically contiguous range into an address space.
+ *
+ * Unlike arch_aspace_map_page(), the page tables are walked once for the
+ * whole range and consecutive entries within each table are filled in a
+ * single pass. Wherever the virtual and physical addresses are suitably
+ * aligned, and pagesz_mask allows it, 1 GB and 2 MB leaf entries are used
+ * instead of 4 KB entries. Existing large pages that only partially overlap
+ * the range are split.
+ *
+ * Arguments:
+ *       [IN] aspace:      Address space to map the range into.
+ *       [IN] start:       Address in aspace to map the range to.
+ *       [IN] paddr:       Physical address of the start of the range.
+ *       [IN] extent:      Size of the range, in bytes.
+ *       [IN] flags:       Protection and memory type flags.
+ *       [IN] pagesz_mask: Page sizes that may be used. start, paddr, and
+ *                         extent must be aligned to the smallest of them.
+ *
+ * Returns:
+ *       Success: 0
+ *       Failure: Error Code, the range may be partially mapped.
+ */
+int
+arch_aspace_map_range(
+	struct aspace *	aspace,
+	vaddr_t		start,
+	paddr_t		paddr,
+	size_t		extent,
+	vmflags_t	flags,
+	vmpagesize_t	pagesz_mask
+)
+{
+	const vaddr_t end = start + extent;
+
+	xpte_t *pud;	/* Page Upper Directory:  level 1 */
+	xpte_t *pmd;	/* Page Middle Directory: level 2 */
+	xpte_t *ptd;	/* Page Table Directory:  level 3 */
+
+	xpte_t *pge;	/* Page Global Directory Entry */
+	xpte_t *pue;	/* Page Upper Directory Entry */
+	xpte_t *pme;	/* Page Middle Directory Entry */
+
+	while (start < end) {
+		/* Traverse the Page Global Directory */
+		pge = &aspace->arch.pgd[(start >> 39) & 0x1FF];
+		if (!pge->present && !alloc_page_table(pge))
+			return -ENOMEM;
+		pud = __va(xpte_paddr(pge));
+
+		/* Fill Page Upper Directory entries */
+		do {
+			pue = &pud[(start >> 30) & 0x1FF];
+			if ((!pue->present || pue->pagesize) &&
+			    can_map_leaf(start, paddr, end,
+			                 VM_PAGE_1GB, pagesz_mask)) {
+				write_pte(pue, paddr, flags, VM_PAGE_1GB);
+				start += VM_PAGE_1GB;
+				paddr += VM_PAGE_1GB;
+				continue;
+			}
+			if (!pue->present) {
+				if (!alloc_page_table(pue))
+					return -ENOMEM;
+			} else if (pue->pagesize) {
+				if (!split_large_page(pue, VM_PAGE_1GB))
+					return -ENOMEM;
+			}
+			pmd = __va(xpte_paddr(pue));
+
+			/* Fill Page Middle Directory entries */
+			do {
+				pme = &pmd[(start >> 21) & 0x1FF];
+				if ((!pme->present || pme->pagesize) &&
+				    can_map_leaf(start, paddr, end,
+				                 VM_PAGE_2MB, pagesz_mask)) {
+					write_pte(pme, paddr, flags, VM_PAGE_2MB);
+					start += VM_PAGE_2MB;
+					paddr += VM_PAGE_2MB;
+					continue;
+				}
+				if (!pme->present) {
+					if (!alloc_page_table(pme))
+						return -ENOMEM;
+				} else if (pme->pagesize) {
+					if (!split_large_page(pme, VM_PAGE_2MB))
+						return -ENOMEM;
+				}
+				ptd = __va(xpte_paddr(pme));
+
+				/* Fill Page Table Directory entries */
+				do {
+					write_pte(&ptd[(start >> 12) & 0x1FF],
+					          paddr, flags, VM_PAGE_4KB);
+					start += VM_PAGE_4KB;
+					paddr += VM_PAGE_4KB;
+				} while ((start < end) &&
+				         (start & (VM_PAGE_2MB - 1)));
+
+			} while ((start < end) && (start & (VM_PAGE_1GB - 1)));
+
+		} while ((start < end) && (start & (PGDIR_SIZE - 1)));
+	}
+
+	return 0;
+}
+
+
+/**
+ * Unmaps a range from an address space. Large pages that only partially
+ * overlap the range are split first, and page tables that become empty are
+ * freed (the PGD is never freed).
+ *
+ * Arguments:
+ *       [IN] aspace: Address space to unmap the range from.
+ *       [IN] start:  Address in aspace of the start of the range.
+ *       [IN] extent: Size of the range, in bytes.
+ *
+ * Returns:
+ *       Success: 0
+ *       Failure: Error Code, the range may be partially unmapped.
+ */
+int
+arch_aspace_unmap_range(
+	struct aspace *	aspace,
+	vaddr_t		start,
+	size_t		extent
+)
+{
+	const vaddr_t end = start + extent;
+
+	xpte_t *pud;	/* Page Upper Directory:  level 1 */
+	xpte_t *pmd;	/* Page Middle Directory: level 2 */
+	xpte_t *ptd;	/* Page Table Directory:  level 3 */
+
+	xpte_t *pge;	/* Page Global Directory Entry */
+	xpte_t *pue;	/* Page Upper Directory Entry */
+	xpte_t *pme;	/* Page Middle Directory Entry */
+
+	while (start < end) {
+		/* Traverse the Page Global Directory */
+		pge = &aspace->arch.pgd[(start >> 39) & 0x1FF];
+		if (!pge->present) {
+			start = next_boundary(start, PGDIR_SIZE, end);
+			continue;
+		}
+		pud = __va(xpte_paddr(pge));
+
+		/* Clear Page Upper Directory entries */
+		do {
+			pue = &pud[(start >> 30) & 0x1FF];
+			if (!pue->present) {
+				start = next_boundary(start, VM_PAGE_1GB, end);
+				continue;
+			}
+			if (pue->pagesize) {
+				if (can_map_leaf(start, 0, end,
+				                 VM_PAGE_1GB, VM_PAGE_1GB)) {
+					memset(pue, 0, sizeof(xpte_t));
+					start += VM_PAGE_1GB;
+					continue;
+				}
+				if (!split_large_page(pue, VM_PAGE_1GB))
+					return -ENOMEM;
+			}
+			pmd = __va(xpte_paddr(pue));
+
+			/* Clear Page Middle Directory entries */
+			do {
+				pme = &pmd[(start >> 21) & 0x1FF];
+				if (!pme->present) {
+					start = next_boundary(start,
+					                      VM_PAGE_2MB, end);
+					continue;
+				}
+				if (pme->pagesize) {
+					if (can_map_leaf(start, 0, end,
+					                 VM_PAGE_2MB, VM_PAGE_2MB)) {
+						memset(pme, 0, sizeof(xpte_t));
+						start += VM_PAGE_2MB;
+						continue;
+					}
+					if (!split_large_page(pme, VM_PAGE_2MB))
+						return -ENOMEM;
+				}
+				ptd = __va(xpte_paddr(pme));
+
+				/* Clear Page Table Directory entries */
+				do {
+					memset(&ptd[(start >> 12) & 0x1FF], 0,
+					       sizeof(xpte_t));
+					start += VM_PAGE_4KB;
+				} while ((start < end) &&
+				         (start & (VM_PAGE_2MB - 1)));
+
+				try_to_free_table(ptd, pme);
+			} while ((start < end) && (start & (VM_PAGE_1GB - 1)));
+
+			try_to_free_table(pmd, pue);
+		} while ((start < end) && (start & (PGDIR_SIZE - 1)));
+
+		try_to_free_table(pud, pge);
+	}
+
+	return 0;
+}
+
 int
 arch_aspace_smartmap(struct aspace *src, struct aspace *dst,
                      vaddr_t start, size_t extent)
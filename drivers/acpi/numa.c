@@ -30,6 +30,7 @@
 #include <lwk/errno.h>
 #include <lwk/acpi.h>
 #include <lwk/pmem.h>
+#include <lwk/topology.h>
 
 #define ACPI_NUMA	0x80000000
 #define _COMPONENT	ACPI_NUMA
@@ -108,14 +109,38 @@ void __init acpi_table_print_srat_entry(struct acpi_subtable_header * header)
 	}
 }
 
+/*
+ * Records the node distances reported by the SLIT. Localities are used
+ * directly as NUMA node IDs, same as the proximity domains in the SRAT.
+ */
+void __init acpi_numa_slit_init(struct acpi_table_slit *slit)
+{
+	u64 i, j;
+
+	for (i = 0; i < slit->locality_count; i++) {
+		for (j = 0; j < slit->locality_count; j++) {
+			numa_set_distance(i, j,
+				slit->entry[slit->locality_count * i + j]);
+		}
+	}
+}
+
 static int __init acpi_parse_slit(struct acpi_table_header *table)
 {
-	//acpi_numa_slit_init((struct acpi_table_slit *)table);
+	acpi_numa_slit_init((struct acpi_table_slit *)table);
 
 	return 0;
 }
 
 #ifndef CONFIG_X86
+void __init
+acpi_numa_processor_affinity_init(struct acpi_srat_cpu_affinity *pa)
+{
+	printk(KERN_WARNING PREFIX
+	       "Found unsupported apic [0x%02x] SRAT entry\n", pa->apic_id);
+	return;
+}
+
 void __init
 acpi_numa_x2apic_affinity_init(struct acpi_srat_x2apic_cpu_affinity *pa)
 {
@@ -138,7 +163,7 @@ acpi_parse_x2apic_affinity(struct acpi_subtable_header *header,
 	acpi_table_print_srat_entry(header);
 
 	/* let architecture-dependent part to do it */
-	//acpi_numa_x2apic_affinity_init(processor_affinity);
+	acpi_numa_x2apic_affinity_init(processor_affinity);
 
 	return 0;
 }
@@ -156,7 +181,7 @@ acpi_parse_processor_affinity(struct acpi_subtable_header * header,
 	acpi_table_print_srat_entry(header);
 
 	/* let architecture-dependent part to do it */
-	//acpi_numa_processor_affinity_init(processor_affinity);
+	acpi_numa_processor_affinity_init(processor_affinity);
 
 	return 0;
 }
@@ -654,8 +654,11 @@ ahci_port_handle_irq(sata_port_t * sata_port) {
 				}
 		
 				if (sata_req->async) {
-					blk_req_complete(sata_req->blk_req, 0);
+					blk_req_t * blk_req = sata_req->blk_req;
+
+					/* Free the slot first, completing may issue the next request */
 					release_cmd_slot(sata_port, i);
+					blk_req_complete(blk_req, 0);
 				} 
 			}
 		}
@@ -819,6 +822,7 @@ sata_handle_blkreq(blk_req_t * blk_req, void * priv_data)
 		printk(KERN_ERR "AHCI: Block Request offset is misaligned.\n");
 		printk(KERN_ERR "AHCI: \tByte Offset=%llu, sector_size=%u\n", 
 		       blk_req->offset, sata_port->sector_size);
+		release_cmd_slot(sata_port, cmd_slot);
 		return -EINVAL;
 	}
 
@@ -826,6 +830,7 @@ sata_handle_blkreq(blk_req_t * blk_req, void * priv_data)
 		printk(KERN_ERR "AHCI: Block Request Length is misaligned\n");
 		printk(KERN_ERR "AHCI: \tByte Length=%llu, sector_size=%u\n", 
 		       blk_req->total_len, sata_port->sector_size);
+		release_cmd_slot(sata_port, cmd_slot);
 		return -EINVAL;
 	}
 
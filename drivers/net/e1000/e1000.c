@@ -19,6 +19,9 @@
 #include <lwk/interrupt.h>
 #include <lwk/delay.h>
 #include <lwk/pci/pci.h>
+#include <lwk/spinlock.h>
+#include <lwk/time.h>
+#include <lwk/proc_fs.h>
 #include <lwip/netif.h>
 #include <lwip/tcpip.h>
 #include <lwip/etharp.h>
@@ -38,7 +41,18 @@
 
 // Number of read/write descriptors
 #define NUM_RX_DESCRIPTORS	64
-#define NUM_TX_DESCRIPTORS	64
+#define NUM_TX_DESCRIPTORS	256
+
+// Most TX descriptors one packet may take before it is copied into one buffer
+#define MAX_TX_SEGMENTS		16
+
+// Receive buffers: those not posted in the RX ring are either free or
+// lent to the network stack, which gives them back when it frees the pbuf
+#define RX_BUFFER_SIZE		8192
+#define NUM_RX_BUFFERS		(NUM_RX_DESCRIPTORS * 3)
+
+// Most packets received per interrupt; more raise another interrupt
+#define RX_POLL_BUDGET		32
 
 
 // E1000 Ethernet Controller Register Offsets
@@ -66,6 +80,7 @@
 #define E1000_REG_IMS      0x000D0	// Interrupt Mask Set/Read
 #define E1000_REG_IMC      0x000D8	// Interrupt Mask Clear
 #define E1000_REG_ICS      0x000C8	// Interrupt Cause Set
+#define E1000_REG_ITR      0x000C4	// Interrupt Throttling Rate
 #define E1000_REG_RAL      0x05400	// Receive Address Low
 #define E1000_REG_RAH      0x05404	// Receive Address High
 #define E1000_REG_TXCW     0x00178	// Transmit Configuration Word
@@ -93,6 +108,11 @@
 #define wait_microsecond(count) do { udelay(count); } while (0)
 
 
+// RX descriptor status bits
+#define RXD_STA_DD		(1 << 0)	// Descriptor done
+#define RXD_STA_EOP		(1 << 1)	// End of packet
+
+
 // E1000 Receive (RX) descriptor structure
 typedef struct __attribute__((packed)) e1000_rx_desc_s 
 {
@@ -105,6 +125,13 @@ typedef struct __attribute__((packed)) e1000_rx_desc_s
 } e1000_rx_desc_t;
 
 
+// TX descriptor command and status bits
+#define TXD_CMD_EOP		(1 << 0)	// End of packet
+#define TXD_CMD_IFCS		(1 << 1)	// Insert FCS
+#define TXD_CMD_RS		(1 << 3)	// Report status
+#define TXD_STA_DD		(1 << 0)	// Descriptor done
+
+
 // E1000 Transmit (TX) descriptor structure
 typedef struct __attribute__((packed)) e1000_tx_desc_s 
 {
@@ -118,6 +145,9 @@ typedef struct __attribute__((packed)) e1000_tx_desc_s
 } e1000_tx_desc_t;
 
 
+struct e1000_rx_buf_s;
+
+
 // Device-specific structure
 typedef struct e1000_device_s
 {
@@ -140,20 +170,52 @@ typedef struct e1000_device_s
 	
 	volatile uint8_t		*rx_desc_base;
 	volatile e1000_rx_desc_t	*rx_desc[NUM_RX_DESCRIPTORS];	// receive descriptor buffer
+	struct e1000_rx_buf_s		*rx_buf[NUM_RX_DESCRIPTORS];	// buffer posted in each descriptor
 	volatile uint16_t		rx_cur;
+	struct e1000_rx_buf_s		*rx_free;	// buffers neither posted nor lent out
+	spinlock_t			rx_free_lock;
+
+	// RX statistics, see /proc/e1000
+	uint64_t			rx_packets;
+	uint64_t			rx_bytes;
+	uint64_t			rx_irqs;	// interrupts that polled the RX ring
+	uint64_t			rx_repolls;	// polls that used up their budget
+	uint64_t			rx_copied;	// packets copied, no free buffer to post
+	uint64_t			rx_dropped;
+	uint64_t			rx_errors;	// short, fragmented or bad packets
+	uint64_t			rx_cycles;	// spent polling the RX ring
 	
 	volatile uint8_t		*tx_desc_base;
 	volatile e1000_tx_desc_t	*tx_desc[NUM_TX_DESCRIPTORS];	// transmit descriptor buffer
-	volatile uint16_t		tx_tail;
+	struct pbuf			*tx_pbuf[NUM_TX_DESCRIPTORS];	// packet sent by each EOP descriptor
+	volatile uint16_t		tx_tail;	// next descriptor to fill
+	volatile uint16_t		tx_clean;	// oldest descriptor still in flight
+	spinlock_t			tx_lock;
 	
 } e1000_device_t;
 
 
+// A receive buffer. When lent to the network stack it is wrapped in a
+// custom pbuf, whose free function puts it back on the free list.
+typedef struct e1000_rx_buf_s
+{
+	struct pbuf_custom		pc;	// must be first
+	e1000_device_t			*dev;
+	uint8_t				*data;
+	struct e1000_rx_buf_s		*next;	// in the free list
+} e1000_rx_buf_t;
+
+
 // Lightweight IP network interface structure for E1000 driver.
 // Only one E1000 instance is supported, so this is a global.
 static struct netif e1000_netif;
 
 
+// Maximum interrupts per second, which lets the card coalesce packets
+// into fewer interrupts (0 disables throttling)
+static unsigned int itr = 20000;
+
+
 // E1000 specific state info.
 // E1000_netif->state points to this.
 // Only one E1000 instance is supported, so this is a global.
@@ -287,9 +349,30 @@ static int e1000_rx_init(struct netif *netif)
 	// aligned base address
 	dev->rx_desc_base = (tmpbase % 16) ? (uint8_t *)((tmpbase) + 16 - (tmpbase % 16)) : (uint8_t *)tmpbase;
 	
+	spin_lock_init(&dev->rx_free_lock);
+	dev->rx_free = NULL;
+
+	for (i = 0; i < NUM_RX_BUFFERS; i++) {
+		e1000_rx_buf_t *buf = kmem_alloc(sizeof(e1000_rx_buf_t));
+
+		if (buf == NULL || (buf->data = kmem_alloc(RX_BUFFER_SIZE)) == NULL) {
+			printk(KERN_ERR "E1000: failed to allocate RX buffers\n");
+			return -1;
+		}
+		buf->dev = dev;
+
+		// The first NUM_RX_DESCRIPTORS are posted below, the rest are spares
+		if (i < NUM_RX_DESCRIPTORS) {
+			dev->rx_buf[i] = buf;
+		} else {
+			buf->next = dev->rx_free;
+			dev->rx_free = buf;
+		}
+	}
+
 	for (i = 0; i < NUM_RX_DESCRIPTORS; i++) {
 		dev->rx_desc[i] = (e1000_rx_desc_t *)(dev->rx_desc_base + (i * 16));
-		dev->rx_desc[i]->address = (uint64_t)__pa(kmem_alloc(8192+16)); // packet buffer size (8K)
+		dev->rx_desc[i]->address = (uint64_t)__pa(dev->rx_buf[i]->data); // packet buffer size (8K)
 		dev->rx_desc[i]->status = 0;
 	}
 	
@@ -329,6 +412,7 @@ static int e1000_tx_init(struct netif *netif)
 		dev->tx_desc[i] = (e1000_tx_desc_t *)(dev->tx_desc_base + (i * 16));
 		dev->tx_desc[i]->address = 0;
 		dev->tx_desc[i]->cmd = 0;
+		dev->tx_pbuf[i] = NULL;
 	}
 
 	// setup the transmit descriptor ring buffer
@@ -342,104 +426,219 @@ static int e1000_tx_init(struct netif *netif)
 	mmio_write32( E1000_REG_TDH, 0 );
 	mmio_write32( E1000_REG_TDT, 0 );
 	dev->tx_tail = 0;
+	dev->tx_clean = 0;
+	spin_lock_init(&dev->tx_lock);
 	
 	// set the transmit control register (padshortpackets)
 	mmio_write32( E1000_REG_TCTL, (TCTL_EN | TCTL_PSP) );
 	return 0;
 }
 
-static err_t e1000_tx_send(struct netif *netif, char * buf, int len) {
+// Number of TX descriptors free for new packets (one is always left empty)
+static unsigned int e1000_tx_avail(e1000_device_t *dev)
+{
+	return NUM_TX_DESCRIPTORS - 1 -
+	       ((dev->tx_tail - dev->tx_clean + NUM_TX_DESCRIPTORS) % NUM_TX_DESCRIPTORS);
+}
+
+// Releases the pbufs of packets the card has finished sending.
+// Only the last descriptor of each packet reports its status.
+// Must be called with tx_lock held.
+static void e1000_tx_clean(e1000_device_t *dev)
+{
+	uint16_t i = dev->tx_clean;
+
+	while (i != dev->tx_tail) {
+		volatile e1000_tx_desc_t *desc = dev->tx_desc[i];
+
+		if (desc->cmd & TXD_CMD_EOP) {
+			if (!(desc->sta & TXD_STA_DD))
+				break;
+
+			pbuf_free(dev->tx_pbuf[i]);
+			dev->tx_pbuf[i] = NULL;
+			dev->tx_clean = (i + 1) % NUM_TX_DESCRIPTORS;
+		}
+
+		i = (i + 1) % NUM_TX_DESCRIPTORS;
+	}
+}
+
+// Queues a packet for transmission, one descriptor per pbuf in the chain.
+// The packet is referenced until the card is done with it, so the caller
+// may free it as soon as this returns. Packets whose memory the card
+// cannot DMA from directly, or that are too fragmented, are copied into
+// a single pbuf first.
+static err_t e1000_tx_queue(struct netif *netif, struct pbuf *pkt, bool copy)
+{
 	e1000_device_t *dev = netif->state;
+	struct pbuf *q;
+	unsigned int segs = 0;
+	unsigned long flags;
+	uint16_t i, last = 0;
+
+	for (q = pkt; q != NULL; q = q->next) {
+		if (q->len == 0)
+			continue;
+		if ((q->type != PBUF_RAM) && (q->type != PBUF_POOL))
+			copy = true;
+		segs++;
+	}
+
+	if (segs == 0)
+		return ERR_OK;
+
+	if (copy || (segs > MAX_TX_SEGMENTS)) {
+		struct pbuf *p = pbuf_alloc(PBUF_RAW, pkt->tot_len, PBUF_RAM);
+
+		if (!p || (pbuf_copy(p, pkt) != ERR_OK)) {
+			if (p)
+				pbuf_free(p);
+			return ERR_MEM;
+		}
+
+		pkt = p;
+		segs = 1;
+	} else {
+		pbuf_ref(pkt);
+	}
+
+	spin_lock_irqsave(&dev->tx_lock, flags);
+
+	// The ring only fills up when the wire can't keep up, so wait it out
+	e1000_tx_clean(dev);
+	while (e1000_tx_avail(dev) < segs) {
+		spin_unlock_irqrestore(&dev->tx_lock, flags);
+		cpu_relax();
+		spin_lock_irqsave(&dev->tx_lock, flags);
+		e1000_tx_clean(dev);
+	}
+
+	i = dev->tx_tail;
+	for (q = pkt; q != NULL; q = q->next) {
+		if (q->len == 0)
+			continue;
+
+		dev->tx_desc[i]->address = (uint64_t) __pa(q->payload);
+		dev->tx_desc[i]->length = q->len;
+		dev->tx_desc[i]->sta = 0;
+		dev->tx_desc[i]->cmd = TXD_CMD_IFCS;
+
+		last = i;
+		i = (i + 1) % NUM_TX_DESCRIPTORS;
+	}
+
+	dev->tx_desc[last]->cmd = (TXD_CMD_EOP | TXD_CMD_IFCS | TXD_CMD_RS);
+	dev->tx_pbuf[last] = pkt;
 
-	dev->tx_desc[dev->tx_tail]->address = (uint64_t) __pa(buf);
-	dev->tx_desc[dev->tx_tail]->length = len;
-	dev->tx_desc[dev->tx_tail]->cmd = ((1 << 3) | (3));
-	
 	// Update the tail so the hardware knows it's ready
-	int oldtail = dev->tx_tail;
-	dev->tx_tail = (dev->tx_tail + 1) % NUM_TX_DESCRIPTORS;
+	wmb();
+	dev->tx_tail = i;
 	mmio_write32(E1000_REG_TDT, dev->tx_tail);
 
-	// Busy poll until the transmit is done
-	while (!(dev->tx_desc[oldtail]->sta & 0xF)) { }
-	
-	// printk("E1000: TX DONE: transmit status = 0x%01x\n", (dev->tx_desc[oldtail]->sta & 0xF));
-	return 0;
+	spin_unlock_irqrestore(&dev->tx_lock, flags);
+
+	return ERR_OK;
 }
 
-// BJK: assemble a single buffer from the queues in pkt
 static err_t e1000_tx_poll(struct netif *netif, struct pbuf *pkt) {
-	int off;
-	char buf[pkt->tot_len];
-	struct pbuf * q;
-
-	// Count the number of entries in the pbuf
-	off = 0;
-	for (q = pkt; q != NULL ; q = q->next) {
-		memcpy(buf + off, q->payload, q->len);
-		off += q->len;
-	}
-
-	return e1000_tx_send(netif, buf, pkt->tot_len);
+	return e1000_tx_queue(netif, pkt, false);
 }
 
 
-// This can be used stand-alone or from an interrupt handler
-static void e1000_rx_poll(struct netif *netif)
+// Custom pbuf free function: returns a lent buffer to the free list.
+// This may be called from any context.
+static void e1000_rx_buf_free(struct pbuf *p)
 {
-	struct pbuf *p;
-	e1000_device_t *dev = netif->state;
+	e1000_rx_buf_t *buf = (e1000_rx_buf_t *)p;
+	e1000_device_t *dev = buf->dev;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->rx_free_lock, flags);
+	buf->next = dev->rx_free;
+	dev->rx_free = buf;
+	spin_unlock_irqrestore(&dev->rx_free_lock, flags);
+}
 
-	// printk("E1000: packet received! [h=%d, t=%d]\n", mmio_read32(E1000_REG_RDH),
-	mmio_read32(E1000_REG_RDT);
+// Lends the buffer holding the packet in descriptor cur to the network
+// stack, posting a free buffer in its place. Returns NULL if there is no
+// free buffer, in which case the packet must be copied out.
+static struct pbuf *e1000_rx_lend(e1000_device_t *dev, uint16_t cur, uint16_t len)
+{
+	e1000_rx_buf_t *buf = dev->rx_buf[cur];
+	e1000_rx_buf_t *fresh;
+	unsigned long flags;
 
-	while ((dev->rx_desc[dev->rx_cur]->status & (1 << 0))) {
-		// raw packet and packet length (excluding CRC)
-		uint8_t *pkt = __va((void *)dev->rx_desc[dev->rx_cur]->address);
-		uint16_t pktlen = dev->rx_desc[dev->rx_cur]->length;
-		bool dropflag = false;
+	spin_lock_irqsave(&dev->rx_free_lock, flags);
+	if ((fresh = dev->rx_free) != NULL)
+		dev->rx_free = fresh->next;
+	spin_unlock_irqrestore(&dev->rx_free_lock, flags);
 
-		if (pktlen < 60) {
-			printk(KERN_WARNING "E1000: short packet (%u bytes)\n", pktlen);
-			dropflag = true;
-		}
+	if (fresh == NULL)
+		return NULL;
 
-		// while not technically an error, there is no support in this driver
-		if (!(dev->rx_desc[dev->rx_cur]->status & (1 << 1))) {
-			printk(KERN_WARNING "E1000: no EOP set! (len=%u, 0x%x 0x%x 0x%x)\n", 
-				pktlen, pkt[0], pkt[1], pkt[2]);
-			dropflag = true;
-		}
-		
-		if (dev->rx_desc[dev->rx_cur]->errors) {
-			printk(KERN_WARNING "E1000: rx errors (0x%x)\n", dev->rx_desc[dev->rx_cur]->errors);
-			dropflag = true;
-		}
+	dev->rx_buf[cur] = fresh;
+	dev->rx_desc[cur]->address = (uint64_t)__pa(fresh->data);
+
+	buf->pc.custom_free_function = e1000_rx_buf_free;
+	return pbuf_alloced_custom(PBUF_RAW, len, PBUF_REF, &buf->pc, buf->data, RX_BUFFER_SIZE);
+}
 
-		if (!dropflag) {
+// Receives up to budget packets, returning how many descriptors it used.
+// This can be used stand-alone or from an interrupt handler.
+static int e1000_rx_poll(struct netif *netif, int budget)
+{
+	e1000_device_t *dev = netif->state;
+	uint64_t start = get_cycles();
+	int done = 0;
+
+	while ((done < budget) && (dev->rx_desc[dev->rx_cur]->status & RXD_STA_DD)) {
+		volatile e1000_rx_desc_t *desc = dev->rx_desc[dev->rx_cur];
+		// packet length (excluding CRC)
+		uint16_t pktlen = desc->length;
+		struct pbuf *p = NULL;
+
+		rmb();
+
+		// Short packets, packets spanning descriptors (no support in this
+		// driver) and errored packets are dropped
+		if ((pktlen < 60) || !(desc->status & RXD_STA_EOP) || desc->errors) {
+			dev->rx_errors++;
+		} else if ((p = e1000_rx_lend(dev, dev->rx_cur, pktlen)) == NULL) {
 			p = pbuf_alloc(PBUF_RAW, pktlen, PBUF_POOL);
-			if (!p) {
-				printk(KERN_WARNING "Unable to allocate pbuf! dropping packet\n");
+			if (p) {
+				pbuf_take(p, dev->rx_buf[dev->rx_cur]->data, pktlen);
+				dev->rx_copied++;
 			} else {
-				memcpy(p->payload, pkt, pktlen);
-				p->len = p->tot_len = pktlen;
-				p->next = 0x0;
-
-				// send the packet to higher layers for parsing
-				if (netif->input(p, netif) != ERR_OK) {
-					printk(KERN_ERR "Packet receive failed!\n");
-					pbuf_free(p);
-				}
+				dev->rx_dropped++;
 			}
 		}
-		
+
+		if (p) {
+			dev->rx_packets++;
+			dev->rx_bytes += pktlen;
+
+			// send the packet to higher layers for parsing
+			if (netif->input(p, netif) != ERR_OK) {
+				dev->rx_dropped++;
+				pbuf_free(p);
+			}
+		}
+
 		// update RX cur pointer
-		dev->rx_desc[dev->rx_cur]->status = (uint16_t)(0);
+		desc->status = 0;
 		dev->rx_cur = (dev->rx_cur + 1) % NUM_RX_DESCRIPTORS;
-		
-		// write the tail to the device
-		mmio_write32(E1000_REG_RDT, (mmio_read32(E1000_REG_RDT) + 1) % NUM_RX_DESCRIPTORS);
+		done++;
 	}
+
+	// Give the used descriptors back to the card with a single tail update
+	if (done) {
+		wmb();
+		mmio_write32(E1000_REG_RDT, (dev->rx_cur + NUM_RX_DESCRIPTORS - 1) % NUM_RX_DESCRIPTORS);
+	}
+
+	dev->rx_cycles += get_cycles() - start;
+	return done;
 }
 
 
@@ -464,6 +663,7 @@ e1000_interrupt_handler(int vector, void *priv)
 {
 	struct netif *netif = priv;	
 	e1000_device_t *dev = netif->state;
+	bool repoll = false;
 
 	if (netif == NULL) {
 		printk(KERN_ERR "E1000: UNKNOWN IRQ / INVALID DEVICE\n");
@@ -482,7 +682,15 @@ e1000_interrupt_handler(int vector, void *priv)
 
 	// tx success stuff
 	// This clears the TX interrupts
-	icr &= ~(E1000_ICR_TXCW | E1000_ICR_TXQE);
+	if (icr & (E1000_ICR_TXCW | E1000_ICR_TXQE)) {
+		unsigned long flags;
+
+		icr &= ~(E1000_ICR_TXCW | E1000_ICR_TXQE);
+
+		spin_lock_irqsave(&dev->tx_lock, flags);
+		e1000_tx_clean(dev);
+		spin_unlock_irqrestore(&dev->tx_lock, flags);
+	}
 
 	// LINK STATUS CHANGE
 	if (icr & (E1000_ICR_LSC)) {
@@ -501,26 +709,17 @@ e1000_interrupt_handler(int vector, void *priv)
 		printk(KERN_INFO "E1000: PHY EPSTATUS = 0x%04x\n", e1000_phy_read(dev, E1000_PHYREG_EPSTATUS));
 	}
 	
-	// RX underrun / min threshold
-	if (icr & (E1000_ICR_RXO) || icr & (E1000_ICR_RXDMT0)) {
-		icr &= ~((E1000_ICR_RXO) | (E1000_ICR_RXDMT0));
-		//printk(" underrun (rx_head = %u, rx_cur = %u)\n", mmio_read32(E1000_REG_RDH), dev->rx_cur);
-		//printk(" overrun (rx head = %u, rx tail = %u)\n", mmio_read32(E1000_REG_RDH),
-		mmio_read32(E1000_REG_RDT);
-		
-		//volatile int i;
-		//for (i = 0; i < NUM_RX_DESCRIPTORS; i++) {
-		//	if (dev->rx_desc[i]->status)
-		//		printk(" pending descriptor (i=%u, status=0x%x)\n", i, dev->rx_desc[i]->status );
-		//}
-		
-		e1000_rx_poll(netif);
-	}
-
-	// packet is pending
-	if (icr & (E1000_ICR_RXT0)) {
-		icr &= ~(E1000_ICR_RXT0);
-		e1000_rx_poll(netif);
+	// RX underrun / min threshold, or packet is pending
+	if (icr & (E1000_ICR_RXO | E1000_ICR_RXDMT0 | E1000_ICR_RXT0)) {
+		icr &= ~(E1000_ICR_RXO | E1000_ICR_RXDMT0 | E1000_ICR_RXT0);
+		dev->rx_irqs++;
+
+		// Packets left over once the budget is used up raise another
+		// interrupt below, rather than keeping this CPU here
+		if (e1000_rx_poll(netif, RX_POLL_BUDGET) == RX_POLL_BUDGET) {
+			dev->rx_repolls++;
+			repoll = true;
+		}
 	}
 	
 	if (icr)
@@ -532,10 +731,44 @@ e1000_interrupt_handler(int vector, void *priv)
 	// Enable interrupts
 	mmio_write32(E1000_REG_IMS, 0xFFFFFFFF);
 
+	if (repoll)
+		mmio_write32(E1000_REG_ICS, E1000_ICR_RXT0);
+
 	return IRQ_HANDLED;
 }
 
 
+// Reports RX statistics in /proc/e1000, one "name value" pair per line.
+// rx_pps is the receive rate since the file was last read, and
+// rx_cycles_per_packet the average CPU cost of receiving a packet.
+static int e1000_proc_stats(struct file *file, void *priv)
+{
+	static uint64_t last_time, last_packets;
+	e1000_device_t *dev = priv;
+	uint64_t now = get_time();
+	uint64_t packets = dev->rx_packets;
+	uint64_t pps = 0;
+
+	if (last_time && (now > last_time))
+		pps = (packets - last_packets) * NSEC_PER_SEC / (now - last_time);
+	last_time = now;
+	last_packets = packets;
+
+	proc_sprintf(file, "rx_packets %llu\n", (unsigned long long)packets);
+	proc_sprintf(file, "rx_bytes %llu\n", (unsigned long long)dev->rx_bytes);
+	proc_sprintf(file, "rx_pps %llu\n", (unsigned long long)pps);
+	proc_sprintf(file, "rx_irqs %llu\n", (unsigned long long)dev->rx_irqs);
+	proc_sprintf(file, "rx_repolls %llu\n", (unsigned long long)dev->rx_repolls);
+	proc_sprintf(file, "rx_copied %llu\n", (unsigned long long)dev->rx_copied);
+	proc_sprintf(file, "rx_dropped %llu\n", (unsigned long long)dev->rx_dropped);
+	proc_sprintf(file, "rx_errors %llu\n", (unsigned long long)dev->rx_errors);
+	proc_sprintf(file, "rx_cycles_per_packet %llu\n",
+		     (unsigned long long)(packets ? dev->rx_cycles / packets : 0));
+
+	return 0;
+}
+
+
 /***************************************************
  ** Intel 825xx-series Chipset Driver Entry Point **
  ***************************************************/
@@ -600,7 +833,8 @@ e1000_hw_init(struct netif *netif)
 	pci_write(dev->pci_dev, PCIR_COMMAND, 2, cmd);
 			
 	// Initialize the E1000 transmit and receive state
-	e1000_rx_init(netif);
+	if (e1000_rx_init(netif) != 0)
+		return ERR_MEM;
 	e1000_tx_init(netif);
 	e1000_rx_enable(netif);
 
@@ -613,8 +847,16 @@ e1000_hw_init(struct netif *netif)
 	printk(KERN_INFO "E1000 IDT vector:  %d\n", vector);
 	irq_request(vector, &e1000_interrupt_handler, 0, "e1000", netif);
 
-	// enable all interrupts (and clear existing pending ones)
-	mmio_write32(E1000_REG_IMS, 0x1F6DC);
+	// Throttle interrupts; the ITR interval is in 256 ns units
+	if (itr)
+		mmio_write32(E1000_REG_ITR, 1000000000 / (itr * 256));
+
+	proc_mkdir("/proc");
+	create_proc_file("/proc/e1000", e1000_proc_stats, dev);
+
+	// enable all interrupts (and clear existing pending ones);
+	// TX queue empty lets sent packets be freed without waiting for the next send
+	mmio_write32(E1000_REG_IMS, 0x1F6DC | E1000_ICR_TXQE);
 	mmio_read32(E1000_REG_ICR);
 	
 	return 0;
@@ -691,8 +933,106 @@ e1000_init(void)
 }
 
 
+#ifdef CONFIG_DEBUG_E1000_BENCH
+// Builds a broadcast frame of len bytes with the local experimental
+// EtherType, as one pbuf or as a header pbuf followed by two body pbufs.
+static struct pbuf *e1000_bench_frame(struct netif *netif, unsigned int len, bool chain)
+{
+	struct pbuf *p, *body;
+	uint8_t *hdr;
+
+	if (!chain) {
+		if ((p = pbuf_alloc(PBUF_RAW, len, PBUF_RAM)) == NULL)
+			return NULL;
+		memset(p->payload, 0x5a, len);
+	} else {
+		if ((p = pbuf_alloc(PBUF_RAW, 14, PBUF_RAM)) == NULL)
+			return NULL;
+		if ((body = pbuf_alloc(PBUF_RAW, (len - 14) / 2, PBUF_RAM)) != NULL) {
+			memset(body->payload, 0x5a, body->len);
+			pbuf_cat(p, body);
+		}
+		if ((body = pbuf_alloc(PBUF_RAW, len - 14 - (len - 14) / 2, PBUF_RAM)) != NULL) {
+			memset(body->payload, 0x5a, body->len);
+			pbuf_cat(p, body);
+		}
+		if (p->tot_len != len) {
+			pbuf_free(p);
+			return NULL;
+		}
+	}
+
+	hdr = p->payload;
+	memset(hdr, 0xff, 6);
+	memcpy(hdr + 6, netif->hwaddr, 6);
+	hdr[12] = 0x88;
+	hdr[13] = 0xb5;
+
+	return p;
+}
+
+// Measures transmit throughput for a range of frame sizes. Each frame is
+// sent as a single pbuf, as a chain of three, and copied into one buffer
+// first, as the driver did before scatter-gather. Results are in MB/s,
+// from the first frame being queued until the ring has drained.
+void e1000_tx_bench(void)
+{
+	static const unsigned int sizes[] = { 64, 256, 1024, 1514 };
+	static const char *modes[] = { "single", "chain", "copy" };
+	const unsigned int frames = 4096;
+	e1000_device_t *dev = &e1000_state;
+	struct netif *netif = &e1000_netif;
+	uint64_t mbps[ARRAY_SIZE(modes)];
+	unsigned long flags;
+	unsigned int i, m, j;
+
+	if (dev->pci_dev == NULL) {
+		printk(KERN_DEBUG "e1000 TX benchmark: no device\n");
+		return;
+	}
+
+	printk(KERN_DEBUG "e1000 TX benchmark (MB/s):\n");
+	printk(KERN_DEBUG "  %6s %10s %10s %10s\n", "bytes", modes[0], modes[1], modes[2]);
+
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		for (m = 0; m < ARRAY_SIZE(modes); m++) {
+			struct pbuf *p = e1000_bench_frame(netif, sizes[i], (m == 1));
+			uint64_t start, end, deadline;
+
+			mbps[m] = 0;
+			if (p == NULL)
+				continue;
+
+			start = get_time();
+			for (j = 0; j < frames; j++)
+				e1000_tx_queue(netif, p, (m == 2));
+
+			// Wait for the ring to drain, giving up if the link is down
+			deadline = get_time() + NSEC_PER_SEC;
+			do {
+				spin_lock_irqsave(&dev->tx_lock, flags);
+				e1000_tx_clean(dev);
+				end = (dev->tx_clean == dev->tx_tail) ? get_time() : 0;
+				spin_unlock_irqrestore(&dev->tx_lock, flags);
+			} while (!end && (get_time() < deadline));
+
+			if (end)
+				mbps[m] = ((uint64_t)sizes[i] * frames * 1000) / (end - start);
+
+			pbuf_free(p);
+		}
+
+		printk(KERN_DEBUG "  %6u %10llu %10llu %10llu\n", sizes[i],
+		       (unsigned long long)mbps[0], (unsigned long long)mbps[1],
+		       (unsigned long long)mbps[2]);
+	}
+}
+#endif
+
+
 DRIVER_INIT("net", e1000_init);
 
 DRIVER_PARAM_STRING(ip, e1000_state.ip_str, sizeof(e1000_state.ip_str));
 DRIVER_PARAM_STRING(nm, e1000_state.nm_str, sizeof(e1000_state.nm_str));
 DRIVER_PARAM_STRING(gw, e1000_state.gw_str, sizeof(e1000_state.gw_str));
+DRIVER_PARAM(itr, uint);
@@ -30,7 +30,7 @@
 #define MODULES_VADDR       (MODULES_END - SZ_64M)
 #define EARLYCON_IOBASE     (MODULES_VADDR - SZ_4M)
 
-#define NODES_SHIFT	10 // TODO: Brian was a config variable
+#define NODES_SHIFT	CONFIG_NODES_SHIFT
 #define MAX_NUMNODES    (1 << NODES_SHIFT)
 
 
@@ -29,5 +29,8 @@ extern void paging_init(void);
 extern void setup_mm_for_reboot(void);
 extern void __iomem *early_io_map(phys_addr_t phys, unsigned long virt);
 
+struct aspace;
+extern unsigned long asid_activate(struct aspace *aspace);
+
 
 #endif
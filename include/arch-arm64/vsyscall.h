@@ -5,6 +5,7 @@ enum vsyscall_num {
 	__NR_vgettimeofday,
 	__NR_vtime,
 	__NR_vgetcpu,
+	__NR_vclock_gettime,
 };
 
 #define VSYSCALL_START (-10UL << 20)
@@ -17,6 +18,7 @@ enum vsyscall_num {
 #include <lwk/init.h>
 
 void __init vsyscall_map(void);
+void vsyscall_cpu_init(void);
 void __init vsyscall_init(void);
 
 
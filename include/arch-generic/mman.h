@@ -19,6 +19,16 @@
 #define MAP_TYPE	0x0f		/* Mask for type of mapping */
 #define MAP_FIXED	0x10		/* Interpret addr exactly */
 #define MAP_ANONYMOUS	0x20		/* don't use a file */
+#define MAP_HUGETLB	0x40000		/* create a huge page mapping */
+
+/* Huge page size of a MAP_HUGETLB mapping is log2(size) << MAP_HUGE_SHIFT */
+#define MAP_HUGE_SHIFT	26
+#define MAP_HUGE_MASK	0x3f
+#define MAP_HUGE_2MB	(21 << MAP_HUGE_SHIFT)
+#define MAP_HUGE_1GB	(30 << MAP_HUGE_SHIFT)
+
+#define MREMAP_MAYMOVE	1		/* mremap() may move the mapping */
+#define MREMAP_FIXED	2		/* mremap() to new_address exactly */
 
 #define MS_ASYNC	1		/* sync memory asynchronously */
 #define MS_INVALIDATE	2		/* invalidate the caches */
@@ -34,6 +44,8 @@
 #define MADV_REMOVE	9		/* remove these pages & resources */
 #define MADV_DONTFORK	10		/* don't inherit across fork */
 #define MADV_DOFORK	11		/* do inherit across fork */
+#define MADV_HUGEPAGE	14		/* map with large pages if possible */
+#define MADV_NOHUGEPAGE	15		/* map only with the base page size */
 
 /* compatibility flags */
 #define MAP_FILE	0
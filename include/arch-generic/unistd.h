@@ -329,10 +329,10 @@ __SYSCALL(__NR_signalfd4, syscall_not_implemented)
 __SYSCALL(__NR_vmsplice, syscall_not_implemented)
 #define __NR_splice 76
 //__SYSCALL(__NR_splice, sys_splice)
-__SYSCALL(__NR_splice, syscall_not_implemented)
+__SYSCALL(__NR_splice, sys_splice)
 #define __NR_tee 77
 //__SYSCALL(__NR_tee, sys_tee)
-__SYSCALL(__NR_tee, syscall_not_implemented)
+__SYSCALL(__NR_tee, sys_tee)
 
 /* fs/stat.c */
 #define __NR_readlinkat 78
@@ -674,7 +674,7 @@ __SYSCALL(__NR_getrusage, sys_getrusage)
 __SYSCALL(__NR_umask, syscall_not_implemented)
 #define __NR_prctl 167
 //__SYSCALL(__NR_prctl, sys_prctl)
-__SYSCALL(__NR_prctl, syscall_not_implemented)
+__SYSCALL(__NR_prctl, sys_prctl)
 #define __NR_getcpu 168
 __SYSCALL(__NR_getcpu, sys_getcpu)
 
@@ -1279,6 +1279,19 @@ __SYSCALL(__NR_aspace_set_rank, sys_set_rank)
 #define __NR_aspace_update_user_hio_syscall_mask 534
 __SYSCALL(__NR_aspace_update_user_hio_syscall_mask, sys_aspace_update_user_hio_syscall_mask)
 
+#define __NR_aspace_set_load_balance 535
+__SYSCALL(__NR_aspace_set_load_balance, sys_aspace_set_load_balance)
+
+#define __NR_hio_uring_setup 536
+#define __NR_hio_uring_enter 537
+#ifdef CONFIG_HIO_SYSCALL
+__SYSCALL(__NR_hio_uring_setup, sys_hio_uring_setup)
+__SYSCALL(__NR_hio_uring_enter, sys_hio_uring_enter)
+#else
+__SYSCALL(__NR_hio_uring_setup, syscall_not_implemented)
+__SYSCALL(__NR_hio_uring_enter, syscall_not_implemented)
+#endif
+
 
 #undef __NR_syscalls
 #define __NR_syscalls 550
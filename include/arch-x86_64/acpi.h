@@ -86,6 +86,8 @@ extern int acpi_skip_timer_override;
 extern int acpi_use_timer_override;
 extern int acpi_fix_pin2_polarity;
 
+extern int apicid_to_node(unsigned int apic_id);
+
 static inline void disable_acpi(void)
 {
 	acpi_disabled = 1;
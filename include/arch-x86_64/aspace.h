@@ -8,6 +8,7 @@
 
 struct arch_aspace {
 	xpte_t *pgd;	/* Page global directory... root page table */
+	uint64_t ctx_id; /* Unique, never reused, ID used to tag TLB entries */
 };
 #endif
 
@@ -22,4 +22,13 @@
 
 #define DECLARE_PER_CPU(type, name) extern __typeof__(type) per_cpu__##name
 
+/*
+ * Declaration/definition used for per-CPU variables that must be read mostly.
+ */
+#define DECLARE_PER_CPU_READ_MOSTLY(type, name) DECLARE_PER_CPU(type, name)
+#define DEFINE_PER_CPU_READ_MOSTLY(type, name)  DEFINE_PER_CPU(type, name)
+
+#define raw_cpu_read(var) __get_cpu_var(var)
+#define raw_cpu_write(var, val) (__get_cpu_var(var) = val)
+
 #endif /* _X86_64_PERCPU_H */
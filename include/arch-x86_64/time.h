@@ -5,6 +5,7 @@
 
 void arch_set_timer_freq(unsigned int hz);
 void arch_set_timer_oneshot(unsigned int nsec);
+void arch_stop_timer_oneshot(void);
 
 extern void arch_core_timer_init();
 #endif
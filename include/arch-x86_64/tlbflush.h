@@ -0,0 +1,33 @@
+#ifndef _ARCH_X86_64_TLBFLUSH_H
+#define _ARCH_X86_64_TLBFLUSH_H
+
+#define INVPCID_TYPE_ADDR		0
+#define INVPCID_TYPE_CONTEXT		1
+#define INVPCID_TYPE_ALL_GLOBAL		2
+#define INVPCID_TYPE_ALL_NON_GLOBAL	3
+
+/**
+ * Invalidates the calling CPU's TLB entry for the page containing addr.
+ * If PCIDs are enabled, only the entry tagged with the current PCID is
+ * invalidated.
+ */
+static inline void
+__flush_tlb_one(unsigned long addr)
+{
+	asm volatile("invlpg (%0)" :: "r" (addr) : "memory");
+}
+
+/**
+ * Invalidates TLB entries by PCID and/or address, as selected by type.
+ */
+static inline void
+__invpcid(unsigned long pcid, unsigned long addr, unsigned long type)
+{
+	struct { unsigned long d[2]; } desc = { { pcid, addr } };
+
+	asm volatile("invpcid %0, %1" :: "m" (desc), "r" (type) : "memory");
+}
+
+extern void pcid_init(void);
+
+#endif
@@ -352,7 +352,7 @@ __SYSCALL(__NR_pivot_root, syscall_not_implemented)
 __SYSCALL(__NR__sysctl, syscall_not_implemented)
 
 #define __NR_prctl                             157
-__SYSCALL(__NR_prctl, syscall_not_implemented)
+__SYSCALL(__NR_prctl, sys_prctl)
 #define __NR_arch_prctl                        158
 __SYSCALL(__NR_arch_prctl, sys_arch_prctl)
 
@@ -608,9 +608,9 @@ __SYSCALL(__NR_set_robust_list, sys_set_robust_list)
 #define __NR_get_robust_list	274
 __SYSCALL(__NR_get_robust_list, syscall_not_implemented)
 #define __NR_splice		275
-__SYSCALL(__NR_splice, syscall_not_implemented)
+__SYSCALL(__NR_splice, sys_splice)
 #define __NR_tee		276
-__SYSCALL(__NR_tee, syscall_not_implemented)
+__SYSCALL(__NR_tee, sys_tee)
 #define __NR_sync_file_range	277
 __SYSCALL(__NR_sync_file_range, syscall_not_implemented)
 #define __NR_vmsplice		278
@@ -645,7 +645,7 @@ __SYSCALL(__NR_epoll_create1, syscall_not_implemented)
 #define __NR_dup3 292
 __SYSCALL(__NR_dup3, syscall_not_implemented)
 #define __NR_pipe2 293
-__SYSCALL(__NR_pipe2, syscall_not_implemented)
+__SYSCALL(__NR_pipe2, sys_pipe2)
 #define __NR_inotify_init1 294
 __SYSCALL(__NR_inotify_init1, syscall_not_implemented)
 
@@ -753,4 +753,17 @@ __SYSCALL(__NR_aspace_set_rank, sys_set_rank)
 #define __NR_aspace_update_user_hio_syscall_mask 534
 __SYSCALL(__NR_aspace_update_user_hio_syscall_mask, sys_aspace_update_user_hio_syscall_mask)
 
+#define __NR_aspace_set_load_balance 535
+__SYSCALL(__NR_aspace_set_load_balance, sys_aspace_set_load_balance)
+
+#define __NR_hio_uring_setup 536
+#define __NR_hio_uring_enter 537
+#ifdef CONFIG_HIO_SYSCALL
+__SYSCALL(__NR_hio_uring_setup, sys_hio_uring_setup)
+__SYSCALL(__NR_hio_uring_enter, sys_hio_uring_enter)
+#else
+__SYSCALL(__NR_hio_uring_setup, syscall_not_implemented)
+__SYSCALL(__NR_hio_uring_enter, syscall_not_implemented)
+#endif
+
 #endif /* _ARCH_X86_64_UNISTD_H */
@@ -35,6 +35,7 @@
 #define VM_KERNEL		(1 << 7)
 #define VM_HEAP			(1 << 8)
 #define VM_SMARTMAP		(1 << 9)
+#define VM_HUGEPAGE		(1 << 10)	// May use pages larger than pagesz
 typedef unsigned long vmflags_t;
 
 
@@ -164,6 +165,12 @@ aspace_get_rank(
                 id_t * rank
 );
 
+extern int
+aspace_set_load_balance(
+		id_t		id,
+		unsigned int	threshold
+);
+
 extern int
 aspace_update_user_hio_syscall_mask(
 		id_t			id,
@@ -212,6 +219,7 @@ aspace_unmap_region(
 #include <lwk/semaphore.h>
 #include <lwk/spinlock.h>
 #include <lwk/list.h>
+#include <lwk/rbtree.h>
 #include <lwk/init.h>
 #include <lwk/signal.h>
 #include <lwk/waitq.h>
@@ -219,11 +227,24 @@ aspace_unmap_region(
 #include <arch/aspace.h>
 
 
+// Pending TLB shootdown
+//
+// Unmapping memory from an address space records the affected range in
+// the aspace. The range is handed off to a tlb_batch while the aspace is
+// still locked and flushed once the lock has been dropped, so several
+// unmaps done under one lock hold cost a single shootdown.
+struct tlb_batch {
+	cpumask_t		cpu_mask;	// CPUs that may cache the range
+	vaddr_t			start;		// First address to invalidate
+	vaddr_t			end;		// 1st byte after last addr, or start
+};
+
 // Address space structure
 //
 // This structure represents the kernel's view of an address space,
 // either user or kernel space. The address space consists of
-// non-overlapping regions, stored in the region_list member.
+// non-overlapping regions, stored in the region_list member and
+// indexed by start address in the region_tree member.
 // The struct region is opaque to users of the high-level API.
 struct aspace {
 	spinlock_t		lock;		// Synchronizes access to aspace
@@ -242,14 +263,27 @@ struct aspace {
 	waitq_t			child_exit_waitq; // Wait queue for waiting on child exits
 
 	struct list_head	region_list;	// Sorted non-overlapping region list
+	struct rb_root		region_tree;	// region_list indexed by start addr
+	struct region *		region_hint;	// Last region found by address
+	struct list_head	smartmap_list;	// SMARTMAP regions in region_list
 
 	struct list_head	task_list;	// List of tasks using this aspace
 	id_t			next_task_id;	// ID for next task created in aspace
 
 	cpumask_t		cpu_mask;	// CPUs this aspace is available on
 	id_t			next_cpu_id;	// CPU ID for next task created in aspace
+	unsigned int		lb_threshold;	// Idle CPUs in cpu_mask steal tasks
+						//   from CPUs with at least this many
+						//   tasks waiting, 0 = never
+
+	cpumask_t		tlb_cpus;	// CPUs this aspace is active on
+	vaddr_t			tlb_flush_start; // Unmapped range awaiting
+	vaddr_t			tlb_flush_end;	 //   TLB shootdown
+	int			smartmap_refcnt; // # aspaces SMARTMAP'ing this one
+	uint64_t		tlb_gen;	// Bumped by each TLB shootdown
 
 	syscall_mask_t		hio_syscall_mask; // Syscalls this aspace is delegating via HIO
+	struct hio_uring_ctx *	hio_uring;	// Asynchronous HIO syscall ring
 
 	int			exit_status;	// Value to return to waitpid() and friends
 
@@ -269,8 +303,20 @@ struct aspace {
 	//     [mmap_brk, heap_end)
 	vaddr_t			heap_start;
 	vaddr_t			heap_end;
+	//
+	// Memory munmap()'ed from the mmap() region is kept in mmap_holes,
+	// a sorted list of non-overlapping, non-adjacent free ranges.
 	vaddr_t			brk;
 	vaddr_t			mmap_brk;
+	struct list_head	mmap_holes;
+
+	// If true, new regions are created with VM_HUGEPAGE and are mapped
+	// with the largest page sizes that alignment allows. Set via
+	// prctl(PR_SET_THP_DISABLE). Ranges can opt in or out afterwards via
+	// madvise(MADV_[NO]HUGEPAGE), the parts of VM_HUGEPAGE regions that
+	// opted out are kept in nohugepage, a sorted list of ranges.
+	bool			hugepage;
+	struct list_head	nohugepage;
 
 	// Needed for IB support
 	struct semaphore	mmap_sem;
@@ -303,6 +349,57 @@ __aspace_find_hole(
 	vaddr_t *		start
 );
 
+extern int
+__aspace_mmap_alloc(
+	struct aspace *		aspace,
+	size_t			extent,
+	size_t			alignment,
+	vaddr_t *		start
+);
+
+extern int
+__aspace_mmap_reserve(
+	struct aspace *		aspace,
+	vaddr_t			start,
+	size_t			extent
+);
+
+extern int
+__aspace_mmap_extend(
+	struct aspace *		aspace,
+	vaddr_t			start,
+	size_t			extent
+);
+
+extern int
+__aspace_mmap_free(
+	struct aspace *		aspace,
+	vaddr_t			start,
+	size_t			extent
+);
+
+extern bool
+__aspace_mmap_allocated(
+	struct aspace *		aspace,
+	vaddr_t			start,
+	size_t			extent
+);
+
+extern bool
+__aspace_mmap_unallocated(
+	struct aspace *		aspace,
+	vaddr_t			start,
+	size_t			extent
+);
+
+extern int
+__aspace_set_hugepage(
+	struct aspace *		aspace,
+	vaddr_t			start,
+	size_t			extent,
+	bool			enable
+);
+
 extern int
 __aspace_add_region(
 	struct aspace *		aspace,
@@ -357,6 +454,20 @@ __aspace_virt_to_phys(
 	paddr_t *		paddr
 );
 
+extern int
+__aspace_swap_pmem(
+	struct aspace *		aspace,
+	vaddr_t			a,
+	vaddr_t			b,
+	size_t			extent
+);
+
+extern void
+__aspace_take_tlb_batch(
+	struct aspace *		aspace,
+	struct tlb_batch *	batch
+);
+
 // End kernel-only "unlocked" versions of the core aspace management API
 
 
@@ -400,6 +511,11 @@ aspace_update_hio_syscall_mask(
 		syscall_mask_t	* syscall_mask
 );
 
+extern void
+tlb_batch_flush(
+	struct tlb_batch *	batch
+);
+
 
 // End kernel-only address space management API
 
@@ -437,6 +553,23 @@ arch_aspace_unmap_page(
 	vmpagesize_t		pagesz
 );
 
+extern int
+arch_aspace_map_range(
+	struct aspace *		aspace,
+	vaddr_t			start,
+	paddr_t			paddr,
+	size_t			extent,
+	vmflags_t		flags,
+	vmpagesize_t		pagesz_mask
+);
+
+extern int
+arch_aspace_unmap_range(
+	struct aspace *		aspace,
+	vaddr_t			start,
+	size_t			extent
+);
+
 extern int
 arch_aspace_smartmap(
 	struct aspace *		src,
@@ -581,6 +714,12 @@ sys_set_rank(
 	id_t rank
 );
 
+extern int
+sys_aspace_set_load_balance(
+	id_t		aspace_id,
+	unsigned int	threshold
+);
+
 extern int
 sys_aspace_update_hio_syscall_mask(
 	id_t				aspace_id,
@@ -7,7 +7,54 @@
 #ifndef _LWK_BLKDEV_H
 #define _LWK_BLKDEV_H
 
+#include <lwk/types.h>
+#include <arch/ioctl.h>
+
+/**
+ * Asynchronous I/O on a block device file, in the style of Linux AIO.
+ *
+ * BLKDEV_IOC_SUBMIT queues nr I/Os and returns how many were queued.
+ * BLKDEV_IOC_GETEVENTS waits for at least min_nr of them to complete and
+ * returns up to nr completions. Buffers, offsets and lengths must be
+ * multiples of the device's sector size, and buffers must stay mapped
+ * until the I/O completes. These I/Os bypass the page cache.
+ *
+ * BLKDEV_IOC_SYNC writes back the data cached for the device.
+ */
+struct blkdev_iocb {
+	uint64_t	user_data;	/* Returned in the completion */
+	uint64_t	buf;		/* User buffer */
+	uint64_t	offset;		/* Byte offset on the device */
+	uint64_t	len;		/* Bytes to transfer */
+	uint32_t	write;		/* 1 to write, 0 to read */
+	uint32_t	pad;
+};
+
+struct blkdev_io_event {
+	uint64_t	user_data;
+	int64_t		res;		/* Bytes transferred, or -errno */
+};
+
+struct blkdev_io_submit {
+	uint64_t	nr;
+	uint64_t	iocbs;		/* struct blkdev_iocb [nr] */
+};
+
+struct blkdev_io_getevents {
+	uint64_t	min_nr;
+	uint64_t	nr;
+	uint64_t	events;		/* struct blkdev_io_event [nr] */
+};
+
+#define BLKDEV_IOC_MAGIC	'B'
+#define BLKDEV_IOC_SUBMIT	_IOW(BLKDEV_IOC_MAGIC, 1, struct blkdev_io_submit)
+#define BLKDEV_IOC_GETEVENTS	_IOWR(BLKDEV_IOC_MAGIC, 2, struct blkdev_io_getevents)
+#define BLKDEV_IOC_SYNC		_IO(BLKDEV_IOC_MAGIC, 3)
+
+#ifdef __KERNEL__
+
 #include <lwk/waitq.h>
+#include <lwk/list.h>
 
 
 typedef struct {
@@ -46,6 +93,39 @@ typedef struct {
 int blk_req_complete(blk_req_t * blk_req, int status);
 
 
+/* Descriptors carried in a blk_io_t itself; I/Os needing more are split */
+#define BLK_IO_DESCS		16
+
+/**
+ * A single I/O queued on a block device. I/Os to adjacent sectors are
+ * merged into one driver request before being issued, so callers may
+ * break large transfers up freely.
+ */
+typedef struct blk_io {
+	u64 offset;                  /* Byte offset on the device */
+	u64 len;                     /* Total length of the I/O */
+	u32 write;
+	u32 desc_cnt;
+	blk_dma_desc_t * dma_descs;  /* Defaults to descs[] */
+
+	/* Called once the I/O has finished, possibly in interrupt context */
+	void (*done)(struct blk_io * io, int status);
+	void * priv;
+
+	/* Private to the block layer */
+	struct list_head node;
+	int status;
+
+	blk_dma_desc_t descs[BLK_IO_DESCS];
+} blk_io_t;
+
+blk_io_t * blkdev_alloc_io(void);
+void blkdev_free_io(blk_io_t * io);
+
+int  blkdev_submit_io(blkdev_handle_t blkdev_handle, blk_io_t * io);
+void blkdev_unplug(blkdev_handle_t blkdev_handle);
+
+
 blkdev_handle_t get_blkdev(char * name);
 
 u64 blkdev_get_capacity(blkdev_handle_t blkdev_handle);
@@ -69,4 +149,6 @@ blkdev_register(char * name,
 */
 extern void blkdev_init(void);
 
+#endif /* __KERNEL__ */
+
 #endif
@@ -49,6 +49,54 @@ typedef struct {
 } hio_syscall_t;
 
 
+/**
+ * Asynchronous HIO system calls.
+ *
+ * hio_uring_setup() maps a ring with room for the given number of system
+ * calls, a power of 2, into the calling address space. The application
+ * fills submission queue entries at sq_tail, and hio_uring_enter() forwards
+ * them to the HIO stub without waiting for them to finish. Results are
+ * posted as completion queue entries at cq_tail as the stub returns them,
+ * and are consumed by advancing cq_head. No more calls are taken than
+ * there is room for their completions.
+ */
+#define HIO_URING_MAX_ARGC	6
+#define HIO_URING_MAX_ENTRIES	1024
+
+struct hio_uring_sqe {
+	uint64_t  user_data;	/* Copied to the completion entry */
+	uint32_t  syscall_nr;
+	uint32_t  argc;
+	uint64_t  args[HIO_URING_MAX_ARGC];
+};
+
+struct hio_uring_cqe {
+	uint64_t  user_data;
+	int64_t   res;		/* Return value of the system call */
+};
+
+/* Followed by entries submission and then entries completion entries */
+struct hio_uring {
+	uint32_t  sq_head;	/* Next entry the kernel takes */
+	uint32_t  sq_tail;	/* Next entry the application fills */
+	uint32_t  cq_head;	/* Next entry the application reaps */
+	uint32_t  cq_tail;	/* Next entry the kernel fills */
+	uint32_t  entries;
+	uint32_t  pad;
+};
+
+#define hio_uring_sqes(ring) \
+	((struct hio_uring_sqe *)((struct hio_uring *)(ring) + 1))
+#define hio_uring_cqes(ring) \
+	((struct hio_uring_cqe *)(hio_uring_sqes(ring) + (ring)->entries))
+
+int
+hio_uring_setup(unsigned int entries, struct hio_uring ** ring);
+
+int
+hio_uring_enter(unsigned int to_submit, unsigned int min_complete);
+
+
 
 #ifndef __KERNEL__
 
@@ -117,10 +165,24 @@ hio_format_and_exec_syscall(uint32_t syscall_nr, uint32_t argc, ...);
 int
 hio_issue_syscall(hio_syscall_t * new_syscall);
 
+/* Queue a system call, complete() is called with its results instead of
+ * anyone waiting for it. The HIO stub is not notified. */
+int
+hio_issue_syscall_async(hio_syscall_t * new_syscall,
+			void         (* complete)(hio_syscall_t *));
+
+/* Notify the HIO stub of newly queued system calls */
+int
+hio_notify_syscalls(void);
+
 /* Cancel a previously issued system call */
 void
 hio_cancel_syscall(hio_syscall_t * syscall);
 
+/* Put a system call taken from the pending queue back on it */
+void
+hio_requeue_syscall(hio_syscall_t * syscall);
+
 /* Return a completed HIO system call */
 void
 hio_return_syscall(hio_syscall_t * finished_syscall);
@@ -133,6 +195,27 @@ hio_get_num_pending_syscalls(void);
 int
 hio_get_pending_syscall(hio_syscall_t ** pending_syscall);
 
+/* The HIO stub polls for new system calls between these, no notifications
+ * are sent meanwhile */
+void
+hio_poll_start(void);
+
+void
+hio_poll_stop(void);
+
+
+struct aspace;
+
+/* Drop an address space's asynchronous system call ring */
+void
+hio_uring_release(struct aspace * aspace);
+
+int
+sys_hio_uring_setup(unsigned int entries, struct hio_uring __user ** ring);
+
+int
+sys_hio_uring_enter(unsigned int to_submit, unsigned int min_complete);
+
 
 struct iovec;
 struct pollfd;
@@ -55,6 +55,10 @@ struct inode
 	unsigned int		mode;
 	loff_t			size;
 
+	/* Changes whenever an entry is added to or removed from the
+	   directory, invalidating its lookup cache entries */
+	unsigned long		lookup_gen;
+
 	atomic_t		i_count;
 
 	/* for chrdevs and linux compatibility */
@@ -121,19 +125,14 @@ extern struct kfs_fops kfs_default_fops;
 
 #define MAX_PATHLEN		1024
 
-#define PIPE_END_READ  0
-#define PIPE_END_WRITE 1
-
-#define PIPE_BUFFER_MAX 1024
+/* Pipe writes of up to this many bytes are atomic */
+#define PIPE_BUF		4096
 
-struct pipe {
-   	char *        buffer;
-	int           amount;       // num chars in buffer
-	unsigned char eof;          // EOF?
-	waitq_t       buffer_wait;
-	spinlock_t    buffer_lock;
-	int           ref_count;
-};
+/* splice() and tee() flags */
+#define SPLICE_F_MOVE		0x01
+#define SPLICE_F_NONBLOCK	0x02
+#define SPLICE_F_MORE		0x04
+#define SPLICE_F_GIFT		0x08
 
 struct file
 {
@@ -145,27 +144,19 @@ struct file
 	struct dentry *         f_dentry;
 	void *                  private_data;
 	atomic_t		f_count;
-	unsigned char		pipe_end_type;
-	struct pipe *		pipe;          // if this is NULL, it's not a pipe
 };
 
-static inline bool pipe_buffer_full(struct pipe *p) {
-   return (p->amount >= PIPE_BUFFER_MAX);
-}
-
-static inline bool pipe_buffer_empty(struct pipe *p) {
-   return (p->amount == 0);
-}
-
-static inline int pipe_amount_free(struct pipe *p) {
-   return (PIPE_BUFFER_MAX - p->amount);
-}
-
 static inline struct file *get_current_file(int fd)
 {
 	return fdTableFile( current->fdTable, fd );
 }
 
+/* Name of file's inode for messages, anonymous files have none */
+static inline const char *file_name(const struct file *file)
+{
+	return file->inode ? file->inode->name : "anon";
+}
+
 extern void kfs_init(void);
 extern void kfs_init_stdio(struct task_struct *);
 
@@ -207,6 +198,8 @@ extern struct inode *kfs_create_at(struct inode *,
 
 extern struct inode *kfs_link(struct inode *, struct inode *, const char *);
 
+extern void kfs_del_dirent(struct inode *);
+
 /* generally useful file ops */
 extern int kfs_readdir(struct file *, uaddr_t, unsigned int, dirent_filler f);
 
@@ -226,8 +219,25 @@ extern int kfs_open_path(const char   * pathname,
 			 struct file ** rv);
 
 
+extern int kfs_open_or_create_at(struct inode * root_inode,
+				 const char   * pathname,
+				 int            flags,
+				 mode_t         mode,
+				 struct file ** rv);
+
 extern int kfs_open_anon(const struct kfs_fops * fops, void * priv_data);
 
+extern int pipe_create(int fds[2], int flags);
+
+extern ssize_t pipe_splice(struct file * in, loff_t * off_in,
+			   struct file * out, loff_t * off_out,
+			   size_t len, unsigned int flags);
+
+extern ssize_t pipe_tee(struct file * in, struct file * out,
+			size_t len, unsigned int flags);
+
+extern int pipe_stat(struct file * filp, uaddr_t buf);
+
 extern struct inode * kfs_lookup(struct inode * root, const char * dirname, unsigned create_mode);
 
 extern struct inode * kfs_mkdir_at(struct inode * root_inode,  char* name, unsigned mode);
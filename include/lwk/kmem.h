@@ -4,14 +4,21 @@
 #define _LWK_KMEM_H
 
 extern void kmem_create_zone(unsigned long base_addr, size_t size);
+extern void kmem_create_zone_node(int node, unsigned long base_addr, size_t size);
+extern void kmem_create_node_zones(size_t size);
 extern void kmem_add_memory(unsigned long base_addr, size_t size);
 
 extern void *kmem_alloc(size_t size);
+extern void *kmem_alloc_node(size_t size, int node);
+extern void *kmem_alloc_nozero(size_t size);
 extern void kmem_free( const void *addr);
 
 extern void * kmem_get_pages(unsigned long order);
+extern void * kmem_get_pages_node(unsigned long order, int node);
 extern void kmem_free_pages(const void *addr, unsigned long order);
 
+extern void kmem_cpu_drain(int cpu);
+
 extern bool paddr_is_kmem(const paddr_t paddr);
 
 #endif
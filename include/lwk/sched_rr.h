@@ -2,8 +2,9 @@
  * Process scheduler API (Round Robin Scheduler).
  *
  * Kitten maintains a linked list of tasks per CPU that are in a
- * ready to run state.  Since the number of tasks is expected to
- * be low, the overhead is very small.
+ * ready to run state, and a second list of the CPU's blocked tasks.
+ * Picking the next task to run only looks at the head of the ready
+ * list, so its cost does not depend on how many tasks are blocked.
  */
 #ifndef _LWK_SCHED_RR_H
 #define _LWK_SCHED_RR_H
@@ -13,15 +14,18 @@
 #include <lwk/timer.h>
 
 struct rr_rq {
-	struct list_head taskq;
+	struct list_head taskq;		/* Runnable tasks, next to run first */
+	struct list_head blockq;	/* Blocked tasks */
 	struct timer nextint;
+	uint64_t nr_examined;		/* Tasks looked at by rr_schedule() */
+	uint64_t nr_blocked;		/* Tasks moved taskq -> blockq */
+	uint64_t nr_woken;		/* Tasks moved blockq -> taskq */
 };
 
 extern int __init rr_sched_init_runqueue(struct rr_rq *, int cpu_id);
 extern void rr_sched_add_task(struct rr_rq *, struct task_struct *task);
 extern void rr_sched_del_task(struct rr_rq *, struct task_struct *task);
-extern int rr_sched_wakeup_task(struct task_struct *task,
-                             taskstate_t valid_states);
+extern void rr_sched_wakeup_task(struct rr_rq *, struct task_struct *task);
 
 extern void rr_sched_cpu_remove(struct rr_rq *, void *);
 extern struct task_struct *rr_schedule(struct rr_rq *, struct list_head *);
@@ -30,5 +34,8 @@ extern ktime_t rr_schedule_timeout(ktime_t timeout);
 extern void rr_adjust_schedule(struct rr_rq *, struct task_struct *task);
 extern void rr_sched_yield(void);
 extern void rr_sched_yield_to(struct rr_rq *, struct task_struct *);
+extern bool rr_sched_only_task(struct rr_rq *, struct task_struct *task);
+extern struct task_struct *rr_sched_steal(struct rr_rq *,
+                                          struct task_struct *curr, id_t cpu);
 
 #endif
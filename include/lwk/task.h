@@ -141,6 +141,7 @@ struct task_struct {
 	struct list_head	migrate_link;	// For per-CPU scheduling lists
 	struct task_rr {
 		struct list_head sched_link;
+		bool		 blocked;	// On the rr_rq's blockq
 	} rr;
 #ifdef CONFIG_SCHED_EDF
         struct task_edf {
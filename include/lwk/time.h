@@ -31,7 +31,22 @@ struct timespec {
 	long		tv_nsec;	/* nanoseconds */
 };
 
+/**
+ * Time conversion state shared read-only with user space through the
+ * vsyscall page, so that gettimeofday() and friends can compute
+ * get_time() without entering the kernel. The kernel makes seq odd
+ * while it updates the other fields; readers retry if seq is odd or
+ * changes while they read.
+ */
+struct vtime_data {
+	uint32_t	seq;
+	uint32_t	shift;
+	uint64_t	mult;
+	uint64_t	offset;
+};
+
 void __init time_init(void);
+void vtime_init(struct vtime_data *vt);
 void init_cycles2ns(uint32_t khz);
 ktime_t cycles2ns(uint64_t cycles);
 ktime_t get_time(void);
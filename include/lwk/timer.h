@@ -1,8 +1,8 @@
 /** \file
  * One-shot timers.
  *
- * Kitten implements one shot timers via an ordered queue of
- * struct timer entities.
+ * Kitten implements one shot timers via a per-CPU hierarchical
+ * timing wheel of struct timer entities.
  */
 #ifndef _LWK_TIMER_H
 #define _LWK_TIMER_H
@@ -27,8 +27,9 @@
  * \note The timer_add() function will initialize the link and cpu fields.
  */
 struct timer {
-	struct list_head link;           /**< Ordered list of callbacks */
+	struct list_head link;           /**< Timer wheel slot list */
 	id_t             cpu;            /**< CPU this timer is installed on */
+	unsigned int     slot;           /**< Timer wheel slot it is in */
 	uint64_t         expires;        /**< Time when this timer expires */
 	uintptr_t        data;           /**< arg to pass to function */
 	void (*function)(uintptr_t);     /**< executed when timer expires */
@@ -38,7 +39,7 @@ struct timer {
  * @{
  */
 
-/** Add a timer to the ordered list of timer events.
+/** Add a timer to the calling CPU's timer wheel.
  *
  * \note timer should not be stack allocated unless the timer
  * structure will remain in scope until expiration of the timer.
@@ -1,6 +1,8 @@
 #ifndef _LWK_TLBFLUSH_H
 #define _LWK_TLBFLUSH_H
 
+#include <lwk/types.h>
+#include <lwk/cpumask.h>
 #include <arch/tlbflush.h>
 
 /**
@@ -19,4 +21,14 @@ extern void __flush_tlb(void);
 extern void __flush_tlb_kernel(void);
 // @}
 
+/**
+ * Targeted TLB flush API. Invalidates the non-global entries for the
+ * addresses in [start, end), on the CPUs in cpu_mask or on the calling CPU
+ * only. Large ranges fall back to flushing all non-global entries.
+ * @{
+ */
+extern void flush_tlb_mask_range(cpumask_t cpu_mask, vaddr_t start, vaddr_t end);
+extern void __flush_tlb_range(vaddr_t start, vaddr_t end);
+// @}
+
 #endif /* _LWK_TLBFLUSH_H */
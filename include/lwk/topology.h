@@ -42,12 +42,24 @@
 
 int arch_update_cpu_topology(void);
 
+#ifndef NUMA_NO_NODE
+#define NUMA_NO_NODE		(-1)
+#endif
+
+#ifndef MAX_NUMNODES
+#define NODES_SHIFT		CONFIG_NODES_SHIFT
+#define MAX_NUMNODES		(1 << NODES_SHIFT)
+#endif
+
 /* Conform to ACPI 2.0 SLIT distance definitions */
 #define LOCAL_DISTANCE		10
 #define REMOTE_DISTANCE		20
 #ifndef node_distance
-#define node_distance(from,to)	((from) == (to) ? LOCAL_DISTANCE : REMOTE_DISTANCE)
+extern int __node_distance(int from, int to);
+#define node_distance(from,to)	__node_distance(from, to)
 #endif
+
+extern void numa_set_distance(int from, int to, int distance);
 #ifndef RECLAIM_DISTANCE
 
 /*
@@ -189,10 +201,12 @@ static inline const struct cpumask *cpu_smt_mask(int cpu)
 }
 #endif
 
+#ifdef cpumask_of_node
 static inline const struct cpumask *cpu_cpu_mask(int cpu)
 {
 	return cpumask_of_node(cpu_to_node(cpu));
 }
+#endif
 
 
 #endif /* _LINUX_TOPOLOGY_H */
\ No newline at end of file
@@ -1,6 +1,13 @@
 /** 
  * Kitten Block Layer
  * (c) 2014 Jack Lange, <jacklange@cs.pitt.edu>
+ *
+ * I/Os are queued per CPU and held there (plugged) until the submitter
+ * unplugs the device, or enough of them pile up. Unplugging moves them to
+ * the device's dispatch list, sorted by offset, from which I/Os to
+ * adjacent sectors are merged into one driver request each. Requests come
+ * from a pool sized to the driver's request slots, so a device never has
+ * more requests outstanding than it can take.
  */
 
 
@@ -15,74 +22,1367 @@
 #include <lwk/pmem.h>
 #include <lwk/aspace.h>
 #include <lwk/delay.h>
+#include <lwk/smp.h>
+#include <lwk/proc_fs.h>
+#include <lwk/radix-tree.h>
 
+#include <arch/uaccess.h>
 
 
+/* Largest transfer I/Os are merged up to */
+#define BLK_RQ_MAX_LEN		(1024 * 1024)
+
+/* Most DMA descriptors in a merged request */
+#define BLK_RQ_MAX_DESCS	128
+
+/* Largest single DMA descriptor (the AHCI PRD limit) */
+#define BLK_SEG_MAX		(4 * 1024 * 1024)
+
+/* I/Os a CPU queue holds before it is unplugged regardless */
+#define BLK_PLUG_MAX		32
+
+/* Free I/Os kept around for reuse */
+#define BLK_IO_POOL_MAX		256
+
+/* Pages the cache takes from pmem at a time */
+#define BLKCACHE_CHUNK_PAGES	512
+
+/* Pages a read or write pins at a time */
+#define BLKCACHE_BATCH		64
+
+/* Read-ahead window bounds, in pages */
+#define BLKCACHE_RA_MIN		4
+#define BLKCACHE_RA_MAX		64
+
+/* Radix tree tag of dirty pages */
+#define BLKCACHE_TAG_DIRTY	0
+
 
 static char blkdev_str[128];
 param_string(block, blkdev_str, sizeof(blkdev_str));
 
-static struct list_head blkdev_list;
-static struct inode *   blkdev_root;
-static spinlock_t       blkdev_lock;
+/* Size of each device's page cache in MB, 0 disables caching */
+static unsigned long blkcache_mb = 32;
+param(blkcache_mb, ulong);
+
+static struct list_head blkdev_list;
+static struct inode *   blkdev_root;
+static spinlock_t       blkdev_lock;
+
+static struct list_head io_pool;
+static unsigned int     io_pool_cnt;
+static spinlock_t       io_pool_lock;
+
+struct blkdev;
+
+#define PG_UPTODATE	0x1	/* Holds the data on disk, or newer */
+#define PG_DIRTY	0x2	/* Newer than the data on disk */
+#define PG_BUSY		0x4	/* Being read or written back */
+
+/* A page of a device cached in memory */
+typedef struct {
+	unsigned long      index;     /* Page number on the device */
+	paddr_t            paddr;
+	u32                flags;
+	u32                refs;      /* Readers and writers using the page */
+	int                error;     /* Of the last read */
+	struct blkdev    * blkdev;
+	struct list_head   lru;       /* Linkage in cache->lru or cache->free */
+} blk_page_t;
+
+/**
+ * A device's page cache. Pages are indexed by their page number on the
+ * device, and recycled least recently used first once max_pages have
+ * been taken from pmem.
+ */
+struct blk_cache {
+	spinlock_t             lock;
+	struct radix_tree_root pages;
+	struct list_head       lru;          /* Cached pages, oldest first */
+	struct list_head       free;
+	u64                    nr_pages;     /* Taken from pmem */
+	u64                    max_pages;    /* 0 if the cache is disabled */
+	u64                    nr_dirty;
+	u64                    nr_writeback; /* Pages being written back */
+	int                    wb_error;     /* Of writebacks since the last sync */
+	waitq_t                waitq;        /* Page I/O finished */
+
+	/* Statistics, see /proc/blkstat */
+	u64                    hits;
+	u64                    misses;
+	u64                    readahead;
+	u64                    writeback;
+};
+
+/* A driver request built from one or more merged I/Os */
+typedef struct {
+	blk_req_t          req;       /* Handed to the driver */
+	struct blkdev    * blkdev;
+	struct list_head   ios;       /* I/Os merged into req */
+	struct list_head   node;      /* Linkage in blkdev->free_rqs */
+	blk_dma_desc_t   * descs;     /* BLK_RQ_MAX_DESCS descriptors */
+} blk_rq_t;
+
+/* I/Os plugged on one CPU */
+struct blk_cpu_queue {
+	spinlock_t       lock;
+	struct list_head ios;
+	u32              nr_ios;
+};
+
+typedef struct blkdev {
+	char name[32];
+
+	blkdev_ops_t * ops;
+	void * priv_data;
+
+	u64 sector_size;    /* Sector Size of the block device (in bytes)*/
+	u64 capacity;       /* Capacity of block device (in bytes) */
+	u32 max_dma_descs;  /* Maximum number of DMA descriptors per request */
+	u32 request_slots;  /* Maximum number of requests that can be issued simultaneously */
+	u32 max_rq_descs;   /* DMA descriptors a merged request may use */
+
+	struct blk_cpu_queue * cpu_queues;  /* NR_CPUS plugged queues */
+
+	struct blk_cache cache;
+
+	/* Protects everything below */
+	spinlock_t lock;
+
+	struct list_head dispatch;  /* Unplugged I/Os, sorted by offset */
+	struct list_head free_rqs;
+	blk_rq_t       * rqs;
+
+	/* Queue statistics, see /proc/blkstat */
+	u32 inflight;       /* Requests the driver has */
+	u32 max_inflight;
+	u64 nr_ios;         /* I/Os dispatched */
+	u64 nr_merged;      /* I/Os merged into another's request */
+	u64 nr_requests;    /* Requests issued to the driver */
+	u64 depth_sum;      /* Sum of inflight at each issue */
+
+	struct inode *  dev_inode;
+
+	struct list_head blkdev_node;
+
+} blkdev_t;
+
+
+/**
+ * Tracks the I/Os a read, write or asynchronous iocb was split into. A
+ * batch belongs either to a waiting thread or, when file is set, to an
+ * open file's completion list.
+ */
+typedef struct blkdev_file blkdev_file_t;
+
+typedef struct {
+	struct list_head node;   /* Linkage in file->events */
+	blkdev_file_t  * file;
+	u64 user_data;
+	u64 len;
+	u32 pending;             /* I/Os not yet complete */
+	int status;
+	spinlock_t lock;         /* Protects pending when file is NULL */
+	waitq_t waitq;
+} blk_batch_t;
+
+/* State of an open block device file */
+struct blkdev_file {
+	blkdev_t * blkdev;
+
+	spinlock_t lock;
+	struct list_head events;  /* Completed asynchronous iocbs */
+	u32 nr_events;
+	u32 inflight;             /* Asynchronous iocbs still queued */
+	bool closed;
+	waitq_t waitq;
+
+	/* Sequential read detection */
+	u64 ra_pos;               /* Where the last read ended */
+	unsigned long ra_end;     /* Page after the last one read ahead */
+	u32 ra_pages;             /* Current read-ahead window */
+	bool dirtied;             /* Written through the cache */
+};
+
+
+
+blk_io_t *
+blkdev_alloc_io(void)
+{
+	blk_io_t      * io = NULL;
+	unsigned long   irqstate;
+
+	spin_lock_irqsave(&(io_pool_lock), irqstate);
+	{
+		if (!list_empty(&io_pool)) {
+			io = list_first_entry(&io_pool, blk_io_t, node);
+			list_del(&(io->node));
+			io_pool_cnt--;
+		}
+	}
+	spin_unlock_irqrestore(&(io_pool_lock), irqstate);
+
+	if (io != NULL) {
+		memset(io, 0, sizeof(blk_io_t));
+	} else if ((io = kmem_alloc(sizeof(blk_io_t))) == NULL) {
+		return NULL;
+	}
+
+	io->dma_descs = io->descs;
+
+	return io;
+}
+
+void
+blkdev_free_io(blk_io_t * io)
+{
+	unsigned long irqstate;
+
+	spin_lock_irqsave(&(io_pool_lock), irqstate);
+	{
+		if (io_pool_cnt < BLK_IO_POOL_MAX) {
+			list_add(&(io->node), &io_pool);
+			io_pool_cnt++;
+			io = NULL;
+		}
+	}
+	spin_unlock_irqrestore(&(io_pool_lock), irqstate);
+
+	if (io != NULL) {
+		kmem_free(io);
+	}
+}
+
+
+static void
+finish_ios(struct list_head * ios)
+{
+	blk_io_t * io  = NULL;
+	blk_io_t * tmp = NULL;
+
+	list_for_each_entry_safe(io, tmp, ios, node) {
+		list_del(&(io->node));
+		io->done(io, io->status);
+	}
+}
+
+/* Appends an I/O's descriptors to a request, joining contiguous ones */
+static void
+add_descs(blk_req_t * req, blk_io_t * io)
+{
+	blk_dma_desc_t * last = NULL;
+	u32 i;
+
+	for (i = 0; i < io->desc_cnt; i++) {
+		blk_dma_desc_t * desc = &(io->dma_descs[i]);
+
+		if (req->desc_cnt > 0) {
+			last = &(req->dma_descs[req->desc_cnt - 1]);
+		}
+
+		if ((last != NULL) &&
+		    (last->buf_paddr + last->length == desc->buf_paddr) &&
+		    (last->length + desc->length <= BLK_SEG_MAX)) {
+			last->length += desc->length;
+		} else {
+			req->dma_descs[req->desc_cnt++] = *desc;
+		}
+	}
+
+	req->total_len += io->len;
+}
+
+static int
+can_merge(blkdev_t * blkdev, blk_req_t * req, blk_io_t * io) 
+{
+	return ((io->write  == req->write) &&
+		(io->offset == req->offset + req->total_len) &&
+		(req->total_len + io->len     <= BLK_RQ_MAX_LEN) &&
+		(req->desc_cnt  + io->desc_cnt <= blkdev->max_rq_descs));
+}
+
+/* Builds a request from the I/O at the head of the dispatch list, and any
+ * that follow it on the disk */
+static void
+build_rq(blkdev_t * blkdev, blk_rq_t * rq)
+{
+	blk_req_t * req = &(rq->req);
+	blk_io_t  * io  = list_first_entry(&(blkdev->dispatch), blk_io_t, node);
+
+	req->async     = 1;
+	req->write     = io->write;
+	req->complete  = 0;
+	req->offset    = io->offset;
+	req->total_len = 0;
+	req->desc_cnt  = 0;
+	req->dma_descs = rq->descs;
+	req->status    = 0;
+
+	while (1) {
+		list_move_tail(&(io->node), &(rq->ios));
+		add_descs(req, io);
+
+		if (list_empty(&(blkdev->dispatch))) {
+			break;
+		}
+
+		io = list_first_entry(&(blkdev->dispatch), blk_io_t, node);
+
+		if (!can_merge(blkdev, req, io)) {
+			break;
+		}
+
+		blkdev->nr_merged++;
+	}
+}
+
+/**
+ * Issues requests while the driver has free slots. I/Os that fail to issue
+ * are moved to failed, for the caller to complete once it drops the lock.
+ * Called with blkdev->lock held.
+ */
+static void
+run_queue(blkdev_t         * blkdev, 
+	  struct list_head * failed)
+{
+	blk_rq_t * rq = NULL;
+	blk_io_t * io = NULL;
+	int ret       = 0;
+
+	while (!list_empty(&(blkdev->dispatch)) && 
+	       !list_empty(&(blkdev->free_rqs))) {
+
+		rq = list_first_entry(&(blkdev->free_rqs), blk_rq_t, node);
+		list_del(&(rq->node));
+
+		build_rq(blkdev, rq);
+
+		blkdev->inflight++;
+
+		ret = blkdev->ops->handle_blkreq(&(rq->req), blkdev->priv_data);
+
+		if (ret == 0) {
+			blkdev->nr_requests++;
+			blkdev->depth_sum += blkdev->inflight;
+
+			if (blkdev->inflight > blkdev->max_inflight) {
+				blkdev->max_inflight = blkdev->inflight;
+			}
+
+			continue;
+		}
+
+		blkdev->inflight--;
+		list_add(&(rq->node), &(blkdev->free_rqs));
+
+		/* Out of driver slots, try again when a request completes */
+		if ((ret == -EAGAIN) && (blkdev->inflight > 0)) {
+			list_splice_init(&(rq->ios), &(blkdev->dispatch));
+			break;
+		}
+
+		printk(KERN_ERR "BLKDEV: Error handling block request in block driver (%d)\n", ret);
+
+		list_for_each_entry(io, &(rq->ios), node) {
+			io->status = ret;
+		}
+
+		list_splice_init(&(rq->ios), failed);
+	}
+}
+
+
+/**
+ * Queues an I/O on the calling CPU. It is not issued before the device is
+ * unplugged, unless BLK_PLUG_MAX I/Os are already waiting.
+ */
+int
+blkdev_submit_io(blkdev_handle_t   blkdev_handle, 
+		 blk_io_t        * io)
+{
+	blkdev_t             * blkdev = (blkdev_t *)blkdev_handle;
+	struct blk_cpu_queue * queue  = NULL;
+	u64 total_len = 0;
+	int unplug    = 0;
+	u32 i         = 0;
+	unsigned long irqstate;
+
+	if ((io->len    == 0)                   ||
+	    (io->len    % blkdev->sector_size)  || 
+	    (io->offset % blkdev->sector_size)  ||
+	    (io->offset + io->len > blkdev->capacity)) {
+		return -EINVAL;
+	}
+
+	if ((io->desc_cnt == 0) || (io->desc_cnt > blkdev->max_rq_descs)) {
+		return -EINVAL;
+	}
+
+	for (i = 0; i < io->desc_cnt; i++) {
+		if ((io->dma_descs[i].length == 0) ||
+		    (io->dma_descs[i].length > BLK_SEG_MAX)) {
+			return -EINVAL;
+		}
+
+		total_len += io->dma_descs[i].length;
+	}
+
+	if (total_len != io->len) {
+		return -EINVAL;
+	}
+
+	queue = &(blkdev->cpu_queues[this_cpu]);
+
+	spin_lock_irqsave(&(queue->lock), irqstate);
+	{
+		list_add_tail(&(io->node), &(queue->ios));
+		unplug = (++queue->nr_ios >= BLK_PLUG_MAX);
+	}
+	spin_unlock_irqrestore(&(queue->lock), irqstate);
+
+	if (unplug) {
+		blkdev_unplug(blkdev);
+	}
+
+	return 0;
+}
+
+/* Inserts an I/O after those at lower or equal offsets */
+static void
+dispatch_insert(blkdev_t * blkdev, blk_io_t * io)
+{
+	struct list_head * pos = blkdev->dispatch.prev;
+
+	while (pos != &(blkdev->dispatch)) {
+		if (list_entry(pos, blk_io_t, node)->offset <= io->offset) {
+			break;
+		}
+
+		pos = pos->prev;
+	}
+
+	list_add(&(io->node), pos);
+}
+
+/**
+ * Moves the I/Os plugged on every CPU to the dispatch list and issues as
+ * many requests as the driver will take. Draining all CPUs means a thread
+ * that migrated since queueing its I/Os still gets them going.
+ */
+void
+blkdev_unplug(blkdev_handle_t blkdev_handle)
+{
+	blkdev_t * blkdev = (blkdev_t *)blkdev_handle;
+	blk_io_t * io     = NULL;
+	blk_io_t * tmp    = NULL;
+	struct list_head ios;
+	struct list_head failed;
+	unsigned long irqstate;
+	int cpu;
+
+	INIT_LIST_HEAD(&ios);
+	INIT_LIST_HEAD(&failed);
+
+	for (cpu = 0; cpu < NR_CPUS; cpu++) {
+		struct blk_cpu_queue * queue = &(blkdev->cpu_queues[cpu]);
+
+		if (list_empty(&(queue->ios))) {
+			continue;
+		}
+
+		spin_lock_irqsave(&(queue->lock), irqstate);
+		{
+			list_splice_init(&(queue->ios), &ios);
+			queue->nr_ios = 0;
+		}
+		spin_unlock_irqrestore(&(queue->lock), irqstate);
+	}
+
+	spin_lock_irqsave(&(blkdev->lock), irqstate);
+	{
+		list_for_each_entry_safe(io, tmp, &ios, node) {
+			dispatch_insert(blkdev, io);
+			blkdev->nr_ios++;
+		}
+
+		run_queue(blkdev, &failed);
+	}
+	spin_unlock_irqrestore(&(blkdev->lock), irqstate);
+
+	finish_ios(&failed);
+}
+
+
+static void
+batch_init(blk_batch_t * batch)
+{
+	memset(batch, 0, sizeof(blk_batch_t));
+	spin_lock_init(&(batch->lock));
+	waitq_init(&(batch->waitq));
+}
+
+static void
+batch_io_done(blk_io_t * io, 
+	      int        status)
+{
+	blk_batch_t   * batch     = io->priv;
+	blkdev_file_t * file      = batch->file;
+	spinlock_t    * lock      = (file) ? &(file->lock) : &(batch->lock);
+	int             free_file = 0;
+	unsigned long   irqstate;
+
+	blkdev_free_io(io);
+
+	spin_lock_irqsave(lock, irqstate);
+	{
+		if ((status != 0) && (batch->status == 0)) {
+			batch->status = status;
+		}
+
+		if (--batch->pending == 0) {
+			if (file == NULL) {
+				waitq_wakeup(&(batch->waitq));
+			} else if (file->closed) {
+				kmem_free(batch);
+				free_file = (--file->inflight == 0);
+			} else {
+				file->inflight--;
+				file->nr_events++;
+				list_add_tail(&(batch->node), &(file->events));
+				waitq_wakeup(&(file->waitq));
+			}
+		}
+	}
+	spin_unlock_irqrestore(lock, irqstate);
+
+	if (free_file) {
+		kmem_free(file);
+	}
+}
+
+/* Waits for a batch without a file. The DMA is in flight, so this cannot
+ * be interrupted. */
+static int
+batch_wait(blk_batch_t * batch)
+{
+	unsigned long irqstate;
+
+	wait_event(batch->waitq, (ACCESS_ONCE(batch->pending) == 0));
+
+	/* Let the last completion finish with the batch */
+	spin_lock_irqsave(&(batch->lock), irqstate);
+	spin_unlock_irqrestore(&(batch->lock), irqstate);
+
+	return batch->status;
+}
+
+/**
+ * Splits a transfer to or from the calling task's memory into I/Os for a
+ * batch, joining physically contiguous pages into single descriptors.
+ */
+static int
+map_user_ios(blkdev_t         * blkdev,
+	     blk_batch_t      * batch,
+	     vaddr_t            vaddr,
+	     u64                len,
+	     u64                offset,
+	     int                write,
+	     struct list_head * ios)
+{
+	blk_io_t * io     = NULL;
+	blk_io_t * tmp    = NULL;
+	paddr_t    paddr  = 0;
+	u64        seg    = 0;
+	int        status = 0;
+
+	while (len > 0) {
+		blk_dma_desc_t * last = NULL;
+		int              join = 0;
+
+		if (aspace_virt_to_phys(current->aspace->id, vaddr, &paddr) != 0) {
+			printk(KERN_ERR "Invalid user address in blkdev request\n");
+			status = -EFAULT;
+			goto err;
+		}
+
+		seg = min(len, (u64)(PAGE_SIZE - (vaddr & (PAGE_SIZE - 1))));
+
+		if ((io != NULL) && (io->len + seg > BLK_RQ_MAX_LEN)) {
+			io = NULL;
+		}
+
+		if (io != NULL) {
+			last = &(io->descs[io->desc_cnt - 1]);
+			join = ((last->buf_paddr + last->length == paddr) &&
+				(last->length + seg <= BLK_SEG_MAX));
+
+			if (!join && (io->desc_cnt == BLK_IO_DESCS)) {
+				io = NULL;
+			}
+		}
+
+		if (io == NULL) {
+			if ((io = blkdev_alloc_io()) == NULL) {
+				status = -ENOMEM;
+				goto err;
+			}
+
+			io->offset = offset;
+			io->write  = write;
+			io->done   = batch_io_done;
+			io->priv   = batch;
+
+			list_add_tail(&(io->node), ios);
+			batch->pending++;
+		}
+
+		if (join) {
+			last->length += seg;
+		} else {
+			io->descs[io->desc_cnt].buf_paddr = paddr;
+			io->descs[io->desc_cnt].length    = seg;
+			io->desc_cnt++;
+		}
+
+		io->len += seg;
+
+		vaddr  += seg;
+		offset += seg;
+		len    -= seg;
+	}
+
+	return 0;
+
+ err:
+	list_for_each_entry_safe(io, tmp, ios, node) {
+		list_del(&(io->node));
+		blkdev_free_io(io);
+	}
+
+	batch->pending = 0;
+
+	return status;
+}
+
+/* Queues a list of I/Os, completing any the device rejects */
+static void
+submit_ios(blkdev_t         * blkdev, 
+	   struct list_head * ios)
+{
+	blk_io_t * io  = NULL;
+	blk_io_t * tmp = NULL;
+	int ret        = 0;
+
+	list_for_each_entry_safe(io, tmp, ios, node) {
+		list_del(&(io->node));
+
+		if ((ret = blkdev_submit_io(blkdev, io)) != 0) {
+			io->done(io, ret);
+		}
+	}
+}
+
+
+/* How cache_get() may find a page for an index that is not cached */
+#define CACHE_FIND	0	/* Only if already cached */
+#define CACHE_ADD	1	/* From free or clean pages */
+#define CACHE_RECLAIM	2	/* Writing back dirty pages if need be */
+
+static u64
+page_len(blkdev_t * blkdev, unsigned long index)
+{
+	return min((u64)PAGE_SIZE, blkdev->capacity - ((u64)index << PAGE_SHIFT));
+}
+
+static void *
+page_data(blk_page_t * page)
+{
+	return __va(page->paddr);
+}
+
+/* Takes another chunk of pages from pmem */
+static int
+cache_grow(blkdev_t * blkdev)
+{
+	struct blk_cache   * cache = &(blkdev->cache);
+	blk_page_t         * pages = NULL;
+	struct pmem_region   rgn;
+	unsigned long        irqstate;
+	u64 cnt = 0;
+	u64 i   = 0;
+
+	spin_lock_irqsave(&(cache->lock), irqstate);
+	{
+		cnt = min((u64)BLKCACHE_CHUNK_PAGES, cache->max_pages - cache->nr_pages);
+		cache->nr_pages += cnt;
+	}
+	spin_unlock_irqrestore(&(cache->lock), irqstate);
+
+	if (cnt == 0) {
+		return -ENOMEM;
+	}
+
+	if (((pages = kmem_alloc(sizeof(blk_page_t) * cnt)) == NULL) ||
+	    (pmem_alloc_umem(cnt << PAGE_SHIFT, PAGE_SIZE, &rgn) != 0)) {
+		if (pages) kmem_free(pages);
+
+		spin_lock_irqsave(&(cache->lock), irqstate);
+		{
+			cache->nr_pages -= cnt;
+		}
+		spin_unlock_irqrestore(&(cache->lock), irqstate);
+
+		return -ENOMEM;
+	}
+
+	spin_lock_irqsave(&(cache->lock), irqstate);
+	{
+		for (i = 0; i < cnt; i++) {
+			pages[i].paddr  = rgn.start + (i << PAGE_SHIFT);
+			pages[i].blkdev = blkdev;
+			list_add_tail(&(pages[i].lru), &(cache->free));
+		}
+	}
+	spin_unlock_irqrestore(&(cache->lock), irqstate);
+
+	return 0;
+}
+
+/**
+ * Takes a page to cache a new index in, recycling the least recently used
+ * idle, clean page if none are free. Called with the cache lock held.
+ */
+static blk_page_t *
+cache_take_page(struct blk_cache * cache)
+{
+	blk_page_t * page = NULL;
+
+	if (!list_empty(&(cache->free))) {
+		page = list_first_entry(&(cache->free), blk_page_t, lru);
+		list_del(&(page->lru));
+		return page;
+	}
+
+	list_for_each_entry(page, &(cache->lru), lru) {
+		if ((page->refs == 0) && !(page->flags & (PG_BUSY | PG_DIRTY))) {
+			list_del(&(page->lru));
+			radix_tree_delete(&(cache->pages), page->index);
+			return page;
+		}
+	}
+
+	return NULL;
+}
+
+static int cache_writeback(blkdev_t * blkdev, int sync);
+
+/**
+ * Looks up the page caching index, adding one as allowed by how. Returns
+ * the page with a reference held, or NULL if there is none.
+ */
+static blk_page_t *
+cache_get(blkdev_t      * blkdev, 
+	  unsigned long   index, 
+	  int             how)
+{
+	struct blk_cache * cache    = &(blkdev->cache);
+	blk_page_t       * page     = NULL;
+	int                grow     = 1;
+	int                reclaim  = (how == CACHE_RECLAIM);
+	int                ret      = 0;
+	unsigned long      irqstate;
+
+	while (1) {
+		spin_lock_irqsave(&(cache->lock), irqstate);
+		{
+			page = radix_tree_lookup(&(cache->pages), index);
+
+			if (page != NULL) {
+				page->refs++;
+				list_move_tail(&(page->lru), &(cache->lru));
+			} else if ((how != CACHE_FIND) && 
+				   ((page = cache_take_page(cache)) != NULL)) {
+				page->index = index;
+				page->flags = 0;
+				page->refs  = 1;
+				page->error = 0;
+
+				if ((ret = radix_tree_insert(&(cache->pages), index, page)) != 0) {
+					list_add(&(page->lru), &(cache->free));
+					page = NULL;
+				} else {
+					list_add_tail(&(page->lru), &(cache->lru));
+				}
+			}
+		}
+		spin_unlock_irqrestore(&(cache->lock), irqstate);
+
+		if ((page != NULL) || (how == CACHE_FIND) || (ret != 0)) {
+			return page;
+		}
+
+		if (grow && (cache->nr_pages < cache->max_pages)) {
+			grow = (cache_grow(blkdev) == 0);
+			continue;
+		}
+
+		if (reclaim && (ACCESS_ONCE(cache->nr_dirty) > 0)) {
+			reclaim = 0;
+			cache_writeback(blkdev, 1);
+			continue;
+		}
+
+		return NULL;
+	}
+}
+
+static void
+cache_put(blk_page_t * page)
+{
+	struct blk_cache * cache = &(page->blkdev->cache);
+	unsigned long      irqstate;
+
+	spin_lock_irqsave(&(cache->lock), irqstate);
+	{
+		page->refs--;
+	}
+	spin_unlock_irqrestore(&(cache->lock), irqstate);
+}
+
+static void
+page_io_finish(blk_page_t * page, 
+	       int          write, 
+	       int          status)
+{
+	struct blk_cache * cache = &(page->blkdev->cache);
+	unsigned long      irqstate;
+
+	spin_lock_irqsave(&(cache->lock), irqstate);
+	{
+		page->flags &= ~PG_BUSY;
+
+		if (write) {
+			cache->nr_writeback--;
+
+			if ((status != 0) && (cache->wb_error == 0)) {
+				cache->wb_error = status;
+			}
+		} else if (status == 0) {
+			page->flags |= PG_UPTODATE;
+		} else {
+			page->error = status;
+		}
+	}
+	spin_unlock_irqrestore(&(cache->lock), irqstate);
+
+	waitq_wakeup(&(cache->waitq));
+}
+
+static void
+page_io_done(blk_io_t * io, 
+	     int        status)
+{
+	blk_page_t * page  = io->priv;
+	int          write = io->write;
+
+	blkdev_free_io(io);
+	page_io_finish(page, write, status);
+}
+
+/* Queues the read or write back of a page marked PG_BUSY */
+static void
+page_io_submit(blk_page_t * page, 
+	       int          write)
+{
+	blkdev_t * blkdev = page->blkdev;
+	blk_io_t * io     = blkdev_alloc_io();
+	int        ret    = 0;
+
+	if (io == NULL) {
+		page_io_finish(page, write, -ENOMEM);
+		return;
+	}
+
+	io->offset             = (u64)page->index << PAGE_SHIFT;
+	io->len                = page_len(blkdev, page->index);
+	io->write              = write;
+	io->desc_cnt           = 1;
+	io->descs[0].buf_paddr = page->paddr;
+	io->descs[0].length    = io->len;
+	io->done               = page_io_done;
+	io->priv               = page;
+
+	if ((ret = blkdev_submit_io(blkdev, io)) != 0) {
+		io->done(io, ret);
+	}
+}
+
+/**
+ * Queues a read of a page unless it is up to date or already being read.
+ * Pages read ahead are counted apart from those read on demand.
+ */
+static void
+cache_start_read(blk_page_t * page, 
+		 int          ahead)
+{
+	struct blk_cache * cache = &(page->blkdev->cache);
+	int                start = 0;
+	unsigned long      irqstate;
+
+	spin_lock_irqsave(&(cache->lock), irqstate);
+	{
+		if (!(page->flags & (PG_UPTODATE | PG_BUSY))) {
+			page->flags |= PG_BUSY;
+			page->error  = 0;
+			start        = 1;
+
+			if (ahead) {
+				cache->readahead++;
+			} else {
+				cache->misses++;
+			}
+		} else if (!ahead) {
+			cache->hits++;
+		}
+	}
+	spin_unlock_irqrestore(&(cache->lock), irqstate);
+
+	if (start) {
+		page_io_submit(page, 0);
+	}
+}
+
+/**
+ * Waits for I/O on a page to finish. If whole is set the caller is about
+ * to overwrite all of it, so the page is made up to date without reading
+ * it. Returns 0 if the page is up to date.
+ */
+static int
+cache_wait(blk_page_t * page, 
+	   int          whole)
+{
+	struct blk_cache * cache  = &(page->blkdev->cache);
+	int                status = 0;
+	int                idle   = 0;
+	unsigned long      irqstate;
+
+	while (!idle) {
+		wait_event(cache->waitq, !(ACCESS_ONCE(page->flags) & PG_BUSY));
+
+		/* Someone may have started a read since */
+		spin_lock_irqsave(&(cache->lock), irqstate);
+		{
+			if (!(page->flags & PG_BUSY)) {
+				if (whole) {
+					page->flags |= PG_UPTODATE;
+				}
+
+				if (!(page->flags & PG_UPTODATE)) {
+					status = (page->error) ? page->error : -EIO;
+				}
+
+				idle = 1;
+			}
+		}
+		spin_unlock_irqrestore(&(cache->lock), irqstate);
+	}
+
+	return status;
+}
+
+static void
+cache_dirty(blk_page_t * page)
+{
+	struct blk_cache * cache = &(page->blkdev->cache);
+	unsigned long      irqstate;
+
+	spin_lock_irqsave(&(cache->lock), irqstate);
+	{
+		if (!(page->flags & PG_DIRTY)) {
+			page->flags |= PG_DIRTY;
+			radix_tree_tag_set(&(cache->pages), page->index, BLKCACHE_TAG_DIRTY);
+			cache->nr_dirty++;
+		}
+	}
+	spin_unlock_irqrestore(&(cache->lock), irqstate);
+}
+
+/**
+ * Writes back the cache's dirty pages. If sync is set, waits for them to
+ * reach the disk and returns the first writeback error since the last
+ * cache_sync().
+ */
+static int
+cache_writeback(blkdev_t * blkdev, 
+		int        sync)
+{
+	struct blk_cache * cache = &(blkdev->cache);
+	blk_page_t       * pages[BLKCACHE_BATCH];
+	unsigned long      index = 0;
+	unsigned long      irqstate;
+	unsigned int       n     = 0;
+	unsigned int       i     = 0;
+	int                pass  = 0;
+
+	/* A second pass picks up pages dirtied again while being written */
+	for (pass = 0; pass < 2; pass++) {
+		index = 0;
+
+		do {
+			spin_lock_irqsave(&(cache->lock), irqstate);
+			{
+				n = radix_tree_gang_lookup_tag(&(cache->pages), (void **)pages, 
+							       index, BLKCACHE_BATCH, 
+							       BLKCACHE_TAG_DIRTY);
+
+				for (i = 0; i < n; i++) {
+					blk_page_t * page = pages[i];
+
+					index = page->index + 1;
+
+					if (page->flags & PG_BUSY) {
+						pages[i] = NULL;
+						continue;
+					}
+
+					page->flags &= ~PG_DIRTY;
+					page->flags |=  PG_BUSY;
+					radix_tree_tag_clear(&(cache->pages), page->index, 
+							     BLKCACHE_TAG_DIRTY);
+
+					cache->nr_dirty--;
+					cache->nr_writeback++;
+					cache->writeback++;
+				}
+			}
+			spin_unlock_irqrestore(&(cache->lock), irqstate);
+
+			for (i = 0; i < n; i++) {
+				if (pages[i] != NULL) {
+					page_io_submit(pages[i], 1);
+				}
+			}
+		} while (n == BLKCACHE_BATCH);
+
+		blkdev_unplug(blkdev);
+
+		if (!sync) {
+			return 0;
+		}
+
+		wait_event(cache->waitq, (ACCESS_ONCE(cache->nr_writeback) == 0));
 
-typedef struct {
-	char name[32];
+		if (ACCESS_ONCE(cache->nr_dirty) == 0) {
+			break;
+		}
+	}
 
-	blkdev_ops_t * ops;
-	void * priv_data;
+	return ACCESS_ONCE(cache->wb_error);
+}
 
-	u64 sector_size;    /* Sector Size of the block device (in bytes)*/
-	u64 capacity;       /* Capacity of block device (in bytes) */
-	u32 max_dma_descs;  /* Maximum number of DMA descriptors per request */
-	u32 request_slots;  /* Maximum number of requests that can be issued simultaneously */
+/* Writes back the cache, reporting and clearing any writeback error */
+static int
+cache_sync(blkdev_t * blkdev)
+{
+	struct blk_cache * cache  = &(blkdev->cache);
+	int                status = 0;
+	unsigned long      irqstate;
 
-	spinlock_t lock;
+	cache_writeback(blkdev, 1);
 
-	struct inode *  dev_inode;
+	spin_lock_irqsave(&(cache->lock), irqstate);
+	{
+		status          = cache->wb_error;
+		cache->wb_error = 0;
+	}
+	spin_unlock_irqrestore(&(cache->lock), irqstate);
 
-	struct list_head blkdev_node;
+	return status;
+}
 
-} blkdev_t;
+/**
+ * Keeps the cache coherent with I/O that bypasses it: dirty pages are
+ * written back first, and pages a write covers are dropped. As with
+ * O_DIRECT on Linux, buffered I/O racing with it is not ordered.
+ */
+static void
+cache_invalidate(blkdev_t * blkdev, 
+		 u64        offset, 
+		 u64        len, 
+		 int        write)
+{
+	struct blk_cache * cache = &(blkdev->cache);
+	blk_page_t       * pages[BLKCACHE_BATCH];
+	unsigned long      index = offset >> PAGE_SHIFT;
+	unsigned long      last  = (offset + len - 1) >> PAGE_SHIFT;
+	unsigned long      irqstate;
+	unsigned int       n     = 0;
+	unsigned int       i     = 0;
+
+	if (cache->max_pages == 0) {
+		return;
+	}
+
+	if (ACCESS_ONCE(cache->nr_dirty) > 0) {
+		cache_writeback(blkdev, 1);
+	}
+
+	if (!write) {
+		return;
+	}
 
+	do {
+		spin_lock_irqsave(&(cache->lock), irqstate);
+		{
+			n = radix_tree_gang_lookup(&(cache->pages), (void **)pages, 
+						   index, BLKCACHE_BATCH);
 
+			for (i = 0; i < n; i++) {
+				blk_page_t * page = pages[i];
 
-static int 
-get_needed_desc_cnt(vaddr_t vaddr, size_t size) 
+				if (page->index > last) {
+					n = 0;
+					break;
+				}
+
+				index = page->index + 1;
+
+				if ((page->refs == 0) && !(page->flags & (PG_BUSY | PG_DIRTY))) {
+					radix_tree_delete(&(cache->pages), page->index);
+					list_move(&(page->lru), &(cache->free));
+				} else {
+					page->flags &= ~PG_UPTODATE;
+				}
+			}
+		}
+		spin_unlock_irqrestore(&(cache->lock), irqstate);
+	} while (n == BLKCACHE_BATCH);
+}
+
+/**
+ * Reads ahead the pages after last, up to the file's read-ahead window,
+ * skipping those an earlier read-ahead already took care of.
+ */
+static void
+cache_readahead(blkdev_t      * blkdev, 
+		blkdev_file_t * file, 
+		unsigned long   last)
+{
+	unsigned long end   = min(last + file->ra_pages, 
+				  (unsigned long)((blkdev->capacity - 1) >> PAGE_SHIFT));
+	unsigned long index = max(last + 1, file->ra_end);
+	blk_page_t  * page  = NULL;
+
+	for (; index <= end; index++) {
+		if ((page = cache_get(blkdev, index, CACHE_ADD)) == NULL) {
+			break;
+		}
+
+		cache_start_read(page, 1);
+		cache_put(page);
+	}
+
+	file->ra_end = index;
+}
+
+/**
+ * Reads through the page cache; any offset and length will do. Sequential
+ * reads double the read-ahead window, up to BLKCACHE_RA_MAX pages, and
+ * other reads close it.
+ */
+static ssize_t
+cache_read(struct file  * filp, 
+	   char __user  * ubuf, 
+	   size_t         size)
+{
+	blkdev_file_t * file   = filp->private_data;
+	blkdev_t      * blkdev = file->blkdev;
+	blk_page_t    * pages[BLKCACHE_BATCH];
+	u64             pos    = filp->pos;
+	size_t          done   = 0;
+	unsigned long   first  = 0;
+	unsigned long   last   = 0;
+	unsigned int    n      = 0;
+	unsigned int    i      = 0;
+	int             status = 0;
+
+	if (pos >= blkdev->capacity) {
+		return 0;
+	}
+
+	size = min((u64)size, blkdev->capacity - pos);
+
+	if (pos == file->ra_pos) {
+		file->ra_pages = min(max(file->ra_pages * 2, (u32)BLKCACHE_RA_MIN), 
+				     (u32)BLKCACHE_RA_MAX);
+	} else {
+		file->ra_pages = 0;
+		file->ra_end   = 0;
+	}
+
+	while ((done < size) && (status == 0)) {
+		first = (pos + done) >> PAGE_SHIFT;
+		last  = min((unsigned long)((pos + size - 1) >> PAGE_SHIFT), 
+			    first + BLKCACHE_BATCH - 1);
+
+		for (n = 0; first + n <= last; n++) {
+			if ((pages[n] = cache_get(blkdev, first + n, CACHE_RECLAIM)) == NULL) {
+				break;
+			}
+
+			cache_start_read(pages[n], 0);
+		}
+
+		if (n == 0) {
+			status = -ENOMEM;
+			break;
+		}
+
+		if (file->ra_pages > 0) {
+			cache_readahead(blkdev, file, first + n - 1);
+		}
+
+		blkdev_unplug(blkdev);
+
+		for (i = 0; i < n; i++) {
+			u64 start = (pos + done) & (PAGE_SIZE - 1);
+			u64 len   = min((u64)PAGE_SIZE - start, (u64)(size - done));
+
+			if (status == 0) {
+				status = cache_wait(pages[i], 0);
+			}
+
+			if ((status == 0) && 
+			    copy_to_user(ubuf + done, page_data(pages[i]) + start, len)) {
+				status = -EFAULT;
+			}
+
+			if (status == 0) {
+				done += len;
+			}
+
+			cache_put(pages[i]);
+		}
+	}
+
+	filp->pos   += done;
+	file->ra_pos = filp->pos;
+
+	return (done > 0) ? done : status;
+}
+
+/**
+ * Writes through the page cache; any offset and length will do. Pages only
+ * partly written are read in first. Writeback starts once a quarter of
+ * the cache is dirty, or when the file is synced or closed.
+ */
+static ssize_t
+cache_write(struct file        * filp, 
+	    const char __user  * ubuf, 
+	    size_t               size)
 {
-	vaddr_t vaddr_iter = vaddr;
-	int cnt            = 0;
+	blkdev_file_t    * file   = filp->private_data;
+	blkdev_t         * blkdev = file->blkdev;
+	struct blk_cache * cache  = &(blkdev->cache);
+	blk_page_t       * pages[BLKCACHE_BATCH];
+	u64                pos    = filp->pos;
+	size_t             done   = 0;
+	unsigned long      first  = 0;
+	unsigned long      last   = 0;
+	unsigned int       n      = 0;
+	unsigned int       i      = 0;
+	int                status = 0;
+
+	if (size == 0) {
+		return 0;
+	}
+
+	if (pos >= blkdev->capacity) {
+		return -ENOSPC;
+	}
+
+	size = min((u64)size, blkdev->capacity - pos);
+
+	while ((done < size) && (status == 0)) {
+		u64 start = (pos + done) & (PAGE_SIZE - 1);
+		u64 len   = 0;
+
+		first = (pos + done) >> PAGE_SHIFT;
+		last  = min((unsigned long)((pos + size - 1) >> PAGE_SHIFT), 
+			    first + BLKCACHE_BATCH - 1);
+
+		for (n = 0; first + n <= last; n++) {
+			if ((pages[n] = cache_get(blkdev, first + n, CACHE_RECLAIM)) == NULL) {
+				break;
+			}
+		}
+
+		if (n == 0) {
+			status = -ENOMEM;
+			break;
+		}
+
+		/* Only the first and last pages can be partly written */
+		if (start != 0) {
+			cache_start_read(pages[0], 0);
+		}
+
+		if (((pos + size) & (PAGE_SIZE - 1)) && (first + n - 1 == last) &&
+		    (((pos + size) >> PAGE_SHIFT) == last)) {
+			cache_start_read(pages[n - 1], 0);
+		}
+
+		blkdev_unplug(blkdev);
+
+		for (i = 0; i < n; i++) {
+			blk_page_t * page = pages[i];
+
+			start = (pos + done) & (PAGE_SIZE - 1);
+			len   = min((u64)PAGE_SIZE - start, (u64)(size - done));
+
+			if (status == 0) {
+				status = cache_wait(page, 
+						    (start == 0) && 
+						    (len == page_len(blkdev, page->index)));
+			}
 
-	while (vaddr_iter <= (vaddr + size)) {
-		aspace_mapping_t mapping;
-		memset(&mapping, 0, sizeof(aspace_mapping_t));
+			if ((status == 0) && 
+			    copy_from_user(page_data(page) + start, ubuf + done, len)) {
+				status = -EFAULT;
+			}
+
+			if (status == 0) {
+				cache_dirty(page);
+				done += len;
+			}
 
-		
-		if (aspace_lookup_mapping(MY_ID, vaddr_iter, &mapping) != 0) {
-			printk(KERN_ERR "Invalid user address in blkdev read request\n");
- 			return -1;
+			cache_put(page);
 		}
-		
-		vaddr_iter = mapping.end;
+	}
 
-		cnt++;
+	if (done > 0) {
+		file->dirtied = true;
 	}
-	
-	return cnt;
+
+	filp->pos += done;
+
+	if (ACCESS_ONCE(cache->nr_dirty) > (cache->max_pages / 4)) {
+		cache_writeback(blkdev, 0);
+	}
+
+	return (done > 0) ? done : status;
 }
 
 
 static ssize_t
 __send_blk_req(struct file * filp, vaddr_t ubuf, size_t size, int is_write) 
 {
-	loff_t offset      = filp->pos;
-	blkdev_t  * blkdev = filp->private_data;
-	blk_req_t * blkreq = NULL;
-	vaddr_t tmp_vaddr  = (vaddr_t)ubuf;
-	size_t tmp_size    = size;
-	int status         = 0;
-	int ret            = 0;
-	int i              = 0;
+	loff_t          offset = filp->pos;
+	blkdev_file_t * file   = filp->private_data;
+	blkdev_t      * blkdev = file->blkdev;
+	blk_batch_t     batch;
+	struct list_head ios;
+	int status             = 0;
 
 	// We only support block operations at the sector size granularity
 	if (((uintptr_t)ubuf % blkdev->sector_size) || 
@@ -91,69 +1391,32 @@ __send_blk_req(struct file * filp, vaddr_t ubuf, size_t size, int is_write)
 	{
 		return -EINVAL;
 	}
-	
-		
-	blkreq = kmem_alloc(sizeof(blk_req_t));
-	blkreq->total_len = size;
-	blkreq->offset    = offset;
-	blkreq->write     = is_write;
-
-	blkreq->desc_cnt  = get_needed_desc_cnt(tmp_vaddr, size);
-	blkreq->dma_descs = kmem_alloc(sizeof(blk_dma_desc_t) * blkreq->desc_cnt);
-
-	for (i = 0; i < blkreq->desc_cnt; i++) {
-		aspace_mapping_t mapping;
-		u32 desc_len = 0;
 
-		memset(&mapping, 0, sizeof(aspace_mapping_t));
-
-		aspace_lookup_mapping(MY_ID, tmp_vaddr, &mapping);
-		
-		desc_len = (mapping.end - tmp_vaddr) < tmp_size ? 
-			   (mapping.end - tmp_vaddr) : tmp_size;
-
-		blkreq->dma_descs[i].buf_paddr = mapping.paddr + (tmp_vaddr - mapping.start);
-		blkreq->dma_descs[i].length    = desc_len;
-
-		tmp_vaddr += desc_len;
-		tmp_size  -= desc_len;
+	if (size == 0) {
+		return 0;
 	}
-	
-	waitq_init(&(blkreq->user_waitq));
 
-	blkreq->complete = 0;
-
-	ret = blkdev->ops->handle_blkreq(blkreq, blkdev->priv_data);
-	
-	/* Failed to issue block request 
-	 * This might be due to unavailable request slots
-	 */
-	if (ret != 0) {
-		kmem_free(blkreq->dma_descs);
-		kmem_free(blkreq);
-		return ret;
+	if (offset + size > blkdev->capacity) {
+		return -EINVAL;
 	}
 
+	batch_init(&batch);
+	INIT_LIST_HEAD(&ios);
 
+	status = map_user_ios(blkdev, &batch, ubuf, size, offset, is_write, &ios);
 
-	/*	while (blkreq->complete == 0) {
-		mdelay(100);
-		blkdev->ops->dump_state(blkdev->priv_data);
+	if (status != 0) {
+		return status;
 	}
-	*/
-
-	wait_event_interruptible(blkreq->user_waitq,
-				 (blkreq->complete != 0));
 
+	submit_ios(blkdev, &ios);
+	blkdev_unplug(blkdev);
 
 	/** 
-	 * At this point blkreq has returned, and the status field records sucess or failure
+	 * At this point every I/O has returned, and the status records sucess or failure
 	 * Success (status = 0), Failure (status = error code) 
 	 */
-	status = blkreq->status;
-
-	kmem_free(blkreq->dma_descs);
-	kmem_free(blkreq);
+	status = batch_wait(&batch);
 
 	if (status == 0) {
 	    filp->pos += size;
@@ -167,6 +1430,12 @@ __send_blk_req(struct file * filp, vaddr_t ubuf, size_t size, int is_write)
 static ssize_t 
 blkdev_write(struct file * filp, const char __user * ubuf, size_t size, loff_t * off)
 {
+	blkdev_file_t * file = filp->private_data;
+
+	if (file->blkdev->cache.max_pages > 0) {
+		return cache_write(filp, ubuf, size);
+	}
+
 	return __send_blk_req(filp, (vaddr_t)ubuf, size, 1);
 }
 
@@ -174,24 +1443,30 @@ blkdev_write(struct file * filp, const char __user * ubuf, size_t size, loff_t *
 static ssize_t 
 blkdev_read(struct file * filp, char __user * ubuf, size_t size, loff_t * off) 
 {
+	blkdev_file_t * file = filp->private_data;
+
+	if (file->blkdev->cache.max_pages > 0) {
+		return cache_read(filp, ubuf, size);
+	}
+
 	return __send_blk_req(filp, (vaddr_t)ubuf, size, 0);
 }
 
 /**
  * The only difference from the standard lseek is that we require aligned offsets 
- * that match the blkdev's sector size 
+ * that match the blkdev's sector size, unless the page cache is enabled
  */
 static off_t
 blkdev_lseek(struct file * filp,
 	     off_t         offset,
 	     int           whence) 
 {
-	blkdev_t * blkdev = filp->private_data;
+	blkdev_t * blkdev = ((blkdev_file_t *)filp->private_data)->blkdev;
         loff_t new_offset = 0;
         int rv = 0;
 	
 
-	if (offset % blkdev->sector_size) {
+	if ((blkdev->cache.max_pages == 0) && (offset % blkdev->sector_size)) {
 		return -EINVAL;
 	}
 
@@ -242,19 +1517,195 @@ static int
 blkdev_open(struct inode * inodep, 
 	    struct file  * filp) 
 {
-	blkdev_t * blkdev   = inodep->priv;
-	
-	filp->private_data = blkdev;
+	blkdev_file_t * file = kmem_alloc(sizeof(blkdev_file_t));
+
+	if (file == NULL) {
+		return -ENOMEM;
+	}
+
+	file->blkdev = inodep->priv;
+	spin_lock_init(&(file->lock));
+	INIT_LIST_HEAD(&(file->events));
+	waitq_init(&(file->waitq));
+
+	filp->private_data = file;
 
         return 0;
 }
 
+/**
+ * Data written through the cache is written back before the file goes.
+ * Asynchronous iocbs still queued free the file when they complete.
+ */
 static int 
 blkdev_close(struct file * filp) 
 {
-//	blkdev_t * blkdev = filp->private_data;
+	blkdev_file_t * file  = filp->private_data;
+	blk_batch_t   * batch = NULL;
+	blk_batch_t   * tmp   = NULL;
+	int             free  = 0;
+	int             ret   = 0;
+	unsigned long   irqstate;
 
-        return 0;
+	if (file->dirtied) {
+		ret = cache_sync(file->blkdev);
+	}
+
+	spin_lock_irqsave(&(file->lock), irqstate);
+	{
+		list_for_each_entry_safe(batch, tmp, &(file->events), node) {
+			list_del(&(batch->node));
+			kmem_free(batch);
+		}
+
+		file->nr_events = 0;
+		file->closed    = true;
+		free            = (file->inflight == 0);
+	}
+	spin_unlock_irqrestore(&(file->lock), irqstate);
+
+	if (free) {
+		kmem_free(file);
+	}
+
+        return ret;
+}
+
+static int
+blkdev_io_submit(blkdev_file_t                  * file, 
+		 struct blkdev_io_submit __user * uarg)
+{
+	blkdev_t                * blkdev = file->blkdev;
+	struct blkdev_io_submit   args;
+	struct blkdev_iocb        iocb;
+	struct list_head          ios;
+	blk_batch_t             * batch  = NULL;
+	unsigned long             irqstate;
+	u64 i      = 0;
+	int status = 0;
+
+	if (copy_from_user(&args, uarg, sizeof(args))) {
+		return -EFAULT;
+	}
+
+	INIT_LIST_HEAD(&ios);
+
+	for (i = 0; i < args.nr; i++) {
+		struct blkdev_iocb __user * uiocb = 
+			(struct blkdev_iocb __user *)args.iocbs + i;
+
+		if (copy_from_user(&iocb, uiocb, sizeof(iocb))) {
+			status = -EFAULT;
+			break;
+		}
+
+		if ((iocb.len == 0)                         ||
+		    (iocb.buf    % blkdev->sector_size)     ||
+		    (iocb.offset % blkdev->sector_size)     ||
+		    (iocb.len    % blkdev->sector_size)     ||
+		    (iocb.offset + iocb.len > blkdev->capacity)) {
+			status = -EINVAL;
+			break;
+		}
+
+		if ((batch = kmem_alloc(sizeof(blk_batch_t))) == NULL) {
+			status = -ENOMEM;
+			break;
+		}
+
+		batch->file      = file;
+		batch->user_data = iocb.user_data;
+		batch->len       = iocb.len;
+
+		cache_invalidate(blkdev, iocb.offset, iocb.len, (iocb.write != 0));
+
+		status = map_user_ios(blkdev, batch, iocb.buf, iocb.len, 
+				      iocb.offset, (iocb.write != 0), &ios);
+
+		if (status != 0) {
+			kmem_free(batch);
+			break;
+		}
+
+		spin_lock_irqsave(&(file->lock), irqstate);
+		{
+			file->inflight++;
+		}
+		spin_unlock_irqrestore(&(file->lock), irqstate);
+
+		submit_ios(blkdev, &ios);
+	}
+
+	blkdev_unplug(blkdev);
+
+	return (i > 0) ? i : status;
+}
+
+static int
+blkdev_io_getevents(blkdev_file_t                     * file, 
+		    struct blkdev_io_getevents __user * uarg)
+{
+	struct blkdev_io_getevents   args;
+	struct blkdev_io_event       event;
+	blk_batch_t                * batch = NULL;
+	unsigned long                irqstate;
+	u64 i      = 0;
+	int status = 0;
+
+	if (copy_from_user(&args, uarg, sizeof(args))) {
+		return -EFAULT;
+	}
+
+	if (args.min_nr > args.nr) {
+		return -EINVAL;
+	}
+
+	status = wait_event_interruptible(file->waitq, 
+					  (ACCESS_ONCE(file->nr_events) >= args.min_nr));
+
+	if (status != 0) {
+		return status;
+	}
+
+	for (i = 0; i < args.nr; i++) {
+		struct blkdev_io_event __user * uevent = 
+			(struct blkdev_io_event __user *)args.events + i;
+
+		spin_lock_irqsave(&(file->lock), irqstate);
+		{
+			batch = NULL;
+
+			if (!list_empty(&(file->events))) {
+				batch = list_first_entry(&(file->events), blk_batch_t, node);
+				list_del(&(batch->node));
+				file->nr_events--;
+			}
+		}
+		spin_unlock_irqrestore(&(file->lock), irqstate);
+
+		if (batch == NULL) {
+			break;
+		}
+
+		event.user_data = batch->user_data;
+		event.res       = (batch->status) ? batch->status : (s64)batch->len;
+
+		if (copy_to_user(uevent, &event, sizeof(event))) {
+			/* Leave it for the next call */
+			spin_lock_irqsave(&(file->lock), irqstate);
+			{
+				list_add(&(batch->node), &(file->events));
+				file->nr_events++;
+			}
+			spin_unlock_irqrestore(&(file->lock), irqstate);
+
+			return (i > 0) ? i : -EFAULT;
+		}
+
+		kmem_free(batch);
+	}
+
+	return i;
 }
 
 static long 
@@ -262,24 +1713,72 @@ blkdev_ioctl(struct file  * filp,
 	     unsigned int   ioctl, 
 	     unsigned long  arg)
 {
-
-    return 0;
+	switch (ioctl) {
+		case BLKDEV_IOC_SUBMIT:
+			return blkdev_io_submit(filp->private_data, 
+						(struct blkdev_io_submit __user *)arg);
+		case BLKDEV_IOC_GETEVENTS:
+			return blkdev_io_getevents(filp->private_data, 
+						   (struct blkdev_io_getevents __user *)arg);
+		case BLKDEV_IOC_SYNC:
+			return cache_sync(((blkdev_file_t *)filp->private_data)->blkdev);
+		default:
+			return -ENOTTY;
+	}
 }
 
 /** 
  * Called when the driver has completed the block request
  * On success: status = 0
  * On failure: status = error code
+ *
+ * May be called from interrupt context, but not from within the driver's
+ * handle_blkreq(). Drivers should free the slot the request used first,
+ * so the next request can go out straight away.
  */
 int 
 blk_req_complete(blk_req_t * blkreq, 
 		 int         status) 
 {
+	blk_rq_t * rq     = NULL;
+	blkdev_t * blkdev = NULL;
+	blk_io_t * io     = NULL;
+	struct list_head done;
+	unsigned long irqstate;
+
+	if (!blkreq->async) {
+		blkreq->complete = 1;
+		blkreq->status   = status;
+    
+		waitq_wakeup(&(blkreq->user_waitq));
+
+		return 0;
+	}
+
+	rq     = container_of(blkreq, blk_rq_t, req);
+	blkdev = rq->blkdev;
 
 	blkreq->complete = 1;
 	blkreq->status   = status;
-    
-	waitq_wakeup(&(blkreq->user_waitq));
+
+	INIT_LIST_HEAD(&done);
+
+	list_for_each_entry(io, &(rq->ios), node) {
+		io->status = status;
+	}
+
+	list_splice_init(&(rq->ios), &done);
+
+	spin_lock_irqsave(&(blkdev->lock), irqstate);
+	{
+		blkdev->inflight--;
+		list_add(&(rq->node), &(blkdev->free_rqs));
+
+		run_queue(blkdev, &done);
+	}
+	spin_unlock_irqrestore(&(blkdev->lock), irqstate);
+
+	finish_ios(&done);
 
 	return 0;
 }
@@ -301,7 +1800,9 @@ blkdev_do_request(blkdev_handle_t   blkdev_handle,
 		  blk_req_t       * request)
 {
     
-        blkdev_t * blkdev = (blkdev_t *)blkdev_handle;
+        blkdev_t  * blkdev = (blkdev_t *)blkdev_handle;
+	blk_io_t  * io     = NULL;
+	blk_batch_t batch;
 	u32 total_len     = 0;
 	int ret           = 0;
 	int i             = 0;
@@ -340,37 +1841,42 @@ blkdev_do_request(blkdev_handle_t   blkdev_handle,
 	}
 
 	/* Check that the iov list is not larger than max supported size */
-	if (request->desc_cnt > blkdev->max_dma_descs) {
+	if (request->desc_cnt > blkdev->max_rq_descs) {
 		printk(KERN_ERR "BLKDEV: DMA Descriptor List is too long\n");
 		printk(KERN_ERR "BLKDEV:\tMAX descriptors=%u, Descriptor Count=%u\n", 
-		       blkdev->max_dma_descs, request->desc_cnt);
+		       blkdev->max_rq_descs, request->desc_cnt);
 		return -EINVAL;
 	}
 	
+	if ((io = blkdev_alloc_io()) == NULL) {
+		return -ENOMEM;
+	}
+
+	batch_init(&batch);
+	batch.pending = 1;
 
-	waitq_init(&(request->user_waitq));
+	io->offset    = request->offset;
+	io->len       = request->total_len;
+	io->write     = request->write;
+	io->desc_cnt  = request->desc_cnt;
+	io->dma_descs = request->dma_descs;
+	io->done      = batch_io_done;
+	io->priv      = &batch;
 
 	request->complete = 0;
 
-	ret = blkdev->ops->handle_blkreq(request, blkdev->priv_data);
+	ret = blkdev_submit_io(blkdev, io);
 	
-	/* Failed to issue block request 
-	 * This might be due to unavailable request slots
-	 */
 	if (ret != 0) {
-		printk(KERN_ERR "BLKDEV: Error handling block request in block driver\n");
+		printk(KERN_ERR "BLKDEV: Error queueing block request\n");
+		blkdev_free_io(io);
 		return ret;
 	}
 
-	/*
-	while (request->complete == 0) {
-		mdelay(100);
-		blkdev->ops->dump_state(blkdev->priv_data);
-	}
-	*/
+	blkdev_unplug(blkdev);
 
-	wait_event_interruptible(request->user_waitq,
-				 (request->complete != 0));
+	request->status   = batch_wait(&batch);
+	request->complete = 1;
 
 	return request->status;
 }
@@ -406,6 +1912,60 @@ get_blkdev(char * name)
 }
 
 
+static int
+blkdev_init_queues(blkdev_t * blkdev)
+{
+	blk_dma_desc_t * descs = NULL;
+	u32 i = 0;
+
+	blkdev->max_rq_descs = min(blkdev->max_dma_descs, (u32)BLK_RQ_MAX_DESCS);
+
+	blkdev->cpu_queues = kmem_alloc(sizeof(struct blk_cpu_queue) * NR_CPUS);
+	blkdev->rqs        = kmem_alloc(sizeof(blk_rq_t) * blkdev->request_slots);
+	descs              = kmem_alloc(sizeof(blk_dma_desc_t) * 
+					blkdev->max_rq_descs * blkdev->request_slots);
+
+	if ((blkdev->cpu_queues == NULL) || (blkdev->rqs == NULL) || (descs == NULL)) {
+		if (blkdev->cpu_queues) kmem_free(blkdev->cpu_queues);
+		if (blkdev->rqs)        kmem_free(blkdev->rqs);
+		if (descs)              kmem_free(descs);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < NR_CPUS; i++) {
+		spin_lock_init(&(blkdev->cpu_queues[i].lock));
+		INIT_LIST_HEAD(&(blkdev->cpu_queues[i].ios));
+	}
+
+	INIT_LIST_HEAD(&(blkdev->dispatch));
+	INIT_LIST_HEAD(&(blkdev->free_rqs));
+
+	/* Pages are taken from pmem as the cache fills */
+	spin_lock_init(&(blkdev->cache.lock));
+	INIT_RADIX_TREE(&(blkdev->cache.pages), 0);
+	INIT_LIST_HEAD(&(blkdev->cache.lru));
+	INIT_LIST_HEAD(&(blkdev->cache.free));
+	waitq_init(&(blkdev->cache.waitq));
+
+	if (blkcache_mb > 0) {
+		blkdev->cache.max_pages = max((u64)blkcache_mb << (20 - PAGE_SHIFT), 
+					      (u64)BLKCACHE_BATCH);
+	}
+
+	for (i = 0; i < blkdev->request_slots; i++) {
+		blk_rq_t * rq = &(blkdev->rqs[i]);
+
+		rq->blkdev = blkdev;
+		rq->descs  = &(descs[i * blkdev->max_rq_descs]);
+		INIT_LIST_HEAD(&(rq->ios));
+		waitq_init(&(rq->req.user_waitq));
+
+		list_add_tail(&(rq->node), &(blkdev->free_rqs));
+	}
+
+	return 0;
+}
+
 int 
 blkdev_register(char         * name, 
 		blkdev_ops_t * blkdev_ops, 
@@ -437,6 +1997,12 @@ blkdev_register(char         * name,
 
 	spin_lock_init(&(blkdev->lock));
 
+	if (blkdev_init_queues(blkdev) != 0) {
+		printk(KERN_ERR "Failed to allocate request queues for blkdev '%s'\n", name);
+		kmem_free(blkdev);
+		return -1;
+	}
+
 	printk("Registering Block Device (%s) [Sect. Size=%llu, capacity=%lluGB]\n", 
 	       blkdev->name, blkdev->sector_size, blkdev->capacity / (1024 * 1024 * 1024));
 
@@ -459,6 +2025,40 @@ blkdev_register(char         * name,
 }
 
 
+/**
+ * Reports each block device's queue statistics in /proc/blkstat, one line
+ * per device:
+ *
+ *     <name> <ios> <merged> <requests> <inflight> <max_inflight> <depth_sum>
+ *            <cache_hits> <cache_misses> <readahead> <writeback>
+ *
+ * depth_sum / requests is the average number of requests outstanding when
+ * one was issued, merged / ios the share of I/Os that rode along in
+ * another's request. The last four count pages.
+ */
+static int
+blkdev_proc_stats(struct file * file, void * priv_data)
+{
+	blkdev_t * blkdev = NULL;
+
+	/* Devices are never unregistered */
+	list_for_each_entry(blkdev, &blkdev_list, blkdev_node) {
+		proc_sprintf(file, "%s %llu %llu %llu %u %u %llu %llu %llu %llu %llu\n", 
+			     blkdev->name,
+			     (unsigned long long)blkdev->nr_ios,
+			     (unsigned long long)blkdev->nr_merged,
+			     (unsigned long long)blkdev->nr_requests,
+			     blkdev->inflight,
+			     blkdev->max_inflight,
+			     (unsigned long long)blkdev->depth_sum,
+			     (unsigned long long)blkdev->cache.hits,
+			     (unsigned long long)blkdev->cache.misses,
+			     (unsigned long long)blkdev->cache.readahead,
+			     (unsigned long long)blkdev->cache.writeback);
+	}
+
+	return 0;
+}
 
 
 /**
@@ -473,11 +2073,16 @@ blkdev_init(void)
 
 	INIT_LIST_HEAD(&(blkdev_list));
 	spin_lock_init(&(blkdev_lock));
+
+	INIT_LIST_HEAD(&(io_pool));
+	spin_lock_init(&(io_pool_lock));
        
 	blkdev_root = kfs_mkdir("/dev/block", 0777);
 
+	proc_mkdir("/proc");
+	create_proc_file("/proc/blkstat", blkdev_proc_stats, NULL);
+
 	driver_init_list("block", blkdev_str);
 
 	return;
 }
-
@@ -1,9 +1,16 @@
 #include <lwk/kernel.h>
 #include <lwk/cpuinfo.h>
+#include <lwk/topology.h>
 
 
 DEFINE_PER_CPU_READ_MOSTLY(int, numa_node);
 
+/**
+ * NUMA node distance table, in ACPI SLIT units.
+ * Zero entries have not been reported by the firmware.
+ */
+static uint8_t numa_distance[MAX_NUMNODES][MAX_NUMNODES];
+
 /**
  * Info structure for each CPU in the system.
  * Array is indexed by logical CPU ID.
@@ -39,3 +46,30 @@ void print_cpuinfo(struct cpuinfo *c)
 	print_arch_cpuinfo(c);
 }
 
+
+/**
+ * Records the distance between two NUMA nodes, as reported by the firmware.
+ */
+void numa_set_distance(int from, int to, int distance)
+{
+	if ((from < 0) || (from >= MAX_NUMNODES) ||
+	    (to < 0)   || (to >= MAX_NUMNODES)   ||
+	    (distance <= 0) || (distance > 0xff))
+		return;
+
+	numa_distance[from][to] = distance;
+}
+
+/**
+ * Returns the distance between two NUMA nodes. Falls back to the default
+ * local/remote distances if the firmware did not provide a distance table.
+ */
+int __node_distance(int from, int to)
+{
+	if ((from >= 0) && (from < MAX_NUMNODES) &&
+	    (to >= 0)   && (to < MAX_NUMNODES)   &&
+	    numa_distance[from][to])
+		return numa_distance[from][to];
+
+	return (from == to) ? LOCAL_DISTANCE : REMOTE_DISTANCE;
+}
@@ -559,6 +559,9 @@ static void gdb_stop_or_resume_single_task(struct task_struct *task, int req_typ
 			//printk("GDB: Resume from %p TF=%lu\n", (void *) regs->rip, regs->eflags & TF_MASK);
 			set_task_state(task, task->ptrace >> 1);
 			task->ptrace = 0;
+			/* Put it back on its CPU's run list */
+			if (task->state == TASK_RUNNING)
+				sched_wakeup_task(task, TASK_RUNNING);
 			//printk("GDB: Task(pid=%d, tid=%d) resume with task->state=%d", task->aspace->id, task->id, task->state); 
 		}   
 	}
@@ -381,7 +381,7 @@ int mk_gdb_fifo(const char *gdb_cons){
 void rm_gdb_fifo(struct file *filep){ 
 	struct inode *inode = filep->inode;
 	inode->i_op->unlink(inode);
-	htable_del(inode->parent->files, inode);
+	kfs_del_dirent(inode);
 	atomic_set(&inode->i_count, 0);
 	kfs_destroy(inode);
 	kmem_free(filep); 
@@ -7,148 +7,288 @@
 #include <lwk/spinlock.h>
 #include <lwk/xpmem/xpmem.h>
 #include <lwk/smp.h>
+#include <lwk/percpu.h>
 
 #include <arch/vsyscall.h>
 #include <arch/atomic.h>
 #include <arch/bug.h>
 #include <arch-generic/fcntl.h>
 
+/* Must be a power of 2 */
 #define MAX_OUTSTANDING_SYSCALLS 128
 
 extern struct hio_implementation hio_impl;
 
 static atomic_t hio_calls_pending = ATOMIC_INIT(0);
 
+/* Number of HIO stub threads polling for new system calls */
+static atomic_t hio_pollers = ATOMIC_INIT(0);
+
 typedef enum {
 	HIO_IDLE,
 	HIO_PENDING,
 	HIO_PROCESSING,
+	HIO_RETURNING,
 	HIO_COMPLETE,
+	HIO_CANCELED,
 } hio_syscall_state_t;
 
+/*
+ * A request's state is kept together with its uniq_id in one word, so a
+ * request is only ever moved between states by whoever holds the uniq_id it
+ * was issued with. A stale uniq_id, e.g. returned late by the HIO stub, can
+ * then never affect a later request that reuses the slot.
+ */
+#define HIO_STATE_BITS		3
+#define HIO_STATE(id, state)	((int)(((id) << HIO_STATE_BITS) | (state)))
+#define HIO_SLOT(id)		((id) % MAX_OUTSTANDING_SYSCALLS)
+
 typedef struct {
-	hio_syscall_state_t state;
+	atomic_t	    state;
+	uint32_t	    uniq_id;	/* Of the last request in this slot */
 	hio_syscall_t     * syscall;
+	void		 (* complete)(hio_syscall_t *);	/* NULL if waited on */
 	waitq_t		    waitq;
 } hio_syscall_request_t;
 
+/*
+ * Bounded multi-producer, multi-consumer queue of request slot numbers.
+ *
+ * Each entry's seq tells its state relative to the lap of the ring the
+ * entry's position belongs to: 2*lap means free, 2*lap+1 means it holds a
+ * slot number. A zeroed ring is therefore empty. As there are only
+ * MAX_OUTSTANDING_SYSCALLS slots, a ring never fills up.
+ */
 typedef struct {
-	hio_syscall_request_t entries[MAX_OUTSTANDING_SYSCALLS];
-	spinlock_t            lock;
-	uint32_t	      offset;
-} hio_syscalls_t;
+	struct {
+		unsigned long seq;
+		uint32_t      slot;
+	} entries[MAX_OUTSTANDING_SYSCALLS];
+	unsigned long	      tail;	/* Next position to fill */
+	unsigned long	      head;	/* Next position to take */
+} hio_ring_t;
+
+#define HIO_LAP(pos)	(2 * ((pos) / MAX_OUTSTANDING_SYSCALLS))
+
+static hio_syscall_request_t syscall_slots[MAX_OUTSTANDING_SYSCALLS];
+
+/* Slots that are not in use */
+static hio_ring_t free_ring;
 
-static hio_syscalls_t syscall_ring;
+/* Requests waiting for the HIO stub, queued on the CPU they were issued on */
+static DEFINE_PER_CPU(hio_ring_t, submit_ring);
+
+/* CPU whose submit_ring the HIO stub looks at first */
+static unsigned int submit_cursor;
+
+
+static void
+ring_put(hio_ring_t * ring, uint32_t slot)
+{
+	unsigned long pos, seq;
+
+	for (;;) {
+		pos = ACCESS_ONCE(ring->tail);
+		seq = ACCESS_ONCE(ring->entries[pos % MAX_OUTSTANDING_SYSCALLS].seq);
+
+		if (seq == HIO_LAP(pos)) {
+			if (cmpxchg(&ring->tail, pos, pos + 1) == pos)
+				break;
+		} else if ((long)(seq - HIO_LAP(pos)) < 0) {
+			/* A consumer is still taking the entry, wait for it */
+			cpu_relax();
+		}
+	}
 
+	ring->entries[pos % MAX_OUTSTANDING_SYSCALLS].slot = slot;
+	wmb();
+	ring->entries[pos % MAX_OUTSTANDING_SYSCALLS].seq = HIO_LAP(pos) + 1;
+}
 
-static inline uint32_t
-next_offset(uint32_t off)
+static int
+ring_get(hio_ring_t * ring, uint32_t * slot)
 {
-	return (off + 1) % MAX_OUTSTANDING_SYSCALLS;
+	unsigned long pos, seq;
+
+	for (;;) {
+		pos = ACCESS_ONCE(ring->head);
+		seq = ACCESS_ONCE(ring->entries[pos % MAX_OUTSTANDING_SYSCALLS].seq);
+
+		if (seq == HIO_LAP(pos) + 1) {
+			if (cmpxchg(&ring->head, pos, pos + 1) == pos)
+				break;
+		} else if ((long)(seq - (HIO_LAP(pos) + 1)) < 0) {
+			/* Empty, or a producer has not filled the entry yet */
+			return -ENOENT;
+		}
+	}
+
+	rmb();
+	*slot = ring->entries[pos % MAX_OUTSTANDING_SYSCALLS].slot;
+	mb();
+	ring->entries[pos % MAX_OUTSTANDING_SYSCALLS].seq = HIO_LAP(pos) + 2;
+	return 0;
 }
 
-static inline uint32_t
-prev_offset(uint32_t off)
+static void
+release_syscall(hio_syscall_request_t * entry)
 {
-	return (off == 0) ? MAX_OUTSTANDING_SYSCALLS - 1 : off - 1;
+	atomic_set(&(entry->state), HIO_STATE(entry->uniq_id, HIO_IDLE));
+	ring_put(&free_ring, HIO_SLOT(entry->uniq_id));
 }
 
 static int
-enqueue_syscall(hio_syscall_t * syscall)
+enqueue_syscall(hio_syscall_t * syscall,
+		void         (* complete)(hio_syscall_t *))
 {
-	unsigned long flags = 0;
-	int start, ret = -EBUSY;
-
-	spin_lock_irqsave(&(syscall_ring.lock), flags);
-
-	start = syscall_ring.offset;
-	do {
-		hio_syscall_request_t * entry = &(syscall_ring.entries[syscall_ring.offset]);
-
-		if (entry->state == HIO_IDLE) {
-			entry->state     = HIO_PENDING;
-			entry->syscall   = syscall;
-			syscall->uniq_id = syscall_ring.offset;
-			ret              = 0;
-			atomic_inc(&hio_calls_pending);
-			break;
-		}
+	hio_syscall_request_t * entry;
+	uint32_t slot;
+
+	if (ring_get(&free_ring, &slot))
+		return -EBUSY;
 
-		syscall_ring.offset = next_offset(syscall_ring.offset);
-	} while (syscall_ring.offset != start);
+	entry            = &(syscall_slots[slot]);
+	entry->uniq_id  += MAX_OUTSTANDING_SYSCALLS;
+	entry->syscall   = syscall;
+	entry->complete  = complete;
+	syscall->uniq_id = entry->uniq_id;
+	wmb();
+	atomic_set(&(entry->state), HIO_STATE(entry->uniq_id, HIO_PENDING));
 
-	spin_unlock_irqrestore(&(syscall_ring.lock), flags);
+	ring_put(&per_cpu(submit_ring, this_cpu), slot);
+	atomic_inc(&hio_calls_pending);
 
-	return ret;
+	return 0;
 }
 
 static int
 dequeue_syscall(hio_syscall_t ** syscall)
 {
-	unsigned long flags = 0;
-	int start, ret = -ENOENT;
-
-	spin_lock_irqsave(&(syscall_ring.lock), flags);
-
-	start = syscall_ring.offset;
-	do {
-		hio_syscall_request_t * entry = &(syscall_ring.entries[syscall_ring.offset]);
-		if (entry->state == HIO_PENDING) {
-			entry->state   = HIO_PROCESSING;
-			*syscall       = entry->syscall;
-			ret            = 0;
-			atomic_dec(&hio_calls_pending);
-			break;
+	hio_syscall_request_t * entry;
+	unsigned int cpu, i;
+	uint32_t slot;
+
+	while (atomic_read(&hio_calls_pending) > 0) {
+		cpu = ACCESS_ONCE(submit_cursor);
+
+		for (i = 0; i < NR_CPUS; i++, cpu = (cpu + 1) % NR_CPUS) {
+			if (cpu_online(cpu) &&
+			    !ring_get(&per_cpu(submit_ring, cpu), &slot))
+				break;
+		}
+		if (i == NR_CPUS)
+			return -ENOENT;
+
+		/* Start with the next CPU next time, to be fair */
+		submit_cursor = (cpu + 1) % NR_CPUS;
+		atomic_dec(&hio_calls_pending);
+
+		entry = &(syscall_slots[slot]);
+		if (atomic_cmpxchg(&(entry->state),
+		                   HIO_STATE(entry->uniq_id, HIO_PENDING),
+		                   HIO_STATE(entry->uniq_id, HIO_PROCESSING))
+		    == HIO_STATE(entry->uniq_id, HIO_PENDING)) {
+			*syscall = entry->syscall;
+			return 0;
 		}
-		syscall_ring.offset = prev_offset(syscall_ring.offset);
-	} while (syscall_ring.offset != start);
 
-	spin_unlock_irqrestore(&(syscall_ring.lock), flags);
-	
-	return ret;
+		/* The issuer gave up on it while it was queued */
+		release_syscall(entry);
+	}
+
+	return -ENOENT;
+}
+
+/*
+ * Takes a request back from the HIO stub, unless it has already been
+ * completed. Returns true if it was withdrawn; otherwise the request is
+ * complete and the caller must release it.
+ */
+static bool
+withdraw_syscall(hio_syscall_t * syscall)
+{
+	hio_syscall_request_t * entry = &(syscall_slots[HIO_SLOT(syscall->uniq_id)]);
+	uint32_t id = syscall->uniq_id;
+	int state;
+
+	for (;;) {
+		state = atomic_read(&(entry->state));
+
+		if ((state == HIO_STATE(id, HIO_PENDING)) ||
+		    (state == HIO_STATE(id, HIO_PROCESSING))) {
+			/* Whoever sees it next releases it */
+			if (atomic_cmpxchg(&(entry->state), state,
+			                   HIO_STATE(id, HIO_CANCELED)) == state)
+				return true;
+		} else if (state == HIO_STATE(id, HIO_RETURNING)) {
+			cpu_relax();
+		} else {
+			BUG_ON(state != HIO_STATE(id, HIO_COMPLETE));
+			return false;
+		}
+	}
 }
 
 void
 hio_cancel_syscall(hio_syscall_t * syscall)
 {
-	unsigned long flags;
-	hio_syscall_request_t * entry;
-
-	BUG_ON((syscall->uniq_id < 0) || (syscall->uniq_id > MAX_OUTSTANDING_SYSCALLS));
-
-	spin_lock_irqsave(&(syscall_ring.lock), flags);
-
-	entry = &(syscall_ring.entries[syscall->uniq_id]);
-	entry->state = HIO_IDLE;
+	if (!withdraw_syscall(syscall))
+		release_syscall(&(syscall_slots[HIO_SLOT(syscall->uniq_id)]));
+}
 
-	spin_unlock_irqrestore(&(syscall_ring.lock), flags);
+void
+hio_requeue_syscall(hio_syscall_t * syscall)
+{
+	hio_syscall_request_t * entry = &(syscall_slots[HIO_SLOT(syscall->uniq_id)]);
+	uint32_t id = syscall->uniq_id;
+
+	if (atomic_cmpxchg(&(entry->state),
+	                   HIO_STATE(id, HIO_PROCESSING),
+	                   HIO_STATE(id, HIO_PENDING))
+	    == HIO_STATE(id, HIO_PROCESSING)) {
+		ring_put(&per_cpu(submit_ring, this_cpu), HIO_SLOT(id));
+		atomic_inc(&hio_calls_pending);
+	} else if (atomic_cmpxchg(&(entry->state),
+	                          HIO_STATE(id, HIO_CANCELED),
+	                          HIO_STATE(id, HIO_IDLE))
+	           == HIO_STATE(id, HIO_CANCELED)) {
+		ring_put(&free_ring, HIO_SLOT(id));
+	}
 }
 
 void
 hio_return_syscall(hio_syscall_t * syscall)
 {
-	unsigned long flags;
-	hio_syscall_request_t * entry;
-
-	BUG_ON((syscall->uniq_id < 0) || (syscall->uniq_id > MAX_OUTSTANDING_SYSCALLS));
-
-	spin_lock_irqsave(&(syscall_ring.lock), flags);
-
-	entry = &(syscall_ring.entries[syscall->uniq_id]);
-
-	/* It could have been canceled by the issuer (e.g, they took a signal) */
-	if (entry->state != HIO_PROCESSING) {
-	    spin_unlock_irqrestore(&(syscall_ring.lock), flags);
-	    return;
+	hio_syscall_request_t * entry = &(syscall_slots[HIO_SLOT(syscall->uniq_id)]);
+	uint32_t id = syscall->uniq_id;
+
+	if (atomic_cmpxchg(&(entry->state),
+	                   HIO_STATE(id, HIO_PROCESSING),
+	                   HIO_STATE(id, HIO_RETURNING))
+	    != HIO_STATE(id, HIO_PROCESSING)) {
+		/* It could have been canceled by the issuer (e.g, they took a signal) */
+		if (atomic_cmpxchg(&(entry->state),
+		                   HIO_STATE(id, HIO_CANCELED),
+		                   HIO_STATE(id, HIO_IDLE))
+		    == HIO_STATE(id, HIO_CANCELED))
+			ring_put(&free_ring, HIO_SLOT(id));
+		return;
 	}
 
 	/* copy in ret_val and hio segs */
 	memcpy(entry->syscall->segs, syscall->segs, syscall->segc * sizeof(hio_segment_t));
 	entry->syscall->segc    = syscall->segc;
 	entry->syscall->ret_val = syscall->ret_val;
-	entry->state            = HIO_COMPLETE;
 
-	spin_unlock_irqrestore(&(syscall_ring.lock), flags);
+	/* Nobody waits for asynchronous calls */
+	if (entry->complete) {
+		entry->complete(entry->syscall);
+		release_syscall(entry);
+		return;
+	}
+
+	wmb();
+	atomic_set(&(entry->state), HIO_STATE(id, HIO_COMPLETE));
 
 	mb();
 	waitq_wakeup(&(entry->waitq));
@@ -158,43 +298,61 @@ static int
 hio_wait_syscall(hio_syscall_t * syscall,
 		 uintptr_t     * ret_val)
 {
-	hio_syscall_request_t * entry;
+	hio_syscall_request_t * entry = &(syscall_slots[HIO_SLOT(syscall->uniq_id)]);
+	uint32_t id = syscall->uniq_id;
 	int status;
 
-	BUG_ON((syscall->uniq_id < 0) || (syscall->uniq_id > MAX_OUTSTANDING_SYSCALLS));
-
-	entry = &(syscall_ring.entries[syscall->uniq_id]);
-	
 	status = wait_event_interruptible(
 		entry->waitq,
-		(entry->state == HIO_COMPLETE)
+		(atomic_read(&(entry->state)) == HIO_STATE(id, HIO_COMPLETE))
 	);
 	mb();
 
-	if (entry->state == HIO_COMPLETE) {
-		*ret_val = entry->syscall->ret_val;
-		hio_cancel_syscall(syscall);
-	} else 
+	/* Don't leave an interrupted call behind in the ring */
+	if (status && withdraw_syscall(syscall)) {
 		*ret_val = status;
+		return status;
+	}
 
-	return status;
+	rmb();
+	*ret_val = entry->syscall->ret_val;
+	release_syscall(entry);
+	return 0;
 }
 
 
+int
+hio_notify_syscalls(void)
+{
+	/* A polling HIO stub will pick them up without being told */
+	mb();
+	if (atomic_read(&hio_pollers) > 0)
+		return 0;
+
+	return hio_impl.notify_new_syscall();
+}
+
+int
+hio_issue_syscall_async(hio_syscall_t * syscall,
+			void         (* complete)(hio_syscall_t *))
+{
+	return enqueue_syscall(syscall, complete);
+}
+
 int
 hio_issue_syscall(hio_syscall_t * syscall)
 {
 	int status;
 
 	/* Enqueue the call */
-	status = enqueue_syscall(syscall);
+	status = enqueue_syscall(syscall, NULL);
 	if (status != 0) {
 		printk(KERN_ERR "Failed to enqueue HIO syscall (err:%d)\n", status);
 		return status;
 	}
 
 	/* Send the notification */
-	status = hio_impl.notify_new_syscall();
+	status = hio_notify_syscalls();
 	if (status != 0) {
 		printk(KERN_ERR "Failed to issue HIO syscall notification (err:%d)\n", status);
 		hio_cancel_syscall(syscall);
@@ -319,11 +477,18 @@ hio_get_pending_syscall(hio_syscall_t ** pending_syscall)
 	return dequeue_syscall(pending_syscall);
 }
 
-static void
-init_syscall_ring_entry(hio_syscall_request_t * entry)
+void
+hio_poll_start(void)
 {
-	entry->state = HIO_IDLE;
-	waitq_init(&(entry->waitq));
+	atomic_inc(&hio_pollers);
+	mb();
+}
+
+void
+hio_poll_stop(void)
+{
+	atomic_dec(&hio_pollers);
+	mb();
 }
 
 static int
@@ -331,12 +496,12 @@ syscall_init(void)
 {
 	uint32_t i;
 
-	memset(&(syscall_ring.entries), 0, sizeof(hio_syscall_request_t) * MAX_OUTSTANDING_SYSCALLS);
-	spin_lock_init(&(syscall_ring.lock));
-	syscall_ring.offset = 0;
-
-	for (i = 0; i < MAX_OUTSTANDING_SYSCALLS; i++)
-		init_syscall_ring_entry(&(syscall_ring.entries[i]));
+	for (i = 0; i < MAX_OUTSTANDING_SYSCALLS; i++) {
+		atomic_set(&(syscall_slots[i].state), HIO_STATE(i, HIO_IDLE));
+		syscall_slots[i].uniq_id = i;
+		waitq_init(&(syscall_slots[i].waitq));
+		ring_put(&free_ring, i);
+	}
 
 	return 0;
 }
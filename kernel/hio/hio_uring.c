@@ -0,0 +1,345 @@
+#include <lwk/kernel.h>
+#include <lwk/unistd.h>
+#include <lwk/hio.h>
+#include <lwk/aspace.h>
+#include <lwk/waitq.h>
+#include <lwk/spinlock.h>
+#include <lwk/mutex.h>
+#include <lwk/list.h>
+#include <lwk/log2.h>
+#include <lwk/pmem.h>
+
+#include <arch/uaccess.h>
+
+/**
+ * An asynchronous system call taken from an aspace's ring. These are
+ * allocated along with the ring, so submitting needs no memory allocation.
+ */
+struct hio_uring_req {
+	hio_syscall_t		syscall;	/* Handed to the HIO layer */
+	uint64_t		user_data;
+	struct hio_uring_ctx *	ctx;
+	struct list_head	link;		/* Linkage in ctx->free_reqs */
+};
+
+/**
+ * Kernel side of an aspace's asynchronous system call ring.
+ */
+struct hio_uring_ctx {
+	spinlock_t		lock;
+	struct mutex		submit_mutex;	/* Serializes submitters */
+	struct hio_uring *	ring;		/* Kernel mapping of the ring */
+	struct pmem_region	pmem;		/* Memory backing the ring */
+	struct hio_uring_sqe *	sqes;
+	struct hio_uring_cqe *	cqes;
+
+	/* Private copies of the ring's state, the application may scribble
+	   over the ring's own */
+	uint32_t		entries;
+	uint32_t		sq_head;
+	uint32_t		cq_tail;
+
+	struct hio_uring_req *	reqs;
+	struct list_head	free_reqs;
+	unsigned int		inflight;	/* # calls the stub has */
+	bool			released;	/* aspace is gone */
+	waitq_t			cq_waitq;	/* Waiting for completions */
+};
+
+static size_t
+ring_size(unsigned int entries)
+{
+	return round_up(sizeof(struct hio_uring) +
+	                entries * (sizeof(struct hio_uring_sqe) +
+	                           sizeof(struct hio_uring_cqe)),
+	                PAGE_SIZE);
+}
+
+/* Completions not reaped by the application yet */
+static uint32_t
+cq_pending(struct hio_uring_ctx * ctx)
+{
+	return ctx->cq_tail - ACCESS_ONCE(ctx->ring->cq_head);
+}
+
+static void
+free_ctx(struct hio_uring_ctx * ctx)
+{
+	pmem_free_umem(&ctx->pmem);
+	kmem_free(ctx->reqs);
+	kmem_free(ctx);
+}
+
+/**
+ * Takes a request for a new call, if its completion is sure to fit in the
+ * completion queue along with those of the calls already submitted.
+ */
+static struct hio_uring_req *
+get_req(struct hio_uring_ctx * ctx)
+{
+	struct hio_uring_req * req = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ctx->lock, flags);
+	if (!list_empty(&ctx->free_reqs) &&
+	    (cq_pending(ctx) <= ctx->entries - ctx->inflight - 1)) {
+		req = list_entry(ctx->free_reqs.next, struct hio_uring_req, link);
+		list_del(&req->link);
+		ctx->inflight++;
+	}
+	spin_unlock_irqrestore(&ctx->lock, flags);
+
+	return req;
+}
+
+/**
+ * Frees a request, posting its completion first if post is true.
+ */
+static void
+put_req(struct hio_uring_req * req, bool post, int64_t res)
+{
+	struct hio_uring_ctx * ctx = req->ctx;
+	struct hio_uring_cqe * cqe;
+	unsigned long flags;
+	bool release;
+
+	spin_lock_irqsave(&ctx->lock, flags);
+
+	if (post && !ctx->released) {
+		cqe = &ctx->cqes[ctx->cq_tail & (ctx->entries - 1)];
+		cqe->user_data = req->user_data;
+		cqe->res       = res;
+		wmb();
+		ctx->ring->cq_tail = ++ctx->cq_tail;
+	}
+
+	list_add(&req->link, &ctx->free_reqs);
+	ctx->inflight--;
+	release = ctx->released && !ctx->inflight;
+
+	spin_unlock_irqrestore(&ctx->lock, flags);
+
+	if (release)
+		free_ctx(ctx);
+	else
+		waitq_wakeup(&ctx->cq_waitq);
+}
+
+static void
+hio_uring_complete(hio_syscall_t * syscall)
+{
+	struct hio_uring_req * req =
+		container_of(syscall, struct hio_uring_req, syscall);
+
+	put_req(req, true, (int64_t)syscall->ret_val);
+}
+
+/**
+ * Fills in a request from a submission queue entry. Returns 0 if it can
+ * be forwarded, otherwise the error to complete it with.
+ */
+static int
+format_req(struct hio_uring_req * req, const struct hio_uring_sqe * sqe)
+{
+	hio_syscall_t * syscall = &req->syscall;
+	uint32_t i;
+
+	req->user_data = sqe->user_data;
+
+	if (sqe->argc > HIO_URING_MAX_ARGC)
+		return -EINVAL;
+
+	/* Calls that return memory segments need the caller to attach them */
+	if ((sqe->syscall_nr == __NR_mmap) || (sqe->syscall_nr == __NR_shmat))
+		return -EINVAL;
+
+	if ((sqe->syscall_nr >= __NR_syscall_max) ||
+	    !syscall_isset(sqe->syscall_nr, current->aspace->hio_syscall_mask))
+		return -ENOSYS;
+
+	syscall->aspace_id  = current->aspace->id;
+	syscall->thread_id  = current->id;
+	syscall->rank_id    = current->rank;
+	syscall->syscall_nr = sqe->syscall_nr;
+	syscall->argc       = sqe->argc;
+	for (i = 0; i < sqe->argc; i++)
+		syscall->args[i] = sqe->args[i];
+	syscall->segc       = 0;
+
+	return 0;
+}
+
+int
+sys_hio_uring_setup(unsigned int entries, struct hio_uring __user ** ring)
+{
+	struct aspace * aspace = current->aspace;
+	struct hio_uring_ctx * ctx;
+	unsigned long flags;
+	size_t size = ring_size(entries);
+	vaddr_t uaddr;
+	unsigned int i;
+	int status;
+
+	if (!entries || (entries > HIO_URING_MAX_ENTRIES) ||
+	    !is_power_of_2(entries))
+		return -EINVAL;
+
+	if (aspace->hio_uring)
+		return -EEXIST;
+
+	if ((ctx = kmem_alloc(sizeof(*ctx))) == NULL)
+		return -ENOMEM;
+
+	if ((ctx->reqs = kmem_alloc(entries * sizeof(*ctx->reqs))) == NULL) {
+		status = -ENOMEM;
+		goto fail_reqs;
+	}
+
+	spin_lock_init(&ctx->lock);
+	mutex_init(&ctx->submit_mutex);
+	waitq_init(&ctx->cq_waitq);
+	list_head_init(&ctx->free_reqs);
+	for (i = 0; i < entries; i++) {
+		ctx->reqs[i].ctx = ctx;
+		list_add_tail(&ctx->reqs[i].link, &ctx->free_reqs);
+	}
+
+	if ((status = pmem_alloc_umem(size, PAGE_SIZE, &ctx->pmem)))
+		goto fail_pmem;
+	if ((status = pmem_zero(&ctx->pmem)))
+		goto fail_map;
+
+	ctx->ring    = __va(ctx->pmem.start);
+	ctx->sqes    = hio_uring_sqes(ctx->ring);
+	ctx->cqes    = (struct hio_uring_cqe *)(ctx->sqes + entries);
+	ctx->entries = entries;
+	ctx->ring->entries = entries;
+
+	status = aspace_map_region_anywhere(aspace->id, &uaddr, size,
+	                                    (VM_USER|VM_READ|VM_WRITE),
+	                                    PAGE_SIZE, "hio_uring",
+	                                    ctx->pmem.start);
+	if (status)
+		goto fail_map;
+
+	/* Hand out the address before the ring can be used, a caller that
+	   can't learn it could neither use the ring nor set up another */
+	if (copy_to_user(ring, &uaddr, sizeof(uaddr))) {
+		aspace_del_region(aspace->id, uaddr, size);
+		status = -EFAULT;
+		goto fail_map;
+	}
+
+	spin_lock_irqsave(&aspace->lock, flags);
+	if (aspace->hio_uring) {
+		spin_unlock_irqrestore(&aspace->lock, flags);
+		aspace_del_region(aspace->id, uaddr, size);
+		status = -EEXIST;
+		goto fail_map;
+	}
+	aspace->hio_uring = ctx;
+	spin_unlock_irqrestore(&aspace->lock, flags);
+
+	return 0;
+
+fail_map:
+	pmem_free_umem(&ctx->pmem);
+fail_pmem:
+	kmem_free(ctx->reqs);
+fail_reqs:
+	kmem_free(ctx);
+	return status;
+}
+
+/**
+ * Forwards up to to_submit queued system calls to the HIO stub, then waits
+ * for at least min_complete completions to be ready. Returns the number of
+ * calls submitted. Submission stops early when there would be no room for
+ * more completions; -EBUSY is returned if none could be submitted.
+ */
+int
+sys_hio_uring_enter(unsigned int to_submit, unsigned int min_complete)
+{
+	struct hio_uring_ctx * ctx = current->aspace->hio_uring;
+	struct hio_uring * ring;
+	struct hio_uring_sqe sqe;
+	struct hio_uring_req * req;
+	unsigned int submitted = 0;
+	int status;
+
+	if (!ctx)
+		return -EINVAL;
+
+	ring = ctx->ring;
+
+	/* Submitters take entries off the queue one at a time. The loop may
+	   block in the HIO layer, so this is a mutex rather than ctx->lock. */
+	mutex_lock(&ctx->submit_mutex);
+
+	while ((submitted < to_submit) &&
+	       (ctx->sq_head != ACCESS_ONCE(ring->sq_tail))) {
+		if ((req = get_req(ctx)) == NULL)
+			break;
+
+		rmb();
+		sqe = ctx->sqes[ctx->sq_head & (ctx->entries - 1)];
+
+		status = format_req(req, &sqe);
+		if (!status) {
+			status = hio_issue_syscall_async(&req->syscall,
+			                                 hio_uring_complete);
+			if (status == -EBUSY) {
+				/* The HIO layer is full, leave it queued */
+				put_req(req, false, 0);
+				break;
+			}
+		}
+		if (status)
+			put_req(req, true, status);
+
+		mb();
+		ring->sq_head = ++ctx->sq_head;
+		submitted++;
+	}
+
+	if (submitted)
+		hio_notify_syscalls();
+	else if (to_submit && (ctx->sq_head != ACCESS_ONCE(ring->sq_tail))) {
+		mutex_unlock(&ctx->submit_mutex);
+		return -EBUSY;
+	}
+
+	mutex_unlock(&ctx->submit_mutex);
+
+	if (min_complete) {
+		status = wait_event_interruptible(
+			ctx->cq_waitq,
+			(cq_pending(ctx) >= min(min_complete, ctx->entries))
+		);
+		if (status && !submitted)
+			return status;
+	}
+
+	return submitted;
+}
+
+void
+hio_uring_release(struct aspace * aspace)
+{
+	struct hio_uring_ctx * ctx = aspace->hio_uring;
+	unsigned long flags;
+	bool release;
+
+	if (!ctx)
+		return;
+
+	/* Calls still with the stub free the ring when they complete */
+	spin_lock_irqsave(&ctx->lock, flags);
+	ctx->released = true;
+	release = !ctx->inflight;
+	spin_unlock_irqrestore(&ctx->lock, flags);
+
+	aspace->hio_uring = NULL;
+	if (release)
+		free_ctx(ctx);
+}
@@ -5,6 +5,8 @@
 #include <lwk/waitq.h>
 #include <lwk/spinlock.h>
 #include <lwk/poll.h>
+#include <lwk/params.h>
+#include <lwk/time.h>
 
 #include <arch/vsyscall.h>
 #include <arch/atomic.h>
@@ -12,6 +14,44 @@
 
 static waitq_t user_waitq;
 
+/**
+ * Longest time, in microseconds, that a reader of /dev/hio polls for new
+ * system calls before going to sleep. New system calls only notify it while
+ * it sleeps. 0 disables polling.
+ */
+static unsigned int hio_poll_usecs = 50;
+param(hio_poll_usecs, uint);
+
+/**
+ * Current polling window, in nanoseconds. It is reset to the maximum each
+ * time polling finds a system call and halved each time it does not, down
+ * to 1/16th of the maximum, so an idle stub mostly sleeps.
+ */
+static ktime_t poll_ns;
+
+static void
+poll_for_syscalls(void)
+{
+	const ktime_t max_ns = (ktime_t)hio_poll_usecs * 1000;
+	ktime_t deadline;
+	bool found;
+
+	if (!max_ns)
+		return;
+
+	if (!poll_ns)
+		poll_ns = max_ns;
+
+	hio_poll_start();
+	deadline = get_time() + poll_ns;
+	while (!(found = (hio_get_num_pending_syscalls() > 0)) &&
+	       (get_time() < deadline))
+		cpu_relax();
+	hio_poll_stop();
+
+	poll_ns = found ? max_ns : max(poll_ns / 2, max_ns / 16);
+}
+
 static int
 hio_open_fop(struct inode * inodep,
     	     struct file  * filp)
@@ -33,6 +73,10 @@ hio_release_fop(struct inode * inodep,
 	return 0;
 }
 
+/**
+ * Hands pending system calls to the HIO stub. A buffer with room for
+ * several gets as many as are pending, the read only waits for the first.
+ */
 static ssize_t
 hio_read_fop(struct file * filp,
 	     char __user * buffer,
@@ -40,12 +84,16 @@ hio_read_fop(struct file * filp,
 	     loff_t      * offset)
 {
 	hio_syscall_t * k_syscall;
+	size_t count = 0;
 	int status;
 
 	if (length < sizeof(hio_syscall_t))
 		return -EINVAL;
 
 retry:
+	if (hio_get_num_pending_syscalls() == 0)
+		poll_for_syscalls();
+
 	status = wait_event_interruptible(
 		user_waitq,
 		(hio_get_num_pending_syscalls() > 0)
@@ -61,16 +109,22 @@ retry:
 		return status;
 	}
 
-	if (copy_to_user(buffer, k_syscall, sizeof(hio_syscall_t))) {
-		/* Cancel it, then re-issue */
-		hio_cancel_syscall(k_syscall);
-		hio_issue_syscall(k_syscall);
-		return -EFAULT;
-	}
-
-	return sizeof(hio_syscall_t);
+	do {
+		if (copy_to_user(buffer + count, k_syscall, sizeof(hio_syscall_t))) {
+			/* Put it back for the next read */
+			hio_requeue_syscall(k_syscall);
+			return count ? count : -EFAULT;
+		}
+		count += sizeof(hio_syscall_t);
+	} while ((length - count >= sizeof(hio_syscall_t)) &&
+	         (hio_get_pending_syscall(&k_syscall) == 0));
+
+	return count;
 }
 
+/**
+ * Takes the results of one or more system calls back from the HIO stub.
+ */
 static ssize_t
 hio_write_fop(struct file	* filp,
 	      const char __user * buffer,
@@ -78,20 +132,25 @@ hio_write_fop(struct file	* filp,
 	      loff_t            * offset)
 {
 	hio_syscall_t syscall;
+	size_t count;
 
 	if (length < sizeof(hio_syscall_t))
 		return -EINVAL;
 
-	if (copy_from_user(&syscall, buffer, sizeof(hio_syscall_t)))
-		return -EFAULT;
+	for (count = 0; length - count >= sizeof(hio_syscall_t);
+	     count += sizeof(hio_syscall_t)) {
+		if (copy_from_user(&syscall, buffer + count, sizeof(hio_syscall_t)))
+			return count ? count : -EFAULT;
+
+		if (syscall.segc > HIO_MAX_SEGC) {
+			printk(KERN_ERR "User returned syscall with invalid segcount (%d, max is %d)\n",
+				syscall.segc, HIO_MAX_SEGC);
+		}
 
-	if (syscall.segc > HIO_MAX_SEGC) {
-		printk(KERN_ERR "User returned syscall with invalid segcount (%d, max is %d)\n",
-			syscall.segc, HIO_MAX_SEGC);
+		hio_return_syscall(&syscall);
 	}
 
-	hio_return_syscall(&syscall);
-	return sizeof(hio_syscall_t);
+	return count;
 }
 
 
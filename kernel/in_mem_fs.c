@@ -1,89 +1,264 @@
 #include <lwk/kfs.h>
 #include <lwk/list.h>
 #include <lwk/pmem.h>
+#include <lwk/log2.h>
+#include <lwk/radix-tree.h>
+#include <lwk/aspace.h>
+#include <lwk/spinlock.h>
 #include <arch/uaccess.h>
+#include <arch-generic/fcntl.h>
+
+/**
+ * A physically contiguous run of a file's data, backing nr_pages pages of
+ * the file starting at page index.
+ */
+struct in_mem_extent {
+	unsigned long      index;
+	unsigned long      nr_pages;
+	struct pmem_region rgn;
+};
 
-struct in_mem_data_block {
-	uintptr_t blk_paddr;
+/**
+ * A range of a file mmap()ed into an aspace. Nothing tells the file when
+ * it is unmapped, so the range is checked for still being mapped to the
+ * file's memory before that memory is freed. Regions are only ever
+ * deleted whole, so checking the range's first page is enough.
+ */
+struct in_mem_mapping {
+	id_t             aspace_id;
+	vaddr_t          start;
+	paddr_t          paddr;   /* Memory mapped at start */
 	struct list_head node;
 };
 
 struct in_mem_priv_data {
-	struct list_head block_list;
-	u32 num_blocks;
+	struct radix_tree_root extents;   /* Keyed by each extent's last page */
+	u64 num_pages;                    /* Pages backed by extents */
+	struct list_head mappings;        /* Protected by mappings_lock */
+	struct list_head orphan_node;     /* Unlinked while still mapped */
 	struct mutex fop_mutex; /* We probably want this... */
 };
 
+/* Unlinked files whose memory is still mapped by some aspace */
+static LIST_HEAD(orphans);
+static DEFINE_SPINLOCK(mappings_lock);
+
 #define dbg(fmt,args...)
 //#define dbg _KDBG
 
 #define PRIV_DATA(x) ((struct in_mem_priv_data*) x)
-#define DATA_BLK_SIZE (PAGE_SIZE)
-#define MAX_FILE_SIZE (64 * 1024 * 1024)   /* 64MB for now... */
 
-static inline struct in_mem_data_block *
-get_block_from_offset(
-	struct in_mem_priv_data * priv, 
+/* Files grow by doubling, in extents of up to 2 MB */
+#define MAX_EXTENT_SIZE (2UL * 1024 * 1024)
+
+static inline struct in_mem_extent *
+get_extent_from_offset(
+	struct in_mem_priv_data * priv,
 	loff_t                    offset)
 {
-	struct in_mem_data_block * data_blk = NULL;
-	u64 target_block = offset / DATA_BLK_SIZE;
-	int i = 0;
+	struct in_mem_extent * ext = NULL;
+	unsigned long target_page = offset >> PAGE_SHIFT;
 
-	if (target_block > priv->num_blocks) {
+	if (target_page >= priv->num_pages) {
 		return NULL;
 	}
 
+	/* The first extent ending at or after the page is the one holding it */
+	if (radix_tree_gang_lookup(&priv->extents, (void **)&ext, target_page, 1) != 1) {
+		return NULL;
+	}
 
-	list_for_each_entry(data_blk, &(priv->block_list), node) {
-		if (i == target_block) return data_blk;
-		i++;
+	if (target_page < ext->index) {
+		return NULL;
 	}
 
-	return NULL;
+	return ext;
 }
 
-static uintptr_t 
-alloc_data_page( void )
+/**
+ * Returns the kernel mapping of the file's data at offset, and in *len how
+ * many bytes from there are contiguous, or NULL if offset isn't backed.
+ */
+static void *
+get_data_from_offset(
+	struct in_mem_priv_data * priv,
+	loff_t                    offset,
+	size_t *                  len)
 {
-	struct pmem_region result;
-	int status;
+	struct in_mem_extent * ext = get_extent_from_offset(priv, offset);
+	loff_t ext_offset;
 
-	status = pmem_alloc_umem(PAGE_SIZE, 0, &result);
-	if (status) return 0;
+	if (ext == NULL) {
+		return NULL;
+	}
 
-	status = pmem_zero(&result);
-	if (status) return 0;
+	ext_offset = offset - ((loff_t)ext->index << PAGE_SHIFT);
+	*len = (ext->nr_pages << PAGE_SHIFT) - ext_offset;
 
-	return result.start;
+	return __va(ext->rgn.start) + ext_offset;
 }
 
-
-static void 
-free_data_page(uintptr_t page_paddr)
+/**
+ * Adds an extent to the end of the file. Extents are sized to at least
+ * double the file, up to MAX_EXTENT_SIZE, and naturally aligned so that
+ * large extents can be mapped with large pages. Smaller extents are used
+ * when physical memory is too fragmented for the preferred size.
+ *
+ * An extent is also no larger than the largest power of two its file
+ * offset is a multiple of, so it is aligned in the file the same way as
+ * in physical memory, as a large page mapping of the file needs.
+ */
+static int
+add_extent(
+	struct in_mem_priv_data * priv,
+	u64                       bytes_needed)
 {
-	struct pmem_region query;
-	struct pmem_region result;
+	struct in_mem_extent * ext;
+	u64 end = priv->num_pages << PAGE_SHIFT;
+	size_t size = max_t(u64, bytes_needed, end);
 	int status;
 
-	pmem_region_unset_all(&query);
+	size = (size >= MAX_EXTENT_SIZE) ? MAX_EXTENT_SIZE
+	                                 : roundup_pow_of_two(max_t(size_t, size, PAGE_SIZE));
 
-	query.start            = page_paddr;
-	query.end              = page_paddr + PAGE_SIZE;
-	query.allocated        = true;
-	query.allocated_is_set = true;
+	if (end && (size > (end & -end))) {
+		size = end & -end;
+	}
+
+	ext = kmem_alloc(sizeof(struct in_mem_extent));
+	if (ext == NULL) {
+		return -ENOMEM;
+	}
 
-	status = pmem_query(&query, &result);
+	while (pmem_alloc_umem(size, size, &ext->rgn) != 0) {
+		if (size == PAGE_SIZE) {
+			kmem_free(ext);
+			return -ENOMEM;
+		}
+		size >>= 1;
+	}
+
+	ext->index    = priv->num_pages;
+	ext->nr_pages = size >> PAGE_SHIFT;
+
+	status = radix_tree_insert(&priv->extents, ext->index + ext->nr_pages - 1, ext);
 	if (status) {
-		panic("Freeing page %p failed! query status=%d\n", 
-		      (void *)page_paddr, status);
+		pmem_free_umem(&ext->rgn);
+		kmem_free(ext);
+		return status;
 	}
 
-	result.allocated = false;
-	status = pmem_update(&result);
+	priv->num_pages += ext->nr_pages;
+	return 0;
+}
+
+static void
+free_extent(struct in_mem_extent * ext)
+{
+	int status;
+
+	status = pmem_free_umem(&ext->rgn);
 	if (status) {
-		panic("Failed to free page %p! (status=%d)",
-		      (void *)page_paddr, status);
+		panic("Failed to free extent %p! (status=%d)",
+		      (void *)ext->rgn.start, status);
+	}
+
+	kmem_free(ext);
+}
+
+/**
+ * Zeroes [start, end) of the file, which must be backed. Data past the end
+ * of a file is left as it was when its memory was allocated, and is only
+ * zeroed if a write leaves a hole.
+ */
+static void
+zero_range(
+	struct in_mem_priv_data * priv,
+	loff_t                    start,
+	loff_t                    end)
+{
+	while (start < end) {
+		size_t len;
+		void * data = get_data_from_offset(priv, start, &len);
+
+		if (len > end - start) {
+			len = end - start;
+		}
+
+		memset(data, 0, len);
+		start += len;
+	}
+}
+
+static void
+free_file_data(struct in_mem_priv_data * priv)
+{
+	struct in_mem_extent * exts[16];
+	unsigned int           nr_exts;
+	unsigned int           i;
+
+	while ((nr_exts = radix_tree_gang_lookup(&(priv->extents),
+	                                         (void **)exts, 0,
+	                                         ARRAY_SIZE(exts))) > 0)
+	{
+		for (i = 0; i < nr_exts; i++) {
+			radix_tree_delete(&(priv->extents),
+			                  exts[i]->index + exts[i]->nr_pages - 1);
+			priv->num_pages -= exts[i]->nr_pages;
+
+			free_extent( exts[i] );
+		}
+	}
+
+	kmem_free( priv );
+}
+
+static bool
+mapping_is_live(struct in_mem_mapping * map)
+{
+	paddr_t paddr;
+
+	return !aspace_virt_to_phys(map->aspace_id, map->start, &paddr) &&
+	       (paddr == map->paddr);
+}
+
+/**
+ * Forgets the file's mappings that are gone. Returns true if any remain.
+ * Called with mappings_lock held.
+ */
+static bool
+prune_mappings(struct in_mem_priv_data * priv)
+{
+	struct in_mem_mapping * map;
+	struct in_mem_mapping * tmp;
+
+	list_for_each_entry_safe(map, tmp, &(priv->mappings), node) {
+		if (!mapping_is_live(map)) {
+			list_del(&(map->node));
+			kmem_free(map);
+		}
+	}
+
+	return !list_empty(&(priv->mappings));
+}
+
+/* Frees the memory of unlinked files that are no longer mapped anywhere */
+static void
+reap_orphans(void)
+{
+	struct in_mem_priv_data * priv;
+	struct in_mem_priv_data * tmp;
+	LIST_HEAD(unmapped);
+
+	spin_lock(&mappings_lock);
+	list_for_each_entry_safe(priv, tmp, &orphans, orphan_node) {
+		if (!prune_mappings(priv))
+			list_move(&(priv->orphan_node), &unmapped);
+	}
+	spin_unlock(&mappings_lock);
+
+	list_for_each_entry_safe(priv, tmp, &unmapped, orphan_node) {
+		free_file_data(priv);
 	}
 }
 
@@ -105,6 +280,9 @@ in_mem_read(
 {
 	struct in_mem_priv_data* priv = file->private_data;
 
+	if (file->pos >= file->inode->size)
+		return 0;
+
 	len = file->pos + len > file->inode->size ?
 			file->inode->size - file->pos : len;
 
@@ -113,22 +291,20 @@ in_mem_read(
 		size_t bytes_copied  = 0;
 
 		while (bytes_to_copy > 0) {
-			struct in_mem_data_block * blk = get_block_from_offset(priv, file->pos);
-			size_t bytes_in_block = DATA_BLK_SIZE - (file->pos % DATA_BLK_SIZE);
-			
-			if (bytes_in_block > bytes_to_copy) {
-				bytes_in_block = bytes_to_copy;
+			size_t bytes_in_extent;
+			void * data = get_data_from_offset(priv, file->pos, &bytes_in_extent);
+
+			if (bytes_in_extent > bytes_to_copy) {
+				bytes_in_extent = bytes_to_copy;
 			}
 
-			if ( copy_to_user(  buf + bytes_copied,
-					    __va(blk->blk_paddr) + (file->pos % DATA_BLK_SIZE), 
-					     bytes_in_block) ) {
+			if ( copy_to_user( buf + bytes_copied, data, bytes_in_extent) ) {
 				return -EFAULT;
 			}
-			
-			file->pos     += bytes_in_block;
-			bytes_copied  += bytes_in_block;
-			bytes_to_copy -= bytes_in_block;
+
+			file->pos     += bytes_in_extent;
+			bytes_copied  += bytes_in_extent;
+			bytes_to_copy -= bytes_in_extent;
 		}
 	}
 
@@ -145,59 +321,46 @@ in_mem_write(
 {
 	struct in_mem_priv_data* priv = file->private_data;
 
-	if ( file->pos + len > MAX_FILE_SIZE ) 
+	if ( file->pos + len < file->pos )
 		return -EFBIG;
 
-	if ((file->pos + len) > (priv->num_blocks * DATA_BLK_SIZE)) {
+	while ((file->pos + len) > (priv->num_pages << PAGE_SHIFT)) {
 		/* Expand memory */
-		u64 bytes_to_add = (file->pos + len) - (priv->num_blocks * DATA_BLK_SIZE);
-		u64 blks_to_add  = (bytes_to_add + (PAGE_SIZE - 1)) / PAGE_SIZE;
-		int i;
-		
-		for (i = 0; i < blks_to_add; i++) {
-			struct in_mem_data_block * new_blk = NULL;
-			uintptr_t blk_paddr = 0; 
-
-			blk_paddr = alloc_data_page();
-			if (blk_paddr == 0) {
-				return -ENOMEM;
-			}
-
-			new_blk = kmem_alloc(sizeof(struct in_mem_data_block));
-			memset(new_blk, 0, sizeof(struct in_mem_data_block));
-
-			new_blk->blk_paddr = blk_paddr;
-			list_add_tail(&(new_blk->node), &(priv->block_list));
-			priv->num_blocks++;
+		int status = add_extent(priv, (file->pos + len) - (priv->num_pages << PAGE_SHIFT));
+		if (status) {
+			return status;
 		}
 	}
-	
+
+	/* Writing past the end leaves a hole, which must read back as zeroes */
+	if ( file->pos > file->inode->size ) {
+		zero_range(priv, file->inode->size, file->pos);
+	}
+
 	{
 		size_t bytes_to_copy = len;
 		size_t bytes_copied  = 0;
 
 		while (bytes_to_copy > 0) {
-			struct in_mem_data_block * blk = get_block_from_offset(priv, file->pos);
-			size_t bytes_in_block = DATA_BLK_SIZE - (file->pos % DATA_BLK_SIZE);
-			
-			if (bytes_in_block > bytes_to_copy) {
-				bytes_in_block = bytes_to_copy;
+			size_t bytes_in_extent;
+			void * data = get_data_from_offset(priv, file->pos, &bytes_in_extent);
+
+			if (bytes_in_extent > bytes_to_copy) {
+				bytes_in_extent = bytes_to_copy;
 			}
 
-			if ( copy_from_user( __va(blk->blk_paddr) + (file->pos % DATA_BLK_SIZE), 
-					     buf + bytes_copied, 
-					     bytes_in_block) ) {
+			if ( copy_from_user( data, buf + bytes_copied, bytes_in_extent) ) {
 				return -EFAULT;
 			}
-			
-			file->pos     += bytes_in_block;
-			bytes_copied  += bytes_in_block;
-			bytes_to_copy -= bytes_in_block;
+
+			file->pos     += bytes_in_extent;
+			bytes_copied  += bytes_in_extent;
+			bytes_to_copy -= bytes_in_extent;
 		}
 	}
 
 	if ( file->pos > file->inode->size ) {
-		file->inode->size = file->pos;	
+		file->inode->size = file->pos;
 	}
 	return len;
 }
@@ -211,14 +374,14 @@ in_mem_lseek(
 {
 	switch ( whence ) {
 	    case 0: /* SEEK_SET */
-		if ( offset > MAX_FILE_SIZE ) 
-			return -EINVAL; 
+		if ( offset < 0 )
+			return -EINVAL;
 		file->pos = offset;
 		break;
 
 	     case 1: /*  SEEK_CUR */
-		if ( file->pos + offset > MAX_FILE_SIZE ) 
-			return -EINVAL; 
+		if ( file->pos + offset < 0 )
+			return -EINVAL;
 		file->pos += offset;
 		break;
 
@@ -232,11 +395,82 @@ in_mem_lseek(
 	return file->pos;
 }
 
-static int 
+/**
+ * Maps the file's extents straight into the caller's aspace, so everyone
+ * mapping a file shares one copy of it. Extents are naturally aligned, so
+ * the mapping uses large pages where the virtual address lines up too.
+ * Mappings are shared, writes through them change the file.
+ */
+static int
+in_mem_mmap(
+	struct file *             file,
+	struct vm_area_struct *   vma
+)
+{
+	struct in_mem_priv_data * priv   = file->private_data;
+	struct in_mem_mapping *   map;
+	loff_t                    size   = file->inode->size;
+	loff_t                    offset = (loff_t)vma->vm_pgoff << PAGE_SHIFT;
+	vaddr_t                   start  = vma->vm_start;
+	size_t                    len    = vma->vm_end - vma->vm_start;
+	int                       status;
+
+	/* There's nothing to fault in past the end of the file */
+	if (offset + len > round_up(size, PAGE_SIZE))
+		return -ENXIO;
+
+	/* Writes through the mapping change the file */
+	if ((pgprot_val(vma->vm_page_prot) & VM_WRITE) &&
+	    ((file->f_flags & O_ACCMODE) == O_RDONLY))
+		return -EACCES;
+
+	/* Data past the end isn't kept zeroed, but the last page's tail shows */
+	zero_range(priv, size, round_up(size, PAGE_SIZE));
+
+	map = kmem_alloc(sizeof(struct in_mem_mapping));
+	if (map == NULL)
+		return -ENOMEM;
+
+	map->aspace_id = current->aspace->id;
+	map->start     = start;
+
+	while (len > 0) {
+		size_t bytes_in_extent;
+		void * data = get_data_from_offset(priv, offset, &bytes_in_extent);
+
+		if (bytes_in_extent > len) {
+			bytes_in_extent = len;
+		}
+
+		if (start == map->start) {
+			map->paddr = __pa(data);
+		}
+
+		/* Anything already mapped goes away with the caller's region */
+		status = aspace_map_pmem(map->aspace_id, __pa(data), start, bytes_in_extent);
+		if (status) {
+			kmem_free(map);
+			return status;
+		}
+
+		start  += bytes_in_extent;
+		offset += bytes_in_extent;
+		len    -= bytes_in_extent;
+	}
+
+	spin_lock(&mappings_lock);
+	prune_mappings(priv);
+	list_add_tail(&(map->node), &(priv->mappings));
+	spin_unlock(&mappings_lock);
+
+	return 0;
+}
+
+static int
 in_mem_ioctl(
         struct file *   file,
 	int		request,
-	uaddr_t		addr	
+	uaddr_t		addr
 )
 {
 	return -EINVAL;
@@ -246,34 +480,38 @@ static int create(struct inode *inode, int mode )
 {
 	dbg("\n");
 	inode->i_private = kmem_alloc( sizeof( struct in_mem_priv_data ) );
-	INIT_LIST_HEAD(&(PRIV_DATA(inode->i_private)->block_list));
+	INIT_RADIX_TREE(&(PRIV_DATA(inode->i_private)->extents), 0);
+	INIT_LIST_HEAD(&(PRIV_DATA(inode->i_private)->mappings));
 	inode->size = 0;
 
-	return 0;	
+	return 0;
 }
 
 static int unlink(struct inode *inode )
 {
-	struct in_mem_priv_data  * file_state = PRIV_DATA(inode->i_private);
-	struct in_mem_data_block * tmp        = NULL;
-	struct in_mem_data_block * blk        = NULL;
+	struct in_mem_priv_data * file_state = PRIV_DATA(inode->i_private);
+	bool                      mapped;
 
 	dbg("\n");
-	list_for_each_entry_safe(blk, tmp, &(file_state->block_list), node) 
-	{
-		list_del( &(blk->node) );
-		file_state->num_blocks--;
 
-		free_data_page( blk->blk_paddr );
-		kmem_free( blk );
+	/* Memory that is still mapped is freed once it no longer is */
+	spin_lock(&mappings_lock);
+	mapped = prune_mappings(file_state);
+	if (mapped) {
+		list_add_tail(&(file_state->orphan_node), &orphans);
 	}
+	spin_unlock(&mappings_lock);
 
-	kmem_free( inode->i_private );
-	return 0;	
+	if (!mapped) {
+		free_file_data(file_state);
+	}
+
+	reap_orphans();
+	return 0;
 }
 
 struct inode_operations in_mem_iops = {
-	.create = create,	
+	.create = create,
 	.unlink = unlink,
 };
 
@@ -283,4 +521,77 @@ struct kfs_fops in_mem_fops = {
 	.lseek = in_mem_lseek,
 	.write = in_mem_write,
 	.ioctl = in_mem_ioctl,
+	.mmap = in_mem_mmap,
 };
+
+#ifdef CONFIG_DEBUG_INMEMFS_BENCH
+#include <lwk/time.h>
+
+// Measures sequential throughput of a freshly written file (which includes
+// allocating its memory), of rewriting it in place, and of reading it back,
+// for a range of I/O sizes. Results are in MB/s.
+void in_mem_fs_bench(void)
+{
+	static const size_t chunks[] = { 4096, 65536, 1024 * 1024 };
+	static const char *phases[] = { "write", "rewrite", "read" };
+	const loff_t file_size = 256 * 1024 * 1024;
+	uint64_t mbps[ARRAY_SIZE(phases)];
+	struct pmem_region rgn;
+	struct inode *inode;
+	struct file file;
+	unsigned long old_fs;
+	char *buf;
+	unsigned int i, p;
+
+	if (pmem_alloc_umem(chunks[ARRAY_SIZE(chunks) - 1], PAGE_SIZE, &rgn) != 0) {
+		printk(KERN_DEBUG "in_mem_fs benchmark: no memory\n");
+		return;
+	}
+	buf = __va(rgn.start);
+	memset(buf, 0x5a, chunks[ARRAY_SIZE(chunks) - 1]);
+
+	// The buffer is in the kernel, not in user space
+	old_fs = get_fs();
+	set_fs(KERNEL_DS);
+
+	printk(KERN_DEBUG "in_mem_fs benchmark, %llu MB file (MB/s):\n",
+	       (unsigned long long)(file_size >> 20));
+	printk(KERN_DEBUG "  %8s %10s %10s %10s\n", "bytes", phases[0], phases[1], phases[2]);
+
+	for (i = 0; i < ARRAY_SIZE(chunks); i++) {
+		if ((inode = kmem_alloc(sizeof(struct inode))) == NULL)
+			break;
+		create(inode, 0777);
+		memset(&file, 0, sizeof(file));
+		file.inode = inode;
+		in_mem_open(inode, &file);
+
+		for (p = 0; p < ARRAY_SIZE(phases); p++) {
+			uint64_t start, end;
+			ssize_t ret = 0;
+
+			in_mem_lseek(&file, 0, 0);
+			start = get_time();
+			while ((file.pos < file_size) && (ret >= 0)) {
+				if (p == 2)
+					ret = in_mem_read(&file, buf, chunks[i], NULL);
+				else
+					ret = in_mem_write(&file, buf, chunks[i], NULL);
+			}
+			end = get_time();
+
+			mbps[p] = (ret < 0) ? 0 : ((uint64_t)file_size * 1000) / (end - start);
+		}
+
+		printk(KERN_DEBUG "  %8lu %10llu %10llu %10llu\n", (unsigned long)chunks[i],
+		       (unsigned long long)mbps[0], (unsigned long long)mbps[1],
+		       (unsigned long long)mbps[2]);
+
+		unlink(inode);
+		kmem_free(inode);
+	}
+
+	set_fs(old_fs);
+	pmem_free_umem(&rgn);
+}
+#endif
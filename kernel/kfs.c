@@ -8,10 +8,41 @@
 #include <lwk/kfs.h>
 #include <lwk/stat.h>
 #include <lwk/aspace.h>
+#include <lwk/hash.h>
+#include <lwk/proc_fs.h>
+#include <arch-generic/fcntl.h>
 
 struct inode *kfs_root;
 spinlock_t _lock;
 
+/**
+ * Path lookup cache. Each entry maps a directory and the name of one of its
+ * entries to the entry's inode, or to NULL if the directory has no entry of
+ * that name. An entry is only valid while the directory's lookup_gen is the
+ * one it was cached with; generations come from a global counter, so they
+ * also tell apart directories that reuse a freed inode's memory.
+ */
+#define KFS_LCACHE_ORDER	11
+#define KFS_LCACHE_SIZE		(1 << KFS_LCACHE_ORDER)
+#define KFS_LCACHE_NAME_LEN	48	/* Longer names aren't cached */
+
+struct kfs_lcache_entry {
+	struct inode *		parent;
+	unsigned long		gen;
+	struct inode *		inode;
+	unsigned long		hash;
+	char			name[ KFS_LCACHE_NAME_LEN ];
+};
+
+static struct kfs_lcache_entry kfs_lcache[ KFS_LCACHE_SIZE ];
+static DEFINE_SPINLOCK(kfs_lcache_lock);
+static unsigned long kfs_lookup_gen;
+
+/* Lookup cache statistics, reported in /proc/kfsstat */
+static unsigned long kfs_lcache_hits;
+static unsigned long kfs_lcache_neg_hits;
+static unsigned long kfs_lcache_misses;
+
 /* in-kernel dirent struct: should match the libc dirent semantics */
 struct dirent {
 	long d_ino;                 /* inode number */
@@ -29,14 +60,151 @@ struct dirent64 {
 	char d_name [1];            /* filename (null-terminated) */
 };
 
-/** Generate a hash from a filename.
+/** Hash a filename up to the first / or nul character (FNV-1a).
  *
- * \todo Actually perform a hash function!
+ * \returns the hash, and the name's length in *len.
+ */
+static unsigned long
+kfs_hash_name(const char * name,
+	      size_t *     len)
+{
+	const char * p = name;
+	unsigned long hash = 14695981039346656037UL;
+
+	while( *p && *p != '/' )
+	{
+		hash ^= (unsigned char)*p++;
+		hash *= 1099511628211UL;
+	}
+
+	*len = p - name;
+	return hash;
+}
+
+/** Generate a hash from a filename.
  */
 static uint64_t
 kfs_hash_filename(const void * name,
 		  size_t       bits)
 {
+	size_t len;
+	return hash_long(kfs_hash_name(name, &len), bits);
+}
+
+/** Mark a directory's lookup cache entries stale.
+ */
+static void
+kfs_dir_changed(struct inode * dir)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&kfs_lcache_lock, flags);
+	dir->lookup_gen = ++kfs_lookup_gen;
+	spin_unlock_irqrestore(&kfs_lcache_lock, flags);
+}
+
+static struct kfs_lcache_entry *
+kfs_lcache_slot(struct inode * parent,
+		unsigned long  hash)
+{
+	return &kfs_lcache[ hash_long(hash ^ (unsigned long)parent,
+				      KFS_LCACHE_ORDER) ];
+}
+
+/** Look up the name's entry in parent in the lookup cache.
+ *
+ * \returns true on a hit, with the entry's inode (NULL if parent has
+ * no such entry) in *child.
+ */
+static bool
+kfs_lcache_find(struct inode *  parent,
+		const char *    name,
+		struct inode ** child)
+{
+	struct kfs_lcache_entry * entry;
+	unsigned long flags;
+	unsigned long hash;
+	size_t len;
+	bool hit = false;
+
+	hash  = kfs_hash_name(name, &len);
+	entry = kfs_lcache_slot(parent, hash);
+
+	spin_lock_irqsave(&kfs_lcache_lock, flags);
+	if( entry->parent == parent && entry->gen == parent->lookup_gen &&
+	    entry->hash == hash && len < KFS_LCACHE_NAME_LEN &&
+	    !memcmp(entry->name, name, len) && entry->name[len] == '\0' )
+	{
+		*child = entry->inode;
+		hit = true;
+		if( entry->inode )
+			kfs_lcache_hits++;
+		else
+			kfs_lcache_neg_hits++;
+	} else {
+		kfs_lcache_misses++;
+	}
+	spin_unlock_irqrestore(&kfs_lcache_lock, flags);
+
+	return hit;
+}
+
+/** Return parent's lookup generation, to be sampled before looking
+ * up an entry that is then added to the cache with kfs_lcache_add().
+ */
+static unsigned long
+kfs_lcache_gen(struct inode * parent)
+{
+	unsigned long flags;
+	unsigned long gen;
+
+	spin_lock_irqsave(&kfs_lcache_lock, flags);
+	gen = parent->lookup_gen;
+	spin_unlock_irqrestore(&kfs_lcache_lock, flags);
+
+	return gen;
+}
+
+/** Remember the result of looking up name in parent, which was done
+ * while parent's lookup generation was gen. The result is dropped if
+ * parent has changed since, as it may no longer hold.
+ */
+static void
+kfs_lcache_add(struct inode * parent,
+	       unsigned long  gen,
+	       const char *   name,
+	       struct inode * child)
+{
+	struct kfs_lcache_entry * entry;
+	unsigned long flags;
+	unsigned long hash;
+	size_t len;
+
+	hash = kfs_hash_name(name, &len);
+	if( len >= KFS_LCACHE_NAME_LEN )
+		return;
+	entry = kfs_lcache_slot(parent, hash);
+
+	spin_lock_irqsave(&kfs_lcache_lock, flags);
+	if( parent->lookup_gen != gen ) {
+		spin_unlock_irqrestore(&kfs_lcache_lock, flags);
+		return;
+	}
+	entry->parent = parent;
+	entry->gen    = gen;
+	entry->inode  = child;
+	entry->hash   = hash;
+	memcpy(entry->name, name, len);
+	entry->name[len] = '\0';
+	spin_unlock_irqrestore(&kfs_lcache_lock, flags);
+}
+
+static int
+kfs_proc_stats(struct file * file, void * priv_data)
+{
+	proc_sprintf(file, "lookup_hits %lu\n", kfs_lcache_hits);
+	proc_sprintf(file, "lookup_neg_hits %lu\n", kfs_lcache_neg_hits);
+	proc_sprintf(file, "lookup_misses %lu\n", kfs_lcache_misses);
 	return 0;
 }
 
@@ -324,6 +492,7 @@ kfs_create_inode(void)
 	struct inode *inode = kmem_alloc(sizeof(struct inode));
 	memset(inode, 0x00, sizeof(struct inode));
 	atomic_set(&inode->i_count, 0);
+	kfs_dir_changed(inode);
 
 	return inode;
 }
@@ -407,12 +576,23 @@ kfs_mkdirent(struct inode *          parent,
 		inode->name[offset] = '\0';
 	}
 
-	if( parent && new_entry )
+	if( parent && new_entry ) {
 		htable_add( parent->files, inode );
+		kfs_dir_changed( parent );
+	}
 
 	return inode;
 }
 
+/** Remove an inode from its parent directory.
+ */
+void
+kfs_del_dirent(struct inode *inode)
+{
+	htable_del( inode->parent->files, inode );
+	kfs_dir_changed( inode->parent );
+}
+
 void
 kfs_destroy(struct inode *inode)
 {
@@ -473,8 +653,13 @@ kfs_lookup(struct inode *       root,
 		if( !S_ISDIR(root->mode) )
 			return NULL;
 
-		// Search for the next / char
-		struct inode *child = htable_lookup(root->files, dirname);
+		// Search for the next / char, in the lookup cache first
+		struct inode *child;
+		if( !kfs_lcache_find(root, dirname, &child) ) {
+			unsigned long gen = kfs_lcache_gen(root);
+			child = htable_lookup(root->files, dirname);
+			kfs_lcache_add(root, gen, dirname, child);
+		}
 
 		// If it does not exist and we're not auto-creating
 		// then return no match
@@ -525,15 +710,11 @@ kfs_create_at(struct inode                  * root_inode,
 
 	dbg("name=`%s`\n", full_filename);
 
+	// A name without a / is created directly in root_inode
 	if( !filename )
-	{
-		//printk( "%s: Non-absolute path name! '%s'\n",
-		//	__func__, full_filename );
-		//return NULL;
-		root_inode = kfs_root;
-	}else{
+		filename = full_filename;
+	else
 		filename++;
-	}
 
 	dir = kfs_lookup( root_inode, full_filename, 0777 );
 
@@ -644,6 +825,7 @@ kfs_link(struct inode *target, struct inode *parent, const char *name)
 
 	link->parent = parent;
 	htable_add(parent->files, link);
+	kfs_dir_changed(parent);
 
 	return link;
 }
@@ -682,6 +864,26 @@ kfs_close(struct file *file)
 }
 
 
+static int
+kfs_open_inode(struct inode * inode,
+	       int            flags,
+	       mode_t         mode,
+	       struct file ** rv)
+{
+	struct file *file = kfs_open(inode, flags, mode);
+	if(NULL == file)
+		return -ENOMEM;
+
+	if( file->f_op->open && file->f_op->open( file->inode , file ) < 0 ) {
+		kfs_close(file);
+		return -EACCES;
+	}
+
+	*rv = file;
+
+	return 0;
+}
+
 int
 kfs_open_path_at(struct inode * root_inode,
 		 const char   * pathname, 
@@ -703,18 +905,42 @@ kfs_open_path_at(struct inode * root_inode,
 		return -ENOENT;
 
 	dbg("name=`%s`\n",pathname);
-	struct file *file = kfs_open(inode, flags, mode);
-	if(NULL == file)
-		return -ENOMEM;
+	return kfs_open_inode(inode, flags, mode, rv);
+}
 
-	if( file->f_op->open && file->f_op->open( file->inode , file ) < 0 ) {
-		kfs_close(file);
-		return -EACCES;
+/** Open pathname like kfs_open_path_at(), first creating it as an
+ * in-memory file if it does not exist and O_CREAT is set. An existing
+ * file is only looked up once. Called with _lock held.
+ */
+int
+kfs_open_or_create_at(struct inode * root_inode,
+		      const char   * pathname,
+		      int            flags,
+		      mode_t         mode,
+		      struct file ** rv)
+{
+	extern struct kfs_fops in_mem_fops;
+	extern struct inode_operations in_mem_iops;
+	struct inode * inode = NULL;
+
+	BUG_ON(!root_inode);
+
+	if (pathname[0] == '/') {
+		root_inode = kfs_root;
 	}
 
-	*rv = file;
+	inode = kfs_lookup( root_inode, pathname, 0 );
+	if( !inode && ( flags & O_CREAT ) ) {
+		inode = kfs_create_at( root_inode, pathname, &in_mem_iops,
+				       &in_mem_fops, 0777, 0, 0 );
+		if( !inode )
+			return -EFAULT;
+	}
+	if( !inode )
+		return -ENOENT;
 
-	return 0;
+	dbg("name=`%s`\n",pathname);
+	return kfs_open_inode(inode, flags, mode, rv);
 }
 
 int
@@ -741,7 +967,7 @@ kfs_open_anon(const struct kfs_fops * fops, void * priv_data)
 
     __lock(&_lock);
     {
-	if ((fd = fdTableGetUnused( current->fdTable )) > 0)
+	if ((fd = fdTableGetUnused( current->fdTable )) >= 0)
 	    fdTableInstallFd( current->fdTable, fd, file );
     }
     __unlock(&_lock);
@@ -812,6 +1038,9 @@ kfs_init( void )
 	if (!sysfs_root) 
 		panic("Failed to 'mkdir /sys'.");
 
+	proc_mkdir("/proc");
+	create_proc_file("/proc/kfsstat", kfs_proc_stats, NULL);
+
 	// Bring up any kfs drivers that we have linked in
 	driver_init_by_name( "kfs", "*" );
 }
@@ -13,12 +13,19 @@ sys_access(const char *pathname, mode_t mode)
 	if (mode & ~00007)	/* where's F_OK, X_OK, W_OK, R_OK? */
 		return -EINVAL;
 
+	int ret;
+__lock(&_lock);
 	struct inode * inode = kfs_lookup(kfs_root, pathname, 0);
-	if (!inode)
-		return -ENOENT;
+	if (!inode) {
+		ret = -ENOENT;
+		goto out;
+	}
 
 	//FIXME: This doesn't look at the effective uid/gid ..
 	//FIXME: This only looks at the uid
-	if ( ((inode->mode >> 6) & mode) == mode) return 0;
-	else return -1;
+	if ( ((inode->mode >> 6) & mode) == mode) ret = 0;
+	else ret = -1;
+out:
+__unlock(&_lock);
+	return ret;
 }
@@ -11,18 +11,6 @@ sys_close(int fd)
 		goto out;
 	}
 
-	// if we're closing an end of a pipe...
-	if (file->pipe != NULL) {
-		file->pipe->ref_count--;
-		if (file->pipe->ref_count <= 0) {
-			kmem_free(file->pipe->buffer);
-			kmem_free(file->pipe);
-		} else if (file->pipe_end_type == PIPE_END_WRITE) {
-			// if the write end was closed, that sends an EOF into the pipe
-			file->pipe->eof = 1;
-		}
-	}
-
 	char __attribute__((unused)) buff[MAX_PATHLEN];
 //        dbg("name=`%s` fd=%d\n", get_full_path(file->inode,buff), fd );
 
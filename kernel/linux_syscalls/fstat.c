@@ -3,18 +3,22 @@
 int
 sys_fstat(int fd, uaddr_t buf)
 {
-	int ret = -EBADF;
+	int ret;
 	struct file * const file = get_current_file( fd );
 	if( !file )
-		goto out;
+		return -EBADF;
+
+	// Anonymous files have no inode, pipes report themselves
+	if( !file->inode ) {
+		ret = pipe_stat(file, buf);
+		if( ret == -EBADF )
+			printk(KERN_WARNING
+			"Attempting fstat() on fd %d with no backing inode.\n", fd);
+		return ret;
+	}
 
 __lock(&_lock);
-	if(file->inode)
-		ret = kfs_stat(file->inode, buf);
-	else
-		printk(KERN_WARNING
-		"Attempting fstat() on fd %d with no backing inode.\n", fd);
-out:
+	ret = kfs_stat(file->inode, buf);
 __unlock(&_lock);
 	return ret;
 }
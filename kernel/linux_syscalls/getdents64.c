@@ -10,7 +10,7 @@ sys_getdents64(unsigned int fd, uaddr_t dirp, unsigned int count)
 	if(NULL == file)
 		goto out;
 
-	if(!S_ISDIR(file->inode->mode)) {
+	if(!file->inode || !S_ISDIR(file->inode->mode)) {
 		ret = -ENOTDIR;
 		goto out;
 	}
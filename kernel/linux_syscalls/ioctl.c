@@ -17,7 +17,7 @@ sys_ioctl(unsigned int  fd,
 		ret = file->f_op->ioctl( file, request, arg );
 
 	else {
-		printk("sys_ioctl %s : no ioctl!\n",file->inode->name);
+		printk("sys_ioctl %s : no ioctl!\n",file_name(file));
 		ret = -ENOTTY;
 	}
 out:
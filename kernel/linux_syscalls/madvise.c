@@ -6,11 +6,31 @@
 long
 sys_madvise(unsigned long start, size_t length, int advice)
 {
-	if (advice != MADV_DONTNEED) {
-		printk(KERN_WARNING
-		       "sys_madvise() advice=%d not supported (task=%u.%u, %s)\n",
-		       advice, current->aspace->id, current->id, current->name);
+	struct aspace *as = current->aspace;
+	struct tlb_batch tlb;
+	int rv;
+
+	switch (advice) {
+	case MADV_DONTNEED:
+		return 0;
+
+	case MADV_HUGEPAGE:
+	case MADV_NOHUGEPAGE:
+		if ((start & (PAGE_SIZE - 1)) || !length)
+			return -EINVAL;
+
+		spin_lock(&as->lock);
+		rv = __aspace_set_hugepage(as, start,
+		                           round_up(length, PAGE_SIZE),
+		                           (advice == MADV_HUGEPAGE));
+		__aspace_take_tlb_batch(as, &tlb);
+		spin_unlock(&as->lock);
+		tlb_batch_flush(&tlb);
+		return rv;
 	}
 
+	printk(KERN_WARNING
+	       "sys_madvise() advice=%d not supported (task=%u.%u, %s)\n",
+	       advice, current->aspace->id, current->id, current->name);
 	return 0;
 }
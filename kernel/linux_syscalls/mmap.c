@@ -18,6 +18,8 @@ sys_mmap(
 	struct file *file;
 	struct vm_area_struct vma;
 	unsigned long mmap_brk;
+	vmflags_t vmflags;
+	size_t align;
 	int rv;
 
 	/* printk("[%s] SYS_MMAP: fd=%lu, addr=%lx, len=%lu\n", current->name, fd, addr, len); */
@@ -27,43 +29,59 @@ sys_mmap(
 
 	/* we only support anonymous private mapping; file-backed
 	   private mapping has copy-on-write semantics, which we don't
-	   want due to complete lack of any pagefaulting resolution */
+	   want due to complete lack of any pagefaulting resolution.
+	   Read-only private mappings can't be written, so they are
+	   treated as shared ones */
 
-	if((flags & MAP_PRIVATE) && !(flags & MAP_ANONYMOUS))
+	if((flags & MAP_PRIVATE) && !(flags & MAP_ANONYMOUS) &&
+	   (prot & PROT_WRITE))
 		return -EINVAL;
 
 	/* anonymous mappings (not backed by a file) are handled specially */
 	if(flags & MAP_ANONYMOUS) {
 		/* anonymous mmap()ed memory is put at the top of the
-		   heap region, and grows from high to low addresses,
-		   i.e. down towards the current heap end. */
-		spin_lock(&as->lock);
-		mmap_brk = round_down(as->mmap_brk - len, PAGE_SIZE);
-
-		/* Protect against extending into the UNIX data segment,
-		   or becoming negative (which wraps around to large addr) */
-		if ((mmap_brk <= as->brk) || (mmap_brk >= as->mmap_brk)) {
-			spin_unlock(&as->lock);
-			printk("[%s] SYS_MMAP: ENOMEM (len=%lu, heap_brk=0x%lx, mmap_brk=0x%lx)\n",
-				current->name, len, as->brk, as->mmap_brk);
-			return -ENOMEM;
+		   heap region, which is already backed by memory. Holes
+		   left by munmap() are reused first, otherwise the mmap
+		   area grows from high to low addresses, i.e. down
+		   towards the current heap end. */
+		size_t align = PAGE_SIZE;
+
+		if (flags & MAP_HUGETLB) {
+			align = (((flags >> MAP_HUGE_SHIFT) & MAP_HUGE_MASK) == 30)
+			        ? VM_PAGE_1GB : VM_PAGE_2MB;
+			len = round_up(len, align);
 		}
 
-		as->mmap_brk = mmap_brk;
+		spin_lock(&as->lock);
+		if (flags & MAP_FIXED) {
+			if (addr & (align - 1))
+				rv = -EINVAL;
+			else
+				rv = __aspace_mmap_reserve(as, addr, len);
+		} else {
+			rv = __aspace_mmap_alloc(as, len, align, &addr);
+		}
+		mmap_brk = as->mmap_brk;
 		spin_unlock(&as->lock);
 
+		if (rv) {
+			printk("[%s] SYS_MMAP: %d (len=%lu, heap_brk=0x%lx, mmap_brk=0x%lx)\n",
+				current->name, rv, len, as->brk, mmap_brk);
+			return rv;
+		}
+
 		/* Zero the memory */
 		/* BJK: why were we using the kernel page tables to do this?? */
 #if 0
 		paddr_t phys;
-		if (__aspace_virt_to_phys(as, mmap_brk, & phys))
+		if (__aspace_virt_to_phys(as, addr, & phys))
 			panic("sys_mmap() failed to get physical address\n");
 		memset(__va(phys), 0, len);
 #endif
-		memset((void *)mmap_brk, 0, len);
+		memset((void *)addr, 0, len);
 
-		/* printk("[%s] SYS_MMAP: len=%lu returning mmap_brk=0x%lx, heap_brk=0x%lx\n", current->name, len, mmap_brk, as->brk); */
-		return mmap_brk;
+		/* printk("[%s] SYS_MMAP: len=%lu returning addr=0x%lx, heap_brk=0x%lx\n", current->name, len, addr, as->brk); */
+		return addr;
 	}
 
 	/* file-backed mappings */
@@ -78,14 +96,26 @@ sys_mmap(
 	   NULL == file->f_op->mmap)
 		return -ENODEV;
 
+	if (off & (PAGE_SIZE - 1))
+		return -EINVAL;
+
+	vmflags = VM_READ|VM_USER;
+	if (prot & PROT_WRITE)
+		vmflags |= VM_WRITE;
+
+	/* Line the mapping up with large pages the file's memory may be
+	   in, so they can be mapped as large pages too */
+	align = PAGE_SIZE;
+	if ((len >= VM_PAGE_2MB) && !(off & (VM_PAGE_2MB - 1)))
+		align = VM_PAGE_2MB;
+
 	spin_lock(&as->lock);
-	if ((rv = __aspace_find_hole(as, addr, len, PAGE_SIZE, &addr))) {
+	if ((rv = __aspace_find_hole(as, addr, len, align, &addr))) {
 		spin_unlock(&as->lock);
 		return -ENOMEM;
 	}
 
-	if ((rv = __aspace_add_region(as, addr, len,
-				      VM_READ|VM_WRITE|VM_USER,
+	if ((rv = __aspace_add_region(as, addr, len, vmflags,
 				      PAGE_SIZE, "mmap"))) {
 		/* assuming there is no race between find_hole and
 		   add_region, as we're holding the as->lock, this
@@ -99,14 +129,18 @@ sys_mmap(
 	/* fill the vm_area_struct to keep compatible with linux layer */
 	vma.vm_start = addr;
 	vma.vm_end = addr + len;
-	vma.vm_page_prot = __pgprot(VM_READ|VM_WRITE);
-	vma.vm_pgoff = 0;
+	vma.vm_page_prot = __pgprot(vmflags & (VM_READ|VM_WRITE));
+	vma.vm_pgoff = off >> PAGE_SHIFT;
 
 	rv = file->f_op->mmap(file, &vma);
 	if(rv) {
+		struct tlb_batch tlb;
+
 		spin_lock(&as->lock);
 		__aspace_del_region(as, addr, len);
+		__aspace_take_tlb_batch(as, &tlb);
 		spin_unlock(&as->lock);
+		tlb_batch_flush(&tlb);
 		return rv;
 	}
 	return vma.vm_start;
@@ -1,13 +1,123 @@
-#include <lwk/pmem.h>
-#include <arch/uaccess.h>
+#include <lwk/kernel.h>
+#include <lwk/task.h>
+#include <lwk/aspace.h>
+#include <lwk/string.h>
+#include <arch/mman.h>
 
 unsigned long
 sys_mremap(
 	unsigned long old_address,
 	size_t old_size,
 	size_t new_size,
-	int flags
+	int flags,
+	unsigned long new_address
 )
 {
-	return (new_size <= old_size) ? old_address : -ENOSYS;
+	struct aspace *as = current->aspace;
+	struct tlb_batch tlb;
+	vaddr_t addr;
+	bool target_mapped = false;
+	int rv;
+
+	if ((old_address & (PAGE_SIZE - 1)) || !new_size
+	     || (flags & ~(MREMAP_MAYMOVE | MREMAP_FIXED))
+	     || ((flags & MREMAP_FIXED) && !(flags & MREMAP_MAYMOVE)))
+		return -EINVAL;
+
+	old_size = round_up(old_size, PAGE_SIZE);
+	new_size = round_up(new_size, PAGE_SIZE);
+
+	spin_lock(&as->lock);
+
+	/* Only anonymous mappings, which live in the heap's mmap area,
+	   can be resized. Others may only shrink, and stay as they are. */
+	if ((old_address < as->mmap_brk) || (old_size > as->heap_end)
+	     || (old_address > as->heap_end - old_size)) {
+		spin_unlock(&as->lock);
+		return (new_size <= old_size) ? old_address : -ENOSYS;
+	}
+
+	/* Don't move or resize memory that mmap() never handed out */
+	if (!__aspace_mmap_allocated(as, old_address, old_size)) {
+		spin_unlock(&as->lock);
+		return -EFAULT;
+	}
+
+	if (!(flags & MREMAP_FIXED)) {
+		if (new_size <= old_size) {
+			__aspace_mmap_free(as, old_address + new_size,
+			                   old_size - new_size);
+			spin_unlock(&as->lock);
+			return old_address;
+		}
+
+		/* Grow in place if the range after the mapping is unused */
+		if ((old_address + new_size <= as->heap_end) &&
+		    !__aspace_mmap_extend(as, old_address + old_size,
+		                          new_size - old_size)) {
+			spin_unlock(&as->lock);
+			memset((void *)(old_address + old_size), 0,
+			       new_size - old_size);
+			return old_address;
+		}
+
+		if (!(flags & MREMAP_MAYMOVE)) {
+			spin_unlock(&as->lock);
+			return -ENOMEM;
+		}
+
+		rv = __aspace_mmap_alloc(as, new_size, PAGE_SIZE, &addr);
+	} else {
+		addr = new_address;
+		if ((addr & (PAGE_SIZE - 1)) ||
+		    ((addr < old_address) ? (addr + new_size > old_address)
+		                          : (old_address + old_size > addr)))
+			rv = -EINVAL;
+		else if ((addr < as->brk) || (new_size > as->heap_end) ||
+		         (addr > as->heap_end - new_size))
+			rv = -ENOMEM;
+		else if (__aspace_mmap_unallocated(as, addr, new_size))
+			rv = __aspace_mmap_reserve(as, addr, new_size);
+		else {
+			/* Replaces mappings the caller has there, so they are
+			   only claimed once the move can no longer fail */
+			target_mapped = true;
+			rv = 0;
+		}
+	}
+
+	if (rv) {
+		spin_unlock(&as->lock);
+		return rv;
+	}
+
+	/* Move the mapping by exchanging its memory with the new range's,
+	   then release the old range, which now holds the new one's memory.
+	   If the exchange fails the old mapping is left as it was. */
+	rv = __aspace_swap_pmem(as, old_address, addr, min(old_size, new_size));
+	if (!rv && target_mapped) {
+		/* Reserving a range that is partly allocated needs no memory,
+		   but if it fails anyway, put the memory back */
+		rv = __aspace_mmap_reserve(as, addr, new_size);
+		if (rv)
+			__aspace_swap_pmem(as, old_address, addr,
+			                   min(old_size, new_size));
+	}
+	if (rv) {
+		if (!target_mapped)
+			__aspace_mmap_free(as, addr, new_size);
+		__aspace_take_tlb_batch(as, &tlb);
+		spin_unlock(&as->lock);
+		tlb_batch_flush(&tlb);
+		return rv;
+	}
+	__aspace_mmap_free(as, old_address, old_size);
+	__aspace_take_tlb_batch(as, &tlb);
+	spin_unlock(&as->lock);
+	tlb_batch_flush(&tlb);
+
+	if (new_size > old_size)
+		memset((void *)(addr + old_size), 0, new_size - old_size);
+
+	return addr;
 }
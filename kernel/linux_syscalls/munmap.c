@@ -12,17 +12,27 @@ sys_munmap(
 {
 	struct aspace *as  = current->aspace;
 	size_t len_aligned = round_up(len, PAGE_SIZE);
+	struct tlb_batch tlb;
+	int rv;
 
 	/* printk("[%s] IN  SYS_MUNMAP: addr=%lx, len=%lx, len_aligned=%lx\n", current->name, addr, len, len_aligned); */
 
 	/* TODO: add a million checks here that we'll simply ignore now */
 
-	/* TODO: this won't munmap() anonymous mapping - need to take care
-	   of those, too, otherwise we leak memory. */
-
 	spin_lock(&as->lock);
+
+	/* Anonymous mappings are carved out of the heap region, which stays
+	   mapped. Their address range is kept for reuse by later mmap()s. */
+	rv = __aspace_mmap_free(as, addr, len_aligned);
+	if (rv != -EINVAL) {
+		spin_unlock(&as->lock);
+		return rv;
+	}
+
 	__aspace_del_region(as, addr, len_aligned);
+	__aspace_take_tlb_batch(as, &tlb);
 	spin_unlock(&as->lock);
+	tlb_batch_flush(&tlb);
 
 	return 0;
 }
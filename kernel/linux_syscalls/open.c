@@ -23,19 +23,8 @@ sys_open(uaddr_t u_pathname,
 	dbg( "name='%s' flags %x mode %x\n", pathname, flags, mode);
 	//_KDBG( "name='%s' flags %x mode %x\n", pathname, flags, mode);
 
-	// FIX ME
 __lock(&_lock);
-	if ( ! kfs_lookup( kfs_root, pathname, 0 ) && ( flags & O_CREAT ) )  {
-		extern struct kfs_fops in_mem_fops;
-		extern struct inode_operations in_mem_iops;
-		if ( kfs_create( pathname, &in_mem_iops, &in_mem_fops, 0777, 0, 0 )
-		     == NULL ) {
-			fd = -EFAULT;
-			goto out;
-       		}
-    	}
-
-	if((fd = kfs_open_path(pathname, flags, mode, &file)) < 0) {
+	if((fd = kfs_open_or_create_at(kfs_root, pathname, flags, mode, &file)) < 0) {
 		//printk("sys_open failed : %s (%d)\n",pathname,fd);
 		goto out;
 	}
@@ -18,17 +18,13 @@ sys_openat(int     dirfd,
 	struct file *file;
 	struct inode * root_inode = NULL;
 
-	printk("openat\n");
-
 	if( strncpy_from_user( pathname, (void*) u_pathname, sizeof(pathname) ) < 0 ) {
-		printk("bad copy from user\n");
-
 		return -EFAULT;
 	}
 
 	//printk("sys_openat(%s): %d %08x %03x\n", pathname, dirfd, flags, mode);
 
-	printk( "name='%s' dirfd=%d flags %x mode %x\n", pathname, dirfd, flags, mode);
+	dbg( "name='%s' dirfd=%d flags %x mode %x\n", pathname, dirfd, flags, mode);
 	//_KDBG( "name='%s' flags %x mode %x\n", pathname, flags, mode);
 
 	if ((pathname[0] == '/') ||
@@ -41,23 +37,17 @@ sys_openat(int     dirfd,
 		return -EBADF;
 	    }
 
+	    /* Pipes and other anonymous files have no inode */
+	    if (!root_file->inode) {
+		return -ENOTDIR;
+	    }
+
 	    root_inode = root_file->inode;
 	}
 
 
-	// FIX ME
 __lock(&_lock);
-	if ( ! kfs_lookup( root_inode, pathname, 0 ) && ( flags & O_CREAT ) )  {
-		extern struct kfs_fops in_mem_fops;
-		extern struct inode_operations in_mem_iops;
-		if ( kfs_create_at( root_inode, pathname, &in_mem_iops, &in_mem_fops, 0777, 0, 0 )
-		     == NULL ) {
-			fd = -EFAULT;
-			goto out;
-       		}
-    	}
-
-	if((fd = kfs_open_path_at(root_inode, pathname, flags, mode, &file)) < 0) {
+	if((fd = kfs_open_or_create_at(root_inode, pathname, flags, mode, &file)) < 0) {
 		//printk("sys_openat failed : %s (%d)\n",pathname,fd);
 		goto out;
 	}
@@ -66,7 +56,7 @@ __lock(&_lock);
 
 	// TODO XXX - check to see if the file's path identifies it as a pipe, and set the pipe stuff
 
-        printk("name=`%s` fd=%d \n", pathname, fd );
+        dbg("name=`%s` fd=%d \n", pathname, fd );
 out:
 __unlock(&_lock);
 	return fd;
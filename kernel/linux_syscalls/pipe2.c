@@ -1,18 +1,28 @@
 #include <lwk/kfs.h>
+#include <arch/uaccess.h>
 #include <arch-generic/fcntl.h>
 
+/** Pipe2 system call
+ *
+ * \todo There are no per-fd flags yet, so O_CLOEXEC is accepted but has
+ * no effect.
+ */
 int
-sys_pipe2(int fd[2], int flags)
+sys_pipe2(int __user fd[2], int flags)
 {
-	int ret = -EFAULT;
-	int fd_read, fd_write;
+	int fds[2];
+	int ret;
 
-	if (flags == 0) {
-		return sys_pipe(fd);
-	} else {
+	if (flags & ~(O_NONBLOCK | O_CLOEXEC)) {
 		printk("Unimplemented pipe2 flags (%x)\n", flags);
 		return -EINVAL;
 	}
 
-}
+	if ((ret = pipe_create(fds, flags)) != 0)
+		return ret;
+
+	if (copy_to_user(fd, fds, sizeof(fds)))
+		return -EFAULT;
 
+	return 0;
+}
@@ -344,7 +344,7 @@ sys_poll(struct pollfd *fds, nfds_t nfds, int timeout)
 
 		len = min(todo, POLLFD_PER_PAGE);
 		size = sizeof(struct poll_list) + sizeof(struct pollfd) * len;
-		walk = walk->next = kmem_alloc(size);
+		walk = walk->next = kmem_alloc_nozero(size);
 		if (!walk) {
 			err = -ENOMEM;
 			goto out_fds;
@@ -426,7 +426,7 @@ sys_ppoll(struct pollfd *fds, nfds_t nfds,
 
 		len = min(todo, POLLFD_PER_PAGE);
 		size = sizeof(struct poll_list) + sizeof(struct pollfd) * len;
-		walk = walk->next = kmem_alloc(size);
+		walk = walk->next = kmem_alloc_nozero(size);
 		if (!walk) {
 			err = -ENOMEM;
 			goto out_fds;
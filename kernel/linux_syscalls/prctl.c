@@ -0,0 +1,44 @@
+#include <lwk/kernel.h>
+#include <lwk/task.h>
+#include <lwk/aspace.h>
+
+#define PR_SET_THP_DISABLE	41
+#define PR_GET_THP_DISABLE	42
+
+long
+sys_prctl(int option, unsigned long arg2, unsigned long arg3,
+          unsigned long arg4, unsigned long arg5)
+{
+	struct aspace *as = current->aspace;
+	struct tlb_batch tlb;
+	int rv = 0;
+
+	switch (option) {
+	case PR_SET_THP_DISABLE:
+		if (arg3 || arg4 || arg5)
+			return -EINVAL;
+
+		/*
+		 * Disabling keeps all of the aspace to small pages, re-enabling
+		 * only affects regions created from then on.
+		 */
+		spin_lock(&as->lock);
+		as->hugepage = !arg2;
+		if (arg2)
+			rv = __aspace_set_hugepage(as, 0, ULONG_MAX, false);
+		__aspace_take_tlb_batch(as, &tlb);
+		spin_unlock(&as->lock);
+		tlb_batch_flush(&tlb);
+		return rv;
+
+	case PR_GET_THP_DISABLE:
+		if (arg2 || arg3 || arg4 || arg5)
+			return -EINVAL;
+		return !as->hugepage;
+	}
+
+	printk(KERN_WARNING
+	       "sys_prctl() option=%d not supported (task=%u.%u, %s)\n",
+	       option, current->aspace->id, current->id, current->name);
+	return -EINVAL;
+}
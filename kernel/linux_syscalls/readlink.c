@@ -7,12 +7,18 @@ sys_readlink(const char __user *path, char __user *buf, size_t bufsiz)
 {
 	char p[2048];
 	size_t len;
+__lock(&_lock);
 	struct inode * const inode = kfs_lookup(NULL, path, 0);
-	if(!inode)
+	if(!inode) {
+		__unlock(&_lock);
 		return -ENOENT;
-	if(!S_ISLNK(inode->mode) || !inode->link_target)
+	}
+	if(!S_ISLNK(inode->mode) || !inode->link_target) {
+		__unlock(&_lock);
 		return -EINVAL;
+	}
 	get_full_path(inode->link_target, p);
+__unlock(&_lock);
 	len = strlen(p);
 	if(len > bufsiz)
 		return -ENAMETOOLONG;
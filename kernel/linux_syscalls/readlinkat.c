@@ -28,16 +28,27 @@ sys_readlinkat(int dirfd, const char __user *path, char __user *buf, size_t bufs
 		return -EBADF;
 	    }
 
+	    /* Pipes and other anonymous files have no inode */
+	    if (!root_file->inode) {
+		return -ENOTDIR;
+	    }
+
 	    root_inode = root_file->inode;
 	}
 
 	
+__lock(&_lock);
 	inode = kfs_lookup(root_inode, pathname, 0);
-	if(!inode)
+	if(!inode) {
+		__unlock(&_lock);
 		return -ENOENT;
-	if(!S_ISLNK(inode->mode) || !inode->link_target)
+	}
+	if(!S_ISLNK(inode->mode) || !inode->link_target) {
+		__unlock(&_lock);
 		return -EINVAL;
+	}
 	get_full_path(inode->link_target, p);
+__unlock(&_lock);
 	len = strlen(p);
 	if(len > bufsiz)
 		return -ENAMETOOLONG;
@@ -15,7 +15,7 @@ sys_readv(int fd, uaddr_t uvec, int count)
 		return -EINVAL;
 	if(!file->f_op->read) {
 		printk( KERN_WARNING "%s: fd %d (%s) has no read operation\n",
-			__func__, fd, file->inode->name );
+			__func__, fd, file_name(file) );
 		return -EINVAL;
 	}
 
@@ -33,7 +33,7 @@ __lock(&_lock);
 		goto out;
 	}
 
-	htable_del( inode->parent->files, inode );
+	kfs_del_dirent( inode );
 
 	kfs_destroy( inode );
 
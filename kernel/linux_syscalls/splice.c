@@ -0,0 +1,40 @@
+#include <lwk/kfs.h>
+#include <arch/uaccess.h>
+
+ssize_t
+sys_splice(int               fd_in,
+	   loff_t __user *   u_off_in,
+	   int               fd_out,
+	   loff_t __user *   u_off_out,
+	   size_t            len,
+	   unsigned int      flags)
+{
+	struct file * in  = get_current_file(fd_in);
+	struct file * out = get_current_file(fd_out);
+	loff_t off_in, off_out;
+	ssize_t ret;
+
+	if (!in || !out)
+		return -EBADF;
+
+	if (u_off_in && copy_from_user(&off_in, u_off_in, sizeof(off_in)))
+		return -EFAULT;
+	if (u_off_out && copy_from_user(&off_out, u_off_out, sizeof(off_out)))
+		return -EFAULT;
+
+	if ((u_off_in && (off_in < 0)) || (u_off_out && (off_out < 0)))
+		return -EINVAL;
+
+	ret = pipe_splice(in,  u_off_in  ? &off_in  : NULL,
+			  out, u_off_out ? &off_out : NULL,
+			  len, flags);
+
+	if (ret > 0) {
+		if (u_off_in && copy_to_user(u_off_in, &off_in, sizeof(off_in)))
+			return -EFAULT;
+		if (u_off_out && copy_to_user(u_off_out, &off_out, sizeof(off_out)))
+			return -EFAULT;
+	}
+
+	return ret;
+}
@@ -0,0 +1,16 @@
+#include <lwk/kfs.h>
+
+ssize_t
+sys_tee(int           fd_in,
+	int           fd_out,
+	size_t        len,
+	unsigned int  flags)
+{
+	struct file * in  = get_current_file(fd_in);
+	struct file * out = get_current_file(fd_out);
+
+	if (!in || !out)
+		return -EBADF;
+
+	return pipe_tee(in, out, len, flags);
+}
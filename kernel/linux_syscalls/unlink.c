@@ -35,7 +35,7 @@ __lock(&_lock);
 		}
 	}
 
-	htable_del( inode->parent->files, inode );
+	kfs_del_dirent( inode );
 
 	kfs_destroy( inode );
 
@@ -9,10 +9,6 @@ sys_writev(int fd, uaddr_t uvec, int count)
 	struct iovec vector;
 	struct file * const file = get_current_file( fd );
 	ssize_t ret = 0, tret;
-	//if (file != NULL && file->pipe_end_type == PIPE_END_WRITE) {
-	//	fd = file->pipe_other_fd;
-	//	file = get_current_file( fd );
-	//}
 
 	if(!file)
 		return -EBADF;
@@ -22,7 +18,7 @@ sys_writev(int fd, uaddr_t uvec, int count)
 
 	if(!file->f_op->write) {
 		printk( KERN_WARNING "%s: fd %d (%s) has no write operation\n",
-			__func__, fd, file->inode->name);
+			__func__, fd, file_name(file));
 		return -EINVAL;
 	}
 
@@ -0,0 +1,17 @@
+#include <lwk/task.h>
+#include <lwk/aspace.h>
+
+int
+sys_aspace_set_load_balance(
+         id_t         aspace_id,
+         unsigned int threshold
+)
+{
+	if (current->uid != 0)
+		return -EPERM;
+
+	if (aspace_id == MY_ID)
+		aspace_get_myid(&aspace_id);
+
+	return aspace_set_load_balance(aspace_id, threshold);
+}
@@ -218,6 +218,36 @@ start_kernel()
 	measure_noise(0, 0);
 #endif
 
+#ifdef CONFIG_DEBUG_ASPACE_BENCH
+	/* Measure aspace region lookup cost vs. number of regions */
+	extern void aspace_lookup_bench(void);
+	aspace_lookup_bench();
+#endif
+
+#ifdef CONFIG_DEBUG_XCALL_BENCH
+	/* Measure cross-call round-trip time vs. number of CPUs */
+	extern void xcall_latency_bench(void);
+	xcall_latency_bench();
+#endif
+
+#ifdef CONFIG_DEBUG_TIMER_BENCH
+	/* Measure timer re-arm cost vs. number of pending timers */
+	extern void timer_churn_bench(void);
+	timer_churn_bench();
+#endif
+
+#ifdef CONFIG_DEBUG_E1000_BENCH
+	/* Measure e1000 transmit throughput vs. frame size */
+	extern void e1000_tx_bench(void);
+	e1000_tx_bench();
+#endif
+
+#ifdef CONFIG_DEBUG_INMEMFS_BENCH
+	/* Measure in-memory file system throughput */
+	extern void in_mem_fs_bench(void);
+	in_mem_fs_bench();
+#endif
+
 #ifdef CONFIG_HIO_SYSCALL
 	/*
 	 * Initialize the HIO system call subsystem
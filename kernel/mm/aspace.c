@@ -8,10 +8,13 @@
 #include <lwk/htable.h>
 #include <lwk/log2.h>
 #include <lwk/cpuinfo.h>
+#include <lwk/smp.h>
 #include <lwk/pmem.h>
 #include <lwk/tlbflush.h>
 #include <lwk/waitq.h>
 #include <lwk/sched.h>
+#include <lwk/params.h>
+#include <arch/tsc.h>
 
 /**
  * Hash table used to lookup address space structures by ID.
@@ -24,6 +27,12 @@ static DEFINE_SPINLOCK(htable_lock);
  */
 static id_t aspace_next_id = UASPACE_MIN_ID;
 
+/**
+ * Default large-page policy of new address spaces, see aspace->hugepage.
+ */
+static bool hugepage = true;
+param(hugepage, bool);
+
 /**
  * Memory region structure. A memory region represents a contiguous region 
  * [start, end) of valid memory addresses in an address space.
@@ -35,6 +44,9 @@ struct region
 {
 	struct aspace *  aspace;   /**< Address space this region belongs to */
 	struct list_head link;     /**< Linkage in the aspace->region_list */
+	struct rb_node   node;     /**< Linkage in the aspace->region_tree */
+	struct list_head smartmap_link; /**< Linkage in aspace->smartmap_list,
+	                                     only if (flags & VM_SMARTMAP) */
 
 	vaddr_t          start;    /**< Starting address of the region */
 	vaddr_t          end;      /**< 1st byte after end of the region */
@@ -45,6 +57,95 @@ struct region
 	char             name[16]; /**< Human-readable name of the region */
 };
 
+/**
+ * Unused range [start, end) of the heap's anonymous mmap() area. These are
+ * left behind when memory in the area is munmap()'ed, and are reused by
+ * later mmap()s before the area is grown down towards brk.
+ */
+struct mmap_hole
+{
+	struct list_head link;     /**< Linkage in the aspace->mmap_holes */
+	vaddr_t          start;    /**< Starting address of the hole */
+	vaddr_t          end;      /**< 1st byte after end of the hole */
+};
+
+/**
+ * Range [start, end) of a VM_HUGEPAGE region that has opted out of large
+ * pages. Each range lies within a single region, regions without
+ * VM_HUGEPAGE have none.
+ */
+struct nohugepage_range
+{
+	struct list_head link;     /**< Linkage in the aspace->nohugepage */
+	vaddr_t          start;    /**< Starting address of the range */
+	vaddr_t          end;      /**< 1st byte after end of the range */
+};
+
+/**
+ * Returns the page sizes that memory in a region may be mapped with. Unless
+ * the region has opted out of large pages, any supported page size at least
+ * as large as the region's may be used where alignment allows. Parts of the
+ * region may still have opted out, see region_map_range().
+ */
+static vmpagesize_t
+region_pagesz_mask(struct region *rgn)
+{
+	if (!(rgn->flags & VM_HUGEPAGE))
+		return rgn->pagesz;
+	return cpu_info[0].pagesz_mask & ~(rgn->pagesz - 1);
+}
+
+/**
+ * Maps [start, start + extent) of region rgn to the physical memory at
+ * paddr, using the page sizes in pagesz_mask except in the ranges that
+ * have opted out of large pages, which get the region's page size only.
+ */
+static int
+region_map_range(struct aspace *aspace, struct region *rgn,
+                 vaddr_t start, paddr_t paddr, size_t extent,
+                 vmpagesize_t pagesz_mask)
+{
+	struct nohugepage_range *range;
+	vaddr_t end = start + extent;
+	vaddr_t va = start;
+	vaddr_t e;
+	int status;
+
+	if (pagesz_mask == rgn->pagesz)
+		goto out;
+
+	list_for_each_entry(range, &aspace->nohugepage, link) {
+		if (range->end <= va)
+			continue;
+		if (range->start >= end)
+			break;
+
+		if (range->start > va) {
+			status = arch_aspace_map_range(aspace, va,
+			                               paddr + (va - start),
+			                               range->start - va,
+			                               rgn->flags, pagesz_mask);
+			if (status)
+				return status;
+			va = range->start;
+		}
+
+		e = min(range->end, end);
+		status = arch_aspace_map_range(aspace, va, paddr + (va - start),
+		                               e - va, rgn->flags, rgn->pagesz);
+		if (status)
+			return status;
+		va = e;
+	}
+
+out:
+	if (va >= end)
+		return 0;
+
+	return arch_aspace_map_range(aspace, va, paddr + (va - start),
+	                             end - va, rgn->flags, pagesz_mask);
+}
+
 
 /**
  * This calculates a region's end address. Normally end is the address of the
@@ -63,31 +164,59 @@ calc_end(vaddr_t start, size_t extent)
 
 /**
  * Locates the region covering the specified address.
+ *
+ * The aspace's last-hit region is checked first since consecutive lookups
+ * usually land in the same region (e.g., when mapping a region page by
+ * page), otherwise the region tree is searched.
  */
 static struct region *
 find_region(struct aspace *aspace, vaddr_t addr)
 {
-	struct region *rgn;
-	
-	list_for_each_entry(rgn, &aspace->region_list, link) {
-		if ((rgn->start <= addr) && (rgn->end > addr))
+	struct rb_node *n = aspace->region_tree.rb_node;
+	struct region *rgn = aspace->region_hint;
+
+	if (rgn && (rgn->start <= addr) && (rgn->end > addr))
+		return rgn;
+
+	while (n) {
+		rgn = rb_entry(n, struct region, node);
+		if (addr < rgn->start) {
+			n = n->rb_left;
+		} else if (addr >= rgn->end) {
+			n = n->rb_right;
+		} else {
+			aspace->region_hint = rgn;
 			return rgn;
+		}
 	}
 	return NULL;
 }
 
 /**
  * Finds a region that overlaps the specified interval.
+ *
+ * Regions do not overlap, so the region ends are sorted the same as the
+ * region starts. The only candidate is the lowest region ending after the
+ * interval starts.
  */
 static struct region *
 find_overlapping_region(struct aspace *aspace, vaddr_t start, vaddr_t end)
 {
-	struct region *rgn;
-
-	list_for_each_entry(rgn, &aspace->region_list, link) {
-		if ((start < rgn->end) && (end > rgn->start))
-			return rgn;
+	struct rb_node *n = aspace->region_tree.rb_node;
+	struct region *rgn, *first = NULL;
+
+	while (n) {
+		rgn = rb_entry(n, struct region, node);
+		if (rgn->end > start) {
+			first = rgn;
+			n = n->rb_left;
+		} else {
+			n = n->rb_right;
+		}
 	}
+
+	if (first && (end > first->start))
+		return first;
 	return NULL;
 }
 
@@ -99,13 +228,85 @@ find_smartmap_region(struct aspace *aspace, id_t src_aspace)
 {
 	struct region *rgn;
 	
-	list_for_each_entry(rgn, &aspace->region_list, link) {
-		if ((rgn->flags & VM_SMARTMAP) && (rgn->smartmap == src_aspace))
+	list_for_each_entry(rgn, &aspace->smartmap_list, smartmap_link) {
+		if (rgn->smartmap == src_aspace)
 			return rgn;
 	}
 	return NULL;
 }
 
+/**
+ * Inserts a region into an address space's region tree and sorted region
+ * list. The caller must have verified that the region does not overlap
+ * any existing region.
+ */
+static void
+insert_region(struct aspace *aspace, struct region *rgn)
+{
+	struct rb_node **link = &aspace->region_tree.rb_node;
+	struct rb_node *parent = NULL;
+	struct rb_node *next;
+	struct region *cur;
+
+	while (*link) {
+		parent = *link;
+		cur = rb_entry(parent, struct region, node);
+		if (rgn->start < cur->start)
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+	rb_link_node(&rgn->node, parent, link);
+	rb_insert_color(&rgn->node, &aspace->region_tree);
+
+	/* Keep region_list sorted, the successor in the tree is the next entry */
+	if ((next = rb_next(&rgn->node)) != NULL)
+		list_add_tail(&rgn->link,
+		              &rb_entry(next, struct region, node)->link);
+	else
+		list_add_tail(&rgn->link, &aspace->region_list);
+
+	if (rgn->flags & VM_SMARTMAP)
+		list_add_tail(&rgn->smartmap_link, &aspace->smartmap_list);
+}
+
+/**
+ * Removes a region from an address space's region tree and region list.
+ */
+static void
+remove_region(struct aspace *aspace, struct region *rgn)
+{
+	if (aspace->region_hint == rgn)
+		aspace->region_hint = NULL;
+
+	if (rgn->flags & VM_SMARTMAP)
+		list_del(&rgn->smartmap_link);
+
+	rb_erase(&rgn->node, &aspace->region_tree);
+	list_del(&rgn->link);
+}
+
+/**
+ * Records that [start, end) has been unmapped from an address space and
+ * must be invalidated in the TLBs of the CPUs the aspace is active on.
+ * Ranges accumulate until __aspace_take_tlb_batch() is called, so several
+ * unmaps are covered by one shootdown.
+ */
+static void
+tlb_batch_add(struct aspace *aspace, vaddr_t start, vaddr_t end)
+{
+	if (aspace->tlb_flush_start == aspace->tlb_flush_end) {
+		aspace->tlb_flush_start = start;
+		aspace->tlb_flush_end   = end;
+		return;
+	}
+
+	if (start < aspace->tlb_flush_start)
+		aspace->tlb_flush_start = start;
+	if (end > aspace->tlb_flush_end)
+		aspace->tlb_flush_end = end;
+}
+
 /**
  * Looks up an aspace object by ID and returns it with its spinlock locked.
  */
@@ -196,6 +397,7 @@ aspace_subsys_init(void)
 	/* Switch to the newly created kernel address space */
 	if ((current->aspace = aspace_acquire(KERNEL_ASPACE_ID)) == NULL)
 		panic("Failed to acquire kernel aspace.");
+	cpu_set(this_cpu, current->aspace->tlb_cpus);
 	arch_aspace_activate(current->aspace);
 
 	return 0;
@@ -278,6 +480,11 @@ aspace_create(id_t id_request, const char *name, id_t *id)
 	aspace->id = new_id;
 	spin_lock_init(&aspace->lock);
 	list_head_init(&aspace->region_list);
+	aspace->region_tree = RB_ROOT;
+	list_head_init(&aspace->smartmap_list);
+	list_head_init(&aspace->mmap_holes);
+	list_head_init(&aspace->nohugepage);
+	aspace->hugepage = hugepage;
 	hlist_node_init(&aspace->ht_link);
 	sema_init(&aspace->mmap_sem, 1);
 	if (name)
@@ -389,12 +596,24 @@ aspace_destroy(id_t id)
 			BUG_ON(src == NULL);
 			spin_lock(&src->lock);
 			--src->refcnt;
+			--src->smartmap_refcnt;
 			spin_unlock(&src->lock);
 			spin_unlock_irqrestore(&htable_lock, irqstate);
 		}
 		list_del(&rgn->link);
 		kmem_free(rgn);
 	}
+	list_for_each_safe(pos, tmp, &aspace->mmap_holes) {
+		list_del(pos);
+		kmem_free(list_entry(pos, struct mmap_hole, link));
+	}
+	list_for_each_safe(pos, tmp, &aspace->nohugepage) {
+		list_del(pos);
+		kmem_free(list_entry(pos, struct nohugepage_range, link));
+	}
+#ifdef CONFIG_HIO_SYSCALL
+	hio_uring_release(aspace);
+#endif
 	arch_aspace_destroy(aspace);
 	kmem_free(aspace);
 	return 0;
@@ -499,6 +718,309 @@ aspace_find_hole(id_t id,
 }
 
 
+/**
+ * Adds [start, end) to the heap's mmap() holes, merging it with any holes
+ * it overlaps or touches. A hole that ends up at the bottom of the mmap()
+ * area is handed back to the area's free space below mmap_brk.
+ */
+static int
+mmap_hole_insert(struct aspace *aspace, vaddr_t start, vaddr_t end)
+{
+	struct mmap_hole *hole, *next, *new;
+
+	/* Find the first hole that ends at or after start */
+	list_for_each_entry(hole, &aspace->mmap_holes, link) {
+		if (hole->end >= start)
+			break;
+	}
+
+	if ((&hole->link != &aspace->mmap_holes) && (hole->start <= end)) {
+		hole->start = min(hole->start, start);
+		hole->end   = max(hole->end, end);
+
+		/* Absorb following holes that now overlap or touch */
+		while (hole->link.next != &aspace->mmap_holes) {
+			next = list_entry(hole->link.next, struct mmap_hole, link);
+			if (next->start > hole->end)
+				break;
+			hole->end = max(hole->end, next->end);
+			list_del(&next->link);
+			kmem_free(next);
+		}
+	} else {
+		if ((new = kmem_alloc(sizeof(*new))) == NULL)
+			return -ENOMEM;
+		new->start = start;
+		new->end   = end;
+		list_add_tail(&new->link, &hole->link);
+	}
+
+	hole = list_entry(aspace->mmap_holes.next, struct mmap_hole, link);
+	if (hole->start == aspace->mmap_brk) {
+		aspace->mmap_brk = hole->end;
+		list_del(&hole->link);
+		kmem_free(hole);
+	}
+
+	return 0;
+}
+
+/**
+ * Removes [start, end) from the heap's mmap() holes.
+ */
+static int
+mmap_hole_remove(struct aspace *aspace, vaddr_t start, vaddr_t end)
+{
+	struct mmap_hole *hole, *tmp, *new;
+
+	list_for_each_entry_safe(hole, tmp, &aspace->mmap_holes, link) {
+		if (hole->end <= start)
+			continue;
+		if (hole->start >= end)
+			break;
+
+		if ((hole->start < start) && (hole->end > end)) {
+			/* Split the hole in two */
+			if ((new = kmem_alloc(sizeof(*new))) == NULL)
+				return -ENOMEM;
+			new->start = end;
+			new->end   = hole->end;
+			hole->end  = start;
+			list_add(&new->link, &hole->link);
+			break;
+		}
+
+		if (hole->start < start) {
+			hole->end = start;
+		} else if (hole->end > end) {
+			hole->start = end;
+		} else {
+			list_del(&hole->link);
+			kmem_free(hole);
+		}
+	}
+
+	return 0;
+}
+
+static int
+mmap_alloc(struct aspace *aspace, size_t extent, size_t alignment,
+           vaddr_t *start)
+{
+	struct mmap_hole *hole;
+	vaddr_t addr;
+	int status;
+
+	list_for_each_entry_reverse(hole, &aspace->mmap_holes, link) {
+		if ((hole->end - hole->start) < extent)
+			continue;
+		addr = round_down(hole->end - extent, alignment);
+		if (addr < hole->start)
+			continue;
+
+		if ((status = mmap_hole_remove(aspace, addr, addr + extent)))
+			return status;
+		*start = addr;
+		return 0;
+	}
+
+	/* No hole fits, grow the mmap() area down towards brk */
+	addr = round_down(aspace->mmap_brk - extent, alignment);
+	if ((addr <= aspace->brk) || (addr >= aspace->mmap_brk))
+		return -ENOMEM;
+
+	/* Keep any alignment padding for later */
+	if (addr + extent < aspace->mmap_brk) {
+		status = mmap_hole_insert(aspace, addr + extent,
+		                          aspace->mmap_brk);
+		if (status)
+			return status;
+	}
+
+	aspace->mmap_brk = addr;
+	*start = addr;
+	return 0;
+}
+
+/**
+ * Allocates extent bytes of address space from the heap's anonymous mmap()
+ * area. Holes left by earlier munmap()s are reused, highest address first,
+ * before the area is grown down towards brk. The memory is already mapped,
+ * as the whole heap region is backed when it is created.
+ *
+ * If the heap may use large pages, allocations of at least a large page are
+ * aligned to the largest one that fits, when the heap's physical memory is
+ * aligned the same way, so that they end up mapped with large pages.
+ */
+int
+__aspace_mmap_alloc(struct aspace *aspace,
+                    size_t extent, size_t alignment,
+                    vaddr_t *start)
+{
+	struct region *heap;
+	vmpagesize_t pagesz;
+	paddr_t paddr;
+
+	if (!aspace || !extent || !is_power_of_2(alignment))
+		return -EINVAL;
+
+	heap = find_region(aspace, aspace->heap_start);
+	if (heap && (heap->flags & VM_HUGEPAGE) &&
+	    !arch_aspace_virt_to_phys(aspace, heap->start, &paddr)) {
+		for (pagesz = VM_PAGE_1GB; pagesz > alignment; pagesz >>= 9) {
+			if (!(region_pagesz_mask(heap) & pagesz) ||
+			    (extent < pagesz) ||
+			    ((paddr - heap->start) & (pagesz - 1)))
+				continue;
+			if (!mmap_alloc(aspace, extent, pagesz, start))
+				return 0;
+		}
+	}
+
+	return mmap_alloc(aspace, extent, alignment, start);
+}
+
+/**
+ * Claims [start, start + extent) of the heap's anonymous mmap() area for a
+ * MAP_FIXED mapping, growing the area down to start if needed. Memory that
+ * is already allocated in the range stays allocated. Fails for lack of
+ * memory only when none of the range was allocated before.
+ *
+ * start may be the heap's break itself, as the break is the first byte
+ * brk() has not handed out. The heap then can't grow until the mapping is
+ * unmapped, since sys_brk() keeps the break below mmap_brk.
+ */
+int
+__aspace_mmap_reserve(struct aspace *aspace, vaddr_t start, size_t extent)
+{
+	vaddr_t end = start + extent;
+	int status;
+
+	if (!aspace || !extent || (end < start))
+		return -EINVAL;
+
+	if ((start < aspace->brk) || (end > aspace->heap_end))
+		return -ENOMEM;
+
+	if (start < aspace->mmap_brk) {
+		if (end < aspace->mmap_brk) {
+			status = mmap_hole_insert(aspace, end, aspace->mmap_brk);
+			if (status)
+				return status;
+		}
+		aspace->mmap_brk = start;
+	}
+
+	return mmap_hole_remove(aspace, start, end);
+}
+
+/**
+ * Claims [start, start + extent) of the heap's anonymous mmap() area, but
+ * only if all of it is unused. Used by mremap() to grow a mapping in place.
+ */
+int
+__aspace_mmap_extend(struct aspace *aspace, vaddr_t start, size_t extent)
+{
+	vaddr_t end = start + extent;
+	struct mmap_hole *hole;
+
+	if (!aspace || !extent || (end < start))
+		return -EINVAL;
+
+	list_for_each_entry(hole, &aspace->mmap_holes, link) {
+		if (hole->end <= start)
+			continue;
+		if ((hole->start > start) || (hole->end < end))
+			break;
+		return mmap_hole_remove(aspace, start, end);
+	}
+
+	return -ENOMEM;
+}
+
+/**
+ * Returns [start, start + extent) to the heap's anonymous mmap() area.
+ * Returns -EINVAL if the range is not in the heap region.
+ */
+int
+__aspace_mmap_free(struct aspace *aspace, vaddr_t start, size_t extent)
+{
+	vaddr_t end = start + extent;
+
+	if (!aspace || (end < start))
+		return -EINVAL;
+
+	if ((start < aspace->heap_start) || (end > aspace->heap_end)
+	     || (start == end))
+		return -EINVAL;
+
+	/* Nothing below mmap_brk has been handed out by mmap() */
+	start = max(start, aspace->mmap_brk);
+	if (start >= end)
+		return 0;
+
+	return mmap_hole_insert(aspace, start, end);
+}
+
+/**
+ * Returns true if all of [start, start + extent) has been handed out by the
+ * heap's anonymous mmap() area, i.e. it is above mmap_brk and in no hole.
+ */
+bool
+__aspace_mmap_allocated(struct aspace *aspace, vaddr_t start, size_t extent)
+{
+	vaddr_t end = start + extent;
+	struct mmap_hole *hole;
+
+	if (!aspace || !extent || (end < start))
+		return false;
+
+	if ((start < aspace->mmap_brk) || (end > aspace->heap_end))
+		return false;
+
+	list_for_each_entry(hole, &aspace->mmap_holes, link) {
+		if (hole->start >= end)
+			break;
+		if (hole->end > start)
+			return false;
+	}
+
+	return true;
+}
+
+/**
+ * Returns true if none of [start, start + extent) of the heap's anonymous
+ * mmap() area has been handed out, i.e. all of it is below mmap_brk or in
+ * holes.
+ */
+bool
+__aspace_mmap_unallocated(struct aspace *aspace, vaddr_t start, size_t extent)
+{
+	vaddr_t end = start + extent;
+	vaddr_t pos = start;
+	struct mmap_hole *hole;
+
+	if (!aspace || !extent || (end < start))
+		return false;
+
+	if ((start < aspace->heap_start) || (end > aspace->heap_end))
+		return false;
+
+	pos = max(pos, aspace->mmap_brk);
+
+	list_for_each_entry(hole, &aspace->mmap_holes, link) {
+		if (pos >= end)
+			break;
+		if (hole->end <= pos)
+			continue;
+		if (hole->start > pos)
+			return false;
+		pos = hole->end;
+	}
+
+	return pos >= end;
+}
+
 int
 __aspace_add_region(struct aspace *aspace,
                     vaddr_t start, size_t extent,
@@ -507,7 +1029,6 @@ __aspace_add_region(struct aspace *aspace,
 {
 	struct region *rgn;
 	struct region *cur;
-	struct list_head *pos;
 	vaddr_t end = calc_end(start, extent);
 
 	if (!aspace || !start)
@@ -553,13 +1074,11 @@ __aspace_add_region(struct aspace *aspace,
 	}
 
 	/* Region must not overlap with any existing regions */
-	list_for_each_entry(cur, &aspace->region_list, link) {
-		if ((start < cur->end) && (end > cur->start)) {
-			printk(KERN_WARNING
-			       "Region overlaps with existing region (0x%lx--0x%lx overlaps with existing 0x%lx--0x%lx).\n",
-			       start, end, cur->start, cur->end);
-			return -ENOTUNIQ;
-		}
+	if ((cur = find_overlapping_region(aspace, start, end)) != NULL) {
+		printk(KERN_WARNING
+		       "Region overlaps with existing region (0x%lx--0x%lx overlaps with existing 0x%lx--0x%lx).\n",
+		       start, end, cur->start, cur->end);
+		return -ENOTUNIQ;
 	}
 
 	/* Allocate and initialize a new region object */
@@ -571,6 +1090,8 @@ __aspace_add_region(struct aspace *aspace,
 	rgn->end    = end;
 	rgn->flags  = flags;
 	rgn->pagesz = pagesz;
+	if (aspace->hugepage && !(flags & VM_SMARTMAP))
+		rgn->flags |= VM_HUGEPAGE;
 	if (name)
 		strlcpy(rgn->name, name, sizeof(rgn->name));
 
@@ -582,13 +1103,213 @@ __aspace_add_region(struct aspace *aspace,
 		aspace->mmap_brk   = aspace->heap_end;
 	}
 
-	/* Insert region into address space's sorted region list */
-	list_for_each(pos, &aspace->region_list) {
-		cur = list_entry(pos, struct region, link);
-		if (cur->start > rgn->start)
+	/* Insert region into address space's region index */
+	insert_region(aspace, rgn);
+	return 0;
+}
+
+/**
+ * Opts [start, end) of region rgn out of large pages, merging it with the
+ * region's opted out ranges that it overlaps or touches.
+ */
+static int
+nohugepage_insert(struct aspace *aspace, struct region *rgn,
+                  vaddr_t start, vaddr_t end)
+{
+	struct nohugepage_range *range, *next, *new;
+
+	/* Find the region's first range that ends at or after start */
+	list_for_each_entry(range, &aspace->nohugepage, link) {
+		if ((range->end >= start) && (range->start >= rgn->start))
 			break;
 	}
-	list_add_tail(&rgn->link, pos);
+
+	if ((&range->link != &aspace->nohugepage) &&
+	    (range->start <= end) && (range->start < rgn->end)) {
+		range->start = min(range->start, start);
+		range->end   = max(range->end, end);
+
+		/* Absorb following ranges that now overlap or touch */
+		while (range->link.next != &aspace->nohugepage) {
+			next = list_entry(range->link.next,
+			                  struct nohugepage_range, link);
+			if ((next->start > range->end) ||
+			    (next->start >= rgn->end))
+				break;
+			range->end = max(range->end, next->end);
+			list_del(&next->link);
+			kmem_free(next);
+		}
+	} else {
+		if ((new = kmem_alloc(sizeof(*new))) == NULL)
+			return -ENOMEM;
+		new->start = start;
+		new->end   = end;
+		list_add_tail(&new->link, &range->link);
+	}
+
+	return 0;
+}
+
+/**
+ * Opts [start, end) back in to large pages. Only splitting a range needs
+ * memory, so dropping all of a region's ranges can't fail.
+ */
+static int
+nohugepage_remove(struct aspace *aspace, vaddr_t start, vaddr_t end)
+{
+	struct nohugepage_range *range, *tmp, *new;
+
+	list_for_each_entry_safe(range, tmp, &aspace->nohugepage, link) {
+		if (range->end <= start)
+			continue;
+		if (range->start >= end)
+			break;
+
+		if ((range->start < start) && (range->end > end)) {
+			/* Split the range in two */
+			if ((new = kmem_alloc(sizeof(*new))) == NULL)
+				return -ENOMEM;
+			new->start = end;
+			new->end   = range->end;
+			range->end = start;
+			list_add(&new->link, &range->link);
+			break;
+		}
+
+		if (range->start < start) {
+			range->end = start;
+		} else if (range->end > end) {
+			range->start = end;
+		} else {
+			list_del(&range->link);
+			kmem_free(range);
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Lets [s, e) of region rgn use large pages. If the region had opted out
+ * as a whole, the rest of it stays out.
+ */
+static int
+region_allow_hugepage(struct aspace *aspace, struct region *rgn,
+                      vaddr_t s, vaddr_t e)
+{
+	int status;
+
+	if (rgn->flags & VM_HUGEPAGE)
+		return nohugepage_remove(aspace, s, e);
+
+	if ((s > rgn->start) &&
+	    (status = nohugepage_insert(aspace, rgn, rgn->start, s)))
+		return status;
+
+	if ((e < rgn->end) &&
+	    (status = nohugepage_insert(aspace, rgn, e, rgn->end))) {
+		nohugepage_remove(aspace, rgn->start, s);
+		return status;
+	}
+
+	rgn->flags |= VM_HUGEPAGE;
+	return 0;
+}
+
+/**
+ * Keeps [s, e) of region rgn to the region's page size. Once all of the
+ * region has opted out, that is recorded in the region's flags instead.
+ */
+static int
+region_deny_hugepage(struct aspace *aspace, struct region *rgn,
+                     vaddr_t s, vaddr_t e)
+{
+	struct nohugepage_range *range;
+	int status;
+
+	if (!(rgn->flags & VM_HUGEPAGE))
+		return 0;
+
+	if ((status = nohugepage_insert(aspace, rgn, s, e)))
+		return status;
+
+	list_for_each_entry(range, &aspace->nohugepage, link) {
+		if (range->start < rgn->start)
+			continue;
+		if ((range->start == rgn->start) && (range->end == rgn->end)) {
+			list_del(&range->link);
+			kmem_free(range);
+			rgn->flags &= ~VM_HUGEPAGE;
+		}
+		break;
+	}
+
+	return 0;
+}
+
+/**
+ * Lets [start, start + extent) be mapped with large pages, or not. The
+ * policy is kept per region, plus a list of the ranges of VM_HUGEPAGE
+ * regions that have opted out, which all paths mapping memory into a region
+ * honor. Opting in applies to memory mapped from then on; existing small
+ * page mappings are not merged, as that would free page tables that other
+ * CPUs may still be walking. Opting out splits any large pages in the range
+ * right away. The TLB shootdown is left pending.
+ */
+int
+__aspace_set_hugepage(struct aspace *aspace,
+                      vaddr_t start, size_t extent, bool enable)
+{
+	struct region *rgn;
+	vaddr_t end = calc_end(start, extent);
+	vaddr_t s, e, va;
+	paddr_t pa, next;
+	size_t len;
+	int status;
+
+	if (!aspace || (start >= end))
+		return -EINVAL;
+
+	list_for_each_entry(rgn, &aspace->region_list, link) {
+		if (rgn->end <= start)
+			continue;
+		if (rgn->start >= end)
+			break;
+		if (rgn->flags & (VM_KERNEL | VM_SMARTMAP))
+			continue;
+
+		s = max(round_down(start, rgn->pagesz), rgn->start);
+		e = (end >= rgn->end) ? rgn->end : round_up(end, rgn->pagesz);
+
+		if (enable) {
+			status = region_allow_hugepage(aspace, rgn, s, e);
+			if (status)
+				return status;
+			continue;
+		}
+
+		if ((status = region_deny_hugepage(aspace, rgn, s, e)))
+			return status;
+
+		/* Map each physically contiguous run again, small pages only */
+		for (va = s; va < e; va += len) {
+			len = rgn->pagesz;
+			if (arch_aspace_virt_to_phys(aspace, va, &pa))
+				continue;
+			while ((va + len < e) &&
+			       !arch_aspace_virt_to_phys(aspace, va + len, &next) &&
+			       (next == pa + len))
+				len += rgn->pagesz;
+
+			status = arch_aspace_map_range(aspace, va, pa, len,
+			                               rgn->flags, rgn->pagesz);
+			if (status)
+				return status;
+		}
+		tlb_batch_add(aspace, s, e);
+	}
+
 	return 0;
 }
 
@@ -633,8 +1354,11 @@ __aspace_del_region(struct aspace *aspace, vaddr_t start, size_t extent)
 			return status;
 	}
 
+	/* Forget the parts of the region that opted out of large pages */
+	nohugepage_remove(aspace, rgn->start, rgn->end);
+
 	/* Remove the region from the address space */
-	list_del(&rgn->link);
+	remove_region(aspace, rgn);
 	kmem_free(rgn);
 	return 0;
 }
@@ -646,12 +1370,18 @@ aspace_del_region(id_t id, vaddr_t start, size_t extent)
 	struct aspace *aspace;
 	unsigned long irqstate;
 
+	struct tlb_batch tlb;
+
 	local_irq_save(irqstate);
 	aspace = lookup_and_lock(id);
 	status = __aspace_del_region(aspace, start, extent);
-	if (aspace) spin_unlock(&aspace->lock);
+	if (aspace) {
+		__aspace_take_tlb_batch(aspace, &tlb);
+		spin_unlock(&aspace->lock);
+	}
 	local_irq_restore(irqstate);
-	flush_tlb();
+	if (aspace)
+		tlb_batch_flush(&tlb);
 	return status;
 }
 
@@ -661,6 +1391,7 @@ __aspace_map_pmem(struct aspace *aspace,
 {
 	int status;
 	struct region *rgn;
+	size_t len;
 
 	if (!aspace)
 		return -EINVAL;
@@ -696,24 +1427,32 @@ __aspace_map_pmem(struct aspace *aspace,
 			return -EINVAL;
 		}
 
+		/* extent must be a multiple of region's page size */
+		if (extent & (rgn->pagesz-1)) {
+			printk(KERN_WARNING
+				"Extent misalignment (start=0x%lx, extent=0x%lx, pagesz=0x%lx).\n",
+				start, extent, rgn->pagesz);
+			return -EINVAL;
+		}
+
 		/* Map until full extent mapped or end of region is reached */
-		while (extent && (start < rgn->end)) {
-
-			status = 
-			arch_aspace_map_page(
-				aspace,
-				start,
-				pmem,
-				rgn->flags,
-				rgn->pagesz
-			);
-			if (status)
-				return status;
+		len = min(extent, (size_t)(rgn->end - start));
+
+		status =
+		region_map_range(
+			aspace,
+			rgn,
+			start,
+			pmem,
+			len,
+			region_pagesz_mask(rgn)
+		);
+		if (status)
+			return status;
 
-			extent -= rgn->pagesz;
-			start  += rgn->pagesz;
-			pmem   += rgn->pagesz;
-		}
+		extent -= len;
+		start  += len;
+		pmem   += len;
 	}
 
 	return 0;
@@ -737,7 +1476,9 @@ aspace_map_pmem(id_t id, paddr_t pmem, vaddr_t start, size_t extent)
 int
 __aspace_unmap_pmem(struct aspace *aspace, vaddr_t start, size_t extent)
 {
+	int status;
 	struct region *rgn;
+	size_t len;
 
 	if (!aspace)
 		return -EINVAL;
@@ -776,17 +1517,15 @@ __aspace_unmap_pmem(struct aspace *aspace, vaddr_t start, size_t extent)
 		}
 
 		/* Unmap until full extent unmapped or end of region is reached */
-		while (extent && (start < rgn->end)) {
+		len = min(extent, (size_t)(rgn->end - start));
 
-			arch_aspace_unmap_page(
-				aspace,
-				start,
-				rgn->pagesz
-			);
+		status = arch_aspace_unmap_range(aspace, start, len);
+		tlb_batch_add(aspace, start, start + len);
+		if (status)
+			return status;
 
-			extent -= rgn->pagesz;
-			start  += rgn->pagesz;
-		}
+		extent -= len;
+		start  += len;
 	}
 
 	return 0;
@@ -799,12 +1538,18 @@ aspace_unmap_pmem(id_t id, vaddr_t start, size_t extent)
 	struct aspace *aspace;
 	unsigned long irqstate;
 
+	struct tlb_batch tlb;
+
 	local_irq_save(irqstate);
 	aspace = lookup_and_lock(id);
 	status = __aspace_unmap_pmem(aspace, start, extent);
-	if (aspace) spin_unlock(&aspace->lock);
+	if (aspace) {
+		__aspace_take_tlb_batch(aspace, &tlb);
+		spin_unlock(&aspace->lock);
+	}
 	local_irq_restore(irqstate);
-	flush_tlb();
+	if (aspace)
+		tlb_batch_flush(&tlb);
 	return status;
 }
 
@@ -845,6 +1590,7 @@ __aspace_smartmap(struct aspace *src, struct aspace *dst,
 
 	/* Ensure source aspace doesn't go away while we have it SMARTMAP'ed */
 	++src->refcnt;
+	++src->smartmap_refcnt;
 
 	return 0;
 }
@@ -885,10 +1631,12 @@ __aspace_unsmartmap(struct aspace *src, struct aspace *dst)
 
 	/* Do architecture-specific SMARTMAP unmapping */
 	BUG_ON(arch_aspace_unsmartmap(src, dst, rgn->start, extent));
+	tlb_batch_add(dst, rgn->start, rgn->end);
 
 	/* Delete the SMARTMAP region and release our reference on the source */
 	BUG_ON(__aspace_del_region(dst, rgn->start, extent));
 	--src->refcnt;
+	--src->smartmap_refcnt;
 
 	return 0;
 }
@@ -899,6 +1647,7 @@ aspace_unsmartmap(id_t src, id_t dst)
 	int status;
 	struct aspace *src_spc, *dst_spc;
 	unsigned long irqstate;
+	struct tlb_batch tlb;
 
 	local_irq_save(irqstate);
 
@@ -908,13 +1657,14 @@ aspace_unsmartmap(id_t src, id_t dst)
 	}
 
 	status = __aspace_unsmartmap(src_spc, dst_spc);
+	__aspace_take_tlb_batch(dst_spc, &tlb);
 
 	spin_unlock(&src_spc->lock);
 	if (src != dst)
 		spin_unlock(&dst_spc->lock);
 
 	local_irq_restore(irqstate);
-	flush_tlb();
+	tlb_batch_flush(&tlb);
 	return status;
 }
 
@@ -926,6 +1676,208 @@ __aspace_virt_to_phys(struct aspace *aspace, vaddr_t vaddr, paddr_t *paddr)
 	return arch_aspace_virt_to_phys(aspace, vaddr, paddr);
 }
 
+/**
+ * Finds the run of [a + off, a + extent) and [b + off, b + extent) that is
+ * physically contiguous in both, returning its memory in *pa and *pb and its
+ * length in *len.
+ */
+static int
+next_swap_run(struct aspace *aspace, vaddr_t a, vaddr_t b,
+              size_t off, size_t extent,
+              paddr_t *pa, paddr_t *pb, size_t *len)
+{
+	paddr_t next_pa, next_pb;
+
+	if (arch_aspace_virt_to_phys(aspace, a + off, pa) ||
+	    arch_aspace_virt_to_phys(aspace, b + off, pb))
+		return -EFAULT;
+
+	for (*len = PAGE_SIZE; off + *len < extent; *len += PAGE_SIZE) {
+		if (arch_aspace_virt_to_phys(aspace, a + off + *len, &next_pa) ||
+		    arch_aspace_virt_to_phys(aspace, b + off + *len, &next_pb) ||
+		    (next_pa != *pa + *len) || (next_pb != *pb + *len))
+			break;
+	}
+
+	return 0;
+}
+
+/**
+ * Page sizes a run may be mapped with, whichever of pa and pb is mapped
+ * where. Large pages are only used where both are aligned the same way, so
+ * the run's page tables have the same shape before and after an exchange.
+ */
+static vmpagesize_t
+swap_pagesz_mask(struct region *rgn, paddr_t pa, paddr_t pb)
+{
+	vmpagesize_t mask = region_pagesz_mask(rgn);
+	vmpagesize_t pagesz;
+
+	for (pagesz = VM_PAGE_1GB; pagesz > VM_PAGE_4KB; pagesz >>= 9) {
+		if ((pa ^ pb) & (pagesz - 1))
+			mask &= ~pagesz;
+	}
+
+	return mask;
+}
+
+/**
+ * Maps each run of [a, a + extent) and [b, b + extent) onto the memory it
+ * already has, using only the page sizes the exchange will use. This
+ * allocates the page tables and splits the large pages the exchange needs,
+ * without changing which memory is mapped where.
+ */
+static int
+prepare_swap_runs(struct aspace *aspace, struct region *rgn,
+                  vaddr_t a, vaddr_t b, size_t extent)
+{
+	paddr_t pa, pb;
+	size_t off, len;
+	vmpagesize_t mask;
+	int status;
+
+	for (off = 0; off < extent; off += len) {
+		if ((status = next_swap_run(aspace, a, b, off, extent,
+		                            &pa, &pb, &len)))
+			return status;
+
+		mask = swap_pagesz_mask(rgn, pa, pb);
+		if ((status = region_map_range(aspace, rgn, a + off, pa,
+		                               len, mask)) ||
+		    (status = region_map_range(aspace, rgn, b + off, pb,
+		                               len, mask)))
+			return status;
+	}
+
+	return 0;
+}
+
+/**
+ * Exchanges the memory of [a, a + extent) and [b, b + extent) of region rgn,
+ * one physically contiguous run at a time.
+ */
+static int
+swap_runs(struct aspace *aspace, struct region *rgn,
+          vaddr_t a, vaddr_t b, size_t extent)
+{
+	paddr_t pa, pb;
+	size_t off, len;
+	vmpagesize_t mask;
+	int status;
+
+	for (off = 0; off < extent; off += len) {
+		if ((status = next_swap_run(aspace, a, b, off, extent,
+		                            &pa, &pb, &len)))
+			return status;
+
+		mask = swap_pagesz_mask(rgn, pa, pb);
+		if ((status = region_map_range(aspace, rgn, a + off, pb,
+		                               len, mask)) ||
+		    (status = region_map_range(aspace, rgn, b + off, pa,
+		                               len, mask)))
+			return status;
+	}
+
+	return 0;
+}
+
+/**
+ * Exchanges the physical memory backing [a, a + extent) and [b, b + extent),
+ * which must be in the same region and must not overlap, so the contents of
+ * each show up at the other without being copied. The page tables are
+ * updated in place, the TLB shootdown for both ranges is left pending.
+ *
+ * If this fails, for lack of memory for page tables, nothing has been
+ * exchanged and both ranges are left as they were.
+ */
+int
+__aspace_swap_pmem(struct aspace *aspace, vaddr_t a, vaddr_t b, size_t extent)
+{
+	struct region *rgn;
+	int status;
+
+	if (!aspace || !extent || ((a | b | extent) & (PAGE_SIZE - 1)))
+		return -EINVAL;
+
+	if ((a < b) ? (a + extent > b) : (b + extent > a))
+		return -EINVAL;
+
+	rgn = find_region(aspace, a);
+	if (!rgn || (rgn != find_region(aspace, b))
+	     || (a + extent > rgn->end) || (b + extent > rgn->end)
+	     || (rgn->flags & (VM_KERNEL | VM_SMARTMAP)))
+		return -EINVAL;
+
+	/*
+	 * arch_aspace_map_range() only allocates for page table entries that
+	 * are missing and for large pages it can't map over whole. Once the
+	 * runs are prepared, every entry the exchange writes is present and
+	 * any large page in the way lines up with the memory replacing it, so
+	 * the exchange itself can't fail part way.
+	 */
+	status = prepare_swap_runs(aspace, rgn, a, b, extent);
+	if (!status)
+		status = swap_runs(aspace, rgn, a, b, extent);
+
+	/* Preparing may have split large pages, flush their TLB entries too */
+	tlb_batch_add(aspace, a, a + extent);
+	tlb_batch_add(aspace, b, b + extent);
+	return status;
+}
+
+/**
+ * Moves an address space's pending TLB shootdown into batch, along with the
+ * set of CPUs it must be sent to. The aspace must be locked. The shootdown
+ * is then issued by calling tlb_batch_flush() after the lock is dropped.
+ */
+void
+__aspace_take_tlb_batch(struct aspace *aspace, struct tlb_batch *batch)
+{
+	batch->start = aspace->tlb_flush_start;
+	batch->end   = aspace->tlb_flush_end;
+	aspace->tlb_flush_start = aspace->tlb_flush_end = 0;
+
+	/*
+	 * CPUs the aspace is not active on may still hold its TLB entries,
+	 * tagged with a PCID/ASID. Bumping tlb_gen makes them discard those
+	 * entries the next time they activate the aspace.
+	 */
+	if (batch->start != batch->end)
+		aspace->tlb_gen++;
+
+	/*
+	 * Order the page table updates and tlb_gen before sampling tlb_cpus.
+	 * A CPU that activates the aspace after this point walks the updated
+	 * tables and sees the new tlb_gen.
+	 */
+	smp_mb();
+
+	/*
+	 * CPUs running an aspace that has this one SMARTMAP'ed share its
+	 * page tables, and are not tracked here. Their TLB entries are
+	 * tagged with the other aspaces' PCIDs/ASIDs, so flush everything.
+	 */
+	if (aspace->smartmap_refcnt) {
+		batch->cpu_mask = cpu_online_map;
+		if (batch->start != batch->end) {
+			batch->start = 0;
+			batch->end   = ULONG_MAX;
+		}
+	} else {
+		batch->cpu_mask = aspace->tlb_cpus;
+	}
+}
+
+/**
+ * Issues a TLB shootdown previously collected by __aspace_take_tlb_batch().
+ * Must be called with interrupts enabled and no spinlocks held.
+ */
+void
+tlb_batch_flush(struct tlb_batch *batch)
+{
+	flush_tlb_mask_range(batch->cpu_mask, batch->start, batch->end);
+}
+
 int
 aspace_virt_to_phys(id_t id, vaddr_t vaddr, paddr_t *paddr)
 {
@@ -1149,6 +2101,33 @@ aspace_set_rank(id_t id,
 	return 0;
 }
 
+/**
+ * Sets the aspace's load balancing threshold. When non-zero, a CPU in the
+ * aspace's cpu_mask that has nothing to run steals a runnable round-robin
+ * task of the aspace from another CPU that has at least threshold tasks
+ * waiting to run. Zero, the default, disables stealing. Higher values make
+ * stealing less aggressive.
+ */
+int
+aspace_set_load_balance(id_t id, unsigned int threshold)
+{
+	struct aspace *aspace;
+	unsigned long irqstate;
+
+	local_irq_save(irqstate);
+
+	if ((aspace = lookup_and_lock(id)) == NULL) {
+		local_irq_restore(irqstate);
+		return -EINVAL;
+	}
+
+	aspace->lb_threshold = threshold;
+
+	spin_unlock(&aspace->lock);
+	local_irq_restore(irqstate);
+	return 0;
+}
+
 int
 aspace_get_rank(id_t   id,
 		id_t * rank)
@@ -1189,3 +2168,98 @@ aspace_update_hio_syscall_mask(id_t		id,
 	local_irq_restore(irqstate);
 	return 0;
 }
+
+#ifdef CONFIG_DEBUG_ASPACE_BENCH
+/**
+ * Reference implementation of find_region(), the linear region_list scan
+ * that the region tree replaced. Only used for comparison by the benchmark.
+ */
+static struct region *
+find_region_linear(struct aspace *aspace, vaddr_t addr)
+{
+	struct region *rgn;
+
+	list_for_each_entry(rgn, &aspace->region_list, link) {
+		if ((rgn->start <= addr) && (rgn->end > addr))
+			return rgn;
+	}
+	return NULL;
+}
+
+/**
+ * Measures the cost of region lookups as a function of the number of
+ * regions in an address space. A scratch aspace is populated with an
+ * increasing number of single page regions separated by single page holes.
+ * For each population, the average cycles per lookup is reported for
+ * random addresses via the region tree, for random addresses via a linear
+ * list scan, and for sequential addresses within one region (last-hit
+ * cache hits).
+ */
+void
+aspace_lookup_bench(void)
+{
+	static const unsigned int counts[] = { 16, 64, 256, 1024, 4096 };
+	const unsigned int iters = 4096;
+	const vaddr_t base = 0x10000000UL;
+	struct aspace *aspace;
+	struct region *rgn, *tmp;
+	unsigned int i, j, nr = 0;
+	uint64_t seed = 1, start, tree, linear, hint;
+	vaddr_t addr;
+
+	if ((aspace = kmem_alloc(sizeof(*aspace))) == NULL)
+		return;
+	list_head_init(&aspace->region_list);
+	aspace->region_tree = RB_ROOT;
+	list_head_init(&aspace->smartmap_list);
+
+	printk(KERN_DEBUG "aspace region lookup benchmark (cycles/lookup):\n");
+	printk(KERN_DEBUG "  %8s %10s %10s %10s\n",
+	       "regions", "tree", "linear", "hint");
+
+	for (i = 0; i < ARRAY_SIZE(counts); i++) {
+		/* Grow the scratch aspace up to the next region count */
+		for ( ; nr < counts[i]; nr++) {
+			if (__aspace_add_region(aspace,
+			                        base + (2 * nr * PAGE_SIZE),
+			                        PAGE_SIZE, VM_READ, VM_PAGE_4KB,
+			                        "bench"))
+				goto out;
+		}
+
+		start = get_cycles();
+		for (j = 0; j < iters; j++) {
+			seed = seed * 6364136223846793005ULL + 1;
+			addr = base + (2 * ((seed >> 33) % nr) * PAGE_SIZE);
+			aspace->region_hint = NULL;
+			BUG_ON(!find_region(aspace, addr));
+		}
+		tree = (get_cycles() - start) / iters;
+
+		start = get_cycles();
+		for (j = 0; j < iters; j++) {
+			seed = seed * 6364136223846793005ULL + 1;
+			addr = base + (2 * ((seed >> 33) % nr) * PAGE_SIZE);
+			BUG_ON(!find_region_linear(aspace, addr));
+		}
+		linear = (get_cycles() - start) / iters;
+
+		addr = base + (2 * (nr / 2) * PAGE_SIZE);
+		start = get_cycles();
+		for (j = 0; j < iters; j++)
+			BUG_ON(!find_region(aspace, addr + (j % PAGE_SIZE)));
+		hint = (get_cycles() - start) / iters;
+
+		printk(KERN_DEBUG "  %8u %10llu %10llu %10llu\n",
+		       nr, (unsigned long long)tree,
+		       (unsigned long long)linear, (unsigned long long)hint);
+	}
+
+out:
+	list_for_each_entry_safe(rgn, tmp, &aspace->region_list, link) {
+		remove_region(aspace, rgn);
+		kmem_free(rgn);
+	}
+	kmem_free(aspace);
+}
+#endif
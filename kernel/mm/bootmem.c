@@ -41,6 +41,14 @@ bool bootmem_destoyed = false;
 static unsigned long kmem_size = (1024 * 1024 * 64);  /* default is first 64 MB */
 param(kmem_size, ulong);
 
+/**
+ * Size of the kernel memory pool created for each additional NUMA node.
+ * These pools are carved out of each node's user memory once NUMA
+ * information is known. Set to 0 to keep a single kmem pool.
+ */
+static unsigned long kmem_node_size = (1024 * 1024 * 64);
+param(kmem_node_size, ulong);
+
 
 /**
  *
@@ -579,5 +587,8 @@ mem_subsys_init(void)
 	kmem_create_zone((unsigned long)__va( bootmem_data.node_boot_start), kmem_size);
 	free_all_bootmem();
 	arch_memsys_init(kmem_size);
+
+	/* Give every other NUMA node its own kernel memory pool */
+	kmem_create_node_zones(kmem_node_size);
 }
 
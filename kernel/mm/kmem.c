@@ -4,6 +4,12 @@
 #include <lwk/buddy.h>
 #include <lwk/log2.h>
 #include <lwk/spinlock.h>
+#include <lwk/percpu.h>
+#include <lwk/smp.h>
+#include <lwk/pmem.h>
+#include <lwk/topology.h>
+#include <lwk/driver.h>
+#include <lwk/proc_fs.h>
 
 
 /**
@@ -22,34 +28,76 @@
 
 
 /**
- * The kernel memory pool. This manages all memory available for dynamic
- * allocation by the kernel. The kernel reserves some amount of memory
- * (e.g., the first 8 MB, amount specifiable on kernel boot command line) for
- * its own use, included in which is the kernel memory pool. The rest of memory
- * is reserved for user applications.
- *
- * NOTE: There is currently only one buddy_mempool for the entire system.
- *       This may change to one per NUMA node in the future.
+ * Small allocations are served from size-class caches layered over the buddy
+ * system rather than directly from it. There is one cache for each block order
+ * from MIN_ORDER to KMEM_CACHE_MAX_ORDER, inclusive. Each cache carves slabs
+ * of 2^KMEM_SLAB_ORDER bytes obtained from the buddy system into blocks.
+ */
+#define KMEM_CACHE_MAX_ORDER	11  /* 2 KB */
+#define KMEM_NR_CACHES		(KMEM_CACHE_MAX_ORDER - MIN_ORDER + 1)
+#define KMEM_SLAB_ORDER		14  /* 16 KB */
+
+
+/**
+ * Number of blocks each per-CPU magazine can hold. When a magazine runs empty
+ * it is refilled with half this many blocks from its cache's depot, and when
+ * it fills up half of its blocks are flushed back to the depot.
  */
-static struct buddy_mempool *kmem = NULL;
+#define KMEM_MAG_ROUNDS		16
 
 
 /**
- * Lock for serializing access to kmem and kmem_bytes_allocated.
+ * Magic value stored in the block header of cached blocks that are free.
+ * Used to catch double frees of small blocks.
  */
-static DEFINE_SPINLOCK(kmem_lock);
+#define KMEM_FREE_MAGIC		0xDEADF0F0DEADF0F0UL
 
 
 /**
- * Total number of bytes in the kernel memory pool.
+ * A size-class cache. Free blocks that are not sitting in some CPU's magazine
+ * live on the depot free list, which is protected by the cache's own lock.
+ * The pool lock is only taken when the depot runs dry and a new slab must be
+ * obtained from the buddy system.
  */
-static unsigned long kmem_bytes_managed;
+struct kmem_cache {
+	spinlock_t		lock;
+	unsigned long		order;       /* block order served by cache */
+	void *			free_list;   /* depot, linked through 1st word */
+	unsigned long		nr_free;     /* blocks on the depot free list */
+	unsigned long		nr_slabs;    /* slabs taken from the buddy system */
+	unsigned long		nr_refills;  /* magazine refills from the depot */
+	unsigned long		nr_flushes;  /* magazine flushes to the depot */
+};
 
 
 /**
- * Total number of bytes allocated from the kernel memory pool.
+ * A kernel memory pool. This manages the memory available for dynamic
+ * allocation by the kernel on one NUMA node. The kernel reserves some amount
+ * of memory (e.g., the first 64 MB, amount specifiable on kernel boot command
+ * line) for its own use, included in which is the boot node's kernel memory
+ * pool. Pools for the other NUMA nodes are carved out of each node's user
+ * memory by kmem_create_node_zones(). The rest of memory is reserved for user
+ * applications.
  */
-static unsigned long kmem_bytes_allocated = 0;
+struct kmem_pool {
+	struct buddy_mempool *	mp;               /* NULL if node has no pool */
+	spinlock_t		lock;             /* protects mp, bytes_allocated */
+	unsigned long		bytes_managed;    /* bytes in the pool */
+	unsigned long		bytes_allocated;  /* bytes allocated from pool */
+	struct kmem_cache	caches[KMEM_NR_CACHES];
+};
+
+static struct kmem_pool kmem_pools[MAX_NUMNODES];
+
+
+/**
+ * Order in which pools are tried when allocating on behalf of each node.
+ * kmem_fallback[node][0] is the node's home pool, which is the node's own
+ * pool if it has one. The remaining pools follow in order of increasing
+ * node_distance(). Rebuilt whenever a zone is created.
+ */
+static int kmem_fallback[MAX_NUMNODES][MAX_NUMNODES];
+static int kmem_nr_fallback[MAX_NUMNODES];
 
 
 /**
@@ -71,36 +119,407 @@ struct kmem_block_hdr {
 
 
 /**
- * This adds a zone to the kernel memory pool. Zones exist to allow there to be
- * multiple non-adjacent regions of physically contiguous memory. The
- * bookkeeping needed to cover the gaps would waste a lot of memory and have no
- * benefit.
+ * Per-CPU magazine of free blocks for one size-class cache. A CPU's magazines
+ * only ever hold blocks from its home pool.
+ */
+struct kmem_magazine {
+	unsigned long		rounds;      /* number of blocks in objs[] */
+	void *			objs[KMEM_MAG_ROUNDS];
+	unsigned long		nr_allocs;   /* blocks allocated on this CPU */
+	unsigned long		nr_frees;    /* blocks freed on this CPU */
+};
+
+struct kmem_cpu_cache {
+	struct kmem_magazine	mag[KMEM_NR_CACHES];
+};
+
+static DEFINE_PER_CPU(struct kmem_cpu_cache, kmem_cpu_cache);
+
+
+/**
+ * Returns true if blocks of the given order are served by a size-class cache.
+ */
+static inline bool
+order_is_cached(unsigned long order)
+{
+	return (order <= KMEM_CACHE_MAX_ORDER);
+}
+
+
+/**
+ * Returns the node whose pool serves allocations for the given node.
+ */
+static inline int
+home_node(int node)
+{
+	return kmem_fallback[node][0];
+}
+
+
+/**
+ * Returns the pool containing the address passed in, or NULL if the address
+ * is not kmem.
+ */
+static struct kmem_pool *
+addr_to_pool(unsigned long addr)
+{
+	struct kmem_pool *pool;
+	int node;
+
+	for (node = 0; node < MAX_NUMNODES; node++) {
+		pool = &kmem_pools[node];
+		if (pool->mp &&
+		    (addr >= pool->mp->base_addr) &&
+		    ((addr - pool->mp->base_addr) < (1UL << pool->mp->pool_order)))
+			return pool;
+	}
+
+	return NULL;
+}
+
+
+/**
+ * Rebuilds the pool fallback order of every node. Each node's list holds all
+ * nodes that have a pool, sorted by distance from the node.
+ */
+static void
+build_fallback_lists(void)
+{
+	int node, other, i, n, tmp;
+
+	for (node = 0; node < MAX_NUMNODES; node++) {
+		n = 0;
+		for (other = 0; other < MAX_NUMNODES; other++) {
+			if (kmem_pools[other].mp == NULL)
+				continue;
+
+			/* Insertion sort, nearest node first, stable */
+			kmem_fallback[node][n] = other;
+			for (i = n++; i > 0; i--) {
+				if (node_distance(node, kmem_fallback[node][i - 1]) <=
+				    node_distance(node, kmem_fallback[node][i]))
+					break;
+				tmp = kmem_fallback[node][i - 1];
+				kmem_fallback[node][i - 1] = kmem_fallback[node][i];
+				kmem_fallback[node][i] = tmp;
+			}
+		}
+		kmem_nr_fallback[node] = n;
+	}
+}
+
+
+/**
+ * Obtains a new slab from the buddy system and carves it into blocks on the
+ * cache's depot free list. The caller must hold cache->lock.
+ *
+ * Returns:
+ *       Success: 0
+ *       Failure: -ENOMEM
+ */
+static int
+kmem_cache_grow(struct kmem_pool *pool, struct kmem_cache *cache)
+{
+	unsigned long nr_blocks = 1UL << (KMEM_SLAB_ORDER - cache->order);
+	unsigned long i;
+	char *slab;
+	void **block;
+
+	spin_lock(&pool->lock);
+	slab = buddy_alloc(pool->mp, KMEM_SLAB_ORDER);
+	if (slab)
+		pool->bytes_allocated += (1UL << KMEM_SLAB_ORDER);
+	spin_unlock(&pool->lock);
+	if (slab == NULL)
+		return -ENOMEM;
+
+	/*
+	 * Blocks stay naturally aligned to their size, same as blocks that
+	 * come straight from the buddy system.
+	 */
+	for (i = 0; i < nr_blocks; i++) {
+		block = (void **)(slab + (i << cache->order));
+		*block = cache->free_list;
+		cache->free_list = block;
+	}
+
+	cache->nr_free += nr_blocks;
+	cache->nr_slabs++;
+	return 0;
+}
+
+
+/**
+ * Moves up to KMEM_MAG_ROUNDS/2 blocks from the cache's depot into an empty
+ * magazine, growing the cache if necessary. Interrupts must be disabled.
+ */
+static void
+kmem_magazine_refill(
+	struct kmem_pool *	pool,
+	struct kmem_cache *	cache,
+	struct kmem_magazine *	mag
+)
+{
+	void **block;
+
+	spin_lock(&cache->lock);
+	if ((cache->free_list == NULL) && kmem_cache_grow(pool, cache)) {
+		spin_unlock(&cache->lock);
+		return;
+	}
+
+	while (cache->free_list && (mag->rounds < KMEM_MAG_ROUNDS / 2)) {
+		block = cache->free_list;
+		cache->free_list = *block;
+		cache->nr_free--;
+		mag->objs[mag->rounds++] = block;
+	}
+	cache->nr_refills++;
+	spin_unlock(&cache->lock);
+}
+
+
+/**
+ * Moves the top 'count' blocks of a magazine back to the cache's depot.
+ * Interrupts must be disabled.
+ */
+static void
+kmem_magazine_flush(
+	struct kmem_cache *	cache,
+	struct kmem_magazine *	mag,
+	unsigned long		count
+)
+{
+	void **block;
+
+	spin_lock(&cache->lock);
+	while (count--) {
+		block = mag->objs[--mag->rounds];
+		*block = cache->free_list;
+		cache->free_list = block;
+		cache->nr_free++;
+	}
+	cache->nr_flushes++;
+	spin_unlock(&cache->lock);
+}
+
+
+/**
+ * Allocates a block of the given order from the calling CPU's magazine.
+ * The block is not zeroed and its header is not initialized.
+ */
+static struct kmem_block_hdr *
+kmem_cache_alloc_block(unsigned long order)
+{
+	unsigned long index = order - MIN_ORDER;
+	struct kmem_pool *pool;
+	struct kmem_magazine *mag;
+	struct kmem_block_hdr *hdr = NULL;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	mag = &__get_cpu_var(kmem_cpu_cache).mag[index];
+	if (mag->rounds == 0) {
+		pool = &kmem_pools[home_node(numa_node_id())];
+		kmem_magazine_refill(pool, &pool->caches[index], mag);
+	}
+	if (mag->rounds) {
+		hdr = mag->objs[--mag->rounds];
+		mag->nr_allocs++;
+	}
+	local_irq_restore(flags);
+
+	return hdr;
+}
+
+
+/**
+ * Returns a block of the given order to the calling CPU's magazine.
+ * The block must belong to the calling CPU's home pool.
+ */
+static void
+kmem_cache_free_block(struct kmem_block_hdr *hdr, unsigned long order)
+{
+	unsigned long index = order - MIN_ORDER;
+	struct kmem_pool *pool;
+	struct kmem_magazine *mag;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	mag = &__get_cpu_var(kmem_cpu_cache).mag[index];
+	if (mag->rounds == KMEM_MAG_ROUNDS) {
+		pool = &kmem_pools[home_node(numa_node_id())];
+		kmem_magazine_flush(&pool->caches[index], mag, KMEM_MAG_ROUNDS / 2);
+	}
+	mag->objs[mag->rounds++] = hdr;
+	mag->nr_frees++;
+	local_irq_restore(flags);
+}
+
+
+/**
+ * Allocates a block of the given order directly from a pool, bypassing the
+ * per-CPU magazines. Used for allocations that target a remote node and as
+ * the fallback when the home pool is exhausted.
+ */
+static void *
+kmem_pool_alloc(struct kmem_pool *pool, unsigned long order)
+{
+	struct kmem_cache *cache;
+	void **block = NULL;
+	unsigned long flags;
+
+	if (order_is_cached(order)) {
+		cache = &pool->caches[order - MIN_ORDER];
+		spin_lock_irqsave(&cache->lock, flags);
+		if (cache->free_list || !kmem_cache_grow(pool, cache)) {
+			block = cache->free_list;
+			cache->free_list = *block;
+			cache->nr_free--;
+		}
+		spin_unlock_irqrestore(&cache->lock, flags);
+		return block;
+	}
+
+	spin_lock_irqsave(&pool->lock, flags);
+	block = buddy_alloc(pool->mp, order);
+	if (block)
+		pool->bytes_allocated += (1UL << order);
+	spin_unlock_irqrestore(&pool->lock, flags);
+	return block;
+}
+
+
+/**
+ * Returns a block of the given order directly to the pool it came from.
+ */
+static void
+kmem_pool_free(struct kmem_pool *pool, const void *addr, unsigned long order)
+{
+	struct kmem_cache *cache;
+	void **block = (void **)addr;
+	unsigned long flags;
+
+	if (order_is_cached(order)) {
+		cache = &pool->caches[order - MIN_ORDER];
+		spin_lock_irqsave(&cache->lock, flags);
+		*block = cache->free_list;
+		cache->free_list = block;
+		cache->nr_free++;
+		spin_unlock_irqrestore(&cache->lock, flags);
+		return;
+	}
+
+	spin_lock_irqsave(&pool->lock, flags);
+	pool->bytes_allocated -= (1UL << order);
+	buddy_free(pool->mp, addr, order);
+	spin_unlock_irqrestore(&pool->lock, flags);
+}
+
+
+/**
+ * Allocates a block of the given order on behalf of a NUMA node. Small blocks
+ * for the calling CPU's home pool come from its magazine. Otherwise the pools
+ * are tried in the node's fallback order. The block is not zeroed.
+ */
+static void *
+kmem_alloc_block(unsigned long order, int node)
+{
+	void *block = NULL;
+	int i;
+
+	if ((node < 0) || (node >= MAX_NUMNODES))
+		node = numa_node_id();
+
+	/* Fast path, does not touch any shared lock in the common case */
+	if (order_is_cached(order) && (home_node(node) == home_node(numa_node_id())))
+		block = kmem_cache_alloc_block(order);
+
+	for (i = 0; (block == NULL) && (i < kmem_nr_fallback[node]); i++)
+		block = kmem_pool_alloc(&kmem_pools[kmem_fallback[node][i]], order);
+
+	return block;
+}
+
+
+/**
+ * Returns a block of the given order to its pool. Small blocks belonging to
+ * the calling CPU's home pool go back to its magazine.
+ */
+static void
+kmem_free_block(const void *addr, unsigned long order)
+{
+	struct kmem_pool *pool = addr_to_pool((unsigned long)addr);
+
+	BUG_ON(pool == NULL);
+
+	if (order_is_cached(order) &&
+	    (pool == &kmem_pools[home_node(numa_node_id())]))
+		kmem_cache_free_block((struct kmem_block_hdr *)addr, order);
+	else
+		kmem_pool_free(pool, addr, order);
+}
+
+
+/**
+ * This adds a zone for a NUMA node to the kernel memory pool. Zones exist to
+ * allow there to be multiple non-adjacent regions of physically contiguous
+ * memory. The bookkeeping needed to cover the gaps would waste a lot of memory
+ * and have no benefit.
  *
  * Arguments:
+ *       [IN] node:      NUMA node the zone's memory is on.
  *       [IN] base_addr: Base address of the memory pool.
  *       [IN] size:      Size of the memory pool in bytes.
  *
- * NOTE: Currently only one zone is supported. Calling kmem_create_zone() more
- *       than once will result in a panic.
+ * NOTE: Currently only one zone per NUMA node is supported. Calling
+ *       kmem_create_zone_node() more than once for a node will result in
+ *       a panic.
  */
 void
-kmem_create_zone(unsigned long base_addr, size_t size)
+kmem_create_zone_node(int node, unsigned long base_addr, size_t size)
 {
+	struct kmem_pool *pool;
 	unsigned long pool_order = ilog2(roundup_pow_of_two(size));
 	unsigned long min_order  = MIN_ORDER;
+	unsigned long i;
 
-	/* For now, protect against calling kmem_create_zone() more than once */
-	BUG_ON(kmem != NULL);
+	BUG_ON((node < 0) || (node >= MAX_NUMNODES));
+	pool = &kmem_pools[node];
+
+	/* For now, protect against creating a node's zone more than once */
+	BUG_ON(pool->mp != NULL);
 
 	/* Initialize the underlying buddy allocator */
-	if ((kmem = buddy_init(base_addr, pool_order, min_order)) == NULL)
+	spin_lock_init(&pool->lock);
+	if ((pool->mp = buddy_init(base_addr, pool_order, min_order)) == NULL)
 		panic("buddy_init() failed.");
+
+	/* Initialize the size-class caches, they start out empty */
+	for (i = 0; i < KMEM_NR_CACHES; i++) {
+		spin_lock_init(&pool->caches[i].lock);
+		pool->caches[i].order = MIN_ORDER + i;
+	}
+
+	build_fallback_lists();
+}
+
+
+/**
+ * This adds the boot zone to the kernel memory pool. The boot zone covers the
+ * memory the kernel reserves for itself at boot and is placed on node 0.
+ */
+void
+kmem_create_zone(unsigned long base_addr, size_t size)
+{
+	kmem_create_zone_node(0, base_addr, size);
 }
 
 
 /**
  * This adds memory to the kernel memory pool. The memory region being added
- * must fall within a zone previously specified via kmem_create_zone().
+ * must fall within a zone previously specified via kmem_create_zone() or
+ * kmem_create_zone_node().
  *
  * Arguments:
  *       [IN] base_addr: Base address of the memory region to add.
@@ -109,39 +528,97 @@ kmem_create_zone(unsigned long base_addr, size_t size)
 void
 kmem_add_memory(unsigned long base_addr, size_t size)
 {
+	struct kmem_pool *pool = addr_to_pool(base_addr);
 	unsigned long flags;
 
+	BUG_ON(pool == NULL);
+
 	/*
 	 * kmem buddy allocator is initially empty.
 	 * Memory is added to it via buddy_free().
 	 * buddy_free() will panic if there are any problems with the args.
 	 */
-	spin_lock_irqsave(&kmem_lock, flags);
-	buddy_free(kmem, (void *)base_addr, ilog2(size));
-	spin_unlock_irqrestore(&kmem_lock, flags);
+	spin_lock_irqsave(&pool->lock, flags);
+	buddy_free(pool->mp, (void *)base_addr, ilog2(size));
+	spin_unlock_irqrestore(&pool->lock, flags);
 
 	/* Update statistics */
-	kmem_bytes_managed += size;
+	pool->bytes_managed += size;
 }
 
 
 /**
- * Allocates memory from the kernel memory pool. This will return a memory
- * region that is at least 16-byte aligned. The memory returned is zeroed.
+ * Creates a kernel memory pool for every NUMA node that has user memory but
+ * no pool yet. Each pool is carved out of the node's own user memory, so
+ * kernel objects allocated on behalf of the node's CPUs are node-local.
  *
  * Arguments:
- *       [IN] size: Amount of memory to allocate in bytes.
- *
- * Returns:
- *       Success: Pointer to the start of the allocated memory.
- *       Failure: NULL
+ *       [IN] size: Size of each node's pool in bytes, 0 disables.
  */
-void *
-kmem_alloc(size_t size)
+void
+kmem_create_node_zones(size_t size)
+{
+	struct pmem_region query, result;
+	unsigned long node_mask = 0;
+	int node;
+
+	if (size == 0)
+		return;
+	size = roundup_pow_of_two(size);
+
+	/* Find the NUMA nodes that have user memory */
+	pmem_region_unset_all(&query);
+	query.start = 0;
+	query.end   = (paddr_t)(-1);
+	query.type  = PMEM_TYPE_UMEM; query.type_is_set = true;
+	while (pmem_query(&query, &result) == 0) {
+		if (result.numa_node_is_set && (result.numa_node < MAX_NUMNODES))
+			node_mask |= (1UL << result.numa_node);
+		query.start = result.end;
+	}
+
+	for (node = 0; node < MAX_NUMNODES; node++) {
+		if (!(node_mask & (1UL << node)) || kmem_pools[node].mp)
+			continue;
+
+		pmem_region_unset_all(&query);
+		query.start     = 0;
+		query.end       = (paddr_t)(-1);
+		query.type      = PMEM_TYPE_UMEM; query.type_is_set      = true;
+		query.allocated = false;          query.allocated_is_set = true;
+		query.numa_node = node;           query.numa_node_is_set = true;
+
+		/* Align to the pool size so blocks are naturally aligned */
+		if (pmem_alloc(size, size, &query, &result)) {
+			printk(KERN_WARNING
+			       "kmem: no %lu byte pool for NUMA node %d.\n",
+			       (unsigned long)size, node);
+			continue;
+		}
+
+		result.type = PMEM_TYPE_KMEM;
+		BUG_ON(pmem_update(&result));
+
+		kmem_create_zone_node(node, (unsigned long)__va(result.start), size);
+		kmem_add_memory((unsigned long)__va(result.start), size);
+
+		printk(KERN_DEBUG
+		       "kmem: NUMA node %d pool [%#016lx, %#016lx)\n",
+		       node, (unsigned long)result.start,
+		       (unsigned long)result.end);
+	}
+}
+
+
+/**
+ * Allocates a block with room for 'size' bytes after its header, without
+ * zeroing it.
+ */
+static struct kmem_block_hdr *
+__kmem_alloc(size_t size, int node, unsigned long *order_out)
 {
 	unsigned long order;
 	struct kmem_block_hdr *hdr;
-	unsigned long flags;
 
 	/* Make room for block header */
 	size += sizeof(struct kmem_block_hdr);
@@ -151,29 +628,87 @@ kmem_alloc(size_t size)
 	if (order < MIN_ORDER)
 		order = MIN_ORDER;
 
-	/* Allocate memory from the underlying buddy system */
-	spin_lock_irqsave(&kmem_lock, flags);
-	hdr = buddy_alloc(kmem, order);
-	if (hdr)
-		kmem_bytes_allocated += (1UL << order);
-	spin_unlock_irqrestore(&kmem_lock, flags);
-	if (hdr == NULL)
+	if ((hdr = kmem_alloc_block(order, node)) == NULL)
 		return NULL;
 
-	/* Zero the block */
-	memset(hdr, 0, (1UL << order));
-
 	/* Initialize the block header */
 	hdr->order = order;       /* kmem_free() needs this to free the block */
 	hdr->magic = KMEM_MAGIC;  /* used for sanity check */
 
+	*order_out = order;
+	return hdr;
+}
+
+
+/**
+ * Allocates memory from a NUMA node's kernel memory pool. This will return a
+ * memory region that is at least 16-byte aligned. The memory returned is
+ * zeroed. If the node's pool is exhausted, the memory comes from the nearest
+ * node that can satisfy the request.
+ *
+ * Arguments:
+ *       [IN] size: Amount of memory to allocate in bytes.
+ *       [IN] node: NUMA node to allocate on, NUMA_NO_NODE for the caller's.
+ *
+ * Returns:
+ *       Success: Pointer to the start of the allocated memory.
+ *       Failure: NULL
+ */
+void *
+kmem_alloc_node(size_t size, int node)
+{
+	struct kmem_block_hdr *hdr;
+	unsigned long order;
+
+	if ((hdr = __kmem_alloc(size, node, &order)) == NULL)
+		return NULL;
+
+	/* Zero everything after the block header */
+	memset(hdr + 1, 0, (1UL << order) - sizeof(struct kmem_block_hdr));
+
 	/* Return address of first byte after block header to caller */
 	return hdr + 1;
 }
 
 
 /**
- * Frees memory previously allocated with kmem_alloc().
+ * Allocates memory from the calling CPU's NUMA node. This will return a
+ * memory region that is at least 16-byte aligned. The memory returned is
+ * zeroed.
+ *
+ * Arguments:
+ *       [IN] size: Amount of memory to allocate in bytes.
+ *
+ * Returns:
+ *       Success: Pointer to the start of the allocated memory.
+ *       Failure: NULL
+ */
+void *
+kmem_alloc(size_t size)
+{
+	return kmem_alloc_node(size, NUMA_NO_NODE);
+}
+
+
+/**
+ * Same as kmem_alloc(), except that the memory returned is not zeroed.
+ * Use this for objects that the caller fully initializes itself.
+ */
+void *
+kmem_alloc_nozero(size_t size)
+{
+	struct kmem_block_hdr *hdr;
+	unsigned long order;
+
+	if ((hdr = __kmem_alloc(size, NUMA_NO_NODE, &order)) == NULL)
+		return NULL;
+
+	return hdr + 1;
+}
+
+
+/**
+ * Frees memory previously allocated with kmem_alloc() or kmem_alloc_node().
  *
  * Arguments:
  *       [IN] addr: Address of the memory region to free.
@@ -189,7 +724,6 @@ kmem_free(
 )
 {
 	struct kmem_block_hdr *hdr;
-	unsigned long flags;
 
 	if( !addr )
 		return;
@@ -200,24 +734,24 @@ kmem_free(
 	hdr = (struct kmem_block_hdr *)addr - 1;
 	BUG_ON(hdr->magic != KMEM_MAGIC);
 
-	/* Return block to the underlying buddy system */
-	spin_lock_irqsave(&kmem_lock, flags);
-	kmem_bytes_allocated -= (1UL << hdr->order);
-	buddy_free(kmem, hdr, hdr->order);
-	spin_unlock_irqrestore(&kmem_lock, flags);
+	/* Poison the header so a double free of a cached block is caught */
+	hdr->magic = KMEM_FREE_MAGIC;
+
+	/* Return block to its pool */
+	kmem_free_block(hdr, hdr->order);
 }
 
 
 /**
- * Allocates pages of memory from the kernel memory pool. The number of pages
- * requested must be a power of two and the returned pages will be contiguous
- * in physical memory. The memory returned is zeroed.
+ * Allocates pages of memory from a NUMA node's kernel memory pool. The number
+ * of pages requested must be a power of two and the returned pages will be
+ * contiguous in physical memory. The memory returned is zeroed.
  *
  * \returns Pointer to the start of the allocated memory on succcess
  * or NULL for failure..
  */
 void *
-kmem_get_pages(
+kmem_get_pages_node(
 	/** Number of pages to allocated, 2^order:
 	 * - 0 = 1 page
 	 * - 1 = 2 pages
@@ -225,22 +759,20 @@ kmem_get_pages(
 	 * - 3 = 8 pages
 	 * - ...
 	 */
-	unsigned long order
+	unsigned long order,
+
+	/** NUMA node to allocate on, NUMA_NO_NODE for the caller's. */
+	int node
 )
 {
 	unsigned long block_order;
 	void *addr;
-	unsigned long flags;
 
 	/* Calculate the block size needed; convert page order to byte order */
 	block_order = order + ilog2(PAGE_SIZE);
 
 	/* Allocate memory from the underlying buddy system */
-	spin_lock_irqsave(&kmem_lock, flags);
-	addr = buddy_alloc(kmem, block_order);
-	if (addr)
-		kmem_bytes_allocated += (1UL << block_order);
-	spin_unlock_irqrestore(&kmem_lock, flags);
+	addr = kmem_alloc_block(block_order, node);
 	if (addr == NULL)
 		return NULL;
 
@@ -250,6 +782,19 @@ kmem_get_pages(
 }
 
 
+/**
+ * Allocates pages of memory from the calling CPU's NUMA node.
+ * See kmem_get_pages_node().
+ */
+void *
+kmem_get_pages(
+	unsigned long order
+)
+{
+	return kmem_get_pages_node(order, NUMA_NO_NODE);
+}
+
+
 /**
  * Frees pages of memory previously allocated with kmem_get_pages().
  */
@@ -265,14 +810,100 @@ kmem_free_pages(
 	unsigned long		order
 )
 {
+	kmem_free_block(addr, order + ilog2(PAGE_SIZE));
+}
+
+
+/**
+ * Returns all blocks cached in a CPU's magazines to the depots. This is used
+ * when a CPU is removed, before its per-CPU area is freed. The target CPU
+ * must be offline.
+ */
+void
+kmem_cpu_drain(int cpu)
+{
+	struct kmem_cpu_cache *cc = &per_cpu(kmem_cpu_cache, cpu);
+	struct kmem_pool *pool = &kmem_pools[home_node(cpu_to_node(cpu))];
+	unsigned long flags;
+	unsigned long i;
+
+	local_irq_save(flags);
+	for (i = 0; i < KMEM_NR_CACHES; i++) {
+		if (cc->mag[i].rounds)
+			kmem_magazine_flush(&pool->caches[i], &cc->mag[i],
+			                    cc->mag[i].rounds);
+	}
+	local_irq_restore(flags);
+}
+
+
+/**
+ * Reports the statistics of each pool and size-class cache in /proc/kmemstat.
+ * The cache counters are snapshotted under the cache lock and printed after
+ * it is dropped, since proc_sprintf() may itself allocate from kmem.
+ */
+static int
+kmem_proc_stats(struct file *file, void *priv_data)
+{
+	struct kmem_pool *pool;
+	struct kmem_cache *cache;
+	struct kmem_magazine *mag;
+	unsigned long allocs, frees, cached;
+	unsigned long slabs, depot, refills, flushes;
 	unsigned long flags;
+	unsigned long i;
+	int node, cpu;
+
+	for (node = 0; node < MAX_NUMNODES; node++) {
+		pool = &kmem_pools[node];
+		if (pool->mp == NULL)
+			continue;
+
+		proc_sprintf(file, "node %d: %lu of %lu bytes allocated\n",
+			node, pool->bytes_allocated, pool->bytes_managed);
+		proc_sprintf(file, "  %6s %8s %10s %10s %8s %8s %8s %8s\n",
+			"size", "slabs", "allocs", "frees",
+			"depot", "mags", "refills", "flushes");
+
+		for (i = 0; i < KMEM_NR_CACHES; i++) {
+			cache = &pool->caches[i];
+			allocs = frees = cached = 0;
+
+			for_each_cpu_mask(cpu, cpu_present_map) {
+				if (home_node(cpu_to_node(cpu)) != node)
+					continue;
+				mag = &per_cpu(kmem_cpu_cache, cpu).mag[i];
+				allocs += mag->nr_allocs;
+				frees  += mag->nr_frees;
+				cached += mag->rounds;
+			}
+
+			spin_lock_irqsave(&cache->lock, flags);
+			slabs   = cache->nr_slabs;
+			depot   = cache->nr_free;
+			refills = cache->nr_refills;
+			flushes = cache->nr_flushes;
+			spin_unlock_irqrestore(&cache->lock, flags);
+
+			proc_sprintf(file,
+				"  %6lu %8lu %10lu %10lu %8lu %8lu %8lu %8lu\n",
+				1UL << cache->order, slabs, allocs, frees,
+				depot, cached, refills, flushes);
+		}
+	}
+
+	return 0;
+}
 
-	spin_lock_irqsave(&kmem_lock, flags);
-	kmem_bytes_allocated -= (1UL << order);
-	buddy_free(kmem, addr, order + ilog2(PAGE_SIZE));
-	spin_unlock_irqrestore(&kmem_lock, flags);
+static int
+kmem_proc_init(void)
+{
+	proc_mkdir("/proc");
+	return create_proc_file("/proc/kmemstat", kmem_proc_stats, NULL);
 }
 
+DRIVER_INIT("kfs", kmem_proc_init);
+
 
 /**
  * Returns true if the physical addr passed in is kmem, false otherwise.
@@ -280,11 +911,7 @@ kmem_free_pages(
 bool
 paddr_is_kmem(
 	const paddr_t		paddr
-) 
+)
 {
-	return (((unsigned long)__va(paddr) >= kmem->base_addr) && 
-	       ((unsigned long)__va(paddr) - kmem->base_addr) < (1 << (kmem->pool_order)));
+	return (addr_to_pool((unsigned long)__va(paddr)) != NULL);
 }
-
-
- 
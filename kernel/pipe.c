@@ -0,0 +1,664 @@
+#include <lwk/kernel.h>
+#include <lwk/poll.h>
+#include <lwk/kfs.h>
+#include <lwk/mutex.h>
+#include <lwk/spinlock.h>
+#include <lwk/waitq.h>
+#include <lwk/stat.h>
+#include <arch/uaccess.h>
+#include <arch-generic/fcntl.h>
+
+//#define dbg _KDBG
+#define dbg(fmt,args...)
+
+#define PIPE_ORDER		4
+#define PIPE_SIZE		(PAGE_SIZE << PIPE_ORDER)
+
+/* Linux's ioctl for the number of bytes ready to be read */
+#define FIONREAD		0x541B
+
+/**
+ * A pipe's data is kept in a ring buffer. head and tail run freely and are
+ * masked to index the buffer, head - tail is the amount of data in it.
+ * Only the writer holding wr_mutex moves head and only the reader holding
+ * rd_mutex moves tail, so each copies data without holding the lock.
+ */
+struct pipe {
+	spinlock_t	lock;		/* Protects the fields below */
+	unsigned int	head;
+	unsigned int	tail;
+	unsigned int	readers;	/* # open read ends */
+	unsigned int	writers;	/* # open write ends */
+
+	char *		buf;
+	struct mutex	rd_mutex;
+	struct mutex	wr_mutex;
+	waitq_t		rd_waitq;	/* Waiting for data */
+	waitq_t		wr_waitq;	/* Waiting for room */
+};
+
+static struct kfs_fops pipe_read_fops;
+static struct kfs_fops pipe_write_fops;
+
+static unsigned int
+pipe_used(struct pipe * p)
+{
+	unsigned int used;
+
+	spin_lock(&p->lock);
+	used = p->head - p->tail;
+	spin_unlock(&p->lock);
+
+	return used;
+}
+
+static bool
+pipe_readable(struct pipe * p)
+{
+	bool readable;
+
+	spin_lock(&p->lock);
+	readable = (p->head != p->tail) || !p->writers;
+	spin_unlock(&p->lock);
+
+	return readable;
+}
+
+static bool
+pipe_writable(struct pipe * p, unsigned int room)
+{
+	bool writable;
+
+	spin_lock(&p->lock);
+	writable = (PIPE_SIZE - (p->head - p->tail) >= room) || !p->readers;
+	spin_unlock(&p->lock);
+
+	return writable;
+}
+
+/**
+ * Waits for data to read, with rd_mutex held. Returns the amount of data,
+ * 0 once the pipe is empty and has no writers, or an error.
+ */
+static ssize_t
+pipe_wait_data(struct pipe * p, bool nonblock)
+{
+	if (nonblock && !pipe_readable(p))
+		return -EAGAIN;
+
+	if (wait_event_interruptible(p->rd_waitq, pipe_readable(p)))
+		return -ERESTARTSYS;
+
+	return pipe_used(p);
+}
+
+/**
+ * Waits for room for at least room bytes, with wr_mutex held. Returns the
+ * room there is, or an error.
+ */
+static ssize_t
+pipe_wait_room(struct pipe * p, unsigned int room, bool nonblock)
+{
+	if (nonblock && !pipe_writable(p, room))
+		return -EAGAIN;
+
+	if (wait_event_interruptible(p->wr_waitq, pipe_writable(p, room)))
+		return -ERESTARTSYS;
+
+	if (!ACCESS_ONCE(p->readers))
+		return -EPIPE;
+
+	return PIPE_SIZE - pipe_used(p);
+}
+
+/**
+ * Returns where position pos of the pipe is in its buffer, and trims *len
+ * to what is contiguous in the buffer from there.
+ */
+static char *
+pipe_seg(struct pipe * p, unsigned int pos, size_t * len)
+{
+	unsigned int off = pos & (PIPE_SIZE - 1);
+
+	if (*len > PIPE_SIZE - off)
+		*len = PIPE_SIZE - off;
+
+	return p->buf + off;
+}
+
+/* Makes len bytes copied in at head visible to readers */
+static void
+pipe_produce(struct pipe * p, size_t len)
+{
+	if (!len)
+		return;
+
+	spin_lock(&p->lock);
+	p->head += len;
+	spin_unlock(&p->lock);
+
+	waitq_wakeup(&p->rd_waitq);
+}
+
+/* Frees the len bytes at tail for writers */
+static void
+pipe_consume(struct pipe * p, size_t len)
+{
+	if (!len)
+		return;
+
+	spin_lock(&p->lock);
+	p->tail += len;
+	spin_unlock(&p->lock);
+
+	waitq_wakeup(&p->wr_waitq);
+}
+
+static bool
+pipe_nonblock(struct file * filp)
+{
+	return (filp->f_flags & O_NONBLOCK) != 0;
+}
+
+static ssize_t
+pipe_read(struct file * filp, char __user * ubuf, size_t size, loff_t * off)
+{
+	struct pipe * p = filp->private_data;
+	size_t done = 0;
+	ssize_t ret;
+
+	if (filp->f_op != &pipe_read_fops)
+		return -EBADF;
+
+	if (size == 0)
+		return 0;
+
+	if (mutex_lock_interruptible(&p->rd_mutex))
+		return -ERESTARTSYS;
+
+	ret = pipe_wait_data(p, pipe_nonblock(filp));
+	if (ret > 0) {
+		size = min(size, (size_t)ret);
+
+		while (done < size) {
+			size_t len = size - done;
+			char * data = pipe_seg(p, p->tail + done, &len);
+
+			if (copy_to_user(ubuf + done, data, len))
+				break;
+			done += len;
+		}
+
+		pipe_consume(p, done);
+		ret = done ? done : -EFAULT;
+	}
+
+	mutex_unlock(&p->rd_mutex);
+	return ret;
+}
+
+/**
+ * Writes of up to PIPE_BUF bytes wait for room for all of the data, so they
+ * aren't interleaved with other writers' data. Larger writes go in as room
+ * becomes available.
+ */
+static ssize_t
+pipe_write(struct file * filp, const char __user * ubuf, size_t size,
+           loff_t * off)
+{
+	struct pipe * p = filp->private_data;
+	unsigned int room = (size <= PIPE_BUF) ? size : 1;
+	size_t done = 0;
+	ssize_t ret = 0;
+
+	if (filp->f_op != &pipe_write_fops)
+		return -EBADF;
+
+	if (size == 0)
+		return 0;
+
+	if (mutex_lock_interruptible(&p->wr_mutex))
+		return -ERESTARTSYS;
+
+	while (done < size) {
+		size_t todo, copied = 0;
+
+		ret = pipe_wait_room(p, room, pipe_nonblock(filp));
+		if (ret < 0)
+			break;
+
+		todo = min(size - done, (size_t)ret);
+		while (copied < todo) {
+			size_t len = todo - copied;
+			char * data = pipe_seg(p, p->head + copied, &len);
+
+			if (copy_from_user(data, ubuf + done + copied, len))
+				break;
+			copied += len;
+		}
+
+		pipe_produce(p, copied);
+		done += copied;
+
+		if (copied < todo) {
+			ret = -EFAULT;
+			break;
+		}
+	}
+
+	mutex_unlock(&p->wr_mutex);
+	return done ? done : ret;
+}
+
+static unsigned int
+pipe_poll(struct file * filp, struct poll_table_struct * table)
+{
+	struct pipe * p = filp->private_data;
+	unsigned int mask = 0;
+	unsigned int used;
+
+	if (filp->f_op == &pipe_read_fops) {
+		poll_wait(filp, &p->rd_waitq, table);
+
+		spin_lock(&p->lock);
+		used = p->head - p->tail;
+		if (used)
+			mask |= POLLIN | POLLRDNORM;
+		if (!p->writers)
+			mask |= POLLHUP;
+		spin_unlock(&p->lock);
+	} else {
+		poll_wait(filp, &p->wr_waitq, table);
+
+		spin_lock(&p->lock);
+		used = p->head - p->tail;
+		if (PIPE_SIZE - used >= PIPE_BUF)
+			mask |= POLLOUT | POLLWRNORM;
+		if (!p->readers)
+			mask |= POLLERR;
+		spin_unlock(&p->lock);
+	}
+
+	return mask;
+}
+
+static int
+pipe_ioctl(struct file * filp, int request, uaddr_t arg)
+{
+	int used;
+
+	switch (request) {
+	case FIONREAD:
+		used = pipe_used(filp->private_data);
+		if (copy_to_user((void __user *)arg, &used, sizeof(used)))
+			return -EFAULT;
+		return 0;
+	default:
+		/* Not a terminal, isatty() and friends land here */
+		return -ENOTTY;
+	}
+}
+
+/* Drops an end of the pipe, freeing the pipe along with its last end */
+static void
+pipe_put_end(struct file * filp)
+{
+	struct pipe * p = filp->private_data;
+	bool reader = (filp->f_op == &pipe_read_fops);
+	bool last;
+
+	spin_lock(&p->lock);
+	if (reader)
+		p->readers--;
+	else
+		p->writers--;
+	last = !p->readers && !p->writers;
+	spin_unlock(&p->lock);
+
+	dbg("pipe %p reader=%d last=%d\n", p, reader, last);
+
+	if (last) {
+		kmem_free_pages(p->buf, PIPE_ORDER);
+		kmem_free(p);
+	} else if (reader) {
+		waitq_wakeup(&p->wr_waitq);
+	} else {
+		waitq_wakeup(&p->rd_waitq);
+	}
+}
+
+static int
+pipe_close(struct file * filp)
+{
+	pipe_put_end(filp);
+	return 0;
+}
+
+static int
+pipe_release(struct inode * inode, struct file * filp)
+{
+	pipe_put_end(filp);
+	return 0;
+}
+
+static struct kfs_fops pipe_read_fops = {
+	.read = pipe_read,
+	.write = pipe_write,
+	.poll = pipe_poll,
+	.ioctl = pipe_ioctl,
+	.close = pipe_close,
+	.release = pipe_release,
+};
+
+static struct kfs_fops pipe_write_fops = {
+	.read = pipe_read,
+	.write = pipe_write,
+	.poll = pipe_poll,
+	.ioctl = pipe_ioctl,
+	.close = pipe_close,
+	.release = pipe_release,
+};
+
+/**
+ * Creates an anonymous pipe, returning its read and write ends' file
+ * descriptors in fds. O_NONBLOCK is the only flag honored.
+ */
+int
+pipe_create(int fds[2], int flags)
+{
+	struct pipe * p;
+	struct file * file;
+	int fd_read, fd_write;
+
+	if ((p = kmem_alloc(sizeof(struct pipe))) == NULL)
+		return -ENOMEM;
+
+	if ((p->buf = kmem_get_pages(PIPE_ORDER)) == NULL) {
+		kmem_free(p);
+		return -ENOMEM;
+	}
+
+	spin_lock_init(&p->lock);
+	mutex_init(&p->rd_mutex);
+	mutex_init(&p->wr_mutex);
+	waitq_init(&p->rd_waitq);
+	waitq_init(&p->wr_waitq);
+	p->readers = 1;
+	p->writers = 1;
+
+	if ((fd_read = kfs_open_anon(&pipe_read_fops, p)) < 0) {
+		kmem_free_pages(p->buf, PIPE_ORDER);
+		kmem_free(p);
+		return fd_read;
+	}
+
+	if ((fd_write = kfs_open_anon(&pipe_write_fops, p)) < 0) {
+		file = get_current_file(fd_read);
+		fdTableInstallFd(current->fdTable, fd_read, NULL);
+		kfs_close(file);
+		kmem_free_pages(p->buf, PIPE_ORDER);
+		kmem_free(p);
+		return fd_write;
+	}
+
+	get_current_file(fd_read)->f_flags  = O_RDONLY | (flags & O_NONBLOCK);
+	get_current_file(fd_write)->f_flags = O_WRONLY | (flags & O_NONBLOCK);
+
+	dbg("pipe %p fds %d,%d\n", p, fd_read, fd_write);
+
+	fds[0] = fd_read;
+	fds[1] = fd_write;
+	return 0;
+}
+
+/**
+ * fstat() of a pipe end, which has no inode. Returns -EBADF if filp is
+ * not a pipe.
+ */
+int
+pipe_stat(struct file * filp, uaddr_t buf)
+{
+	struct stat rv;
+
+	if ((filp->f_op != &pipe_read_fops) && (filp->f_op != &pipe_write_fops))
+		return -EBADF;
+
+	memset(&rv, 0x00, sizeof(struct stat));
+	rv.st_mode    = S_IFIFO | S_IRUSR | S_IWUSR;
+	rv.st_ino     = (ino_t)filp->private_data;
+	rv.st_nlink   = 1;
+	rv.st_blksize = PIPE_BUF;
+
+	if (copy_to_user((void __user *)buf, &rv, sizeof(struct stat)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/**
+ * Returns the pipe behind filp if it is a pipe's read end (or write end,
+ * if read_end is false), otherwise NULL.
+ */
+static struct pipe *
+get_pipe(struct file * filp, bool read_end)
+{
+	if (filp->f_op != (read_end ? &pipe_read_fops : &pipe_write_fops))
+		return NULL;
+	return filp->private_data;
+}
+
+/**
+ * Reads or writes a file from or to kernel memory, at *off and leaving the
+ * file position alone if off is given.
+ */
+static ssize_t
+file_io(struct file * filp, loff_t * off, char * buf, size_t len, bool write)
+{
+	unsigned long old_fs = get_fs();
+	loff_t pos = filp->pos;
+	ssize_t ret;
+
+	if (off)
+		filp->pos = *off;
+
+	set_fs(KERNEL_DS);
+	if (write)
+		ret = filp->f_op->write(filp, buf, len, NULL);
+	else
+		ret = filp->f_op->read(filp, buf, len, NULL);
+	set_fs(old_fs);
+
+	if (off) {
+		*off = filp->pos;
+		filp->pos = pos;
+	}
+
+	return ret;
+}
+
+/* Copies up to len bytes from in to out, consuming them if consume is set */
+static ssize_t
+pipe_to_pipe(struct pipe * in, struct pipe * out, size_t len,
+             bool nonblock, bool consume)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	/* Read ends are always locked before write ends */
+	if (mutex_lock_interruptible(&in->rd_mutex))
+		return -ERESTARTSYS;
+
+	ret = pipe_wait_data(in, nonblock);
+	if (ret <= 0)
+		goto out;
+	len = min(len, (size_t)ret);
+
+	if (mutex_lock_interruptible(&out->wr_mutex)) {
+		ret = -ERESTARTSYS;
+		goto out;
+	}
+
+	ret = pipe_wait_room(out, 1, nonblock);
+	if (ret > 0) {
+		len = min(len, (size_t)ret);
+
+		while (done < len) {
+			size_t n = len - done;
+			char * src = pipe_seg(in, in->tail + done, &n);
+			char * dst = pipe_seg(out, out->head + done, &n);
+
+			memcpy(dst, src, n);
+			done += n;
+		}
+
+		pipe_produce(out, done);
+		if (consume)
+			pipe_consume(in, done);
+		ret = done;
+	}
+
+	mutex_unlock(&out->wr_mutex);
+out:
+	mutex_unlock(&in->rd_mutex);
+	return ret;
+}
+
+static ssize_t
+pipe_to_file(struct pipe * in, struct file * out, loff_t * off, size_t len,
+             bool nonblock)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	if (mutex_lock_interruptible(&in->rd_mutex))
+		return -ERESTARTSYS;
+
+	ret = pipe_wait_data(in, nonblock);
+	if (ret > 0) {
+		len = min(len, (size_t)ret);
+
+		while (done < len) {
+			size_t n = len - done;
+			char * data = pipe_seg(in, in->tail + done, &n);
+
+			ret = file_io(out, off, data, n, true);
+			if (ret <= 0)
+				break;
+			done += ret;
+			if (ret < n)
+				break;
+		}
+
+		pipe_consume(in, done);
+		if (done)
+			ret = done;
+	}
+
+	mutex_unlock(&in->rd_mutex);
+	return ret;
+}
+
+static ssize_t
+file_to_pipe(struct file * in, loff_t * off, struct pipe * out, size_t len,
+             bool nonblock)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	if (mutex_lock_interruptible(&out->wr_mutex))
+		return -ERESTARTSYS;
+
+	ret = pipe_wait_room(out, 1, nonblock);
+	if (ret > 0) {
+		len = min(len, (size_t)ret);
+
+		while (done < len) {
+			size_t n = len - done;
+			char * data = pipe_seg(out, out->head + done, &n);
+
+			ret = file_io(in, off, data, n, false);
+			if (ret <= 0)
+				break;
+			done += ret;
+			if (ret < n)
+				break;
+		}
+
+		pipe_produce(out, done);
+		if (done)
+			ret = done;
+	}
+
+	mutex_unlock(&out->wr_mutex);
+	return ret;
+}
+
+/**
+ * Moves up to len bytes from in to out without copying them through user
+ * space. One of them must be a pipe, the other may be a pipe or any file
+ * that can be read or written. Offsets may only be given for files, in
+ * which case their file positions are left alone. Returns the number of
+ * bytes moved, 0 at the end of the input.
+ */
+ssize_t
+pipe_splice(struct file * in, loff_t * off_in, struct file * out,
+            loff_t * off_out, size_t len, unsigned int flags)
+{
+	struct pipe * ipipe = get_pipe(in, true);
+	struct pipe * opipe = get_pipe(out, false);
+	bool nonblock = (flags & SPLICE_F_NONBLOCK) != 0;
+
+	if (len == 0)
+		return 0;
+
+	if (ipipe && opipe) {
+		if (off_in || off_out)
+			return -ESPIPE;
+		if (ipipe == opipe)
+			return -EINVAL;
+		return pipe_to_pipe(ipipe, opipe, len,
+		                    nonblock || pipe_nonblock(in) || pipe_nonblock(out),
+		                    true);
+	}
+
+	if (ipipe) {
+		if (off_in)
+			return -ESPIPE;
+		if (!out->f_op || !out->f_op->write)
+			return -EINVAL;
+		return pipe_to_file(ipipe, out, off_out, len,
+		                    nonblock || pipe_nonblock(in));
+	}
+
+	if (opipe) {
+		if (off_out)
+			return -ESPIPE;
+		if (!in->f_op || !in->f_op->read)
+			return -EINVAL;
+		return file_to_pipe(in, off_in, opipe, len,
+		                    nonblock || pipe_nonblock(out));
+	}
+
+	return -EINVAL;
+}
+
+/**
+ * Copies up to len bytes from pipe in to pipe out, leaving them in in.
+ */
+ssize_t
+pipe_tee(struct file * in, struct file * out, size_t len, unsigned int flags)
+{
+	struct pipe * ipipe = get_pipe(in, true);
+	struct pipe * opipe = get_pipe(out, false);
+	bool nonblock = (flags & SPLICE_F_NONBLOCK) != 0;
+
+	if (!ipipe || !opipe || (ipipe == opipe))
+		return -EINVAL;
+
+	if (len == 0)
+		return 0;
+
+	return pipe_to_pipe(ipipe, opipe, len,
+	                    nonblock || pipe_nonblock(in) || pipe_nonblock(out),
+	                    false);
+}
@@ -317,7 +317,7 @@ __lock(&_lock);
 		}
 	}
 	
-	htable_del( inode->parent->files, inode );
+	kfs_del_dirent( inode );
 	kfs_destroy(inode);
 out:
 __unlock(&_lock);
@@ -356,7 +356,7 @@ __lock(&_lock);
 		goto out;
 	}
 	
-	htable_del( inode->parent->files, inode );
+	kfs_del_dirent( inode );
 	
 	kfs_destroy( inode );
  out:
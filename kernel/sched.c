@@ -9,6 +9,9 @@
 #include <lwk/preempt_notifier.h>
 #include <lwk/xcall.h>
 #include <lwk/bootstrap.h>
+#include <lwk/driver.h>
+#include <lwk/proc_fs.h>
+#include <arch/tsc.h>
 
 #include <lwk/sched_rr.h>
 
@@ -24,6 +27,15 @@
 unsigned int sched_hz = 1;  /* default to 1 Hz timer tick */
 param(sched_hz, uint);
 
+#ifdef CONFIG_NOHZ
+/**
+ * If true, the quantum timer is stopped on CPUs with at most one runnable
+ * task. Other timers still fire as requested.
+ */
+static bool nohz = true;
+param(nohz, bool);
+#endif
+
 /**
  * Process run queue.
  *
@@ -43,7 +55,14 @@ struct run_queue {
         int                  online;
         struct list_head     migrate_list;
         struct task_struct * idle_task;
+        struct task_struct * curr;         /* Task running on the CPU */
+        bool                 steal_pending; /* Idle CPU asked to steal work */
+        bool                 tick_stopped; /* Quantum timer not armed */
 	struct timer	     next_int;
+        uint64_t             nr_schedule;  /* Calls to schedule() */
+        uint64_t             nr_switches;  /* Context switches */
+        uint64_t             pick_cycles;  /* Cycles spent picking next */
+        uint64_t             nr_stolen;    /* Tasks stolen from other CPUs */
         struct rr_rq rr;
 #ifdef CONFIG_SCHED_EDF
         struct edf_rq edf;
@@ -52,6 +71,116 @@ struct run_queue {
 
 static DEFINE_PER_CPU(struct run_queue, run_queue);
 
+static void
+set_quantum_timer(struct run_queue *runq, ktime_t inttime)
+{
+	timer_del(&runq->next_int);
+	if (!inttime) {
+        	const ktime_t now = get_time();
+		inttime =  now + 1000000000ul/sched_hz;
+	}
+        runq->next_int.expires = inttime;
+        timer_add(&runq->next_int);
+	
+	return;
+}
+
+/**
+ * Restarts the quantum timer of the calling CPU's run queue if it was
+ * stopped while the CPU had a single runnable task, since a second task
+ * has just become runnable. Called with runq->lock held.
+ */
+static void
+sched_restart_tick(struct run_queue *runq, id_t cpu)
+{
+#ifdef CONFIG_NOHZ
+	/* Remote CPUs are sent a reschedule IPI, and rearm in schedule() */
+	if (!runq->tick_stopped || (cpu != this_cpu)
+	    || (runq->curr == runq->idle_task))
+		return;
+
+	set_quantum_timer(runq, 0);
+	runq->tick_stopped = false;
+#endif
+}
+
+/**
+ * Steals a runnable task from another CPU's run queue for this idle CPU.
+ * Called from the idle task with local IRQs disabled, after another CPU
+ * has set runq->steal_pending. Returns true if a task was stolen. The
+ * quantum timer is left to the schedule() that follows, which arms it
+ * under runq->lock if the stolen task has company.
+ */
+static bool
+sched_steal_task(struct run_queue *runq)
+{
+	struct run_queue *victim;
+	struct task_struct *task = NULL;
+	id_t cpu;
+
+	runq->steal_pending = false;
+
+	for_each_cpu_mask(cpu, cpu_online_map) {
+		if (cpu == this_cpu)
+			continue;
+
+		victim = &per_cpu(run_queue, cpu);
+		if (victim->curr == victim->idle_task)
+			continue;
+
+		spin_lock(&victim->lock);
+		task = rr_sched_steal(&victim->rr, victim->curr, this_cpu);
+		if (task) {
+			--victim->num_tasks;
+			task->cpu_id        = this_cpu;
+			task->cpu_target_id = this_cpu;
+		}
+		spin_unlock(&victim->lock);
+
+		if (task)
+			break;
+	}
+
+	if (!task)
+		return false;
+
+	spin_lock(&runq->lock);
+	rr_sched_add_task(&runq->rr, task);
+	++runq->num_tasks;
+	++runq->nr_stolen;
+	spin_unlock(&runq->lock);
+
+	set_bit(TF_NEED_RESCHED_BIT, &current->arch.flags);
+	return true;
+}
+
+/**
+ * Asks an idle CPU that task may run on to steal work, if task's aspace
+ * has load balancing enabled and task was just made runnable on a busy
+ * CPU. Called without any run queue locks held.
+ */
+static void
+sched_kick_idle_cpu(struct task_struct *task, struct run_queue *task_runq)
+{
+	struct run_queue *runq;
+	id_t cpu;
+
+	if (!task->aspace->lb_threshold || (task_runq->curr == task_runq->idle_task))
+		return;
+
+	for_each_cpu_mask(cpu, task->cpu_mask) {
+		if (!cpu_isset(cpu, cpu_online_map))
+			continue;
+
+		runq = &per_cpu(run_queue, cpu);
+		if (runq->curr == runq->idle_task) {
+			runq->steal_pending = true;
+			xcall_reschedule(cpu);
+			break;
+		}
+	}
+}
+
 /** Spin until something else is ready to run */
 void
 idle_task_loop(void)
@@ -68,6 +197,8 @@ idle_task_loop(void)
                         panic("CPU offline should not return!\n");
                 } else {
 			local_irq_disable();
+			if (runq->steal_pending)
+				sched_steal_task(runq);
 			if (!test_bit(TF_NEED_RESCHED_BIT, &current->arch.flags)) {
                         	arch_idle_task_loop_body(1);
 			} else {
@@ -93,6 +224,12 @@ sched_init_runqueue(int cpu_id)
 
 	runq->num_tasks = 0;
 	runq->online    = 1;
+	runq->nr_schedule = 0;
+	runq->nr_switches = 0;
+	runq->pick_cycles = 0;
+	runq->nr_stolen   = 0;
+	runq->curr        = NULL;
+	runq->steal_pending = false;
 	list_head_init(&runq->migrate_list);
         runq->next_int.expires = 0;
         runq->next_int.function = interrupt_task;
@@ -205,10 +342,13 @@ sched_add_task(struct task_struct *task)
 	{
 		rr_sched_add_task(&runq->rr, task);
 	}
+	sched_restart_tick(runq, cpu);
 	spin_unlock_irqrestore(&runq->lock, irqstate);
 
 	if (cpu != this_cpu)
 		xcall_reschedule(cpu);
+
+	sched_kick_idle_cpu(task, runq);
 }
 
 void
@@ -265,6 +405,8 @@ repeat_lock_runq:
 	}
 	if (task->state & valid_states) {
 		set_task_state(task, TASK_RUNNING);
+		rr_sched_wakeup_task(&runq->rr, task);
+		sched_restart_tick(runq, cpu);
 		status = 0;
 	} else {
 		if (task->state == TASK_STOPPED)
@@ -278,6 +420,9 @@ repeat_lock_runq:
 	if (!status && (cpu != this_cpu))
 		xcall_reschedule(cpu);
 
+	if (!status)
+		sched_kick_idle_cpu(task, runq);
+
 	return status;
 }
 
@@ -289,9 +434,18 @@ context_switch(struct task_struct *prev, struct task_struct *next)
 	arch_task_meas();
 #endif
 
-	/* Switch to the next task's address space */
-	if (prev->aspace != next->aspace)
+	/*
+	 * Switch to the next task's address space. Mark this CPU as caching
+	 * TLB entries for next's aspace before loading it, so no shootdown is
+	 * missed. An exiting task has dropped its aspace reference, so only
+	 * unmark prev's aspace while prev still holds one.
+	 */
+	if (prev->aspace != next->aspace) {
+		cpu_set(this_cpu, next->aspace->tlb_cpus);
 		arch_aspace_activate(next->aspace);
+		if (prev->state != TASK_EXITED)
+			cpu_clear(this_cpu, prev->aspace->tlb_cpus);
+	}
 
 	/**
 	 * Switch to the next task's register state and kernel stack.
@@ -316,26 +470,13 @@ context_switch(struct task_struct *prev, struct task_struct *next)
 	return prev;
 }
 
-static void
-set_quantum_timer(struct run_queue *runq, ktime_t inttime)
-{
-	timer_del(&runq->next_int);
-	if (!inttime) {
-        	const ktime_t now = get_time();
-		inttime =  now + 1000000000ul/sched_hz;
-	}
-        runq->next_int.expires = inttime;
-        timer_add(&runq->next_int);
-	
-	return;
-}
-
 void
 schedule(void)
 {
 	struct run_queue *runq = &per_cpu(run_queue, this_cpu);
 	struct task_struct *prev = current, *next = NULL, *task, *tmp;
 	ktime_t inttime = 0;
+	uint64_t pick_start;
 
 	/* Remember prev's external interrupt state */
 	prev->sched_irqs_on = irqs_enabled();
@@ -381,6 +522,7 @@ schedule(void)
 	}
 	next = NULL;
 	inttime = 0;
+	pick_start = get_cycles();
 #ifdef CONFIG_SCHED_EDF
 	next = edf_schedule(&runq->edf, &runq->migrate_list, &inttime);
 #endif
@@ -393,13 +535,30 @@ schedule(void)
 		next = runq->idle_task;
 	}
 
+	++runq->nr_schedule;
+	runq->pick_cycles += get_cycles() - pick_start;
+	runq->curr = next;
+
         /*Just in case a tight inttime has been set*/
         const ktime_t now = get_time();
         if(inttime && inttime < now){
                 inttime = now + 1000000ul;
         }
 
-	set_quantum_timer(runq, inttime);
+#ifdef CONFIG_NOHZ
+	/* Nobody to preempt next in favor of, don't take quantum ticks */
+	if (nohz && !inttime
+	    && ((next == runq->idle_task) || rr_sched_only_task(&runq->rr, next))) {
+		if (!runq->tick_stopped) {
+			timer_del(&runq->next_int);
+			runq->tick_stopped = true;
+		}
+	} else
+#endif
+	{
+		set_quantum_timer(runq, inttime);
+		runq->tick_stopped = false;
+	}
 
 #ifdef CONFIG_SCHED_EDF
 	set_wakeup_task(&runq->edf,next);
@@ -409,6 +568,7 @@ schedule(void)
 	clear_bit(TF_NEED_RESCHED_BIT, &prev->arch.flags);
 
 	if (prev != next) {
+		++runq->nr_switches;
 		fire_sched_out_preempt_notifiers(prev, next);
 		prev = context_switch(prev, next);
 
@@ -625,3 +785,43 @@ repeat_lock_runq:
 	spin_unlock_irqrestore(&runq->lock, irqstate);
 #endif
 }
+
+/**
+ * Reports each CPU's scheduler counters in /proc/schedstat, one line per
+ * online CPU:
+ *
+ *     cpu<N> <schedule> <switches> <pick_cycles> <rr_examined>
+ *            <rr_blocked> <rr_woken> <stolen>
+ *
+ * pick_cycles / schedule is the average cost of picking the next task,
+ * rr_examined / schedule the average number of tasks looked at to do so.
+ */
+static int
+sched_proc_stats(struct file *file, void *priv_data)
+{
+	struct run_queue *runq;
+	id_t cpu;
+
+	for_each_cpu_mask(cpu, cpu_online_map) {
+		runq = &per_cpu(run_queue, cpu);
+		proc_sprintf(file, "cpu%u %llu %llu %llu %llu %llu %llu %llu\n", cpu,
+		             (unsigned long long)runq->nr_schedule,
+		             (unsigned long long)runq->nr_switches,
+		             (unsigned long long)runq->pick_cycles,
+		             (unsigned long long)runq->rr.nr_examined,
+		             (unsigned long long)runq->rr.nr_blocked,
+		             (unsigned long long)runq->rr.nr_woken,
+		             (unsigned long long)runq->nr_stolen);
+	}
+
+	return 0;
+}
+
+static int
+sched_proc_init(void)
+{
+	proc_mkdir("/proc");
+	return create_proc_file("/proc/schedstat", sched_proc_stats, NULL);
+}
+
+DRIVER_INIT("kfs", sched_proc_init);
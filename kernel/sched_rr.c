@@ -26,8 +26,10 @@
  * Process run queue.
  *
  * Kitten maintains a linked list of tasks per CPU that are in a
- * ready to run state.  Since the number of tasks is expected to
- * be low, the overhead is very smal.
+ * ready to run state (taskq), with the task that runs next at its head.
+ * Tasks that block are moved to the blockq when they call schedule()
+ * and moved back to the tail of the taskq when they are woken up, so
+ * picking the next task is O(1) no matter how many tasks are asleep.
  *
  * If there are no tasks on the queue's taskq, the idle task
  * is run instead.
@@ -36,12 +38,40 @@
 int
 rr_sched_init_runqueue(struct rr_rq *q, int cpu_id) {
 	list_head_init(&q->taskq);
+	list_head_init(&q->blockq);
+	q->nr_examined = 0;
+	q->nr_blocked  = 0;
+	q->nr_woken    = 0;
 	return 0;
 }
 
+/* Puts a task that is giving up the CPU back on the runqueue. Called
+ * from schedule() with the runq lock held.
+ */
 void rr_adjust_schedule(struct rr_rq *q, struct task_struct *task)
 {
+	if (task->state == TASK_RUNNING) {
+		list_add_tail(&task->rr.sched_link, &q->taskq);
+	} else {
+		list_add_tail(&task->rr.sched_link, &q->blockq);
+		task->rr.blocked = true;
+		++q->nr_blocked;
+	}
+}
+
+/* Moves a task that has just been made TASK_RUNNING from the blockq to
+ * the tail of the taskq. Called with the runq lock held.
+ */
+void
+rr_sched_wakeup_task(struct rr_rq *q, struct task_struct *task)
+{
+	if (!task->rr.blocked || list_empty(&task->rr.sched_link))
+		return;
+
+	list_del(&task->rr.sched_link);
 	list_add_tail(&task->rr.sched_link, &q->taskq);
+	task->rr.blocked = false;
+	++q->nr_woken;
 }
 
 /* Migrate all tasks away. Called with the runq lock held and local
@@ -55,18 +85,24 @@ void rr_sched_cpu_remove(struct rr_rq *runq, void * arg)
                 kthread_bind(task, 0);
                 cpu_clear(this_cpu, task->aspace->cpu_mask);
 	}
+	list_for_each_entry_safe(task, tmp, &runq->blockq, rr.sched_link) {
+                kthread_bind(task, 0);
+                cpu_clear(this_cpu, task->aspace->cpu_mask);
+	}
 }
 
 void
 rr_sched_add_task(struct rr_rq *rr, struct task_struct *task)
 {
 	list_add_tail(&task->rr.sched_link, &rr->taskq);
+	task->rr.blocked = false;
 }
 
 void
 rr_sched_del_task(struct rr_rq *runq, struct task_struct *task)
 {
 	list_del(&task->rr.sched_link);
+	task->rr.blocked = false;
 }
 
 void
@@ -77,9 +113,11 @@ rr_sched_yield(void){
 void
 rr_sched_yield_to(struct rr_rq * rr, struct task_struct * task){
 
-	/*Move task to the front of the list*/
-	list_del(&task->rr.sched_link);
-	list_add(&task->rr.sched_link, &rr->taskq);
+	/*Move task to the front of the list, unless it is blocked*/
+	if (!task->rr.blocked) {
+		list_del(&task->rr.sched_link);
+		list_add(&task->rr.sched_link, &rr->taskq);
+	}
 
        schedule();
 }
@@ -87,14 +125,17 @@ rr_sched_yield_to(struct rr_rq * rr, struct task_struct * task){
 struct task_struct *
 rr_schedule(struct rr_rq *runq, struct list_head *migrate_list)
 {
-	struct task_struct *task, *tmp, *next = NULL;
+	struct task_struct *task;
+
+	/* Look for a ready to execute task at the head of the taskq */
+	while (!list_empty(&runq->taskq)) {
+		task = list_entry(runq->taskq.next, struct task_struct,
+		                  rr.sched_link);
+		++runq->nr_examined;
 
-	/* Look for a ready to execute task */
-	list_for_each_entry_safe(task, tmp, &runq->taskq, rr.sched_link) {
 		/* If the task is migrating, move it to the migrate_list.
 		 * The task will be migrated in the second-half of
 		 * schedule(). */
-
 	        if (task->cpu_id != task->cpu_target_id) {
 			list_del(&task->rr.sched_link);
 			list_add_tail(&task->migrate_link, migrate_list);
@@ -102,11 +143,57 @@ rr_schedule(struct rr_rq *runq, struct list_head *migrate_list)
 		}
 
 		/* Pick the first running task */
-		if (task->state == TASK_RUNNING) {
-			next = task;
-			break;
-		}
+		if (task->state == TASK_RUNNING)
+			return task;
+
+		/* Tasks that were queued while not runnable, e.g. migrated
+		 * while blocked, wait on the blockq for their wakeup. */
+		list_del(&task->rr.sched_link);
+		list_add_tail(&task->rr.sched_link, &runq->blockq);
+		task->rr.blocked = true;
+		++runq->nr_blocked;
+	}
+
+	return NULL;
+}
+
+/* Returns true if task is the only task on the taskq, or the taskq is
+ * empty. Called with the runq lock held.
+ */
+bool
+rr_sched_only_task(struct rr_rq *runq, struct task_struct *task)
+{
+	return list_empty(&runq->taskq)
+	    || ((runq->taskq.next == &task->rr.sched_link)
+	        && (runq->taskq.prev == &task->rr.sched_link));
+}
+
+/* Picks a task for an idle CPU to steal and removes it from the taskq.
+ * Candidates are waiting tasks, other than curr, whose aspace has load
+ * balancing enabled and which may run on cpu. A task is only taken if at
+ * least its aspace's lb_threshold tasks are waiting. Called with the runq
+ * lock held.
+ */
+struct task_struct *
+rr_sched_steal(struct rr_rq *runq, struct task_struct *curr, id_t cpu)
+{
+	struct task_struct *task, *victim = NULL;
+	unsigned int waiting = 0;
+
+	list_for_each_entry(task, &runq->taskq, rr.sched_link) {
+		if ((task == curr) || (task->state != TASK_RUNNING))
+			continue;
+		++waiting;
+
+		if (!victim && task->aspace->lb_threshold
+		    && (task->cpu_id == task->cpu_target_id)
+		    && cpu_isset(cpu, task->cpu_mask))
+			victim = task;
 	}
 
-	return next;
+	if (!victim || (waiting < victim->aspace->lb_threshold))
+		return NULL;
+
+	list_del(&victim->rr.sched_link);
+	return victim;
 }
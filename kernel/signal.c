@@ -257,13 +257,11 @@ sigsend(id_t aspace_id, id_t task_id, int signum, struct siginfo *siginfo)
 
 	// Wake up sleeping tasks in TASK_INTERRUPTIBLE
 	if (task && (task->state == TASK_INTERRUPTIBLE)) {
-		set_task_state(task, TASK_RUNNING);
-		xcall_reschedule(task->cpu_id);
+		sched_wakeup_task(task, TASK_INTERRUPTIBLE);
 	} else {
 		list_for_each_entry(cur, &aspace->task_list, aspace_link) {
 			if (cur->state == TASK_INTERRUPTIBLE) {
-				set_task_state(cur, TASK_RUNNING);
-				xcall_reschedule(cur->cpu_id);
+				sched_wakeup_task(cur, TASK_INTERRUPTIBLE);
 			}
 		}
 	}
@@ -7,6 +7,7 @@
 #include <lwk/kfs.h>
 #include <lwk/sched.h>
 #include <lwk/smp.h>
+#include <lwk/topology.h>
 
 #ifdef CONFIG_SCHED_EDF
 #include <lwk/sched_edf.h>
@@ -90,6 +91,7 @@ __task_create(
 	struct aspace *aspace;
 	union task_union *tsk_union;
 	struct task_struct *tsk;
+	id_t cpu_id;
 	int irqstate;
 
 	// Lookup the target address space
@@ -104,23 +106,24 @@ __task_create(
 	if (aspace->exiting)
 		goto fail_exiting;
 
-	// Allocate a new task structure
-	tsk_union = kmem_get_pages(TASK_ORDER);
+	// Figure out the new task's CPU ID
+	cpu_id = alloc_cpu_id(aspace, start_state->cpu_id);
+	if (cpu_id == ERROR_ID)
+		goto fail_cpu_id_alloc;
+
+	// Allocate a new task structure on the NUMA node it will run on
+	tsk_union = kmem_get_pages_node(TASK_ORDER, cpu_to_node(cpu_id));
 	if (!tsk_union)
 		goto fail_task_alloc;
 	tsk = &tsk_union->task_info;
+	tsk->cpu_id = cpu_id;
+	tsk->cpu_target_id = tsk->cpu_id;
 
 	// Figure out the new task's ID
 	tsk->id = alloc_task_id(aspace, start_state->task_id);
 	if (tsk->id == ERROR_ID)
 		goto fail_task_id_alloc;
 
-	// Figure out the new task's CPU ID
-	tsk->cpu_id = alloc_cpu_id(aspace, start_state->cpu_id);
-	if (tsk->cpu_id == ERROR_ID)
-		goto fail_cpu_id_alloc;
-	tsk->cpu_target_id = tsk->cpu_id;
-
 #ifdef CONFIG_SCHED_EDF
 
 	if(start_state->edf.period){
@@ -168,6 +171,7 @@ __task_create(
 	list_head_init(&tsk->aspace_link);
 	list_head_init(&tsk->migrate_link);
 	list_head_init(&tsk->rr.sched_link);
+	tsk->rr.blocked	=	false;
 	list_head_init(&tsk->sigpending.list);
 	
 	// Do architecture-specific initialization
@@ -202,10 +206,10 @@ __task_create(
 	return tsk;
 
 fail_arch:
-fail_cpu_id_alloc:
 fail_task_id_alloc:
 	kmem_free_pages(tsk_union, TASK_ORDER);
 fail_task_alloc:
+fail_cpu_id_alloc:
 fail_exiting:
 	spin_unlock_irqrestore(&aspace->lock, irqstate);
 	aspace_release(aspace);
@@ -344,10 +348,8 @@ task_exit_group(
 			if (tsk != current) {
 				sigset_add(&tsk->sigpending.sigset, SIGKILL);
 				set_bit(TF_SIG_PENDING_BIT, &tsk->arch.flags);
-				if (tsk->state == TASK_INTERRUPTIBLE) {
-					set_task_state(tsk, TASK_RUNNING);
-					xcall_reschedule(tsk->cpu_id);
-				}
+				if (tsk->state == TASK_INTERRUPTIBLE)
+					sched_wakeup_task(tsk, TASK_INTERRUPTIBLE);
 			}
 		}
 	}
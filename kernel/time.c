@@ -1,10 +1,48 @@
 #include <lwk/time.h>
+#include <lwk/spinlock.h>
 #include <arch/div64.h>
 
 static uint64_t shift;
 static uint64_t mult;
 static uint64_t offset;
 
+/* User-visible copy of the above, NULL until the arch provides one */
+static struct vtime_data *vtime;
+static DEFINE_SPINLOCK(vtime_lock);
+
+/**
+ * Publishes the current cycles to nanoseconds conversion to user space.
+ */
+static void
+vtime_update(void)
+{
+	unsigned long irqstate;
+
+	if (!vtime)
+		return;
+
+	spin_lock_irqsave(&vtime_lock, irqstate);
+	vtime->seq++;
+	smp_wmb();
+	vtime->shift  = shift;
+	vtime->mult   = mult;
+	vtime->offset = offset;
+	smp_wmb();
+	vtime->seq++;
+	spin_unlock_irqrestore(&vtime_lock, irqstate);
+}
+
+/**
+ * Registers the user-visible time conversion state, which is kept in sync
+ * with the kernel's from now on. Called by the arch's vsyscall setup.
+ */
+void
+vtime_init(struct vtime_data *vt)
+{
+	vtime = vt;
+	vtime_update();
+}
+
 /**
  * Converts the input khz cycle counter frequency to a time source multiplier.
  * The multiplier is used to convert cycle counts to nanoseconds.
@@ -40,6 +78,8 @@ init_cycles2ns(uint32_t khz)
 	mult = ((u64)1000000) << shift;
 	mult += khz/2; /* round for do_div */
 	do_div(mult, khz);
+
+	vtime_update();
 }
 
 /**
@@ -71,6 +111,7 @@ void
 set_time(ktime_t ns)
 {
 	offset = ns - cycles2ns(get_cycles());
+	vtime_update();
 }
 
 /**
@@ -10,10 +10,44 @@
 #include <lwk/timer.h>
 #include <lwk/sched.h>
 #include <lwk/xcall.h>
+#include <lwk/params.h>
+#ifdef CONFIG_DEBUG_TIMER_BENCH
+#include <lwk/kmem.h>
+#include <arch/tsc.h>
+#endif
+
+/**
+ * Each CPU keeps its pending timers in a hierarchical timing wheel.
+ *
+ * Time is divided into ticks of 2^TW_TICK_SHIFT ns. Level 0 of the wheel
+ * has one slot per tick for the next TW_SIZE ticks, and each higher level
+ * has slots TW_SIZE times wider than the level below it. A timer is put in
+ * the lowest level whose range covers its expiration, so adding and
+ * deleting a timer is O(1). Whenever the wheel's clock crosses the start of
+ * a higher level slot, the slot's timers are re-added (cascaded) into the
+ * levels below. Timers keep their exact expiration time, ticks are only
+ * used to pick slots.
+ *
+ * Timers further out than the top level's range are parked in the top
+ * level's furthest slot and cascaded back into it until they are in range.
+ */
+#define TW_TICK_SHIFT	14		/* ~16 us per level 0 slot */
+#define TW_BITS		6
+#define TW_SIZE		(1UL << TW_BITS)
+#define TW_MASK		(TW_SIZE - 1)
+#define TW_LEVELS	4		/* Level 3 slots are ~4.3 s wide */
+
+#define TW_LEVEL_SHIFT(lvl)	((lvl) * TW_BITS)
+#define TW_RANGE		(1UL << (TW_LEVELS * TW_BITS))
+#define TW_SLOT(lvl, idx)	((lvl) * TW_SIZE + (idx))
+#define TW_EXPIRED		(~0U)	/* Slot of timers waiting to be run */
 
 struct timer_queue {
 	spinlock_t       lock;
-	struct list_head timer_list;
+	uint64_t         clk;		/* Tick the wheel has been run up to */
+	unsigned long    nr_timers;	/* # timers in the wheel */
+	uint64_t         pending[TW_LEVELS];	/* Bitmap of non-empty slots */
+	struct list_head slot[TW_LEVELS * TW_SIZE];
 };
 
 static DEFINE_PER_CPU(struct timer_queue, timer_queue);
@@ -21,6 +55,13 @@ static DEFINE_PER_CPU(struct timer_queue, timer_queue);
 /* Don't ask for timers shorter than 10 microseconds */
 #define MIN_TIMER_INTERVAL 10000 
 
+/**
+ * Timers expiring up to timer_slack ns after the earliest pending timer
+ * are run by the same interrupt, which is delayed until the last of them.
+ */
+static unsigned long timer_slack = MIN_TIMER_INTERVAL;
+param(timer_slack, ulong);
+
 static void
 interrupt_timer_init(void) {
 /* Oneshot timer is started by the scheduler. */
@@ -34,46 +75,265 @@ int
 core_timer_init(int cpu_id)
 {
 	struct timer_queue *timerq = &per_cpu(timer_queue, cpu_id);
+	unsigned int i;
     
 	spin_lock_init(&timerq->lock);
-	list_head_init(&timerq->timer_list);
+	timerq->clk       = get_time() >> TW_TICK_SHIFT;
+	timerq->nr_timers = 0;
+	for (i = 0; i < TW_LEVELS; i++)
+		timerq->pending[i] = 0;
+	for (i = 0; i < TW_LEVELS * TW_SIZE; i++)
+		list_head_init(&timerq->slot[i]);
 	interrupt_timer_init();
 
 	return 0;
 }
 
 
+/** Puts a timer in the wheel slot matching its expiration time.
+ *  Called with timerq->lock held.
+ */
+static void
+wheel_insert(struct timer_queue *timerq, struct timer *timer)
+{
+	uint64_t tick = timer->expires >> TW_TICK_SHIFT;
+	uint64_t delta;
+	unsigned int lvl;
+
+	/* Timers that are already due go in the current slot */
+	if (tick < timerq->clk)
+		tick = timerq->clk;
+
+	delta = tick - timerq->clk;
+	if (delta >= TW_RANGE) {
+		tick  = timerq->clk + TW_RANGE - 1;
+		delta = TW_RANGE - 1;
+	}
+
+	for (lvl = 0; lvl < TW_LEVELS - 1; lvl++) {
+		if (delta < (1UL << TW_LEVEL_SHIFT(lvl + 1)))
+			break;
+	}
+
+	timer->slot = TW_SLOT(lvl, (tick >> TW_LEVEL_SHIFT(lvl)) & TW_MASK);
+	list_add_tail(&timer->link, &timerq->slot[timer->slot]);
+	timerq->pending[lvl] |= 1UL << (timer->slot & TW_MASK);
+}
+
+/** Takes a timer out of its wheel slot. Called with timerq->lock held. */
+static void
+wheel_remove(struct timer_queue *timerq, struct timer *timer)
+{
+	list_del_init(&timer->link);
+	if (list_empty(&timerq->slot[timer->slot]))
+		timerq->pending[timer->slot / TW_SIZE] &=
+			~(1UL << (timer->slot & TW_MASK));
+}
+
+/** Returns the index of the first non-empty slot at or after idx, going
+ *  round the level, or -1 if the level is empty.
+ */
+static int
+wheel_next_slot(uint64_t pending, unsigned int idx)
+{
+	uint64_t rotated;
+
+	if (!pending)
+		return -1;
+
+	rotated = (pending >> idx) | (idx ? (pending << (TW_SIZE - idx)) : 0);
+	return (idx + __ffs(rotated)) & TW_MASK;
+}
+
+/** Returns the first tick >= from whose level 0 slot holds timers. */
+static uint64_t
+wheel_next_tick(struct timer_queue *timerq, uint64_t from)
+{
+	int idx = wheel_next_slot(timerq->pending[0], from & TW_MASK);
+
+	if (idx < 0)
+		return ULLONG_MAX;
+	return from + ((idx - from) & TW_MASK);
+}
+
+/** Returns the first tick >= from at which a non-empty higher level slot
+ *  must be cascaded.
+ */
+static uint64_t
+wheel_next_cascade(struct timer_queue *timerq, uint64_t from)
+{
+	uint64_t next = ULLONG_MAX, width, start, tick;
+	unsigned int lvl;
+	int idx;
+
+	for (lvl = 1; lvl < TW_LEVELS; lvl++) {
+		width = 1UL << TW_LEVEL_SHIFT(lvl);
+		start = (from + width - 1) & ~(width - 1);
+		idx   = wheel_next_slot(timerq->pending[lvl],
+		                        (start >> TW_LEVEL_SHIFT(lvl)) & TW_MASK);
+		if (idx < 0)
+			continue;
+
+		tick = start + (((idx - (start >> TW_LEVEL_SHIFT(lvl))) & TW_MASK)
+		                << TW_LEVEL_SHIFT(lvl));
+		if (tick < next)
+			next = tick;
+	}
+
+	return next;
+}
+
+/** Re-adds the timers of the higher level slots that start at the wheel's
+ *  current tick into the levels below. Called with timerq->lock held.
+ */
+static void
+wheel_cascade(struct timer_queue *timerq)
+{
+	struct list_head list;
+	struct timer *timer, *tmp;
+	unsigned int lvl, idx;
+
+	for (lvl = 1; lvl < TW_LEVELS; lvl++) {
+		if (timerq->clk & ((1UL << TW_LEVEL_SHIFT(lvl)) - 1))
+			break;
+
+		idx = (timerq->clk >> TW_LEVEL_SHIFT(lvl)) & TW_MASK;
+		if (list_empty(&timerq->slot[TW_SLOT(lvl, idx)]))
+			continue;
+
+		list_head_init(&list);
+		list_splice_init(&timerq->slot[TW_SLOT(lvl, idx)], &list);
+		timerq->pending[lvl] &= ~(1UL << idx);
+
+		list_for_each_entry_safe(timer, tmp, &list, link) {
+			list_del(&timer->link);
+			wheel_insert(timerq, timer);
+		}
+	}
+}
+
+/** Advances the wheel to now, moving every timer that has expired onto the
+ *  expired list. The cascade for the wheel's current tick has always been
+ *  done already. Called with timerq->lock held.
+ */
+static void
+wheel_advance(struct timer_queue *timerq, uint64_t now,
+              struct list_head *expired)
+{
+	const uint64_t target = now >> TW_TICK_SHIFT;
+	struct timer *timer, *tmp;
+	struct list_head *slot;
+	uint64_t next;
+
+	for (;;) {
+		slot = &timerq->slot[TW_SLOT(0, timerq->clk & TW_MASK)];
+		list_for_each_entry_safe(timer, tmp, slot, link) {
+			if (timer->expires > now)
+				continue;
+			wheel_remove(timerq, timer);
+			list_add_tail(&timer->link, expired);
+			timer->slot = TW_EXPIRED;
+			--timerq->nr_timers;
+		}
+
+		if (timerq->clk >= target)
+			break;
+
+		/* Skip over ticks with nothing to do */
+		next = min(wheel_next_tick(timerq, timerq->clk + 1),
+		           wheel_next_cascade(timerq, timerq->clk + 1));
+		timerq->clk = min(next, target);
+		wheel_cascade(timerq);
+	}
+}
+
+#ifdef CONFIG_TIMER_ONESHOT
+/** Returns the time the calling CPU's timer interrupt should fire at, or 0
+ *  if no timers are pending. That is the earliest expiration of any timer,
+ *  or the latest one within timer_slack of it so they share the interrupt.
+ *  Cascades don't need an interrupt of their own, wheel_advance() does them
+ *  when the wheel is run. Called with timerq->lock held.
+ */
+static uint64_t
+wheel_next_expiry(struct timer_queue *timerq)
+{
+	struct list_head *slot[TW_LEVELS];
+	uint64_t first = ULLONG_MAX, last;
+	struct timer *timer;
+	unsigned int lvl, nr = 0, i;
+	int idx;
+
+	if (!timerq->nr_timers)
+		return 0;
+
+	/* The earliest timers of each level are in its first non-empty slot.
+	 * Higher levels start at the slot after the wheel's clock, their
+	 * current slot only holds timers a full round away. */
+	for (lvl = 0; lvl < TW_LEVELS; lvl++) {
+		idx = wheel_next_slot(timerq->pending[lvl],
+		                      ((timerq->clk >> TW_LEVEL_SHIFT(lvl)) +
+		                       (lvl ? 1 : 0)) & TW_MASK);
+		if (idx >= 0)
+			slot[nr++] = &timerq->slot[TW_SLOT(lvl, idx)];
+	}
+
+	for (i = 0; i < nr; i++) {
+		list_for_each_entry(timer, slot[i], link) {
+			if (timer->expires < first)
+				first = timer->expires;
+		}
+	}
+
+	last = first;
+	for (i = 0; i < nr; i++) {
+		list_for_each_entry(timer, slot[i], link) {
+			if ((timer->expires > last) &&
+			    (timer->expires <= first + timer_slack))
+				last = timer->expires;
+		}
+	}
+
+	return last;
+}
+#endif
+
 
-/** Set the timer interrupt to fire for the current head of
- *  the per-CPU timer list.
+/** Set the timer interrupt to fire for the next expiring timer of
+ *  the per-CPU timer wheel. Called with timerq->lock held.
  */
 static void 
 set_timer_interrupt(void)
 {
 #ifdef CONFIG_TIMER_ONESHOT
 	struct timer_queue *timerq = &per_cpu(timer_queue, this_cpu);
-	if (!list_empty(&timerq->timer_list) ) {
+	const uint64_t expires = wheel_next_expiry(timerq);
+
+	if (expires) {
 		const uint64_t now = get_time();
 		uint64_t diff;
-		struct timer *timer = 
-			list_entry( timerq->timer_list.next,
-				    struct timer, link );
 
-		if (timer->expires > (now + MIN_TIMER_INTERVAL)) {
-			diff = timer->expires - now;
+		/* Timers further out than the one-shot timer can count to
+		 * take an early interrupt, which sets it again. */
+		if (expires > (now + MIN_TIMER_INTERVAL)) {
+			diff = min_t(uint64_t, expires - now, UINT_MAX);
 		} else {
 			diff = MIN_TIMER_INTERVAL;
 		}
 
 		arch_set_timer_oneshot(diff);
-	} 
+	}
+#ifdef CONFIG_NOHZ
+	else {
+		/* Nothing to wait for, don't take a stale interrupt */
+		arch_stop_timer_oneshot();
+	}
+#endif
 #endif 
 }
 
 void
 timer_add(struct timer *timer)
 {
-	struct list_head *pos;
 	unsigned long irqstate;
 
 	struct timer_queue *timerq = &per_cpu(timer_queue, this_cpu);
@@ -83,13 +343,8 @@ timer_add(struct timer *timer)
 	list_head_init(&timer->link);
 	timer->cpu = this_cpu;
 
-	/* Insert the new timer into the CPU's sorted timer_list */
-	list_for_each(pos, &timerq->timer_list) {
-		struct timer *cur = list_entry(pos, struct timer, link);
-		if (cur->expires > timer->expires)
-			break;
-	}
-	list_add_tail(&timer->link, pos);
+	wheel_insert(timerq, timer);
+	++timerq->nr_timers;
 
 	set_timer_interrupt();
 
@@ -120,11 +375,21 @@ timer_del(struct timer *timer)
 	struct timer_queue *timerq = &per_cpu(timer_queue, timer->cpu);
 	spin_lock_irqsave(&timerq->lock, irqstate);
 
-	/* Remove the timer, if it hasn't already expired */
+	/* Remove the timer, if it hasn't already expired, and set the
+	 * interrupt for the next timer still pending. Another CPU's interrupt
+	 * can't be set from here and is left as is, firing early is
+	 * harmless. */
 	if (!list_empty(&timer->link)) {
-		list_del_init(&timer->link);
 		not_expired = 1;
-		set_timer_interrupt();
+		if (timer->slot == TW_EXPIRED) {
+			/* Expired, but its callback hasn't been run yet */
+			list_del_init(&timer->link);
+		} else {
+			wheel_remove(timerq, timer);
+			--timerq->nr_timers;
+			if (timer->cpu == this_cpu)
+				set_timer_interrupt();
+		}
 	}
 
 	spin_unlock_irqrestore(&timerq->lock, irqstate);
@@ -174,7 +439,7 @@ timer_sleep_until(uint64_t when)
 }
 
 
-/** Walk the per-CPU timer list, calling any timer callbacks.
+/** Run the per-CPU timer wheel up to now, calling any timer callbacks.
  *
  * The struct timer entries will be unlinked, but not deleted.
  * It is up to the caller to free any dynamically allocated
@@ -185,20 +450,22 @@ expire_timers(void)
 {
 	struct timer_queue *timerq = &per_cpu(timer_queue, this_cpu);
 	const uint64_t now = get_time();
+	struct list_head expired;
 	unsigned long irqstate;
 
+	list_head_init(&expired);
+
 	spin_lock_irqsave(&timerq->lock, irqstate);
 
-	while( !list_empty(&timerq->timer_list) )
+	wheel_advance(timerq, now, &expired);
+
+	while( !list_empty(&expired) )
 	{
 		struct timer *timer = 
-			list_entry( timerq->timer_list.next,
+			list_entry( expired.next,
 			struct timer, link
 		);
 
-		if( timer->expires > now )
-			break;
-
 		list_del_init(&timer->link);
 		spin_unlock_irqrestore(&timerq->lock, irqstate);
 
@@ -216,3 +483,97 @@ expire_timers(void)
 
 	spin_unlock_irqrestore(&timerq->lock, irqstate);
 }
+
+#ifdef CONFIG_DEBUG_TIMER_BENCH
+/**
+ * Reference implementation of timer_add(), the sorted list insert that the
+ * timer wheel replaced. Only used for comparison by the benchmark.
+ */
+static void
+timer_add_sorted(struct list_head *list, struct timer *timer)
+{
+	struct list_head *pos;
+
+	list_for_each(pos, list) {
+		struct timer *cur = list_entry(pos, struct timer, link);
+		if (cur->expires > timer->expires)
+			break;
+	}
+	list_add_tail(&timer->link, pos);
+}
+
+/**
+ * Measures the cost of timer churn as a function of the number of pending
+ * timers. The calling CPU is loaded with an increasing number of timers
+ * expiring at random times 10 to 11 seconds out. For each population, the
+ * average cycles per timer_del() + timer_add() pair that re-arms a random
+ * timer is reported, for the timer wheel and for a sorted list.
+ */
+void
+timer_churn_bench(void)
+{
+	static const unsigned int counts[] = { 16, 64, 256, 1024, 4096 };
+	const unsigned int iters = 4096;
+	const uint64_t base = 10 * NSEC_PER_SEC;
+	struct timer *timers, *timer;
+	struct list_head sorted;
+	unsigned int i, j, nr = 0;
+	uint64_t seed = 1, start, wheel, list;
+
+	timers = kmem_alloc(counts[ARRAY_SIZE(counts) - 1] * sizeof(*timers));
+	if (!timers)
+		return;
+
+	printk(KERN_DEBUG "timer churn benchmark (cycles/re-arm):\n");
+	printk(KERN_DEBUG "  %8s %10s %10s\n", "timers", "wheel", "list");
+
+	for (i = 0; i < ARRAY_SIZE(counts); i++) {
+		/* Grow the population up to the next timer count */
+		for ( ; nr < counts[i]; nr++) {
+			seed = seed * 6364136223846793005ULL + 1;
+			timers[nr].expires = get_time() + base + (seed >> 34);
+			timer_add(&timers[nr]);
+		}
+
+		start = get_cycles();
+		for (j = 0; j < iters; j++) {
+			seed = seed * 6364136223846793005ULL + 1;
+			timer = &timers[(seed >> 33) % nr];
+			timer_del(timer);
+			timer->expires = get_time() + base + (seed >> 34);
+			timer_add(timer);
+		}
+		wheel = (get_cycles() - start) / iters;
+
+		/* Move the population over to a sorted list */
+		list_head_init(&sorted);
+		for (j = 0; j < nr; j++) {
+			timer_del(&timers[j]);
+			timer_add_sorted(&sorted, &timers[j]);
+		}
+
+		start = get_cycles();
+		for (j = 0; j < iters; j++) {
+			seed = seed * 6364136223846793005ULL + 1;
+			timer = &timers[(seed >> 33) % nr];
+			list_del(&timer->link);
+			timer->expires = get_time() + base + (seed >> 34);
+			timer_add_sorted(&sorted, timer);
+		}
+		list = (get_cycles() - start) / iters;
+
+		/* And back into the wheel */
+		for (j = 0; j < nr; j++) {
+			list_del(&timers[j].link);
+			timer_add(&timers[j]);
+		}
+
+		printk(KERN_DEBUG "  %8u %10llu %10llu\n", nr,
+		       (unsigned long long)wheel, (unsigned long long)list);
+	}
+
+	for (j = 0; j < nr; j++)
+		timer_del(&timers[j]);
+	kmem_free(timers);
+}
+#endif
@@ -1,6 +1,9 @@
 #include <lwk/kernel.h>
 #include <lwk/smp.h>
 #include <lwk/xcall.h>
+#ifdef CONFIG_DEBUG_XCALL_BENCH
+#include <arch/tsc.h>
+#endif
 
 /**
  * Carries out an inter-CPU function call. The specified function is executed
@@ -77,3 +80,55 @@ int on_each_cpu(void (*func) (void *info), void *info, int wait)
 {
     return xcall_function(cpu_online_map, func, info, wait);
 }
+
+#ifdef CONFIG_DEBUG_XCALL_BENCH
+/**
+ * Cross-call function used by the benchmark, does nothing.
+ */
+static void
+xcall_bench_nop(void *info)
+{
+}
+
+/**
+ * Measures cross-call round-trip latency as a function of the number of
+ * CPUs involved. For n = 2 .. num_online_cpus, the calling CPU repeatedly
+ * cross-calls the first n-1 other online CPUs with wait=true, and the
+ * average cycles per cross-call is reported. Also reports the cost of
+ * queueing an asynchronous (wait=false) cross-call to all other CPUs.
+ */
+void
+xcall_latency_bench(void)
+{
+	const unsigned int iters = 1000;
+	cpumask_t mask = CPU_MASK_NONE;
+	unsigned int cpu, n = 1, i;
+	uint64_t start, sync, async;
+
+	printk(KERN_DEBUG "xcall latency benchmark (cycles/xcall):\n");
+	printk(KERN_DEBUG "  %6s %10s %10s\n", "cpus", "sync", "async");
+
+	for_each_cpu_mask(cpu, cpu_online_map) {
+		if (cpu == this_cpu)
+			continue;
+		cpu_set(cpu, mask);
+		n++;
+
+		start = get_cycles();
+		for (i = 0; i < iters; i++)
+			xcall_function(mask, xcall_bench_nop, NULL, true);
+		sync = (get_cycles() - start) / iters;
+
+		start = get_cycles();
+		for (i = 0; i < iters; i++)
+			xcall_function(mask, xcall_bench_nop, NULL, false);
+		async = (get_cycles() - start) / iters;
+
+		/* Let the async cross-calls drain before the next round */
+		xcall_function(mask, xcall_bench_nop, NULL, true);
+
+		printk(KERN_DEBUG "  %6u %10llu %10llu\n", n,
+		       (unsigned long long)sync, (unsigned long long)async);
+	}
+}
+#endif
@@ -22,6 +22,7 @@
 #include <math.h>
 #include <lwk/rcr/rcr.h>
 #include <sys/mman.h>
+#include <string.h>
 
 #define TEST_BLOCK_LAYER 1
 //#define TEST_TASK_MEAS 1
@@ -31,6 +32,7 @@ static int aspace_api_test(void);
 static int task_api_test(void);
 static int task_migrate_test(void);
 static int fd_test(void);
+static int mremap_test(void);
 static int socket_api_test(void);
 static int hypervisor_api_test(void);
 #ifdef TEST_BLOCK_LAYER
@@ -59,6 +61,7 @@ main(int argc, char *argv[], char *envp[])
 	pmem_api_test();
 	aspace_api_test();
 	fd_test();
+	mremap_test();
 	task_api_test();
 	task_migrate_test();
 #ifdef TEST_BLOCK_LAYER
@@ -505,6 +508,82 @@ fd_test( void )
 	return 0;
 }
 
+static int
+check_fill(const char *buf, char c, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (buf[i] != c)
+			return -1;
+	}
+	return 0;
+}
+
+static int
+mremap_test(void)
+{
+	const size_t len = 4 * 4096;
+	char *a, *b, *c, *moved;
+
+	printf("\n");
+	printf("TEST BEGIN: mremap() Test\n");
+
+	a = mmap(0, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	b = mmap(0, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if ((a == MAP_FAILED) || (b == MAP_FAILED)) {
+		printf("    ERROR: mmap() failed\n");
+		return -1;
+	}
+	memset(a, 'a', len);
+	memset(b, 'b', len);
+
+	printf("  Growing a mapping in place or moving it...\n");
+	moved = mremap(a, len, 2 * len, MREMAP_MAYMOVE);
+	if ((moved == MAP_FAILED) || check_fill(moved, 'a', len) ||
+	    check_fill(moved + len, 0, len)) {
+		printf("    ERROR: mremap() lost the mapping's contents\n");
+		return -1;
+	}
+	a = moved;
+	printf("    Success, %p\n", a);
+
+	printf("  Moving a mapping onto an existing mapping (MREMAP_FIXED)...\n");
+	moved = mremap(a, len, len, MREMAP_MAYMOVE|MREMAP_FIXED, b);
+	if (moved != b) {
+		printf("    ERROR: mremap() returned %p, expected %p\n", moved, b);
+		return -1;
+	}
+	if (check_fill(b, 'a', len)) {
+		printf("    ERROR: moved mapping does not hold its contents\n");
+		return -1;
+	}
+	munmap(a + len, len);
+
+	/* The target stays mapped, a new mapping must not be put over it */
+	c = mmap(0, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (c == MAP_FAILED) {
+		printf("    ERROR: mmap() failed\n");
+		return -1;
+	}
+	if ((c < b + len) && (b < c + len)) {
+		printf("    ERROR: mmap() returned %p, inside the moved mapping\n", c);
+		return -1;
+	}
+	memset(c, 'c', len);
+	if (check_fill(b, 'a', len)) {
+		printf("    ERROR: moved mapping was overwritten\n");
+		return -1;
+	}
+	printf("    Success.\n");
+
+	munmap(b, len);
+	munmap(c, len);
+
+	printf("TEST END:   mremap() Test\n");
+	return 0;
+}
+
 int
 socket_api_test( void )
 {
@@ -655,6 +655,22 @@ elf_load_executable(
 	return (num_load_segments) ? 0 : -ENOENT;
 }
 
+/**
+ * Returns the largest page size, at least pagesz, that an extent bytes long
+ * region can hold. Placing the region at an address aligned to it, and
+ * backing it with memory aligned the same way, lets the kernel map all but
+ * its unaligned tail with large pages.
+ */
+static vmpagesize_t
+large_pagesz(size_t extent, vmpagesize_t pagesz)
+{
+	if ((extent >= VM_PAGE_1GB) && (pagesz <= VM_PAGE_1GB))
+		return VM_PAGE_1GB;
+	if ((extent >= VM_PAGE_2MB) && (pagesz <= VM_PAGE_2MB))
+		return VM_PAGE_2MB;
+	return pagesz;
+}
+
 static int
 make_region(
 	id_t         aspace_id,
@@ -662,6 +678,7 @@ make_region(
 	size_t       extent,
 	vmflags_t    flags,
 	vmpagesize_t pagesz,
+	vmpagesize_t alignment,
 	const char * name,
 	uintptr_t    alloc_pmem_arg,
 	paddr_t (*alloc_pmem)(size_t size, size_t alignment, uintptr_t arg),
@@ -670,7 +687,11 @@ make_region(
 {
 	int status;
 
-	*pmem = alloc_pmem(extent, pagesz, alloc_pmem_arg);
+	/* Fall back to smaller alignments if memory is fragmented */
+	while (((*pmem = alloc_pmem(extent, alignment, alloc_pmem_arg)) == 0)
+	       && (alignment > pagesz))
+		alignment = ((alignment >> 9) > pagesz) ? (alignment >> 9)
+		                                         : pagesz;
 	if (*pmem == 0) {
 		print("Failed to allocate physical memory for %s.", name);
 		return -ENOMEM;
@@ -723,6 +744,7 @@ elf_load(
 	vaddr_t heap_start, stack_start, stack_end, stack_ptr;
 	vaddr_t local_stack_start;
 	size_t heap_extent, stack_extent;
+	vmpagesize_t heap_align, stack_align;
 	paddr_t heap_pmem, stack_pmem;
 	uint32_t hwcap;
 	paddr_t elf_image_paddr;
@@ -765,9 +787,10 @@ elf_load(
 		return status;
 	}
 
-	/* Create the UNIX heap */
-	heap_start  = round_up(elf_heap_start(elf_image), pagesz);
+	/* Create the UNIX heap, large page aligned */
 	heap_extent = round_up(heap_size, pagesz);
+	heap_align  = large_pagesz(heap_extent, pagesz);
+	heap_start  = round_up(elf_heap_start(elf_image), heap_align);
 	status =
 	make_region(
 		aspace_id,
@@ -775,6 +798,7 @@ elf_load(
 		heap_extent,
 		(VM_USER|VM_READ|VM_WRITE|VM_EXEC|VM_HEAP),
 		pagesz,
+		heap_align,
 		"heap",
 		alloc_pmem_arg,
 		alloc_pmem,
@@ -785,9 +809,14 @@ elf_load(
 		return status;
 	}
 
-	/* Create the stack region */
+	/* Create the stack region. Its top is aligned to any page size, so
+	   growing it down to a 2 MB boundary lets it use large pages for
+	   less than a large page's worth of extra memory. */
 	stack_end    = SMARTMAP_ALIGN;
-	stack_start  = round_down(stack_end - stack_size, pagesz);
+	stack_align  = large_pagesz(stack_size, pagesz);
+	if ((stack_align > VM_PAGE_2MB) && (pagesz <= VM_PAGE_2MB))
+		stack_align = VM_PAGE_2MB;
+	stack_start  = round_down(stack_end - stack_size, stack_align);
 	stack_extent = stack_end - stack_start;
 	status = 
 	make_region(
@@ -796,6 +825,7 @@ elf_load(
 		stack_extent,
 		(VM_USER|VM_READ|VM_WRITE|VM_EXEC),
 		pagesz,
+		stack_align,
 		"stack",
 		alloc_pmem_arg,
 		alloc_pmem,
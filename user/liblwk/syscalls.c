@@ -38,6 +38,7 @@ SYSCALL2(aspace_update_user_cpumask, id_t, user_cpumask_t *);
 SYSCALL2(aspace_get_rank, id_t, id_t *);
 SYSCALL2(aspace_set_rank, id_t, id_t);
 SYSCALL2(aspace_update_user_hio_syscall_mask, id_t, user_syscall_mask_t *);
+SYSCALL2(aspace_set_load_balance, id_t, unsigned int);
 
 /**
  * Task management.
@@ -63,6 +64,12 @@ SYSCALL2(elf_hwcap, id_t, uint32_t *);
 SYSCALL2(phys_cpu_add, id_t, id_t);
 SYSCALL2(phys_cpu_remove, id_t, id_t);
 
+/**
+ * Asynchronous HIO system calls
+ */
+SYSCALL2(hio_uring_setup, unsigned int, struct hio_uring **);
+SYSCALL2(hio_uring_enter, unsigned int, unsigned int);
+
 
 /**
  * Palacios hypervisor control system calls.